@@ -15,12 +15,18 @@
  */
 
 #include <cxxopts.hpp>
+#include <sched.h>
 #include <systemd/sd-bus.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <ctime>
 #include <functional>
 #include <iomanip>
 #include <iostream>
+#include <map>
 #include <string>
 #include <string_view>
 #include <unordered_map>
@@ -233,12 +239,22 @@ parameter_validator set_validator(std::vector<std::string_view> allowed_values)
     };
 }
 
-void add_handler(const cxxopts::ParseResult & result)
+enum class modification
 {
+    add,
+    set
+};
+
+template<modification Mode>
+void modification_handler(const cxxopts::ParseResult & result)
+{
+    const char * verb = Mode == modification::add ? "add" : "set";
+    const char * method = Mode == modification::add ? "Add" : "Set";
+
     auto arguments = result["command-arguments"].as<std::vector<std::string>>();
     if (arguments.size() < 2)
     {
-        std::cerr << "Error: Not enough arguments for command add\n";
+        std::cerr << "Error: Not enough arguments for command " << verb << '\n';
         std::exit(1);
     }
 
@@ -257,7 +273,7 @@ void add_handler(const cxxopts::ParseResult & result)
 
     sd_bus_message * message = nullptr;
     status = sd_bus_message_new_method_call(
-        dbus, &message, dbus_service, dbus_path.c_str(), dbus_interface, "Add");
+        dbus, &message, dbus_service, dbus_path.c_str(), dbus_interface, method);
     HANDLE_DBUS_RESULT("Failed to create a dbus method call message", status);
 
     status = sd_bus_message_append(message, "s", arguments[0].c_str());
@@ -295,6 +311,42 @@ void add_handler(const cxxopts::ParseResult & result)
     HANDLE_DBUS_RESULT("Failed to parse response message", status);
 }
 
+void delete_handler(const cxxopts::ParseResult & result)
+{
+    auto arguments = result["command-arguments"].as<std::vector<std::string>>();
+    if (arguments.size() != 1)
+    {
+        std::cerr << "Error: delete takes exactly one argument, the name of the entity\n";
+        std::exit(1);
+    }
+
+    if (!result.count("token"))
+    {
+        std::cerr << "Error: a transaction token must be provided for delete.\n";
+        std::exit(1);
+    }
+
+    dbus_connect();
+
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message * message = nullptr;
+
+    int status = sd_bus_call_method(
+        dbus,
+        dbus_service,
+        (dbus_path_prefix + "/configuration/transactions/" + result["token"].as<std::string>()).c_str(),
+        "info.griwes.nonsense.Transaction",
+        "Delete",
+        &error,
+        &message,
+        "s",
+        arguments[0].c_str());
+    HANDLE_DBUS_ERROR("Method call failed", status, error);
+
+    status = sd_bus_message_read(message, "");
+    HANDLE_DBUS_RESULT("Failed to parse response message", status);
+}
+
 void commit_handler(const cxxopts::ParseResult &)
 {
     assert(0);
@@ -398,27 +450,149 @@ enum class action
 {
     start,
     stop,
-    restart,
-    status
+    restart
+};
+
+struct pending_jobs
+{
+    std::map<std::uint64_t, std::string> names;
+    bool failed = false;
 };
 
+int job_done_handler(sd_bus_message * message, void * userdata, sd_bus_error *)
+{
+    auto & pending = *static_cast<pending_jobs *>(userdata);
+
+    std::uint64_t id;
+    const char * path;
+    const char * name;
+    const char * job_result;
+    const char * job_error;
+
+    int status = sd_bus_message_read(message, "tosss", &id, &path, &name, &job_result, &job_error);
+    HANDLE_DBUS_RESULT("Failed to parse a signal message", status);
+
+    // Jobs submitted by other clients are announced on the same signal.
+    if (!pending.names.erase(id))
+    {
+        return 0;
+    }
+
+    std::cout << name << ": " << job_result;
+    if (std::string_view(job_result) == "failed")
+    {
+        if (*job_error)
+        {
+            std::cout << ": " << job_error;
+        }
+        pending.failed = true;
+    }
+    std::cout << std::endl;
+
+    return 0;
+}
+
+// Submits the operation on all the entities as jobs, which the daemon performs concurrently, and then waits
+// for all of them to finish, unless asked not to.
+void submit_jobs(const char * operation, const std::vector<std::string> & names, bool block)
+{
+    pending_jobs pending;
+
+    int status;
+
+    // Subscribe before submitting, so that no job can finish unnoticed.
+    if (block)
+    {
+        status = sd_bus_match_signal(
+            dbus,
+            nullptr,
+            dbus_service,
+            dbus_path_prefix.c_str(),
+            "info.griwes.nonsense.Controller",
+            "JobDone",
+            job_done_handler,
+            &pending);
+        HANDLE_DBUS_RESULT("Failed to subscribe to job completion signals", status);
+    }
+
+    for (auto && name : names)
+    {
+        sd_bus_error error = SD_BUS_ERROR_NULL;
+        sd_bus_message * message = nullptr;
+
+        status = sd_bus_call_method(
+            dbus,
+            dbus_service,
+            dbus_path_prefix.c_str(),
+            "info.griwes.nonsense.Controller",
+            "SubmitJob",
+            &error,
+            &message,
+            "ss",
+            operation,
+            name.c_str());
+        if (status < 0)
+        {
+            // Keep going, so that the jobs already submitted are still waited for.
+            std::cerr << "Error: Failed to submit a job for " << name << ": " << error.name << ": "
+                      << error.message << '\n';
+            sd_bus_error_free(&error);
+            pending.failed = true;
+            continue;
+        }
+
+        std::uint64_t id;
+        const char * path;
+        status = sd_bus_message_read(message, "to", &id, &path);
+        HANDLE_DBUS_RESULT("Failed to parse response message", status);
+
+        if (!block)
+        {
+            std::cout << name << ": " << path << '\n';
+        }
+
+        pending.names.emplace(id, name);
+        sd_bus_message_unref(message);
+    }
+
+    while (block && !pending.names.empty())
+    {
+        status = sd_bus_process(dbus, nullptr);
+        HANDLE_DBUS_RESULT("Failed to process the bus", status);
+
+        if (status > 0)
+        {
+            continue;
+        }
+
+        status = sd_bus_wait(dbus, UINT64_MAX);
+        HANDLE_DBUS_RESULT("Failed to wait on the bus", status);
+    }
+
+    if (pending.failed)
+    {
+        std::exit(1);
+    }
+}
+
 template<action Mode>
 void action_handler(const cxxopts::ParseResult & result)
 {
     const char * dbus_method;
+    const char * job_operation;
     switch (Mode)
     {
         case action::start:
             dbus_method = "Start";
+            job_operation = "start";
             break;
         case action::stop:
-            dbus_method = "Stop";
+            dbus_method = result.count("recursive") ? "StopTree" : "Stop";
+            job_operation = result.count("recursive") ? "stop-tree" : "stop";
             break;
         case action::restart:
             dbus_method = "Restart";
-            break;
-        case action::status:
-            dbus_method = "Status";
+            job_operation = "restart";
             break;
         default:
             __builtin_unreachable();
@@ -426,10 +600,17 @@ void action_handler(const cxxopts::ParseResult & result)
 
     auto arguments = result["command-arguments"].as<std::vector<std::string>>();
 
-    auto & name = arguments.front();
-
     dbus_connect();
 
+    // More than one entity is handled through jobs, so that they are all worked on at the same time.
+    if (arguments.size() > 1 || result.count("no-block"))
+    {
+        submit_jobs(job_operation, arguments, !result.count("no-block"));
+        return;
+    }
+
+    auto & name = arguments.front();
+
     sd_bus_error error = SD_BUS_ERROR_NULL;
     sd_bus_message * message = nullptr;
 
@@ -449,12 +630,351 @@ void action_handler(const cxxopts::ParseResult & result)
     HANDLE_DBUS_RESULT("Failed to parse response message", status);
 }
 
+std::string format_timestamp(std::uint64_t usec)
+{
+    auto time = static_cast<std::time_t>(usec / 1000000);
+
+    std::ostringstream os;
+    os << std::put_time(std::localtime(&time), "%F %T");
+    return os.str();
+}
+
+// Reads and prints the "ssutta{st}sts" representation of the status of an entity.
+void print_status(sd_bus_message * message)
+{
+    const char * name;
+    const char * phase;
+    std::uint32_t pid;
+    std::uint64_t started_at;
+    std::uint64_t phase_since;
+
+    int status = sd_bus_message_read(message, "ssutt", &name, &phase, &pid, &started_at, &phase_since);
+    HANDLE_DBUS_RESULT("Failed to parse response message", status);
+
+    std::cout << name << ": " << phase << '\n';
+    if (pid)
+    {
+        std::cout << "    pid: " << pid << '\n';
+    }
+    if (started_at)
+    {
+        std::cout << "    active since: " << format_timestamp(started_at) << '\n';
+    }
+    if (phase_since)
+    {
+        std::cout << "    in this phase since: " << format_timestamp(phase_since) << '\n';
+    }
+
+    status = sd_bus_message_enter_container(message, SD_BUS_TYPE_ARRAY, "{st}");
+    HANDLE_DBUS_RESULT("Failed to parse response message", status);
+
+    const char * separator = "    last phase durations: ";
+    const char * phase_name;
+    std::uint64_t duration;
+    while ((status = sd_bus_message_read(message, "{st}", &phase_name, &duration)) > 0)
+    {
+        std::cout << separator << phase_name << ' ' << std::fixed << std::setprecision(3)
+                  << duration / 1000.0 << "ms";
+        separator = ", ";
+    }
+    HANDLE_DBUS_RESULT("Failed to parse response message", status);
+    if (*separator == ',')
+    {
+        std::cout << '\n';
+    }
+
+    status = sd_bus_message_exit_container(message);
+    HANDLE_DBUS_RESULT("Failed to parse response message", status);
+
+    const char * last_error;
+    status = sd_bus_message_read(message, "s", &last_error);
+    HANDLE_DBUS_RESULT("Failed to parse response message", status);
+
+    if (*last_error)
+    {
+        std::cout << "    last error: " << last_error << '\n';
+    }
+
+    std::uint64_t network_events;
+    const char * last_network_event;
+    status = sd_bus_message_read(message, "ts", &network_events, &last_network_event);
+    HANDLE_DBUS_RESULT("Failed to parse response message", status);
+
+    if (network_events)
+    {
+        std::cout << "    network changes: " << network_events << ", last: " << last_network_event << '\n';
+    }
+}
+
+int state_changed_handler(sd_bus_message * message, void * userdata, sd_bus_error *)
+{
+    auto & names = *static_cast<std::unordered_set<std::string> *>(userdata);
+
+    const char * name;
+    const char * phase;
+    std::uint32_t pid;
+    const char * last_error;
+
+    int status = sd_bus_message_read(message, "ssus", &name, &phase, &pid, &last_error);
+    HANDLE_DBUS_RESULT("Failed to parse a signal message", status);
+
+    if (!names.empty() && !names.count(name))
+    {
+        return 0;
+    }
+
+    std::cout << name << ": " << phase;
+    if (pid)
+    {
+        std::cout << " (pid " << pid << ")";
+    }
+    if (*last_error && std::string_view(phase) == "failed")
+    {
+        std::cout << ": " << last_error;
+    }
+    std::cout << std::endl;
+
+    return 0;
+}
+
+void status_handler(const cxxopts::ParseResult & result)
+{
+    auto arguments = result["command-arguments"].as<std::vector<std::string>>();
+    bool watch = result.count("watch");
+
+    dbus_connect();
+
+    int status;
+
+    // Subscribe before querying the current state, so that no change can slip in between the two.
+    std::unordered_set<std::string> watched_names{ arguments.begin(), arguments.end() };
+    if (watch)
+    {
+        status = sd_bus_match_signal(
+            dbus,
+            nullptr,
+            dbus_service,
+            dbus_path_prefix.c_str(),
+            "info.griwes.nonsense.Controller",
+            "EntityStateChanged",
+            state_changed_handler,
+            &watched_names);
+        HANDLE_DBUS_RESULT("Failed to subscribe to state change signals", status);
+    }
+
+    sd_bus_message * message = nullptr;
+    status = sd_bus_message_new_method_call(
+        dbus,
+        &message,
+        dbus_service,
+        dbus_path_prefix.c_str(),
+        "info.griwes.nonsense.Controller",
+        "StatusMany");
+    HANDLE_DBUS_RESULT("Failed to create a dbus method call message", status);
+
+    status = sd_bus_message_open_container(message, SD_BUS_TYPE_ARRAY, "s");
+    HANDLE_DBUS_RESULT("Failed to open a container", status);
+
+    for (auto && name : arguments)
+    {
+        status = sd_bus_message_append(message, "s", name.c_str());
+        HANDLE_DBUS_RESULT("Failed to append to a container", status);
+    }
+
+    status = sd_bus_message_close_container(message);
+    HANDLE_DBUS_RESULT("Failed to close a container", status);
+
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message * reply = nullptr;
+    status = sd_bus_call(dbus, message, 0, &error, &reply);
+    HANDLE_DBUS_ERROR("Method call failed", status, error);
+
+    status = sd_bus_message_enter_container(reply, SD_BUS_TYPE_ARRAY, "(ssutta{st}sts)");
+    HANDLE_DBUS_RESULT("Failed to parse response message", status);
+
+    while ((status = sd_bus_message_enter_container(reply, SD_BUS_TYPE_STRUCT, "ssutta{st}sts")) > 0)
+    {
+        print_status(reply);
+
+        status = sd_bus_message_exit_container(reply);
+        HANDLE_DBUS_RESULT("Failed to parse response message", status);
+    }
+    HANDLE_DBUS_RESULT("Failed to parse response message", status);
+
+    if (!watch)
+    {
+        return;
+    }
+
+    std::cout << std::flush;
+
+    while (true)
+    {
+        status = sd_bus_process(dbus, nullptr);
+        HANDLE_DBUS_RESULT("Failed to process the bus", status);
+
+        if (status > 0)
+        {
+            continue;
+        }
+
+        status = sd_bus_wait(dbus, UINT64_MAX);
+        HANDLE_DBUS_RESULT("Failed to wait on the bus", status);
+    }
+}
+
+// Prints the usage counters of the cgroups of the given entities.
+void usage_handler(const cxxopts::ParseResult & result)
+{
+    auto arguments = result["command-arguments"].as<std::vector<std::string>>();
+    if (arguments.empty())
+    {
+        std::cerr << "Error: The usage verb requires at least one entity name.\n";
+        std::exit(1);
+    }
+
+    dbus_connect();
+
+    for (auto && name : arguments)
+    {
+        sd_bus_error error = SD_BUS_ERROR_NULL;
+        sd_bus_message * message = nullptr;
+
+        int status = sd_bus_call_method(
+            dbus,
+            dbus_service,
+            dbus_path_prefix.c_str(),
+            "info.griwes.nonsense.Controller",
+            "GetResourceUsage",
+            &error,
+            &message,
+            "s",
+            name.c_str());
+        HANDLE_DBUS_ERROR("Method call failed", status, error);
+
+        std::cout << name << ":\n";
+
+        status = sd_bus_message_enter_container(message, SD_BUS_TYPE_ARRAY, "{st}");
+        HANDLE_DBUS_RESULT("Failed to parse response message", status);
+
+        const char * counter;
+        std::uint64_t value;
+        while ((status = sd_bus_message_read(message, "{st}", &counter, &value)) > 0)
+        {
+            std::cout << "    " << counter << ": " << value << '\n';
+        }
+        HANDLE_DBUS_RESULT("Failed to parse response message", status);
+
+        sd_bus_message_unref(message);
+    }
+}
+
+// Waits until the networks of all of the given entities are online.
+void wait_online_handler(const cxxopts::ParseResult & result)
+{
+    auto arguments = result["command-arguments"].as<std::vector<std::string>>();
+    if (arguments.empty())
+    {
+        std::cerr << "Error: The wait-online verb requires at least one entity name.\n";
+        std::exit(1);
+    }
+
+    // A timeout of 0 waits for as long as it takes, like it does for the daemon.
+    auto timeout = std::chrono::seconds(result["timeout"].as<unsigned>());
+    auto forever = timeout.count() == 0;
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+
+    dbus_connect();
+
+    for (auto && name : arguments)
+    {
+        // All the entities share the one timeout.
+        auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(
+            deadline - std::chrono::steady_clock::now());
+        remaining = forever ? std::chrono::microseconds(0)
+                            : std::max(remaining, std::chrono::microseconds(1));
+
+        sd_bus_message * call = nullptr;
+        int status = sd_bus_message_new_method_call(
+            dbus,
+            &call,
+            dbus_service,
+            dbus_path_prefix.c_str(),
+            "info.griwes.nonsense.Controller",
+            "WaitOnline");
+        HANDLE_DBUS_RESULT("Failed to create a method call message", status);
+
+        status = sd_bus_message_append(
+            call, "st", name.c_str(), static_cast<std::uint64_t>(remaining.count()));
+        HANDLE_DBUS_RESULT("Failed to build a method call message", status);
+
+        // The daemon gives up on its own once the timeout passes; the call itself only needs to outlast it.
+        sd_bus_error error = SD_BUS_ERROR_NULL;
+        sd_bus_message * reply = nullptr;
+        auto call_timeout = forever ? UINT64_MAX : remaining.count() + 5'000'000;
+        status = sd_bus_call(dbus, call, call_timeout, &error, &reply);
+        HANDLE_DBUS_ERROR("Method call failed", status, error);
+
+        sd_bus_message_unref(reply);
+        sd_bus_message_unref(call);
+    }
+}
+
+// Runs a command inside the network namespace of an entity. Options of the command need to be separated from
+// those of nonsensectl with "--".
+void exec_handler(const cxxopts::ParseResult & result)
+{
+    auto arguments = result["command-arguments"].as<std::vector<std::string>>();
+    if (arguments.size() < 2)
+    {
+        std::cerr << "Error: The exec verb requires an entity name and a command to run.\n";
+        std::exit(1);
+    }
+
+    dbus_connect();
+
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message * message = nullptr;
+
+    int status = sd_bus_call_method(
+        dbus,
+        dbus_service,
+        dbus_path_prefix.c_str(),
+        "info.griwes.nonsense.Controller",
+        "GetNamespaceFd",
+        &error,
+        &message,
+        "s",
+        arguments.front().c_str());
+    HANDLE_DBUS_ERROR("Method call failed", status, error);
+
+    int fd;
+    status = sd_bus_message_read(message, "h", &fd);
+    HANDLE_DBUS_RESULT("Failed to parse response message", status);
+
+    status = setns(fd, CLONE_NEWNET) == -1 ? -errno : 0;
+    HANDLE_DBUS_RESULT("Failed to enter the namespace of the entity", status);
+
+    std::vector<char *> command;
+    for (auto it = arguments.begin() + 1; it != arguments.end(); ++it)
+    {
+        command.push_back(it->data());
+    }
+    command.push_back(nullptr);
+
+    execvp(command.front(), command.data());
+    std::cerr << "Error: Failed to execute " << command.front() << ": " << strerror(errno) << '\n';
+    std::exit(1);
+}
+
 std::unordered_map<std::string_view, verb_information> recognized_verbs = {
     { "help", { help_handler } },
     { "version", { version_handler } },
 
     { "get", { get_handler } },
-    { "add", { add_handler } },
+    { "add", { modification_handler<modification::add> } },
+    { "set", { modification_handler<modification::set> } },
+    { "delete", { delete_handler } },
 
     { "commit", { finalize_handler<finalize::commit> } },
     { "discard", { finalize_handler<finalize::discard> } },
@@ -463,7 +983,13 @@ std::unordered_map<std::string_view, verb_information> recognized_verbs = {
     { "unlock", { locking_handler<locking::unlock> } },
 
     { "start", { action_handler<action::start> } },
-    { "stop", { action_handler<action::stop> } }
+    { "stop", { action_handler<action::stop> } },
+    { "restart", { action_handler<action::restart> } },
+    { "status", { status_handler } },
+    { "usage", { usage_handler } },
+    { "wait-online", { wait_online_handler } },
+
+    { "exec", { exec_handler } }
 };
 
 int main(int argc, char ** argv)
@@ -473,7 +999,17 @@ try
     opts.add_options()
         ("t,token", "Set the transaction token for this operation. If not present, the operation is applied "
             "immediately. Only relevant for the add, set, and delete verbs.", cxxopts::value<std::string>(),
-            "options");
+            "options")
+        ("w,watch", "Keep printing the changes of the state of the entities after printing their current "
+            "state. Only relevant for the status verb.", cxxopts::value<bool>(), "options")
+        ("r,recursive", "Also stop every entity downstream of the one given. Only relevant for the stop "
+            "verb.", cxxopts::value<bool>(), "options")
+        ("no-block", "Do not wait for the requested operations to finish; print the paths of the jobs "
+            "performing them instead. Only relevant for the start, stop, and restart verbs.",
+            cxxopts::value<bool>(), "options")
+        ("timeout", "How many seconds to wait for, in total; 0 waits for as long as it takes. Only relevant "
+            "for the wait-online verb.",
+            cxxopts::value<unsigned>()->default_value("120"), "options");
 
     opts.add_options()
         ("verb", "The command to execute.", cxxopts::value<std::string>(), "verbs")
@@ -17,6 +17,7 @@
 #pragma once
 
 #include "bus_slot.h"
+#include "function.h"
 #include "log_helpers.h"
 #include "overloads.h"
 
@@ -25,6 +26,7 @@
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <string>
 #include <tuple>
 #include <variant>
 #include <vector>
@@ -156,6 +158,23 @@ struct function;
 
 using subtask = function<future(coro::coroutine_handle<promise>)>;
 
+// The state shared by a group of subtasks awaited together through async::when_all.
+struct join_state
+{
+    std::size_t remaining;
+    coro::coroutine_handle<promise> continuation;
+    // The first error reported by any of the subtasks; once all of them are done, it is returned from the
+    // awaiting coroutine.
+    std::optional<reply_status_t> error;
+};
+
+// The state of a subtask started through async::detach, owned by the coroutine running it.
+struct detached_state
+{
+    // Called once the subtask is done, with its error if it has failed, or with nullptr otherwise.
+    function<void(const reply_status_t *)> done;
+};
+
 class promise
 {
 public:
@@ -174,11 +193,21 @@ public:
     {
     }
 
+    promise(join_state * state, subtask &) : _payload(state)
+    {
+    }
+
+    promise(detached_state * state, subtask &) : _payload(state)
+    {
+    }
+
     ~promise()
     {
         std::visit(
             overload{ [](sd_bus_message * message) { sd_bus_message_unref(message); },
-                      [](coro::coroutine_handle<promise> handle) {} },
+                      [](coro::coroutine_handle<promise> handle) {},
+                      [](join_state * state) {},
+                      [](detached_state * state) { delete state; } },
             _payload);
     }
 
@@ -195,6 +224,8 @@ public:
     // Error replies.
     void return_value(const reply_error_t & error)
     {
+        _record_error(-EIO, error.error);
+
         std::visit(
             overload{ [&](sd_bus_message * message) {
                          int result = sd_bus_reply_method_error(message, &error.error);
@@ -208,12 +239,31 @@ public:
                       [&](coro::coroutine_handle<promise> handle) {
                           handle.promise().return_value(error);
                           handle.destroy();
+                      },
+                      [&](join_state * state) {
+                          if (!state->error)
+                          {
+                              state->error = reply_status_t{ -EIO };
+                              sd_bus_error_copy(&state->error->error, &error.error);
+                          }
+                          _finish_joined(state);
+                      },
+                      [&](detached_state * state) {
+                          reply_status_t status{ -EIO };
+                          sd_bus_error_copy(&status.error, &error.error);
+                          state->done(&status);
+                          sd_bus_error_free(&status.error);
                       } },
             _payload);
     }
 
     void return_value(const reply_status_t & status)
     {
+        if (status.code < 0)
+        {
+            _record_error(status.code, status.error);
+        }
+
         std::visit(
             overload{ [&](sd_bus_message * message) {
                          if (status.code < 0)
@@ -230,7 +280,15 @@ public:
                       [&](coro::coroutine_handle<promise> handle) {
                           handle.promise().return_value(status);
                           handle.destroy();
-                      } },
+                      },
+                      [&](join_state * state) {
+                          if (status.code < 0 && !state->error)
+                          {
+                              state->error = reply_status(status.code, &status.error);
+                          }
+                          _finish_joined(state);
+                      },
+                      [&](detached_state * state) { state->done(status.code < 0 ? &status : nullptr); } },
             _payload);
     }
 
@@ -242,7 +300,9 @@ public:
                          std::cerr << "Fatal error: attempted to return void from a top-level coroutine.\n";
                          std::abort();
                      },
-                      [](coro::coroutine_handle<promise> handle) { handle.resume(); } },
+                      [](coro::coroutine_handle<promise> handle) { handle.resume(); },
+                      [](join_state * state) { _finish_joined(state); },
+                      [](detached_state * state) { state->done(nullptr); } },
             _payload);
     }
 
@@ -333,8 +393,41 @@ public:
         }
     }
 
+    // A description of the error this coroutine has failed with, either of its own or of one of its subtasks;
+    // empty until it does. Used to attribute failures to coroutines that get torn down because of them, by
+    // the objects in their frames; see async::current_promise.
+    const std::string & error() const
+    {
+        return _error;
+    }
+
 private:
-    std::variant<sd_bus_message *, coro::coroutine_handle<promise>> _payload;
+    void _record_error(int code, const sd_bus_error & error)
+    {
+        if (error.message)
+        {
+            _error = error.message;
+        }
+        else if (error.name)
+        {
+            _error = error.name;
+        }
+        else
+        {
+            _error = strerror(-code);
+        }
+    }
+
+    static void _finish_joined(join_state * state)
+    {
+        if (--state->remaining == 0)
+        {
+            state->continuation.resume();
+        }
+    }
+
+    std::variant<sd_bus_message *, coro::coroutine_handle<promise>, join_state *, detached_state *> _payload;
+    std::string _error;
 };
 
 struct service_description
@@ -363,6 +456,10 @@ namespace services
     inline service_description entityd = { .service = "info.griwes.nonsense",
                                            .dbus_path = "/",
                                            .interface = "info.griwes.nonsense.Entityd" };
+
+    inline service_description entityd_host = { .service = "info.griwes.nonsense",
+                                                .dbus_path = "/",
+                                                .interface = "info.griwes.nonsense.EntitydHost" };
 }
 
 template<typename... Arguments>
@@ -398,6 +495,10 @@ namespace signals
 
 namespace async
 {
+    using message_ptr = std::unique_ptr<
+        sd_bus_message,
+        std::integral_constant<decltype(&sd_bus_message_unref), &sd_bus_message_unref>>;
+
     template<typename... Ts>
     auto sd_bus_call_method(
         sd_bus * bus,
@@ -469,17 +570,75 @@ namespace async
 
             auto await_resume()
             {
-                return std::unique_ptr<
-                    sd_bus_message,
-                    std::integral_constant<decltype(&sd_bus_message_unref), &sd_bus_message_unref>>{
-                    message
-                };
+                return message_ptr{ message };
             }
         } awaitable{ bus, service, method, argument_string, { ts... } };
 
         return awaitable;
     }
 
+    // Like sd_bus_call_method, but for a method call message built by the caller, for arguments that can't be
+    // passed as a flat list of values, like arrays.
+    inline auto sd_bus_call(sd_bus * bus, sd_bus_message * call)
+    {
+        struct awaitable_t
+        {
+            sd_bus * bus;
+            sd_bus_message * call;
+
+            sd_bus_message * message = nullptr;
+            coro::coroutine_handle<promise> handle;
+
+            bool await_ready()
+            {
+                return false;
+            }
+
+            void await_suspend(coro::coroutine_handle<promise> handle)
+            {
+                this->handle = std::move(handle);
+
+                int r = sd_bus_call_async(
+                    bus,
+                    nullptr,
+                    call,
+                    +[](sd_bus_message * message, void * userdata, sd_bus_error * ret_error) {
+                        auto & self = *static_cast<awaitable_t *>(userdata);
+
+                        if (sd_bus_message_is_method_error(message, nullptr))
+                        {
+                            self.handle.promise().return_value(reply_status(
+                                -sd_bus_message_get_errno(message), sd_bus_message_get_error(message)));
+                            self.handle.destroy();
+
+                            return 1;
+                        }
+
+                        sd_bus_message_ref(message);
+                        self.message = message;
+                        self.handle();
+
+                        return 1;
+                    },
+                    this,
+                    0);
+
+                if (r < 0)
+                {
+                    std::cerr << "Failed to issue a method call: " << strerror(-r) << '\n';
+                    std::abort();
+                }
+            }
+
+            auto await_resume()
+            {
+                return message_ptr{ message };
+            }
+        } awaitable{ bus, call };
+
+        return awaitable;
+    }
+
     template<typename... Arguments>
     class signal_subscription
     {
@@ -661,5 +820,162 @@ namespace async
     {
         return signal_subscription<Arguments...>(bus, signal);
     }
+
+    // Runs a single subtask of a when_all group; the promise of this coroutine reports the outcome of the
+    // subtask to the group instead of to a continuation.
+    inline future _join_one(join_state * state, subtask task)
+    {
+        co_await std::move(task);
+        co_return unit;
+    }
+
+    // Runs all the subtasks concurrently, and completes once all of them have completed. If any of them
+    // fails, the rest are still allowed to finish, and then the first error is returned.
+    inline subtask when_all(std::vector<subtask> tasks)
+    {
+        return [tasks = std::move(tasks)](
+                   [[maybe_unused]] coro::coroutine_handle<promise> nonsense_promise_arg) mutable -> future {
+            // One extra for the awaiting below, so that subtasks that complete synchronously can't resume
+            // this coroutine before it has suspended.
+            join_state state{ .remaining = tasks.size() + 1 };
+
+            for (auto && task : tasks)
+            {
+                _join_one(&state, std::move(task));
+            }
+
+            struct
+            {
+                join_state & state;
+
+                bool await_ready()
+                {
+                    return false;
+                }
+
+                bool await_suspend(coro::coroutine_handle<promise> handle)
+                {
+                    state.continuation = std::move(handle);
+                    return --state.remaining != 0;
+                }
+
+                void await_resume()
+                {
+                }
+            } all_done{ state };
+
+            co_await all_done;
+
+            if (state.error)
+            {
+                co_return *state.error;
+            }
+
+            co_return unit;
+        };
+    }
+
+    inline future _run_detached(detached_state * state, subtask task)
+    {
+        co_await std::move(task);
+        co_return unit;
+    }
+
+    // Starts the subtask without anything awaiting it; once it is done, its outcome is passed to the callback
+    // in the same way as it is to detached_state::done.
+    inline void detach(subtask task, function<void(const reply_status_t *)> done)
+    {
+        _run_detached(new detached_state{ std::move(done) }, std::move(task));
+    }
+
+    // The promise of the awaiting coroutine, which carries on right away.
+    inline auto current_promise()
+    {
+        struct
+        {
+            promise * current = nullptr;
+
+            bool await_ready()
+            {
+                return false;
+            }
+
+            bool await_suspend(coro::coroutine_handle<promise> handle)
+            {
+                current = &handle.promise();
+                return false;
+            }
+
+            promise & await_resume()
+            {
+                return *current;
+            }
+        } awaitable;
+
+        return awaitable;
+    }
+
+    // Runs the subtask, and resumes the awaiting coroutine with its error, if it fails, instead of failing
+    // the awaiting coroutine along with it; for the coroutines that need to clean up after a failed step.
+    inline auto attempt(subtask task)
+    {
+        struct awaitable_t
+        {
+            subtask task;
+
+            std::optional<reply_status_t> error;
+            coro::coroutine_handle<promise> handle;
+            // One for the subtask, and one for the awaiting below, so that a subtask that completes
+            // synchronously can't resume the awaiting coroutine before it has suspended.
+            int remaining = 2;
+
+            bool await_ready()
+            {
+                return false;
+            }
+
+            bool await_suspend(coro::coroutine_handle<promise> handle)
+            {
+                this->handle = std::move(handle);
+
+                detach(std::move(task), [this](const reply_status_t * status) {
+                    if (status)
+                    {
+                        error = reply_status(status->code, &status->error);
+                    }
+
+                    if (--remaining == 0)
+                    {
+                        this->handle.resume();
+                    }
+                });
+
+                return --remaining != 0;
+            }
+
+            std::optional<reply_status_t> await_resume()
+            {
+                return std::move(error);
+            }
+        } awaitable{ std::move(task) };
+
+        return awaitable;
+    }
+
+    // The description of an error carried by a reply status, for putting it into another error.
+    inline std::string describe(const reply_status_t & status)
+    {
+        if (status.error.message)
+        {
+            return status.error.message;
+        }
+
+        if (status.error.name)
+        {
+            return status.error.name;
+        }
+
+        return strerror(-status.code);
+    }
 }
 }
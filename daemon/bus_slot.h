@@ -48,7 +48,7 @@ public:
 
     void reset()
     {
-        sd_bus_slot_unref(_slot);
+        _slot = sd_bus_slot_unref(_slot);
     }
 
 private:
@@ -0,0 +1,473 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "cgroup.h"
+
+#include "log_helpers.h"
+
+#include <systemd/sd-bus.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+namespace nonsensed
+{
+namespace
+{
+    const std::filesystem::path cgroup_mount = "/sys/fs/cgroup";
+
+    std::uint64_t _parse_number(std::string_view value, std::string_view what)
+    {
+        std::uint64_t ret;
+        auto [end, error] = std::from_chars(value.begin(), value.end(), ret);
+        if (error != std::errc() || end != value.end())
+        {
+            throw std::invalid_argument("invalid " + std::string(what) + " '" + std::string(value) + "'");
+        }
+        return ret;
+    }
+
+    std::uint64_t _parse_weight(const nlohmann::json & value, std::string_view what)
+    {
+        if (!value.is_number_unsigned() || value < 1 || value > 10000)
+        {
+            throw std::invalid_argument(std::string(what) + " must be an integer between 1 and 10000");
+        }
+        return value;
+    }
+
+    // Either a number of bytes, or a string with a number followed by one of the binary K, M, G, or T
+    // suffixes, or "infinity".
+    std::uint64_t _parse_size(const nlohmann::json & value)
+    {
+        if (value.is_number_unsigned())
+        {
+            return value;
+        }
+
+        if (!value.is_string())
+        {
+            throw std::invalid_argument("memory_max must be a number of bytes or a string");
+        }
+
+        auto string = value.get<std::string_view>();
+        if (string == "infinity")
+        {
+            return UINT64_MAX;
+        }
+
+        auto shift = 0;
+        switch (string.empty() ? '\0' : string.back())
+        {
+            case 'T':
+                shift += 10;
+                [[fallthrough]];
+            case 'G':
+                shift += 10;
+                [[fallthrough]];
+            case 'M':
+                shift += 10;
+                [[fallthrough]];
+            case 'K':
+                shift += 10;
+                string.remove_suffix(1);
+        }
+
+        auto number = _parse_number(string, "memory_max");
+        if (number > UINT64_MAX >> shift)
+        {
+            throw std::invalid_argument("memory_max is too large");
+        }
+        return number << shift;
+    }
+
+    void _write(const std::filesystem::path & path, std::string_view contents)
+    {
+        unique_fd fd{ open(path.c_str(), O_WRONLY | O_CLOEXEC) };
+        if (!fd || write(fd.get(), contents.data(), contents.size()) == -1)
+        {
+            throw std::runtime_error(
+                "Failed to write '" + std::string(contents) + "' to " + path.string() + ": "
+                + strerror(errno));
+        }
+    }
+
+    // Like _write, but settings of controllers that are not available only get a warning.
+    void _write_setting(const std::filesystem::path & path, std::string_view contents)
+    {
+        if (!std::filesystem::exists(path))
+        {
+            std::cerr << error_prefix() << "Warning: cannot apply " << path.filename().string()
+                      << ", since the controller is not available.\n";
+            return;
+        }
+
+        _write(path, contents);
+    }
+
+    // Enables, for the children of the cgroup, every controller that is available in it.
+    void _delegate_controllers(const std::filesystem::path & path)
+    {
+        std::ifstream in(path / "cgroup.controllers");
+
+        std::string controller;
+        std::string request;
+        while (in >> controller)
+        {
+            request += (request.empty() ? "+" : " +") + controller;
+        }
+
+        if (!request.empty())
+        {
+            _write(path / "cgroup.subtree_control", request);
+        }
+    }
+
+    // Reads cgroup.events through the fd that is polled for its changes, which also rearms the notification.
+    bool _populated(int events)
+    {
+        char buffer[256];
+        auto size = pread(events, buffer, sizeof(buffer) - 1, 0);
+        if (size < 0)
+        {
+            return false;
+        }
+
+        std::istringstream in(std::string(buffer, size));
+        std::string key;
+        int value;
+        while (in >> key >> value)
+        {
+            if (key == "populated")
+            {
+                return value != 0;
+            }
+        }
+        return false;
+    }
+}
+
+resource_controls parse_resource_controls(const nlohmann::json & component)
+{
+    resource_controls ret;
+
+    if (!component.is_object())
+    {
+        throw std::invalid_argument("the component is not an object");
+    }
+
+    for (auto && [key, value] : component.items())
+    {
+        if (key == "cpu_weight")
+        {
+            ret.cpu_weight = _parse_weight(value, key);
+        }
+        else if (key == "io_weight")
+        {
+            ret.io_weight = _parse_weight(value, key);
+        }
+        else if (key == "memory_max")
+        {
+            ret.memory_max = _parse_size(value);
+        }
+        else if (key == "allowed_cpus")
+        {
+            // Numbers are allowed for a single CPU, since that's what a parameter like that is parsed as.
+            ret.allowed_cpus = value.is_number_unsigned() ? std::to_string(value.get<unsigned>())
+                                                          : value.get<std::string>();
+            cpu_set_mask(ret.allowed_cpus);
+        }
+        else
+        {
+            throw std::invalid_argument("unknown parameter '" + key + "'");
+        }
+    }
+
+    return ret;
+}
+
+std::vector<std::uint8_t> cpu_set_mask(std::string_view cpus)
+{
+    std::vector<std::uint8_t> ret;
+
+    auto set = [&](std::uint64_t cpu) {
+        if (cpu >= 8192)
+        {
+            throw std::invalid_argument("CPU number out of range: " + std::to_string(cpu));
+        }
+        if (ret.size() <= cpu / 8)
+        {
+            ret.resize(cpu / 8 + 1);
+        }
+        ret[cpu / 8] |= 1 << (cpu % 8);
+    };
+
+    while (!cpus.empty())
+    {
+        auto comma = cpus.find(',');
+        auto range = cpus.substr(0, comma);
+        cpus = comma == std::string_view::npos ? std::string_view() : cpus.substr(comma + 1);
+
+        auto dash = range.find('-');
+        auto first = _parse_number(range.substr(0, dash), "CPU set");
+        auto last = dash == std::string_view::npos ? first : _parse_number(range.substr(dash + 1), "CPU set");
+        if (last < first)
+        {
+            throw std::invalid_argument("invalid CPU range '" + std::string(range) + "'");
+        }
+
+        for (auto cpu = first; cpu <= last; ++cpu)
+        {
+            set(cpu);
+        }
+    }
+
+    return ret;
+}
+
+int append_unit_properties(sd_bus_message * message, const resource_controls & controls)
+{
+    int ret = sd_bus_message_append(
+        message,
+        "(sv)(sv)(sv)",
+        "CPUWeight",
+        "t",
+        controls.cpu_weight,
+        "IOWeight",
+        "t",
+        controls.io_weight,
+        "MemoryMax",
+        "t",
+        controls.memory_max);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    auto mask = cpu_set_mask(controls.allowed_cpus);
+
+    if ((ret = sd_bus_message_open_container(message, 'r', "sv")) < 0
+        || (ret = sd_bus_message_append(message, "s", "AllowedCPUs")) < 0
+        || (ret = sd_bus_message_open_container(message, 'v', "ay")) < 0
+        || (ret = sd_bus_message_append_array(message, 'y', mask.data(), mask.size())) < 0
+        || (ret = sd_bus_message_close_container(message)) < 0)
+    {
+        return ret;
+    }
+
+    return sd_bus_message_close_container(message);
+}
+
+void write_resource_controls(const std::filesystem::path & path, const resource_controls & controls)
+{
+    _write_setting(path / "cpu.weight", std::to_string(controls.cpu_weight));
+    _write_setting(path / "io.weight", "default " + std::to_string(controls.io_weight));
+    _write_setting(
+        path / "memory.max",
+        controls.memory_max == UINT64_MAX ? std::string("max") : std::to_string(controls.memory_max));
+    _write_setting(path / "cpuset.cpus", controls.allowed_cpus.empty() ? "\n" : controls.allowed_cpus);
+}
+
+// The unified hierarchy entry of /proc/<pid>/cgroup has the form "0::<path>".
+std::filesystem::path cgroup_of(int pid)
+{
+    std::ifstream in("/proc/" + std::to_string(pid) + "/cgroup");
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.starts_with("0::"))
+        {
+            return cgroup_mount / std::filesystem::path(line.substr(3)).relative_path();
+        }
+    }
+
+    throw std::runtime_error(
+        "Failed to find the cgroup of process " + std::to_string(pid) + "; is the unified hierarchy in use?");
+}
+
+std::vector<std::pair<std::string, std::uint64_t>> read_usage(const std::filesystem::path & path)
+{
+    std::vector<std::pair<std::string, std::uint64_t>> ret;
+
+    std::ifstream cpu(path / "cpu.stat");
+    std::string key;
+    std::uint64_t value;
+    while (cpu >> key >> value)
+    {
+        if (key == "usage_usec" || key == "user_usec" || key == "system_usec")
+        {
+            ret.emplace_back("cpu_" + key, value);
+        }
+    }
+
+    std::ifstream memory(path / "memory.current");
+    if (memory >> value)
+    {
+        ret.emplace_back("memory_current", value);
+    }
+
+    // Every line is a device followed by key=value pairs.
+    std::uint64_t io[4] = {};
+    const char * io_keys[4] = { "rbytes", "wbytes", "rios", "wios" };
+
+    std::ifstream io_stat(path / "io.stat");
+    std::string line;
+    while (std::getline(io_stat, line))
+    {
+        std::istringstream is(line);
+        std::string field;
+        is >> field;
+        while (is >> field)
+        {
+            auto equals = field.find('=');
+            for (int i = 0; i < 4; ++i)
+            {
+                if (field.compare(0, equals, io_keys[i]) == 0)
+                {
+                    io[i] += _parse_number(std::string_view(field).substr(equals + 1), "io.stat value");
+                }
+            }
+        }
+    }
+
+    ret.emplace_back("io_read_bytes", io[0]);
+    ret.emplace_back("io_write_bytes", io[1]);
+    ret.emplace_back("io_read_ops", io[2]);
+    ret.emplace_back("io_write_ops", io[3]);
+
+    return ret;
+}
+
+
+cgroup_tree::cgroup_tree()
+{
+    auto own = cgroup_of(getpid());
+
+    if (own.filename() == "nonsensed")
+    {
+        _root = own.parent_path();
+    }
+    else
+    {
+        _root = own;
+        std::filesystem::create_directories(_root / "nonsensed");
+        _write(_root / "nonsensed" / "cgroup.procs", "0");
+    }
+
+    _delegate_controllers(_root);
+    std::filesystem::create_directories(_root / "entities");
+    _delegate_controllers(_root / "entities");
+}
+
+std::filesystem::path cgroup_tree::entity_path(const std::string & name) const
+{
+    return _root / "entities" / name;
+}
+
+std::filesystem::path cgroup_tree::shared_entityd_path() const
+{
+    return _root / "shared-entityd";
+}
+
+std::vector<std::string> cgroup_tree::entities() const
+{
+    std::vector<std::string> names;
+
+    std::error_code ec;
+    for (auto && entry : std::filesystem::directory_iterator(_root / "entities", ec))
+    {
+        if (entry.is_directory(ec))
+        {
+            names.push_back(entry.path().filename().string());
+        }
+    }
+
+    return names;
+}
+
+unique_fd cgroup_tree::create(const std::filesystem::path & path)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(path, ec);
+
+    unique_fd procs{ open((path / "cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC) };
+    if (!procs)
+    {
+        std::cerr << error_prefix() << "Failed to create cgroup " << path.string() << ": " << strerror(errno)
+                  << '\n';
+    }
+
+    return procs;
+}
+
+void cgroup_tree::remove(const std::filesystem::path & path)
+{
+    unique_fd events{ open((path / "cgroup.events").c_str(), O_RDONLY | O_CLOEXEC) };
+    if (!events)
+    {
+        if (errno != ENOENT)
+        {
+            std::cerr << error_prefix() << "Failed to open the events of cgroup " << path.string() << ": "
+                      << strerror(errno) << '\n';
+        }
+        return;
+    }
+
+    // Entityd has normally exited by the time its cgroup is removed, but an adopted one is not a child of
+    // this instance of the daemon, so nothing has waited for it. Killing is asynchronous, and the cgroup can
+    // only be removed once it is empty, which is signalled by a change of cgroup.events.
+    if (_populated(events.get()))
+    {
+        try
+        {
+            _write(path / "cgroup.kill", "1");
+        }
+        catch (std::exception & ex)
+        {
+            std::cerr << error_prefix() << ex.what() << '\n';
+        }
+
+        using clock = std::chrono::steady_clock;
+        auto deadline = clock::now() + std::chrono::seconds(1);
+        while (_populated(events.get()))
+        {
+            auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - clock::now());
+            if (left.count() <= 0)
+            {
+                break;
+            }
+
+            pollfd pfd{ .fd = events.get(), .events = POLLPRI };
+            poll(&pfd, 1, left.count());
+        }
+    }
+
+    if (rmdir(path.c_str()) == -1 && errno != ENOENT)
+    {
+        std::cerr << error_prefix() << "Failed to remove cgroup " << path.string() << ": " << strerror(errno)
+                  << '\n';
+    }
+}
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "unique_fd.h"
+
+#include <json.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <utility>
+#include <vector>
+
+extern "C"
+{
+    struct sd_bus_message;
+}
+
+namespace nonsensed
+{
+// The resource controls of an entity, as given by its resources component. Everything not specified there has
+// the default value of the corresponding cgroup setting, so that applying the controls of an entity also
+// resets the settings that have been removed from its configuration.
+struct resource_controls
+{
+    std::uint64_t cpu_weight = 100;
+    std::uint64_t io_weight = 100;
+    // In bytes; the maximum value means no limit.
+    std::uint64_t memory_max = UINT64_MAX;
+    // In the cpuset list format, like "0-3,6"; empty means all CPUs.
+    std::string allowed_cpus;
+};
+
+// Throws std::invalid_argument with a description of the problem if the component is not valid.
+resource_controls parse_resource_controls(const nlohmann::json & component);
+
+// Converts a cpuset list to the bitmask systemd takes for AllowedCPUs.
+std::vector<std::uint8_t> cpu_set_mask(std::string_view cpus);
+
+// Appends the controls, as properties of a systemd unit, to an open "a(sv)" container.
+int append_unit_properties(sd_bus_message * message, const resource_controls & controls);
+void write_resource_controls(const std::filesystem::path & path, const resource_controls & controls);
+
+// The cgroup a process is in.
+std::filesystem::path cgroup_of(int pid);
+
+// Reads the CPU, memory, and IO usage counters of a cgroup, from cpu.stat, memory.current, and io.stat, the
+// latter summed over all devices.
+std::vector<std::pair<std::string, std::uint64_t>> read_usage(const std::filesystem::path & path);
+
+// The cgroup subtree delegated to the daemon by the service manager, in which it manages the cgroups of the
+// entityd processes itself in the direct cgroup mode, instead of asking systemd for a slice and a scope for
+// every entity. The daemon itself lives in the "nonsensed" leaf of the subtree, the shared entityd of the
+// multiplexed mode in "shared-entityd", and the entities under "entities".
+class cgroup_tree
+{
+public:
+    // Moves the daemon into its leaf, if the service manager hasn't already started it there, and enables all
+    // available controllers for the rest of the subtree.
+    cgroup_tree();
+
+    cgroup_tree(const cgroup_tree &) = delete;
+    cgroup_tree & operator=(const cgroup_tree &) = delete;
+
+    std::filesystem::path entity_path(const std::string & name) const;
+    std::filesystem::path shared_entityd_path() const;
+    // The names of the entities that currently have a cgroup.
+    std::vector<std::string> entities() const;
+
+    // Creates the cgroup, if it doesn't exist yet, and returns its cgroup.procs, opened for writing, or an
+    // empty fd on failure. Writing "0" to it moves the writing process into the cgroup, which is how entityd
+    // gets there before it execs.
+    unique_fd create(const std::filesystem::path & path);
+
+    // Kills whatever is still running in the cgroup, waits for it to be gone, and removes the cgroup.
+    void remove(const std::filesystem::path & path);
+
+private:
+    std::filesystem::path _root;
+};
+}
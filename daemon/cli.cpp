@@ -29,7 +29,23 @@ options::options(int argc, char ** argv)
     opts.add_options()
         ("h,help", "Display this message.")
         ("c,config", "Select the configuration file to use.",
-            cxxopts::value<std::string>()->default_value("/etc/nonsense/nonsensed.json"));
+            cxxopts::value<std::string>()->default_value("/etc/nonsense/nonsensed.json"))
+        ("entityd-mode", "Select how entity daemons are run: 'process' for one process per entity, "
+            "'multiplexed' for a single process serving all entities.",
+            cxxopts::value<std::string>()->default_value("process"))
+        ("netns-pool-size", "Select how many network namespaces to keep prepared for entities that are yet "
+            "to start, for each network role in use; 0 disables the pool.",
+            cxxopts::value<std::size_t>()->default_value("4"))
+        ("netns-export", "Select how the namespaces of entities are made available to other programs: "
+            "'mount' to also bind-mount them under /var/run/netns, 'none' to only hand them out by fd.",
+            cxxopts::value<std::string>()->default_value("mount"))
+        ("cgroup-mode", "Select who manages the cgroups of entities: 'systemd' for transient systemd units, "
+            "'direct' for the daemon itself, in the cgroup subtree delegated to it; the cgroup-direct.conf "
+            "drop-in of nonsensed.service sets up the delegation.",
+            cxxopts::value<std::string>()->default_value("systemd"))
+        ("idle-timeout", "Select after how many seconds without any traffic in its namespace an entity is "
+            "hibernated, until it is asked for again; 0 disables hibernation.",
+            cxxopts::value<unsigned>()->default_value("0"));
     // clang-format on
 
     auto result = opts.parse(argc, argv);
@@ -51,10 +67,84 @@ options::options(int argc, char ** argv)
     }
 
     _config_file = result["config"].as<std::string>();
+
+    auto mode = result["entityd-mode"].as<std::string>();
+    if (mode == "process")
+    {
+        _entityd_mode = entityd_mode::process;
+    }
+    else if (mode == "multiplexed")
+    {
+        _entityd_mode = entityd_mode::multiplexed;
+    }
+    else
+    {
+        std::cerr << error_prefix() << "Error: Unknown entityd mode: " << mode << '\n';
+        std::exit(1);
+    }
+
+    _netns_pool_size = result["netns-pool-size"].as<std::size_t>();
+
+    auto export_mode = result["netns-export"].as<std::string>();
+    if (export_mode == "mount")
+    {
+        _netns_export = netns_export::mount;
+    }
+    else if (export_mode == "none")
+    {
+        _netns_export = netns_export::none;
+    }
+    else
+    {
+        std::cerr << error_prefix() << "Error: Unknown namespace export mode: " << export_mode << '\n';
+        std::exit(1);
+    }
+
+    auto cgroups = result["cgroup-mode"].as<std::string>();
+    if (cgroups == "systemd")
+    {
+        _cgroup_mode = cgroup_mode::systemd;
+    }
+    else if (cgroups == "direct")
+    {
+        _cgroup_mode = cgroup_mode::direct;
+    }
+    else
+    {
+        std::cerr << error_prefix() << "Error: Unknown cgroup mode: " << cgroups << '\n';
+        std::exit(1);
+    }
+
+    _idle_timeout = std::chrono::seconds(result["idle-timeout"].as<unsigned>());
 }
 
 std::string_view options::configuration_file() const
 {
     return _config_file;
 }
+
+entityd_mode options::get_entityd_mode() const
+{
+    return _entityd_mode;
+}
+
+std::size_t options::netns_pool_size() const
+{
+    return _netns_pool_size;
+}
+
+netns_export options::get_netns_export() const
+{
+    return _netns_export;
+}
+
+cgroup_mode options::get_cgroup_mode() const
+{
+    return _cgroup_mode;
+}
+
+std::chrono::seconds options::idle_timeout() const
+{
+    return _idle_timeout;
+}
 }
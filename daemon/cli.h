@@ -16,19 +16,57 @@
 
 #pragma once
 
+#include <chrono>
+#include <cstddef>
 #include <string>
 #include <string_view>
 
 namespace nonsensed
 {
+enum class entityd_mode
+{
+    // Every running entity gets its own nonsense-entityd process.
+    process,
+    // A single nonsense-entityd process serves all running entities.
+    multiplexed
+};
+
+enum class cgroup_mode
+{
+    // The cgroups of entities are systemd units, a slice and a scope for every entity.
+    systemd,
+    // The daemon manages the cgroups of entities itself, in the subtree delegated to its service; see
+    // cgroup_tree.
+    direct
+};
+
+enum class netns_export
+{
+    // The namespace of every entity is bind-mounted at /var/run/netns/nonsense:<entity name>.
+    mount,
+    // Namespaces are only held open by fd, and handed out through Controller.GetNamespaceFd.
+    none
+};
+
 class options
 {
 public:
     options(int argc, char ** argv);
 
     std::string_view configuration_file() const;
+    entityd_mode get_entityd_mode() const;
+    std::size_t netns_pool_size() const;
+    netns_export get_netns_export() const;
+    cgroup_mode get_cgroup_mode() const;
+    // Zero when hibernation of idle entities is disabled.
+    std::chrono::seconds idle_timeout() const;
 
 private:
     std::string _config_file;
+    entityd_mode _entityd_mode = entityd_mode::process;
+    std::size_t _netns_pool_size = 0;
+    netns_export _netns_export = netns_export::mount;
+    cgroup_mode _cgroup_mode = cgroup_mode::systemd;
+    std::chrono::seconds _idle_timeout{ 0 };
 };
 }
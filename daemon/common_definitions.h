@@ -16,20 +16,31 @@
 
 #pragma once
 
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 
 namespace nonsensed
 {
 enum class component_type
 {
-    network
+    network,
+    // Applied to the cgroup of the entity by the daemon itself; never sent to entityd.
+    resources
 };
 
 inline const std::unordered_map<std::string_view, component_type> known_components = {
-    { "network", component_type::network }
+    { "network", component_type::network },
+    { "resources", component_type::resources }
 };
 
+inline bool is_entityd_component(component_type type)
+{
+    return type != component_type::resources;
+}
+
 enum class network_role
 {
     root,
@@ -47,6 +58,51 @@ inline const std::unordered_map<std::string_view, network_role> known_network_ro
     { "client", network_role::client }
 };
 
+// A sysctl, by its path under /proc/sys.
+struct sysctl_setting
+{
+    std::string_view path;
+    std::string_view value;
+};
+
+// The sysctls set in a network namespace created for an entity with the given role, before the entity is
+// connected. Roots, routers and switches route the subnets below them, and so forward; clients don't, even if
+// forwarding is enabled in the namespace the new one inherits its defaults from.
+inline std::vector<sysctl_setting> role_sysctls(network_role role)
+{
+    switch (role)
+    {
+        case network_role::root:
+        case network_role::router:
+        case network_role::switch_:
+            return { { "net/ipv4/ip_forward", "1" } };
+
+        case network_role::interface:
+        case network_role::client:
+            return { { "net/ipv4/ip_forward", "0" } };
+    }
+
+    return {};
+}
+
+// The outcome of Entityd.ReconfigureComponent, sent over the bus as a byte.
+enum class reconfigure_result : std::uint8_t
+{
+    // The new configuration of the component is the same as the one already applied.
+    unchanged,
+    // The difference has been applied in place, without touching the namespace of the entity.
+    reconfigured,
+    // The difference cannot be applied in place; the entity needs to be stopped and started again.
+    restart_required
+};
+
+// The fd on which entityd receives new bus connections from a restarted daemon; see entity::adopt_stored.
+inline constexpr int entityd_control_fd = 3;
+
+// Entityd keeps the undo journal of every entity it serves in a directory named after the entity under this
+// one; see entityd::journal.
+inline constexpr const char * entityd_journal_directory = "/run/nonsense";
+
 struct parameter_value
 {
     std::string parameter;
@@ -16,14 +16,15 @@
 
 #include "config.h"
 
+#include "cgroup.h"
 #include "cli.h"
+#include "ipam.h"
 #include "log_helpers.h"
 #include "service.h"
 
 #include <filesystem>
 #include <fstream>
 #include <iostream>
-#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <unordered_set>
@@ -48,7 +49,8 @@ static const sd_bus_vtable mutable_config_vtable[] = {
     SD_BUS_VTABLE_END
 };
 
-config::config(const config & other) : _mutable{ true }, _configuration(other._configuration)
+config::config(const config & other)
+    : _srv{ other._srv }, _mutable{ true }, _configuration(other._configuration), _resolved(other._resolved)
 {
 }
 
@@ -61,13 +63,21 @@ config::config(const options & opts) : _mutable{ false }
         throw std::runtime_error{ "Failed to open the configuration file " + std::string(config_path) };
     }
 
-    _configuration = nlohmann::json::parse(config_stream);
+    load(config_stream);
+}
+
+void config::load(std::istream & stream)
+{
+    _configuration = nlohmann::json::parse(stream);
+    _resolved.clear();
 
     _validate_metadata();
 
     for (auto && [key, ns] : _configuration.items())
     {
-        if (key == "!metadata")
+        // Keys starting with a colon are set by the validation itself, and appear here when loading a
+        // configuration serialized after being validated.
+        if (key == "!metadata" || key.starts_with(':'))
         {
             continue;
         }
@@ -76,9 +86,28 @@ config::config(const options & opts) : _mutable{ false }
     }
 }
 
+std::string config::serialize() const
+{
+    return _configuration.dump();
+}
+
 config & config::operator=(const config & other) noexcept
 {
+    auto changes = diff(other);
+
     _configuration = other._configuration;
+
+    // Entities that were removed can only have had downlinks that were removed or changed as well, so this
+    // drops the resolved forms of exactly the subtrees that are affected.
+    for (auto && name : changes.removed)
+    {
+        _resolved.erase(name);
+    }
+    for (auto && name : changes.changed)
+    {
+        _invalidate_resolved(name);
+    }
+
     return *this;
 }
 
@@ -116,6 +145,189 @@ std::optional<entity> config::try_get(std::string_view name) noexcept
     return std::make_optional(entity(*this, *it, name));
 }
 
+std::vector<entity> config::get_downlinks(std::string_view name) noexcept
+{
+    std::vector<entity> ret;
+
+    for (auto && [key, ent] : _configuration.items())
+    {
+        if (key.starts_with('!') || key.starts_with(':') || !ent.is_object())
+        {
+            continue;
+        }
+
+        auto network_it = ent.find("network");
+        if (network_it == ent.end() || !network_it->is_object())
+        {
+            continue;
+        }
+
+        auto uplink_it = network_it->find("uplink");
+        if (uplink_it != network_it->end() && uplink_it->is_string() && *uplink_it == name)
+        {
+            ret.push_back(entity(*this, ent, key));
+        }
+    }
+
+    return ret;
+}
+
+std::vector<std::string> config::entity_names() const
+{
+    std::vector<std::string> ret;
+
+    for (auto && [key, ent] : _configuration.items())
+    {
+        if (key.starts_with('!') || key.starts_with(':') || !ent.is_object())
+        {
+            continue;
+        }
+
+        ret.push_back(key);
+    }
+
+    return ret;
+}
+
+const nlohmann::json & config::_resolved_network(const std::string & name)
+{
+    // References to elements of an unordered_map survive insertions, including the ones done by the recursive
+    // call below.
+    auto & resolved = _resolved[name];
+    if (!resolved.network.is_null())
+    {
+        return resolved.network;
+    }
+
+    auto network = _configuration[name]["network"];
+    assert(!network.is_null());
+
+    auto it = network.find("uplink");
+    if (it != network.end())
+    {
+        auto uplink = it->get<std::string>();
+        assert(try_get(uplink));
+
+        network[":uplink-name"] = uplink;
+        network["uplink"] = _resolved_network(uplink);
+    }
+
+    resolved.network = std::move(network);
+    return resolved.network;
+}
+
+std::optional<std::pair<std::string, ipv4_subnet>> config::_switch_subnet(const std::string & name)
+{
+    auto & network = _resolved_network(name);
+    auto uplink_it = network.find("uplink");
+    if (uplink_it == network.end() || network.value("role", "") == "switch"
+        || uplink_it->value("role", "") != "switch")
+    {
+        return std::nullopt;
+    }
+
+    auto address_it = uplink_it->find("address");
+    if (address_it == uplink_it->end())
+    {
+        return std::nullopt;
+    }
+
+    auto subnet = parse_subnet(address_it->get<std::string>());
+    assert(subnet);
+    return std::pair(network.at(":uplink-name").get<std::string>(), *subnet);
+}
+
+const std::string & config::_component_payload(const std::string & name, const std::string & type)
+{
+    auto & payload = _resolved[name].payloads[type];
+    if (!payload.empty())
+    {
+        return payload;
+    }
+
+    if (type != "network")
+    {
+        payload = _configuration[name][type].dump();
+        return payload;
+    }
+
+    // Entities connected to the bridge of a switch get the address they have leased in its subnet.
+    auto network = _resolved_network(name);
+    if (auto address = _switch_subnet(name) ? get_service().addresses().address_of(name) : std::nullopt)
+    {
+        network[":assigned-address"] = *address;
+    }
+
+    payload = network.dump();
+    return payload;
+}
+
+void config::_invalidate_resolved(const std::string & name)
+{
+    if (!_resolved.erase(name))
+    {
+        // Resolving an entity resolves all of its uplinks, so if this one was not resolved, none of its
+        // downlinks were either.
+        return;
+    }
+
+    for (auto && downlink : get_downlinks(name))
+    {
+        _invalidate_resolved(downlink.name());
+    }
+}
+
+// Finds the place of a parameter, named by the path to it with the parts separated by dots, within the
+// configuration of an entity, creating the objects on the way to it. Returns the object the parameter is in,
+// and its name within it, or null if one of the objects on the way is a value instead.
+static std::pair<nlohmann::json *, std::string> _find_parameter(
+    const std::string & name,
+    nlohmann::json & entity,
+    const std::string & key,
+    std::string & error)
+{
+    auto * tree = &entity;
+    std::size_t start_pos = 0;
+
+    while (true)
+    {
+        if (tree->is_null())
+        {
+            *tree = nlohmann::json::object();
+        }
+
+        if (!tree->is_object())
+        {
+            error = "Invalid entity configuration of '" + name + "': value specified for parameter " + key
+                + ", but " + key.substr(0, start_pos - 1) + " is a value, not an object.";
+            return { nullptr, "" };
+        }
+
+        auto dot_pos = key.find('.', start_pos);
+        if (dot_pos == std::string::npos)
+        {
+            return { tree, key.substr(start_pos) };
+        }
+
+        tree = &(*tree)[key.substr(start_pos, dot_pos - start_pos)];
+        start_pos = dot_pos + 1;
+    }
+}
+
+// Parameters whose value is valid JSON are stored as that, and the other ones as strings.
+static nlohmann::json _parse_parameter(const std::string & value)
+{
+    auto possible_object =
+        nlohmann::json::parse(value, /* callback = */ nullptr, /* allow_exceptions = */ false);
+
+    if (possible_object.is_discarded())
+    {
+        return value;
+    }
+
+    return possible_object;
+}
+
 config_result config::add(std::string name, std::vector<parameter_value> initial_parameters) noexcept
 {
     if (!_mutable)
@@ -133,37 +345,16 @@ config_result config::add(std::string name, std::vector<parameter_value> initial
 
     for (auto && [key, value] : initial_parameters)
     {
-        auto * tree = &entity;
-        auto start_pos = 0;
-
-        while (auto dot_pos = key.find('.', start_pos))
+        std::string error;
+        auto [tree, parameter] = _find_parameter(name, entity, key, error);
+        if (!tree)
         {
-            if (dot_pos == std::string::npos)
-            {
-                break;
-            }
-
-            auto subkey = std::string_view(&key[start_pos], dot_pos - start_pos);
-
-            if (tree->is_null())
-            {
-                *tree = nlohmann::json::object();
-            }
-
-            if (!tree->is_object())
-            {
-                return { -EINVAL,
-                         "Invalid entity configuration of '" + name + "': value specified for parameter "
-                             + key + ", but " + key.substr(0, dot_pos) + " is a value, not an object." };
-            }
-
-            tree = &(*tree)[std::string(subkey)];
-            start_pos = dot_pos + 1;
+            _configuration.erase(name);
+            return { -EINVAL, std::move(error) };
         }
 
-        tree = &(*tree)[key.substr(start_pos)];
-
-        if (!tree->is_null())
+        auto & slot = (*tree)[parameter];
+        if (!slot.is_null())
         {
             _configuration.erase(name);
             return { -EINVAL,
@@ -171,52 +362,170 @@ config_result config::add(std::string name, std::vector<parameter_value> initial
                          + " specified more than once." };
         }
 
-        auto possible_object =
-            nlohmann::json::parse(value, /* callback = */ nullptr, /* allow_exceptions = */ false);
+        slot = _parse_parameter(value);
+    }
+
+    try
+    {
+        _validate_entity(name, entity);
+    }
+    catch (std::exception & err)
+    {
+        _configuration.erase(name);
+        return { -EINVAL, err.what() };
+    }
+
+    return { 0, "" };
+}
+
+config_result config::set(
+    const std::string & name,
+    const std::vector<parameter_value> & modification) noexcept
+{
+    if (!_mutable)
+    {
+        return { -EROFS, "Cannot modify an immutable configuration." };
+    }
 
-        if (possible_object.is_discarded())
+    auto it = _configuration.find(name);
+    if (it == _configuration.end() || name.starts_with('!') || name.starts_with(':'))
+    {
+        return { -ENOENT, "Cannot modify entity " + name + ": no such entity." };
+    }
+
+    // Validation fills in parts of the configuration beyond the entity itself, so a failed modification puts
+    // all of it back.
+    auto previous = _configuration;
+    auto fail = [&](std::string error) -> config_result
+    {
+        _configuration = std::move(previous);
+        return { -EINVAL, std::move(error) };
+    };
+
+    auto & entity = *it;
+    for (auto && [key, value] : modification)
+    {
+        std::string error;
+        auto [tree, parameter] = _find_parameter(name, entity, key, error);
+        if (!tree)
         {
-            *tree = value;
+            return fail(std::move(error));
+        }
+
+        // A null value removes the parameter.
+        auto parsed = _parse_parameter(value);
+        if (parsed.is_null())
+        {
+            tree->erase(parameter);
         }
         else
         {
-            *tree = std::move(possible_object);
+            (*tree)[parameter] = std::move(parsed);
         }
     }
 
+    if (_configuration.value(":default-netns", "") == name)
+    {
+        _configuration.erase(":default-netns");
+    }
+
+    // The chain of uplinks was free of loops before, so one can only appear through this entity.
+    auto uplink = try_get(name)->uplink();
+    while (uplink && *uplink != name)
+    {
+        auto ent = try_get(*uplink);
+        uplink = ent ? ent->uplink() : std::nullopt;
+    }
+
+    if (uplink)
+    {
+        return fail(
+            "Invalid entity configuration of '" + name + "': the entity would be among its own uplinks.");
+    }
+
     try
     {
         _validate_entity(name, entity);
+
+        // The downlinks of the entity are validated against it.
+        for (auto && downlink : get_downlinks(name))
+        {
+            _validate_entity(downlink.name(), _configuration[downlink.name()]);
+        }
     }
     catch (std::exception & err)
     {
-        _configuration.erase(name);
-        return { -EINVAL, err.what() };
+        return fail(err.what());
+    }
+
+    _invalidate_resolved(name);
+
+    return { 0, "" };
+}
+
+config_result config::remove(const std::string & name) noexcept
+{
+    if (!_mutable)
+    {
+        return { -EROFS, "Cannot modify an immutable configuration." };
+    }
+
+    if (!_configuration.contains(name) || name.starts_with('!') || name.starts_with(':'))
+    {
+        return { -ENOENT, "Cannot remove entity " + name + ": no such entity." };
+    }
+
+    if (auto downlinks = get_downlinks(name); !downlinks.empty())
+    {
+        return { -EBUSY,
+                 "Cannot remove entity " + name + ": it is the uplink of entity " + downlinks.front().name()
+                     + ", which has to be removed first." };
+    }
+
+    if (_configuration.value(":default-netns", "") == name)
+    {
+        _configuration.erase(":default-netns");
     }
 
+    _resolved.erase(name);
+    _configuration.erase(name);
+
     return { 0, "" };
 }
 
-std::string _nth_address_in_subnet(std::string_view net_value, int n, bool include_mask = true)
+config_diff config::diff(const config & newer) const
 {
-    auto sep = net_value.find('/');
-    assert(sep != std::string_view::npos);
+    config_diff ret;
 
-    auto network = net_value.substr(0, sep);
-    auto mask = net_value.substr(sep + 1);
-    assert(mask == "24" && "this logic needs updating when network addresses other than /24 are supported");
+    auto is_entity = [](const std::string & key) { return !key.starts_with('!') && !key.starts_with(':'); };
 
-    auto last_octet = network.rfind('.');
-    auto prefix = network.substr(0, last_octet);
+    for (auto && [key, ent] : _configuration.items())
+    {
+        if (!is_entity(key))
+        {
+            continue;
+        }
+
+        auto it = newer._configuration.find(key);
+        if (it == newer._configuration.end())
+        {
+            ret.removed.push_back(key);
+        }
+        else if (*it != ent)
+        {
+            ret.changed.push_back(key);
+        }
+    }
 
-    std::ostringstream os;
-    os << prefix << '.' << n;
-    if (include_mask)
+    for (auto && [key, ent] : newer._configuration.items())
     {
-        os << '/' << mask;
+        if (is_entity(key) && !_configuration.contains(key))
+        {
+            ret.added.push_back(key);
+        }
     }
 
-    return os.str();
+    return ret;
 }
 
 METHOD_SIGNATURE(config, get)
@@ -285,6 +594,10 @@ void config::_validate_entity(std::string_view name, nlohmann::json & ns)
             case component_type::network:
                 _validate_network(name, component);
                 break;
+
+            case component_type::resources:
+                _validate_resources(name, component);
+                break;
         }
     }
 }
@@ -309,6 +622,8 @@ void config::_validate_network(std::string_view name, nlohmann::json & component
         default_,
         address,
         uplink,
+        offload,
+        notrack,
     };
 
     static std::unordered_map<std::string_view, network_parameter> known_parameters = {
@@ -316,7 +631,9 @@ void config::_validate_network(std::string_view name, nlohmann::json & component
         { "external", network_parameter::external },
         { "default", network_parameter::default_ },
         { "address", network_parameter::address },
-        { "uplink", network_parameter::uplink }
+        { "uplink", network_parameter::uplink },
+        { "offload", network_parameter::offload },
+        { "notrack", network_parameter::notrack }
     };
 
     for (auto && [key, value] : component.items())
@@ -364,6 +681,7 @@ void config::_validate_network(std::string_view name, nlohmann::json & component
             }
 
             case network_parameter::address:
+            {
                 if (component[":role"] != network_role::switch_)
                 {
                     throw std::runtime_error(
@@ -373,9 +691,25 @@ void config::_validate_network(std::string_view name, nlohmann::json & component
                         + "', but the role of the network component role is not 'switch'.");
                 }
 
-                // TODO validate it's a valid IP address
+                auto subnet = value.is_string() ? parse_subnet(value.get<std::string>()) : std::nullopt;
+                if (!subnet)
+                {
+                    throw std::runtime_error(
+                        "Invalid configuration: the address of the network component of entity '"
+                        + std::string(name) + "' is not an IPv4 subnet of the form 'a.b.c.d/n'.");
+                }
+
+                // The switch itself takes the first two hosts of its subnet, and the broadcast address is not
+                // handed out, so there has to be at least one host left for the entities connected to it.
+                if (subnet->size() - 1 <= address_pool::first_host)
+                {
+                    throw std::runtime_error(
+                        "Invalid configuration: the address of the network component of entity '"
+                        + std::string(name) + "' is too small a subnet; its prefix can be at most /29.");
+                }
 
                 break;
+            }
 
             case network_parameter::uplink:
             {
@@ -435,7 +769,55 @@ void config::_validate_network(std::string_view name, nlohmann::json & component
                 // It's okay then.
                 break;
             }
+
+            case network_parameter::offload:
+                if (component[":role"] != network_role::router)
+                {
+                    throw std::runtime_error(
+                        "Invalid configuration: offload is specified for the network component of entity '"
+                        + std::string(name) + "', but the role of the network component is not 'router'.");
+                }
+
+                if (!value.is_boolean())
+                {
+                    throw std::runtime_error(
+                        "Invalid configuration: offload of the network component of entity '"
+                        + std::string(name) + "' is not a boolean.");
+                }
+
+                break;
+
+            case network_parameter::notrack:
+                if (component[":role"] != network_role::switch_)
+                {
+                    throw std::runtime_error(
+                        "Invalid configuration: notrack is specified for the network component of entity '"
+                        + std::string(name) + "', but the role of the network component is not 'switch'.");
+                }
+
+                if (!value.is_boolean())
+                {
+                    throw std::runtime_error(
+                        "Invalid configuration: notrack of the network component of entity '"
+                        + std::string(name) + "' is not a boolean.");
+                }
+
+                break;
         }
     }
 }
+
+void config::_validate_resources(std::string_view name, nlohmann::json & component)
+{
+    try
+    {
+        parse_resource_controls(component);
+    }
+    catch (std::exception & ex)
+    {
+        throw std::runtime_error(
+            "Invalid configuration: invalid resources component of entity '" + std::string(name)
+            + "': " + ex.what() + ".");
+    }
+}
 }
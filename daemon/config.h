@@ -20,11 +20,16 @@
 #include "dbus.h"
 #include "entity.h"
 #include "function.h"
+#include "ipam.h"
 
 #include <json.hpp>
 
+#include <istream>
 #include <optional>
+#include <string>
 #include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace nonsensed
@@ -40,21 +45,46 @@ struct config_result
     std::string error_message;
 };
 
+// The entity-level difference between two configurations.
+struct config_diff
+{
+    std::vector<std::string> added;
+    std::vector<std::string> removed;
+    std::vector<std::string> changed;
+};
+
 class config
 {
 public:
     friend class entity;
+    // Inspects the cache of resolved components; see unit-tests/config.cpp.
+    friend struct config_test;
 
     config(const config & other);
     config(const options & opts);
 
     config & operator=(const config & other) noexcept;
 
+    // Replaces the contents of the configuration with a validated one read from the stream.
+    void load(std::istream & stream);
+    std::string serialize() const;
+
     void install(service & srv, const char * dbus_path);
     service & get_service() const;
 
     std::optional<entity> try_get(std::string_view name) noexcept;
+    // Returns the entities whose network component uses the named entity as its uplink.
+    std::vector<entity> get_downlinks(std::string_view name) noexcept;
+    std::vector<std::string> entity_names() const;
     config_result add(std::string name, std::vector<parameter_value> initial_parameters) noexcept;
+    // Changes parameters of an existing entity; a value of null removes the parameter. Nothing changes if the
+    // result is not a valid configuration.
+    config_result set(const std::string & name, const std::vector<parameter_value> & modification) noexcept;
+    // Removes an entity that no other entity uses as its uplink.
+    config_result remove(const std::string & name) noexcept;
+
+    // Returns the difference between this configuration and a newer one.
+    config_diff diff(const config & newer) const;
 
     DECLARE_METHOD(get);
 
@@ -68,5 +98,24 @@ private:
     void _validate_metadata() const;
     void _validate_entity(std::string_view name, nlohmann::json & ns);
     void _validate_network(std::string_view name, nlohmann::json & component);
+    void _validate_resources(std::string_view name, nlohmann::json & component);
+
+    // The components of entities in the form they are sent to entityd, with the chains of uplinks of network
+    // components resolved into nested objects. Computed on first use, and dropped when the configuration of
+    // the entity or of any of its uplinks changes.
+    struct _resolved_entity
+    {
+        nlohmann::json network;
+        std::unordered_map<std::string, std::string> payloads;
+    };
+
+    std::unordered_map<std::string, _resolved_entity> _resolved;
+
+    const nlohmann::json & _resolved_network(const std::string & name);
+    // The switch the entity is connected to the bridge of, and its subnet, if the entity gets an address
+    // there; the address is leased by the entity before its network component is sent to entityd.
+    std::optional<std::pair<std::string, ipv4_subnet>> _switch_subnet(const std::string & name);
+    const std::string & _component_payload(const std::string & name, const std::string & type);
+    void _invalidate_resolved(const std::string & name);
 };
 }
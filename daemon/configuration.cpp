@@ -55,7 +55,14 @@
  *    Parameters:
  *      * the transaction token as an integer
  *    No return value.
- *    Semantics: commits the transaction indicated by the transaction token to the running configuration.
+ *    Semantics: commits the transaction indicated by the transaction token to the running configuration, and
+ * then reconciles the running entities with the result: running entities removed by the transaction are
+ * stopped, and running entities whose configuration changed (directly, or through a change to an entity
+ * upstream of them) are restarted in place, as with Controller.Restart. Running entities that did not change
+ * are not touched. The resulting running configuration survives restarts of the daemon, along with the
+ * running entities. If the entities can't be reconciled with it, the commit fails and doesn't take effect:
+ * the previous configuration is restored, the entities are reconciled with it again, and the running entities
+ * that were stopped for being removed are started again. The transaction is used up either way.
  *  - Discard :: "t" -> ""
  *    Parameters:
  *      * the transaction token as an integer
@@ -87,20 +94,23 @@
  *    Semantics: adds an operation of adding a new entity to the configuration to the transaction. The new
  * entity's kind is identified by the first argument; the name by the second; and a set of initial parameters
  * by the third.
- *  - Set :: "ys(ss)" -> ""
+ *  - Set :: "sa(ss)" -> ""
  *    Parameters:
- *      * the kind of the entity to modify (see docs of Add)
  *      * the name of the entity to modify
- *      * a struct containing:
- *        * the name of the configuration key to change
- *        * the value of the configuration key to change
- *  - Delete :: "ys" -> ""
+ *      * an array of structs containing:
+ *        * the name of the configuration key to change, with the parts of its path separated by dots
+ *        * the new value of the configuration key, or "null" to remove it
+ *    No return values.
+ *    Semantics: adds an operation of modifying an existing entity to the transaction. All of the changes of
+ * one operation are applied together, and the entity has to be valid once they are, so that for instance a
+ * role and the parameters that only make sense for it can be changed at once.
+ *  - Delete :: "s" -> ""
  *    Parameters:
- *      * the kind of the entity to delete (see docs of Add)
  *      * the name of the entity to delete
  *     No return values.
- *     Semantics: adds an operation of removing an entity from the configuration to the transaction. The
- * entity to delete's kind is identified by the first argument; the name by the second.
+ *     Semantics: adds an operation of removing an entity from the configuration to the transaction. An entity
+ * used as the uplink of another one can't be removed; the entities below it have to be removed by an earlier
+ * operation of the same transaction, or moved elsewhere.
  */
 
 /**
@@ -146,6 +156,7 @@
 
 #include "configuration.h"
 
+#include "fd_store.h"
 #include "log_helpers.h"
 #include "service.h"
 
@@ -166,6 +177,23 @@ configuration::configuration(const options & opts)
       _running_config{ _saved_config },
       _transaction_manager{ _saved_config, _running_config }
 {
+    // A previous instance of the daemon hands over the configuration its entities are running with, which
+    // may differ from the saved one, along with the entities themselves.
+    if (auto fd = fd_store::take("running-config"))
+    {
+        std::istringstream stream{ fd_store::read_contents(fd.get()) };
+
+        try
+        {
+            _running_config.load(stream);
+        }
+        catch (std::exception & ex)
+        {
+            std::cerr << error_prefix() << "Failed to restore the running configuration: " << ex.what()
+                      << '\n';
+            _running_config = _saved_config;
+        }
+    }
 }
 
 void configuration::install(service & srv)
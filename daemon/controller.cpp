@@ -25,6 +25,141 @@
  *
  * info.griwes.nonsense.Controller
  * ===============================
+ * Methods:
+ *  - Start :: "s" -> ""
+ *    Parameters:
+ *      * the name of the entity to start
+ *    No return values.
+ *    Semantics: starts the entity, after starting its uplink if that is not running yet. This is also how a
+ * hibernated entity is woken up.
+ *  - Stop :: "s" -> ""
+ *    Parameters:
+ *      * the name of the entity to stop
+ *    No return values.
+ *    Semantics: stops the entity. A hibernated entity becomes inactive, and is no longer woken up on demand.
+ *  - StopTree :: "s" -> ""
+ *    Parameters:
+ *      * the name of the entity at the root of the subtree to stop
+ *    No return values.
+ *    Semantics: stops the entity and every running entity downstream of it. Entities are stopped after all
+ * the entities that use them as uplinks, and separate branches of the subtree are stopped concurrently. If
+ * any entity fails to stop, the entities upstream of it are left running, and once everything else that
+ * could be stopped has been, an error naming every entity that failed is returned.
+ *  - Restart :: "s" -> ""
+ *    Parameters:
+ *      * the name of the entity to restart
+ *    No return values.
+ *    Semantics: applies the current running configuration of the entity without rebuilding it. The namespace,
+ * the devices inside of it, and everything connected to them from downstream are kept; only the parts of the
+ * entity that differ from the configuration it was started with are redone, and the running entities using it
+ * as an uplink are then restarted the same way. When the difference cannot be applied in place (for instance
+ * when the role of the entity changes), the entity is stopped and started again, which is refused while any
+ * entity using it as an uplink is running. An entity that is not running is started.
+ *  - SubmitJob :: "ss" -> "to"
+ *    Parameters:
+ *      * the operation to perform: one of "start", "stop", "stop-tree", or "restart"
+ *      * the name of the entity to perform it on
+ *    Return values:
+ *      * the id of the new job
+ *      * the object path of the new job
+ *    Semantics: performs the operation like the method of the same name would, but returns as soon as it has
+ * been started, instead of when it is done. The job is exposed as an info.griwes.nonsense.Job object until
+ * then, and its outcome is announced with the JobDone signal; the reply to this method is always sent before
+ * that signal. Any number of jobs can be running at the same time; operations on the same entity are still
+ * performed one after another.
+ *  - Status :: "s" -> "sutta{st}sts"
+ *    Parameters:
+ *      * the name of the entity to query
+ *    Return values:
+ *      * the lifecycle phase of the entity: one of "inactive", "waiting", "spawning", "creating-units",
+ * "configuring", "active", "reconfiguring", "stopping", "failed", or "hibernated"; an entity is hibernated
+ * when it has been stopped for being idle (see the --idle-timeout option of nonsensed)
+ *      * the pid of the entityd process serving the entity, or 0 if it is not running
+ *      * the time the entity last became active, in microseconds since the epoch, or 0 if it is not running
+ *      * the time the entity entered its current phase, in microseconds since the epoch, or 0 if it never
+ * left the initial "inactive" phase
+ *      * a map from phase names to the time, in microseconds, that the entity spent in each phase the last
+ * time it went through it; phases it has never left are omitted
+ *      * the description of the last error that caused an operation on the entity to fail, or an empty string
+ *      * the number of changes to the network of the entity the daemon has seen since it last became active:
+ * links in its namespace losing or regaining carrier, and links, addresses and routes being removed from it
+ *      * the description of the last of those changes, or an empty string
+ *    Semantics: returns the runtime state of the entity, as tracked in memory by the daemon; this does not
+ * involve any communication with the entity itself.
+ *  - StatusMany :: "as" -> "a(ssutta{st}sts)"
+ *    Parameters:
+ *      * the names of the entities to query; if empty, all entities in the running configuration are queried
+ *    Return values:
+ *      * for every entity, its name followed by the values returned by Status for it
+ *    Semantics: like Status, but for many entities in a single call.
+ *  - GetNamespaceFd :: "s" -> "h"
+ *    Parameters:
+ *      * the name of the entity
+ *    Return values:
+ *      * an fd referring to the network namespace of the entity
+ *    Semantics: returns the network namespace of a running entity, which the caller can enter with setns(2).
+ * A hibernated entity is started first, and the reply is sent once it is running.
+ * This works regardless of whether the namespaces of entities are also bind-mounted under /var/run/netns
+ * (see the --netns-export option of nonsensed). Only privileged callers are allowed to call it.
+ *  - WaitOnline :: "st" -> ""
+ *    Parameters:
+ *      * the name of the entity
+ *      * the longest time to wait, in microseconds, or 0 to wait for as long as it takes
+ *    No return values.
+ *    Semantics: returns once the network of a running entity is usable: every link of the entity is up and
+ * has carrier, no address on them is still tentative, and, unless the entity is the root of its tree, one of
+ * them has a default route. The links of an entity are the ones in its namespace, other than the downlinks of
+ * the entities below it, and its own downlink in the namespace of its uplink. This is tracked from the
+ * netlink notifications of the namespaces as they come, so the reply is sent as soon as that happens. Fails
+ * if the timeout passes first, or the entity is stopped in the meantime. Nothing is started: if the entity is
+ * already being started, the wait begins once that is done, and otherwise an entity that is not running fails
+ * the call right away.
+ *  - GetResourceUsage :: "s" -> "a{st}"
+ *    Parameters:
+ *      * the name of the entity
+ *    Return values:
+ *      * a map from counter names to their values: "cpu_usage_usec", "cpu_user_usec", and "cpu_system_usec"
+ * from cpu.stat, "memory_current" in bytes, and "io_read_bytes", "io_write_bytes", "io_read_ops", and
+ * "io_write_ops", summed over all devices in io.stat; counters of controllers not enabled for the cgroup are
+ * omitted, except for the IO ones, which are then 0
+ *    Semantics: reads the usage counters of the cgroup of a running entity at the time of the call. This is
+ * the slice of the entity in the systemd cgroup mode, and the cgroup of its entityd in the direct one. Not
+ * available in the multiplexed entityd mode, where all entities share a single cgroup.
+ *
+ * Signals:
+ *  - EntityStateChanged :: "ssus"
+ *    Values:
+ *      * the name of the entity
+ *      * its new lifecycle phase
+ *      * the pid of the entityd process serving it, or 0
+ *      * the description of the last error of the entity, or an empty string
+ *    Semantics: emitted when the runtime state of an entity changes. Changes are coalesced: at most one
+ * signal is emitted per entity for every iteration of the main loop of the daemon, carrying the state at the
+ * end of that iteration, so intermediate phases of quick transitions may not be observed.
+ *  - JobDone :: "tosss"
+ *    Values:
+ *      * the id of the job
+ *      * the object path of the job
+ *      * the name of the entity the job operated on
+ *      * the result of the job: "done" or "failed"
+ *      * the description of the error that caused the job to fail, or an empty string
+ *    Semantics: emitted when a job started with SubmitJob is done. The job object is removed at that point.
+ *
+ * info.griwes.nonsense.Job
+ * ========================
+ * Properties:
+ *  - Id :: "t"
+ *  - Entity :: "s"
+ *  - Operation :: "s"
+ *
+ * Signals:
+ *  - Progress :: "ss"
+ *    Values:
+ *      * the lifecycle phase the entity of the job has entered
+ *      * the step of that phase the entity is going through, like "network: connection" while its network
+ * component is being connected to its uplink, or an empty string
+ *    Semantics: emitted as the entity of the job goes through the phases of the operation, and through the
+ * steps of applying its components, coalesced in the same way as EntityStateChanged.
  *
  * info.griwes.nonsense.Entity
  * ===========================
@@ -44,6 +179,7 @@
  * Under /info/griwes/nonsense. the following sub-objects are exposed:
  *  - /info/griwes/nonsense/entity, which is the collection of currently managed entities. This subtree also
  * presents specific objects for every entity.
+ *  - /info/griwes/nonsense/job/<id>, for every running job, implementing info.griwes.nonsense.Job.
  *
  * /info/griwes/nonsense
  * =====================
@@ -54,31 +190,58 @@
 
 #include "controller.h"
 
+#include "cgroup.h"
+#include "cli.h"
 #include "common_definitions.h"
 #include "configuration.h"
 #include "log_helpers.h"
+#include "netns_monitor.h"
+#include "registry.h"
 #include "service.h"
 
 #include <iostream>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
 
 namespace nonsensed
 {
 DEFINE_METHOD(controller, start);
 DEFINE_METHOD(controller, stop);
+DEFINE_METHOD(controller, stop_tree);
+DEFINE_METHOD(controller, restart);
+DEFINE_METHOD(controller, submit_job);
+DEFINE_METHOD(controller, status);
+DEFINE_METHOD(controller, status_many);
+DEFINE_METHOD(controller, get_namespace_fd);
+DEFINE_METHOD(controller, wait_online);
+DEFINE_METHOD(controller, get_resource_usage);
 
 static const sd_bus_vtable controller_vtable[] = {
     SD_BUS_VTABLE_START(0),
 
     SD_BUS_METHOD("Start", "s", "", controller::method_start, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_METHOD("Stop", "s", "", controller::method_stop, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("StopTree", "s", "", controller::method_stop_tree, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("Restart", "s", "", controller::method_restart, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("SubmitJob", "ss", "to", controller::method_submit_job, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("Status", "s", "sutta{st}sts", controller::method_status, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD(
+        "StatusMany", "as", "a(ssutta{st}sts)", controller::method_status_many, SD_BUS_VTABLE_UNPRIVILEGED),
+
+    SD_BUS_METHOD("GetNamespaceFd", "s", "h", controller::method_get_namespace_fd, 0),
+    SD_BUS_METHOD("WaitOnline", "st", "", controller::method_wait_online, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD(
+        "GetResourceUsage", "s", "a{st}", controller::method_get_resource_usage, SD_BUS_VTABLE_UNPRIVILEGED),
+
+    SD_BUS_SIGNAL("EntityStateChanged", "ssus", 0),
+    SD_BUS_SIGNAL("JobDone", "tosss", 0),
 
     SD_BUS_VTABLE_END
 };
 
 controller::controller(const options & opts, configuration & configuration_object, const service & srv)
-    : _srv{ srv }, _config(configuration_object.running())
+    : _srv{ srv }, _config(configuration_object.running()), _jobs{ srv }
 {
     const char * dbus_path = "/info/griwes/nonsense";
     int ret = sd_bus_add_object_vtable(
@@ -132,4 +295,408 @@ METHOD_SIGNATURE(controller, stop)
     co_await ent->stop();
     co_return reply_status(sd_bus_reply_method_return(message, ""));
 }
+
+METHOD_SIGNATURE(controller, stop_tree)
+{
+    const char * name;
+
+    co_yield log_and_reply_on_error(sd_bus_message_read(message, "s", &name), "Failed to parse parameters");
+
+    std::optional<entity> ent = _config.try_get(name);
+
+    if (!ent)
+    {
+        co_return reply_status_format(
+            -ENOENT,
+            "info.griwes.nonsense.NoSuchEntity",
+            "Attempted to stop an entity that does not exist: %s.",
+            name);
+    }
+
+    co_await ent->stop_subtree();
+    co_return reply_status(sd_bus_reply_method_return(message, ""));
+}
+
+METHOD_SIGNATURE(controller, restart)
+{
+    const char * name;
+
+    co_yield log_and_reply_on_error(sd_bus_message_read(message, "s", &name), "Failed to parse parameters");
+
+    std::optional<entity> ent = _config.try_get(name);
+
+    if (!ent)
+    {
+        co_return reply_status_format(
+            -ENOENT,
+            "info.griwes.nonsense.NoSuchEntity",
+            "Attempted to restart an entity that does not exist: %s.",
+            name);
+    }
+
+    co_await ent->restart();
+    co_return reply_status(sd_bus_reply_method_return(message, ""));
+}
+
+METHOD_SIGNATURE(controller, submit_job)
+{
+    const char * operation;
+    const char * name;
+
+    co_yield log_and_reply_on_error(
+        sd_bus_message_read(message, "ss", &operation, &name), "Failed to parse parameters");
+
+    static const std::unordered_map<std::string_view, subtask (*)(entity &)> operations = {
+        { "start", [](entity & ent) { return ent.start(); } },
+        { "stop", [](entity & ent) { return ent.stop(); } },
+        { "stop-tree", [](entity & ent) { return ent.stop_subtree(); } },
+        { "restart", [](entity & ent) { return ent.restart(); } }
+    };
+
+    auto operation_it = operations.find(operation);
+    if (operation_it == operations.end())
+    {
+        co_return reply_status_format(
+            -EINVAL, "info.griwes.nonsense.InvalidOperation", "Unknown job operation: %s.", operation);
+    }
+
+    std::optional<entity> ent = _config.try_get(name);
+
+    if (!ent)
+    {
+        co_return reply_status_format(
+            -ENOENT,
+            "info.griwes.nonsense.NoSuchEntity",
+            "Attempted to submit a job for an entity that does not exist: %s.",
+            name);
+    }
+
+    // The entity is kept in the task, since this coroutine is gone long before the job is done.
+    subtask task = [ent = *ent, perform = operation_it->second](
+                       [[maybe_unused]] coro::coroutine_handle<promise> nonsense_promise_arg) mutable
+        -> future {
+        co_await perform(ent);
+        co_return unit;
+    };
+
+    auto & new_job = _jobs.add(name, operation);
+    int ret = sd_bus_reply_method_return(message, "to", new_job.id(), new_job.object_path());
+    _jobs.run(new_job, std::move(task));
+
+    co_return reply_status(ret);
+}
+
+// Appends the "sutta{st}sts" representation of the status of an entity to a message.
+static int append_status(sd_bus_message * reply, const entity_status & status)
+{
+    int ret = sd_bus_message_append(
+        reply,
+        "sutt",
+        std::string(to_string(status.phase)).c_str(),
+        static_cast<std::uint32_t>(status.pid),
+        status.started_at,
+        status.phase_since);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    ret = sd_bus_message_open_container(reply, 'a', "{st}");
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    for (std::size_t i = 0; i < status.durations.size(); ++i)
+    {
+        if (!status.durations[i])
+        {
+            continue;
+        }
+
+        ret = sd_bus_message_append(
+            reply,
+            "{st}",
+            std::string(to_string(static_cast<lifecycle_phase>(i))).c_str(),
+            status.durations[i]);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+
+    ret = sd_bus_message_close_container(reply);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    return sd_bus_message_append(
+        reply, "sts", status.last_error.c_str(), status.network_events, status.last_network_event.c_str());
+}
+
+METHOD_SIGNATURE(controller, status)
+{
+    const char * name;
+
+    co_yield log_and_reply_on_error(sd_bus_message_read(message, "s", &name), "Failed to parse parameters");
+
+    if (!_config.try_get(name))
+    {
+        co_return reply_status_format(
+            -ENOENT,
+            "info.griwes.nonsense.NoSuchEntity",
+            "Attempted to query the status of an entity that does not exist: %s.",
+            name);
+    }
+
+    __attribute__((cleanup(sd_bus_message_unrefp))) sd_bus_message * reply = nullptr;
+    co_yield log_and_reply_on_error(
+        sd_bus_message_new_method_return(message, &reply), "Failed to create a reply message");
+    co_yield log_and_reply_on_error(
+        append_status(reply, _srv.registry().get(name)), "Failed to build a reply message");
+
+    co_return reply_status(sd_bus_send(nullptr, reply, nullptr));
+}
+
+METHOD_SIGNATURE(controller, status_many)
+{
+    std::vector<std::string> names;
+
+    char ** raw_names = nullptr;
+    co_yield log_and_reply_on_error(
+        sd_bus_message_read_strv(message, &raw_names), "Failed to parse parameters");
+
+    for (auto it = raw_names; it && *it; ++it)
+    {
+        names.emplace_back(*it);
+        free(*it);
+    }
+    free(raw_names);
+
+    if (names.empty())
+    {
+        names = _config.entity_names();
+    }
+
+    for (auto && name : names)
+    {
+        if (!_config.try_get(name))
+        {
+            co_return reply_status_format(
+                -ENOENT,
+                "info.griwes.nonsense.NoSuchEntity",
+                "Attempted to query the status of an entity that does not exist: %s.",
+                name.c_str());
+        }
+    }
+
+    __attribute__((cleanup(sd_bus_message_unrefp))) sd_bus_message * reply = nullptr;
+    co_yield log_and_reply_on_error(
+        sd_bus_message_new_method_return(message, &reply), "Failed to create a reply message");
+    co_yield log_and_reply_on_error(
+        sd_bus_message_open_container(reply, 'a', "(ssutta{st}sts)"), "Failed to build a reply message");
+
+    for (auto && name : names)
+    {
+        co_yield log_and_reply_on_error(
+            sd_bus_message_open_container(reply, 'r', "ssutta{st}sts"), "Failed to build a reply message");
+        co_yield log_and_reply_on_error(
+            sd_bus_message_append(reply, "s", name.c_str()), "Failed to build a reply message");
+        co_yield log_and_reply_on_error(
+            append_status(reply, _srv.registry().get(name)), "Failed to build a reply message");
+        co_yield log_and_reply_on_error(
+            sd_bus_message_close_container(reply), "Failed to build a reply message");
+    }
+
+    co_yield log_and_reply_on_error(
+        sd_bus_message_close_container(reply), "Failed to build a reply message");
+
+    co_return reply_status(sd_bus_send(nullptr, reply, nullptr));
+}
+
+METHOD_SIGNATURE(controller, get_namespace_fd)
+{
+    const char * name;
+
+    co_yield log_and_reply_on_error(sd_bus_message_read(message, "s", &name), "Failed to parse parameters");
+
+    std::optional<entity> ent = _config.try_get(name);
+
+    if (!ent)
+    {
+        co_return reply_status_format(
+            -ENOENT,
+            "info.griwes.nonsense.NoSuchEntity",
+            "Attempted to get the namespace of an entity that does not exist: %s.",
+            name);
+    }
+
+    if (_srv.registry().get(name).phase == lifecycle_phase::hibernated)
+    {
+        co_await ent->start();
+    }
+
+    if (ent->netns() == -1)
+    {
+        co_return reply_error_format(
+            "info.griwes.nonsense.NoNamespace",
+            "Entity %s is not running, or does not have a network namespace.",
+            name);
+    }
+
+    co_return reply_status(sd_bus_reply_method_return(message, "h", ent->netns()));
+}
+
+// Suspends a method until the network of an entity is online, or the wait for it is over, and resumes it with
+// whether it is.
+struct online_awaitable
+{
+    netns_monitor & monitor;
+    std::string entity;
+    bool default_route;
+    std::chrono::milliseconds timeout;
+    bool result = false;
+
+    bool await_ready()
+    {
+        result = monitor.online(entity, default_route);
+        return result;
+    }
+
+    void await_suspend(coro::coroutine_handle<promise> handle)
+    {
+        monitor.wait_online(entity, default_route, timeout, [this, handle](bool online) mutable {
+            result = online;
+            handle.resume();
+        });
+    }
+
+    bool await_resume()
+    {
+        return result;
+    }
+};
+
+METHOD_SIGNATURE(controller, wait_online)
+{
+    const char * name;
+    std::uint64_t timeout;
+
+    co_yield log_and_reply_on_error(
+        sd_bus_message_read(message, "st", &name, &timeout), "Failed to parse parameters");
+
+    std::optional<entity> ent = _config.try_get(name);
+
+    if (!ent)
+    {
+        co_return reply_status_format(
+            -ENOENT,
+            "info.griwes.nonsense.NoSuchEntity",
+            "Attempted to wait for an entity that does not exist: %s.",
+            name);
+    }
+
+    // Waits out the operations already queued on the entity, like a start submitted as a job right before
+    // this call, without queueing one of its own; starting the entity is up to Start.
+    {
+        auto token = co_await ent->enqueue();
+    }
+
+    if (ent->netns() == -1)
+    {
+        co_return reply_error_format(
+            "info.griwes.nonsense.NoNamespace",
+            "Entity %s is not running, or does not have a network namespace.",
+            name);
+    }
+
+    // The root of a tree has nowhere to route to.
+    auto online = co_await online_awaitable{
+        .monitor = _srv.network_monitor(),
+        .entity = name,
+        .default_route = ent->uplink().has_value(),
+        .timeout = std::chrono::ceil<std::chrono::milliseconds>(std::chrono::microseconds(timeout)),
+    };
+
+    if (!online)
+    {
+        co_return reply_error_format(
+            "info.griwes.nonsense.NotOnline",
+            "Entity %s has not come online: the timeout has passed, or the entity has been stopped.",
+            name);
+    }
+
+    co_return reply_status(sd_bus_reply_method_return(message, ""));
+}
+
+METHOD_SIGNATURE(controller, get_resource_usage)
+{
+    const char * name;
+
+    co_yield log_and_reply_on_error(sd_bus_message_read(message, "s", &name), "Failed to parse parameters");
+
+    std::optional<entity> ent = _config.try_get(name);
+
+    if (!ent)
+    {
+        co_return reply_status_format(
+            -ENOENT,
+            "info.griwes.nonsense.NoSuchEntity",
+            "Attempted to get the resource usage of an entity that does not exist: %s.",
+            name);
+    }
+
+    if (_srv.get_options().get_entityd_mode() == entityd_mode::multiplexed)
+    {
+        co_return reply_error_format(
+            "info.griwes.nonsense.NoResourceUsage",
+            "Entities do not have cgroups of their own in the multiplexed entityd mode.");
+    }
+
+    auto pid = _srv.registry().get(name).pid;
+    if (!ent->running() || pid == 0)
+    {
+        co_return reply_error_format(
+            "info.griwes.nonsense.NoResourceUsage", "Entity %s is not running.", name);
+    }
+
+    std::vector<std::pair<std::string, std::uint64_t>> usage;
+    std::string failure;
+    try
+    {
+        // In the systemd mode, entityd is in a scope in the slice of the entity.
+        auto cgroups = _srv.cgroups();
+        usage = read_usage(cgroups ? cgroups->entity_path(name) : cgroup_of(pid).parent_path());
+    }
+    catch (std::exception & ex)
+    {
+        failure = ex.what();
+    }
+
+    if (!failure.empty())
+    {
+        co_return reply_error_format(
+            "info.griwes.nonsense.NoResourceUsage",
+            "Failed to read the resource usage of entity %s: %s",
+            name,
+            failure.c_str());
+    }
+
+    __attribute__((cleanup(sd_bus_message_unrefp))) sd_bus_message * reply = nullptr;
+    co_yield log_and_reply_on_error(
+        sd_bus_message_new_method_return(message, &reply), "Failed to create a reply message");
+
+    co_yield log_and_reply_on_error(
+        sd_bus_message_open_container(reply, 'a', "{st}"), "Failed to build a reply message");
+    for (auto && [key, value] : usage)
+    {
+        co_yield log_and_reply_on_error(
+            sd_bus_message_append(reply, "{st}", key.c_str(), value), "Failed to build a reply message");
+    }
+    co_yield log_and_reply_on_error(
+        sd_bus_message_close_container(reply), "Failed to build a reply message");
+
+    co_return reply_status(sd_bus_send(nullptr, reply, nullptr));
+}
 }
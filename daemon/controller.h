@@ -17,6 +17,7 @@
 #pragma once
 
 #include "dbus.h"
+#include "jobs.h"
 
 extern "C"
 {
@@ -37,10 +38,19 @@ public:
 
     DECLARE_METHOD(start);
     DECLARE_METHOD(stop);
+    DECLARE_METHOD(stop_tree);
+    DECLARE_METHOD(restart);
+    DECLARE_METHOD(submit_job);
+    DECLARE_METHOD(status);
+    DECLARE_METHOD(status_many);
+    DECLARE_METHOD(get_namespace_fd);
+    DECLARE_METHOD(wait_online);
+    DECLARE_METHOD(get_resource_usage);
 
 private:
     const service & _srv;
     sd_bus_slot * _slot = nullptr;
     config & _config;
+    jobs _jobs;
 };
 }
@@ -16,23 +16,38 @@
 
 #include "entity.h"
 
+#include "cgroup.h"
+#include "cli.h"
 #include "config.h"
+#include "fd_store.h"
+#include "ipam.h"
+#include "netns_monitor.h"
+#include "netns_pool.h"
+#include "registry.h"
 #include "service.h"
 
 #include <nonsense-paths.h>
 
+#include <fcntl.h>
+#include <signal.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <systemd/sd-id128.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
 #include <list>
 #include <thread>
+#include <unordered_set>
 
 namespace nonsensed
 {
 std::unordered_map<std::string, entity::_entity_state> entity::_live_entities;
+std::optional<entity::_entity_state> entity::_shared_entityd;
 
 entity::entity(config & config_object, nlohmann::json & self, std::string_view name)
     : _config(config_object), _self(self), _name(name)
@@ -101,54 +116,64 @@ entity::queue_awaitable entity::enqueue()
     return { _name };
 }
 
-subtask entity::start()
+subtask entity::_spawn_entityd(
+    std::string argument,
+    std::string fd_suffix,
+    _entity_state * state,
+    int cgroup_procs)
 {
     RETURN_MEMBER_TASK
     {
-        auto token = co_await enqueue();
-
-        if (_live_entities.count(_name))
-        {
-            co_return unit;
-        }
-
-        auto it = _self.find("network");
-        if (it != _self.end())
+        // Close-on-exec, so that entityds spawned concurrently don't inherit each other's sockets; the ends
+        // passed on are duplicated onto their final numbers in the child, which clears the flag.
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
         {
-            auto uplink_it = it->find("uplink");
-            if (uplink_it != it->end())
-            {
-                auto uplink = _config.try_get(uplink_it->get<std::string>());
-                assert(uplink);
-                co_await uplink->start();
-            }
+            co_return reply_status(errno);
         }
 
-        int sv[2];
-        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+        int control[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, control) == -1)
         {
+            close(sv[0]);
+            close(sv[1]);
             co_return reply_status(errno);
         }
 
+        // Prepared before forking, since the daemon is not single-threaded (see netns_pool), so the child
+        // must not allocate.
+        auto filename = (install_prefix / "bin" / "nonsense-entityd").string();
+        auto argument_copy = argument;
+        char * arguments[] = { filename.data(), argument_copy.data(), NULL };
+
         auto pid = fork();
         if (pid == -1)
         {
-            co_return reply_status(errno);
+            auto error = errno;
+            close(sv[0]);
+            close(sv[1]);
+            close(control[0]);
+            close(control[1]);
+            co_return reply_status(error);
         }
 
         if (pid == 0)
         {
-            if (dup2(sv[1], STDIN_FILENO) == -1)
+            if (cgroup_procs != -1 && write(cgroup_procs, "0", 1) == -1)
+            {
+                perror("Failed to move entityd into its cgroup");
+                std::abort();
+            }
+
+            if (dup2(sv[1], STDIN_FILENO) == -1 || dup2(control[1], entityd_control_fd) == -1)
             {
                 perror("Call to dup2 failed");
                 std::abort();
             }
             close(sv[0]);
             close(sv[1]);
-
-            auto filename = (install_prefix / "bin" / "nonsense-entityd").string();
-
-            char * arguments[] = { filename.data(), _name.data(), NULL };
+            close(control[0]);
+            close(control[1]);
 
             if (execv(filename.c_str(), arguments) == -1)
             {
@@ -160,12 +185,14 @@ subtask entity::start()
         }
 
         close(sv[1]);
+        close(control[1]);
+        state->control = unique_fd(control[0]);
 
         sd_bus * raw_bus;
         co_yield log_and_reply_on_error(sd_bus_new(&raw_bus), "Failed to allocate an sd_bus");
 
-        _entity_state state = { .pid = pid, .bus = _entity_state::bus_ptr(raw_bus) };
-        _live_entities.emplace(_name, std::move(state));
+        state->pid = pid;
+        state->bus = _entity_state::bus_ptr(raw_bus);
 
         co_yield log_and_reply_on_error(sd_bus_set_fd(raw_bus, sv[0], sv[0]), "Failed to set bus fd");
         co_yield log_and_reply_on_error(
@@ -185,16 +212,49 @@ subtask entity::start()
             assert(!"failed to connect to entity dbus server, TODO: handle this more gracefully");
         }
 
-        auto dashed_name = _name;
-        for (auto && c : dashed_name)
+        fd_store::store(sv[0], "bus" + fd_suffix);
+        fd_store::store(control[0], "control" + fd_suffix);
+
+        co_return unit;
+    };
+}
+
+subtask entity::_start_shared_entityd()
+{
+    RETURN_MEMBER_TASK
+    {
+        // Entity names come from the top level keys of the configuration, where names starting with a colon
+        // are reserved, so this can't collide with the queue of any actual entity.
+        auto token = co_await queue_awaitable(":shared-entityd");
+
+        if (_shared_entityd)
+        {
+            co_return unit;
+        }
+
+        _entity_state state;
+
+        if (auto cgroups = _config.get_service().cgroups())
         {
-            if (c == '.')
+            auto procs = cgroups->create(cgroups->shared_entityd_path());
+            if (!procs)
             {
-                c = '-';
+                co_return reply_error_format(
+                    "info.griwes.nonsense.FailedToStart",
+                    "Failed to create the cgroup of the shared entityd.");
             }
+
+            co_await _spawn_entityd("--multiplexed", "", &state, procs.get());
+            _shared_entityd = std::move(state);
+            co_return unit;
         }
 
-        auto slice_name = "nonsense-" + dashed_name + ".slice";
+        co_await _spawn_entityd("--multiplexed", "", &state);
+
+        auto pid = state.pid;
+        _shared_entityd = std::move(state);
+
+        auto scope_name = "nonsense-entityd.scope";
 
         auto subscription =
             async::sd_bus_subscribe_signal(_config._srv->bus(), signals::systemd::job_removed);
@@ -204,12 +264,19 @@ subtask entity::start()
             services::systemd::manager,
             "StartTransientUnit",
             "ssa(sv)a(sa(sv))",
-            slice_name.c_str(),
+            scope_name,
             "fail",
-            1,
+            3,
             "Description",
             "s",
-            ("Slice for nonsense namespace engine entity " + _name).c_str(),
+            "Scope for the nonsense namespace engine entity daemon serving all entities",
+            "Slice",
+            "s",
+            "nonsense.slice",
+            "PIDs",
+            "au",
+            1,
+            pid,
             0);
 
         const char * job;
@@ -218,6 +285,125 @@ subtask entity::start()
 
         auto result = co_await subscription.match<1>(std::string_view(job));
 
+        std::uint32_t id;
+        const char * job_;
+        const char * unit_name;
+        const char * result_string;
+        co_yield log_and_reply_on_error(
+            sd_bus_message_read(result.get(), "uoss", &id, &job_, &unit_name, &result_string),
+            "Failed to parse systemd signal");
+
+        if (std::string_view(result_string) != "done")
+        {
+            co_return reply_error_format(
+                "info.griwes.nonsense.FailedToStart",
+                "Failed to start unit %s: job returned result '%s'.",
+                scope_name,
+                result_string);
+        }
+
+        co_return unit;
+    };
+}
+
+subtask entity::_start_dedicated_entityd(lifecycle_operation * operation)
+{
+    RETURN_MEMBER_TASK
+    {
+        _entity_state state;
+
+        // Without systemd in the way, the cgroup is there before entityd is, and nothing else needs to wait.
+        if (auto cgroups = _config.get_service().cgroups())
+        {
+            operation->enter(lifecycle_phase::creating_units);
+
+            auto procs = cgroups->create(cgroups->entity_path(_name));
+            if (!procs)
+            {
+                co_return reply_error_format(
+                    "info.griwes.nonsense.FailedToStart",
+                    "Failed to create the cgroup of entity %s.",
+                    _name.c_str());
+            }
+
+            std::string failure;
+            try
+            {
+                write_resource_controls(cgroups->entity_path(_name), _resource_controls());
+            }
+            catch (std::exception & ex)
+            {
+                failure = ex.what();
+            }
+
+            if (!failure.empty())
+            {
+                cgroups->remove(cgroups->entity_path(_name));
+                co_return reply_error_format(
+                    "info.griwes.nonsense.FailedToStart",
+                    "Failed to apply the resource controls of entity %s: %s",
+                    _name.c_str(),
+                    failure.c_str());
+            }
+
+            co_await _spawn_entityd(_name, "." + _name, &state, procs.get());
+            _live_entities.emplace(_name, std::move(state));
+            co_return unit;
+        }
+
+        co_await _spawn_entityd(_name, "." + _name, &state);
+
+        auto pid = state.pid;
+        _live_entities.emplace(_name, std::move(state));
+
+        operation->enter(lifecycle_phase::creating_units);
+
+        auto slice_name = _slice_name(_name);
+
+        auto subscription =
+            async::sd_bus_subscribe_signal(_config._srv->bus(), signals::systemd::job_removed);
+
+        // The resource controls go on the slice, so that they also cover anything else started in it.
+        sd_bus_message * raw_call;
+        co_yield log_and_reply_on_error(
+            sd_bus_message_new_method_call(
+                _config.get_service().bus(),
+                &raw_call,
+                services::systemd::manager.service,
+                services::systemd::manager.dbus_path,
+                services::systemd::manager.interface,
+                "StartTransientUnit"),
+            "Failed to create a method call message");
+        auto call = async::message_ptr(raw_call);
+
+        co_yield log_and_reply_on_error(
+            sd_bus_message_append(raw_call, "ss", slice_name.c_str(), "fail"),
+            "Failed to build a method call message");
+        co_yield log_and_reply_on_error(
+            sd_bus_message_open_container(raw_call, 'a', "(sv)"), "Failed to build a method call message");
+        co_yield log_and_reply_on_error(
+            sd_bus_message_append(
+                raw_call,
+                "(sv)",
+                "Description",
+                "s",
+                ("Slice for nonsense namespace engine entity " + _name).c_str()),
+            "Failed to build a method call message");
+        co_yield log_and_reply_on_error(
+            append_unit_properties(raw_call, _resource_controls()), "Failed to build a method call message");
+        co_yield log_and_reply_on_error(
+            sd_bus_message_close_container(raw_call), "Failed to build a method call message");
+        co_yield log_and_reply_on_error(
+            sd_bus_message_append(raw_call, "a(sa(sv))", 0), "Failed to build a method call message");
+
+        auto reply = co_await async::sd_bus_call(_config.get_service().bus(), raw_call);
+
+        const char * job;
+        co_yield log_and_reply_on_error(
+            sd_bus_message_read(reply.get(), "o", &job), "Failed to parse systemd response");
+
+        auto result = co_await subscription.match<1>(std::string_view(job));
+
         std::uint32_t id;
         const char * job_;
         const char * unit_name;
@@ -275,108 +461,490 @@ subtask entity::start()
                 result_string);
         }
 
-        for (auto elements : _self.items())
+        co_return unit;
+    };
+}
+
+std::optional<std::string> entity::uplink() const
+{
+    auto network_it = _self.find("network");
+    if (network_it == _self.end() || !network_it->is_object())
+    {
+        return std::nullopt;
+    }
+
+    auto uplink_it = network_it->find("uplink");
+    if (uplink_it == network_it->end() || !uplink_it->is_string())
+    {
+        return std::nullopt;
+    }
+
+    return uplink_it->get<std::string>();
+}
+
+bool entity::has_own_namespace() const
+{
+    auto network = _self.find("network");
+    if (network == _self.end())
+    {
+        return false;
+    }
+
+    auto is_set = [&](auto key) {
+        auto it = network->find(key);
+        return it != network->end() && *it == true;
+    };
+
+    return !is_set("external") && !is_set("default");
+}
+
+int entity::netns() const
+{
+    auto it = _live_entities.find(_name);
+    return it == _live_entities.end() ? -1 : it->second.netns.get();
+}
+
+int entity::_append_namespaces(sd_bus_message * message, const unique_fd & own)
+{
+    int ret = sd_bus_message_open_container(message, 'a', "{sh}");
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    if (own)
+    {
+        ret = sd_bus_message_append(message, "{sh}", _name.c_str(), own.get());
+        if (ret < 0)
         {
-            auto type = elements.key();
-            auto component = elements.value();
+            return ret;
+        }
+    }
+
+    auto uplink = this->uplink();
+    while (uplink)
+    {
+        auto ent = _config.try_get(*uplink);
+        auto it = _live_entities.find(*uplink);
+        if (!ent || it == _live_entities.end())
+        {
+            break;
+        }
 
-            if (type == "network")
+        if (it->second.netns)
+        {
+            ret = sd_bus_message_append(message, "{sh}", uplink->c_str(), it->second.netns.get());
+            if (ret < 0)
             {
-                auto deep_uplink_info = [&](auto && component, auto && self) {
-                    auto it = component.find("uplink");
-                    if (it == component.end())
-                    {
-                        return;
-                    }
+                return ret;
+            }
+        }
 
-                    auto uplink_ent = _config.try_get(it->template get_ref<std::string &>());
-                    assert(uplink_ent);
-                    auto uplink = uplink_ent->_self["network"];
-                    assert(!uplink.is_null());
+        uplink = ent->uplink();
+    }
 
-                    self(uplink, self);
+    return sd_bus_message_close_container(message);
+}
 
-                    component[":uplink-name"] = std::move(component["uplink"]);
-                    component["uplink"] = std::move(uplink);
-                };
+std::string entity::_slice_name(const std::string & name)
+{
+    auto dashed_name = name;
+    for (auto && c : dashed_name)
+    {
+        if (c == '.')
+        {
+            c = '-';
+        }
+    }
 
-                deep_uplink_info(component, deep_uplink_info);
-            }
+    return "nonsense-" + dashed_name + ".slice";
+}
 
-            auto reply = co_await async::sd_bus_call_method(
-                raw_bus, services::entityd, "AddComponent", "ss", type.c_str(), component.dump().c_str());
+resource_controls entity::_resource_controls() const
+{
+    auto it = _self.find("resources");
+    return it == _self.end() ? resource_controls() : parse_resource_controls(*it);
+}
 
-            bool result;
-            co_yield log_and_reply_on_error(
-                sd_bus_message_read(reply.get(), "b", &result),
-                "Failed to parse entityd response to AddComponent");
+subtask entity::_apply_resources()
+{
+    RETURN_MEMBER_TASK
+    {
+        if (_config.get_service().get_options().get_entityd_mode() == entityd_mode::multiplexed)
+        {
+            co_return unit;
+        }
+
+        if (auto cgroups = _config.get_service().cgroups())
+        {
+            std::string failure;
+            try
+            {
+                write_resource_controls(cgroups->entity_path(_name), _resource_controls());
+            }
+            catch (std::exception & ex)
+            {
+                failure = ex.what();
+            }
+
+            if (!failure.empty())
+            {
+                co_return reply_error_format(
+                    "info.griwes.nonsense.FailedToRestart",
+                    "Failed to apply the resource controls of entity %s: %s",
+                    _name.c_str(),
+                    failure.c_str());
+            }
 
-            assert(result); // FIXME better handling
+            co_return unit;
         }
 
+        sd_bus_message * raw_call;
+        co_yield log_and_reply_on_error(
+            sd_bus_message_new_method_call(
+                _config.get_service().bus(),
+                &raw_call,
+                services::systemd::manager.service,
+                services::systemd::manager.dbus_path,
+                services::systemd::manager.interface,
+                "SetUnitProperties"),
+            "Failed to create a method call message");
+        auto call = async::message_ptr(raw_call);
+
+        co_yield log_and_reply_on_error(
+            sd_bus_message_append(raw_call, "sb", _slice_name(_name).c_str(), true),
+            "Failed to build a method call message");
+        co_yield log_and_reply_on_error(
+            sd_bus_message_open_container(raw_call, 'a', "(sv)"), "Failed to build a method call message");
+        co_yield log_and_reply_on_error(
+            append_unit_properties(raw_call, _resource_controls()), "Failed to build a method call message");
+        co_yield log_and_reply_on_error(
+            sd_bus_message_close_container(raw_call), "Failed to build a method call message");
+
+        co_await async::sd_bus_call(_config.get_service().bus(), raw_call);
+
         co_return unit;
     };
 }
 
-subtask entity::stop()
+subtask entity::start()
 {
     RETURN_MEMBER_TASK
     {
         auto token = co_await enqueue();
 
-        auto it = _live_entities.find(_name);
-        if (it == _live_entities.end())
+        if (_live_entities.count(_name))
         {
-            co_return reply_error_format(
-                "info.griwes.nonsense.EntityNotStarted",
-                "Failed to stop entity %s: entity is not running.",
-                _name.c_str());
+            co_return unit;
         }
 
-        auto raw_bus = it->second.bus.get();
+        lifecycle_operation operation{ _config.get_service().registry(),
+                                       _name,
+                                       lifecycle_phase::waiting,
+                                       co_await async::current_promise() };
 
-        auto reply = co_await async::sd_bus_call_method(raw_bus, services::entityd, "Shutdown", "");
+        co_await _lease_address();
 
-        int status;
-        waitpid(it->second.pid, &status, 0);
+        auto it = _self.find("network");
+        if (it != _self.end())
+        {
+            auto uplink_it = it->find("uplink");
+            if (uplink_it != it->end())
+            {
+                auto uplink = _config.try_get(uplink_it->get<std::string>());
+                assert(uplink);
+                co_await uplink->start();
+            }
+        }
 
-        _config.get_service().unregister_bus(raw_bus);
+        operation.enter(lifecycle_phase::spawning);
 
-        _live_entities.erase(it);
+        if (_config.get_service().get_options().get_entityd_mode() == entityd_mode::multiplexed)
+        {
+            if (_self.contains("resources"))
+            {
+                std::cerr << error_prefix() << "Warning: ignoring the resources component of entity " << _name
+                          << ", since all entities share a single cgroup in the multiplexed entityd mode.\n";
+            }
+
+            co_await _start_shared_entityd();
 
-        auto dashed_name = _name;
-        for (auto && c : dashed_name)
+            auto reply = co_await async::sd_bus_call_method(
+                _shared_entityd->bus.get(), services::entityd_host, "Host", "s", _name.c_str());
+
+            const char * object_path;
+            co_yield log_and_reply_on_error(
+                sd_bus_message_read(reply.get(), "o", &object_path), "Failed to parse entityd host response");
+
+            _live_entities.emplace(
+                _name,
+                _entity_state{ .pid = _shared_entityd->pid,
+                               .bus = _entity_state::bus_ptr(sd_bus_ref(_shared_entityd->bus.get())),
+                               .object_path = object_path });
+        }
+        else if (auto failure = co_await async::attempt(_start_dedicated_entityd(&operation)))
         {
-            if (c == '.')
+            // Entityd may already be running by the time setting up its units fails.
+            if (_live_entities.contains(_name))
             {
-                c = '-';
+                co_await _abort_start();
             }
+
+            co_return *failure;
         }
 
-        auto slice_name = "nonsense-" + dashed_name + ".slice";
+        auto & state = _live_entities.at(_name);
+        _config.get_service().registry().set_pid(_name, state.pid);
 
-        auto subscription =
-            async::sd_bus_subscribe_signal(_config._srv->bus(), signals::systemd::job_removed);
+        operation.enter(lifecycle_phase::configuring);
+        auto entityd_object = service_description{ .service = services::entityd.service,
+                                                   .dbus_path = state.object_path.c_str(),
+                                                   .interface = services::entityd.interface };
 
-        reply = co_await async::sd_bus_call_method(
-            _config._srv->bus(), services::systemd::manager, "StopUnit", "ss", slice_name.c_str(), "replace");
+        // Entityd announces the steps of applying the components as it goes through them, before it replies.
+        struct progress_target
+        {
+            entity_registry & registry;
+            std::string name;
+        } progress{ _config.get_service().registry(), _name };
 
-        const char * job;
+        dbus_slot progress_slot;
         co_yield log_and_reply_on_error(
-            sd_bus_message_read(reply.get(), "o", &job), "Failed to parse systemd response");
+            sd_bus_match_signal(
+                state.bus.get(),
+                &progress_slot,
+                nullptr,
+                entityd_object.dbus_path,
+                entityd_object.interface,
+                "Progress",
+                +[](sd_bus_message * message, void * userdata, sd_bus_error *) {
+                    auto & progress = *static_cast<progress_target *>(userdata);
+
+                    const char * component;
+                    const char * step;
+                    if (sd_bus_message_read(message, "ss", &component, &step) >= 0)
+                    {
+                        progress.registry.set_step(progress.name, std::string(component) + ": " + step);
+                    }
 
-        auto result = co_await subscription.match<2>(std::string_view(slice_name));
+                    return 0;
+                },
+                &progress),
+            "Failed to subscribe to the progress of entityd");
 
-        std::uint32_t id;
-        const char * job_;
-        const char * unit_name;
-        const char * result_string;
+        sd_bus_message * raw_call;
         co_yield log_and_reply_on_error(
-            sd_bus_message_read(result.get(), "uoss", &id, &job_, &unit_name, &result_string),
-            "Failed to parse systemd signal");
+            sd_bus_message_new_method_call(
+                state.bus.get(),
+                &raw_call,
+                entityd_object.service,
+                entityd_object.dbus_path,
+                entityd_object.interface,
+                "ApplyComponents"),
+            "Failed to create a method call message");
+        auto call = async::message_ptr(raw_call);
+
+        co_yield log_and_reply_on_error(
+            sd_bus_message_open_container(raw_call, 'a', "(ss)"), "Failed to build a method call message");
+
+        for (auto elements : _self.items())
+        {
+            auto type = elements.key();
+            if (!is_entityd_component(known_components.at(type)))
+            {
+                continue;
+            }
+
+            co_yield log_and_reply_on_error(
+                sd_bus_message_append(
+                    raw_call, "(ss)", type.c_str(), _config._component_payload(_name, type).c_str()),
+                "Failed to build a method call message");
+        }
+
+        co_yield log_and_reply_on_error(
+            sd_bus_message_close_container(raw_call), "Failed to build a method call message");
+
+        // A namespace from the pool, for a network component that would otherwise have entityd create one.
+        unique_fd netns;
+        if (has_own_namespace())
+        {
+            auto role = _self["network"][":role"].get<network_role>();
+            netns = _config.get_service().namespaces().take(role);
+        }
+
+        co_yield log_and_reply_on_error(
+            _append_namespaces(raw_call, netns), "Failed to build a method call message");
+        co_yield log_and_reply_on_error(
+            sd_bus_message_append(
+                raw_call,
+                "b",
+                _config.get_service().get_options().get_netns_export() == netns_export::mount),
+            "Failed to build a method call message");
+
+        bool applied = false;
+        auto failure = co_await async::attempt(
+            [&]([[maybe_unused]] coro::coroutine_handle<promise> nonsense_promise_arg) -> future {
+                auto reply = co_await async::sd_bus_call(state.bus.get(), raw_call);
+                co_yield log_and_reply_on_error(
+                    sd_bus_message_read(reply.get(), "b", &applied),
+                    "Failed to parse entityd response to ApplyComponents");
+                co_return unit;
+            });
+
+        // Whatever entityd has managed to set up goes away with it, so that the next start begins afresh.
+        if (failure || !applied)
+        {
+            co_await _abort_start();
+
+            if (failure)
+            {
+                co_return *failure;
+            }
+
+            co_return reply_error_format(
+                "info.griwes.nonsense.FailedToStart",
+                "Failed to start entity %s: entityd failed to apply its components.",
+                _name.c_str());
+        }
+
+        if (_self.contains("network"))
+        {
+            auto reply =
+                co_await async::sd_bus_call_method(state.bus.get(), entityd_object, "GetNamespaceFd", "");
+
+            int fd;
+            co_yield log_and_reply_on_error(
+                sd_bus_message_read(reply.get(), "h", &fd),
+                "Failed to parse entityd response to GetNamespaceFd");
+
+            // The fd in the message is closed along with it.
+            state.netns = unique_fd(fcntl(fd, F_DUPFD_CLOEXEC, 3));
+            if (state.netns)
+            {
+                fd_store::store(state.netns.get(), "netns." + _name);
+                _config.get_service().network_monitor().watch(_name, state.netns.get());
+            }
+        }
+
+        operation.complete(lifecycle_phase::active);
+
+        co_return unit;
+    };
+}
+
+subtask entity::stop(lifecycle_phase final_phase)
+{
+    RETURN_MEMBER_TASK
+    {
+        auto token = co_await enqueue();
+        co_await _stop_queued(final_phase);
+        co_return unit;
+    };
+}
+
+subtask entity::_stop_queued(lifecycle_phase final_phase)
+{
+    RETURN_MEMBER_TASK
+    {
+        auto it = _live_entities.find(_name);
+        if (it == _live_entities.end())
+        {
+            auto & registry = _config.get_service().registry();
+            if (registry.get(_name).phase == lifecycle_phase::hibernated)
+            {
+                registry.set_phase(_name, final_phase);
+                co_return unit;
+            }
 
-        if (std::string_view(result_string) != "done")
-        {
+            co_return reply_error_format(
+                "info.griwes.nonsense.EntityNotStarted",
+                "Failed to stop entity %s: entity is not running.",
+                _name.c_str());
+        }
+
+        lifecycle_operation operation{ _config.get_service().registry(),
+                                       _name,
+                                       lifecycle_phase::stopping,
+                                       co_await async::current_promise() };
+
+        auto raw_bus = it->second.bus.get();
+        auto entityd_object = service_description{ .service = services::entityd.service,
+                                                   .dbus_path = it->second.object_path.c_str(),
+                                                   .interface = services::entityd.interface };
+
+        // What entityd removes on its way out is not worth telling anyone about.
+        _config.get_service().network_monitor().unwatch(_name);
+
+        co_await async::sd_bus_call_method(raw_bus, entityd_object, "Shutdown", "");
+        co_await _release_entityd();
+
+        operation.complete(final_phase);
+
+        co_return unit;
+    };
+}
+
+subtask entity::_release_entityd()
+{
+    RETURN_MEMBER_TASK
+    {
+        auto it = _live_entities.find(_name);
+        assert(it != _live_entities.end());
+
+        auto raw_bus = it->second.bus.get();
+
+        fd_store::remove("netns." + _name);
+
+        if (_config.get_service().get_options().get_entityd_mode() == entityd_mode::multiplexed)
+        {
+            // The shared entityd keeps running for the other entities, and there is no per-entity slice to
+            // stop.
+            _live_entities.erase(it);
+            co_return unit;
+        }
+
+        // An entityd process adopted from a previous instance of the daemon is not a child of this one, in
+        // which case this returns immediately; removing its cgroup or stopping its slice below waits for it.
+        int status;
+        waitpid(it->second.pid, &status, 0);
+
+        fd_store::remove("bus." + _name);
+        fd_store::remove("control." + _name);
+
+        _config.get_service().unregister_bus(raw_bus);
+
+        _live_entities.erase(it);
+
+        if (auto cgroups = _config.get_service().cgroups())
+        {
+            cgroups->remove(cgroups->entity_path(_name));
+            co_return unit;
+        }
+
+        auto slice_name = _slice_name(_name);
+
+        auto subscription =
+            async::sd_bus_subscribe_signal(_config._srv->bus(), signals::systemd::job_removed);
+
+        auto reply = co_await async::sd_bus_call_method(
+            _config._srv->bus(), services::systemd::manager, "StopUnit", "ss", slice_name.c_str(), "replace");
+
+        const char * job;
+        co_yield log_and_reply_on_error(
+            sd_bus_message_read(reply.get(), "o", &job), "Failed to parse systemd response");
+
+        auto result = co_await subscription.match<2>(std::string_view(slice_name));
+
+        std::uint32_t id;
+        const char * job_;
+        const char * unit_name;
+        const char * result_string;
+        co_yield log_and_reply_on_error(
+            sd_bus_message_read(result.get(), "uoss", &id, &job_, &unit_name, &result_string),
+            "Failed to parse systemd signal");
+
+        if (std::string_view(result_string) != "done")
+        {
             co_return reply_error_format(
                 "info.griwes.nonsense.FailedToStop",
                 "Failed to stop unit %s: job returned result '%s'.",
@@ -387,4 +955,637 @@ subtask entity::stop()
         co_return unit;
     };
 }
+
+subtask entity::_lease_address()
+{
+    RETURN_MEMBER_TASK
+    {
+        auto subnet = _config._switch_subnet(_name);
+        if (!subnet)
+        {
+            co_return unit;
+        }
+
+        auto & [switch_name, addresses] = *subnet;
+        if (!_config.get_service().addresses().lease(_name, switch_name, addresses))
+        {
+            co_return reply_error_format(
+                "info.griwes.nonsense.SubnetExhausted",
+                "Failed to assign an address to entity %s: subnet %s of switch %s is exhausted.",
+                _name.c_str(),
+                to_string(addresses).c_str(),
+                switch_name.c_str());
+        }
+
+        co_return unit;
+    };
+}
+
+subtask entity::_abort_start()
+{
+    RETURN_MEMBER_TASK
+    {
+        auto & state = _live_entities.at(_name);
+        auto entityd_object = service_description{ .service = services::entityd.service,
+                                                   .dbus_path = state.object_path.c_str(),
+                                                   .interface = services::entityd.interface };
+
+        _config.get_service().network_monitor().unwatch(_name);
+
+        auto shutdown = co_await async::attempt(
+            [&]([[maybe_unused]] coro::coroutine_handle<promise> nonsense_promise_arg) -> future {
+                co_await async::sd_bus_call_method(state.bus.get(), entityd_object, "Shutdown", "");
+                co_return unit;
+            });
+
+        // A dedicated entityd that can't be told to go is killed instead; the shared one keeps serving the
+        // other entities either way.
+        if (shutdown
+            && _config.get_service().get_options().get_entityd_mode() != entityd_mode::multiplexed)
+        {
+            std::cerr << error_prefix() << "Failed to shut down entityd of entity " << _name
+                      << ", killing it: " << async::describe(*shutdown) << '\n';
+            kill(state.pid, SIGKILL);
+        }
+
+        // The error of the start is the one worth reporting; this one only gets logged.
+        if (auto failure = co_await async::attempt(_release_entityd()))
+        {
+            std::cerr << error_prefix() << "Failed to clean up after entity " << _name << ": "
+                      << async::describe(*failure) << '\n';
+        }
+
+        co_return unit;
+    };
+}
+
+subtask entity::stop_subtree()
+{
+    RETURN_MEMBER_TASK
+    {
+        auto downlinks = _config.get_downlinks(_name);
+
+        // Every branch is given the chance to stop, and all the failures are reported together.
+        std::vector<std::string> failures;
+        std::vector<subtask> stops;
+        for (auto && downlink : downlinks)
+        {
+            auto stop = [&]([[maybe_unused]] coro::coroutine_handle<promise> nonsense_promise_arg) -> future {
+                if (auto failure = co_await async::attempt(downlink.stop_subtree()))
+                {
+                    failures.push_back(downlink.name() + ": " + async::describe(*failure));
+                }
+                co_return unit;
+            };
+            stops.push_back(std::move(stop));
+        }
+
+        co_await async::when_all(std::move(stops));
+
+        if (!failures.empty())
+        {
+            std::string joined;
+            for (auto && failure : failures)
+            {
+                joined += (joined.empty() ? "" : "; ") + failure;
+            }
+
+            co_return reply_error_format(
+                "info.griwes.nonsense.FailedToStop",
+                "Failed to stop entity %s, since entities downstream of it failed to stop: %s",
+                _name.c_str(),
+                joined.c_str());
+        }
+
+        // Whether the entity needs stopping is only known for sure once nothing else can get in between.
+        auto token = co_await enqueue();
+        if (running() || _config.get_service().registry().get(_name).phase == lifecycle_phase::hibernated)
+        {
+            co_await _stop_queued(lifecycle_phase::inactive);
+        }
+
+        co_return unit;
+    };
+}
+
+subtask entity::restart(bool restart_downlinks)
+{
+    RETURN_MEMBER_TASK
+    {
+        bool running;
+        auto result = reconfigure_result::unchanged;
+
+        {
+            auto token = co_await enqueue();
+
+            auto it = _live_entities.find(_name);
+            running = it != _live_entities.end();
+
+            if (running)
+            {
+                lifecycle_operation operation{ _config.get_service().registry(),
+                                               _name,
+                                               lifecycle_phase::reconfiguring,
+                                               co_await async::current_promise() };
+
+                auto & state = it->second;
+                auto entityd_object = service_description{ .service = services::entityd.service,
+                                                           .dbus_path = state.object_path.c_str(),
+                                                           .interface = services::entityd.interface };
+
+                // The entity may have been connected to another switch, or the subnet of its switch changed.
+                co_await _lease_address();
+
+                for (auto elements : _self.items())
+                {
+                    auto type = elements.key();
+                    if (!is_entityd_component(known_components.at(type)))
+                    {
+                        continue;
+                    }
+
+                    auto & payload = _config._component_payload(_name, type);
+
+                    sd_bus_message * raw_call;
+                    co_yield log_and_reply_on_error(
+                        sd_bus_message_new_method_call(
+                            state.bus.get(),
+                            &raw_call,
+                            entityd_object.service,
+                            entityd_object.dbus_path,
+                            entityd_object.interface,
+                            "ReconfigureComponent"),
+                        "Failed to create a method call message");
+                    auto call = async::message_ptr(raw_call);
+
+                    co_yield log_and_reply_on_error(
+                        sd_bus_message_append(raw_call, "ss", type.c_str(), payload.c_str()),
+                        "Failed to build a method call message");
+                    co_yield log_and_reply_on_error(
+                        _append_namespaces(raw_call, unique_fd()), "Failed to build a method call message");
+
+                    auto reply = co_await async::sd_bus_call(state.bus.get(), raw_call);
+
+                    std::uint8_t component_result;
+                    co_yield log_and_reply_on_error(
+                        sd_bus_message_read(reply.get(), "y", &component_result),
+                        "Failed to parse entityd response to ReconfigureComponent");
+
+                    result = std::max(result, static_cast<reconfigure_result>(component_result));
+                }
+
+                co_await _apply_resources();
+
+                operation.complete(lifecycle_phase::active);
+            }
+        }
+
+        if (!running)
+        {
+            co_await start();
+            co_return unit;
+        }
+
+        switch (result)
+        {
+            case reconfigure_result::unchanged:
+                break;
+
+            case reconfigure_result::reconfigured:
+                if (!restart_downlinks)
+                {
+                    break;
+                }
+
+                // The entities downstream of this one carry information about it in their own connections
+                // (like routes for their subnets in the namespaces upstream), so give them a chance to
+                // catch up as well. They get the same treatment, so a warm restart only ever touches the
+                // entities whose configuration actually changed.
+                for (auto && downlink : _config.get_downlinks(_name))
+                {
+                    if (_live_entities.count(downlink._name))
+                    {
+                        co_await downlink.restart();
+                    }
+                }
+                break;
+
+            case reconfigure_result::restart_required:
+                for (auto && downlink : _config.get_downlinks(_name))
+                {
+                    if (_live_entities.count(downlink._name))
+                    {
+                        co_return reply_error_format(
+                            "info.griwes.nonsense.FailedToRestart",
+                            "Failed to restart entity %s: the change cannot be applied in place, and entity "
+                            "%s, which uses it as an uplink, is running.",
+                            _name.c_str(),
+                            downlink._name.c_str());
+                    }
+                }
+
+                co_await stop();
+                co_await start();
+                break;
+        }
+
+        co_return unit;
+    };
+}
+
+std::optional<entity::_entity_state> entity::_reconnect(
+    service & srv,
+    unique_fd control,
+    const std::string & fd_suffix)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+    {
+        std::cerr << error_prefix() << "Failed to create a socket pair: " << strerror(errno) << '\n';
+        return std::nullopt;
+    }
+
+    unique_fd local{ sv[0] };
+    unique_fd remote{ sv[1] };
+
+    char byte = 0;
+    iovec iov{ .iov_base = &byte, .iov_len = 1 };
+
+    alignas(cmsghdr) char control_buffer[CMSG_SPACE(sizeof(int))] = {};
+    msghdr message{ .msg_iov = &iov,
+                    .msg_iovlen = 1,
+                    .msg_control = control_buffer,
+                    .msg_controllen = sizeof(control_buffer) };
+
+    auto header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(header), &sv[1], sizeof(int));
+
+    if (sendmsg(control.get(), &message, MSG_NOSIGNAL) == -1)
+    {
+        std::cerr << error_prefix() << "Failed to send a new connection to entityd: " << strerror(errno)
+                  << '\n';
+        return std::nullopt;
+    }
+
+    remote.reset();
+
+    // Entityd acknowledges switching over to the new connection by sending its pid.
+    timeval timeout{ .tv_sec = 5, .tv_usec = 0 };
+    setsockopt(control.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    pid_t pid;
+    if (recv(control.get(), &pid, sizeof(pid), MSG_WAITALL) != sizeof(pid))
+    {
+        std::cerr << error_prefix() << "Entityd did not acknowledge the new connection.\n";
+        return std::nullopt;
+    }
+
+    sd_bus * raw_bus;
+    int ret = sd_bus_new(&raw_bus);
+    if (ret < 0)
+    {
+        std::cerr << error_prefix() << "Failed to allocate an sd_bus: " << strerror(-ret) << '\n';
+        return std::nullopt;
+    }
+
+    _entity_state state{ .pid = pid, .bus = _entity_state::bus_ptr(raw_bus), .control = std::move(control) };
+
+    auto fd = local.get();
+    ret = sd_bus_set_fd(raw_bus, fd, fd);
+    if (ret < 0)
+    {
+        std::cerr << error_prefix() << "Failed to set bus fd: " << strerror(-ret) << '\n';
+        return std::nullopt;
+    }
+
+    // The bus owns the fd from now on.
+    local.release();
+
+    if ((ret = sd_bus_set_bus_client(raw_bus, false)) < 0 || (ret = sd_bus_start(raw_bus)) < 0)
+    {
+        std::cerr << error_prefix() << "Failed to start bus: " << strerror(-ret) << '\n';
+        return std::nullopt;
+    }
+
+    while (sd_bus_is_open(raw_bus) && !sd_bus_is_ready(raw_bus))
+    {
+        ret = sd_bus_process(raw_bus, nullptr);
+        if (ret == 0)
+        {
+            ret = sd_bus_wait(raw_bus, UINT64_MAX);
+        }
+
+        if (ret < 0)
+        {
+            std::cerr << error_prefix() << "Failed to process client bus: " << strerror(-ret) << '\n';
+            return std::nullopt;
+        }
+    }
+
+    if (sd_bus_is_ready(raw_bus) <= 0)
+    {
+        std::cerr << error_prefix() << "Failed to connect to entityd.\n";
+        return std::nullopt;
+    }
+
+    srv.register_bus(raw_bus);
+
+    fd_store::remove("bus" + fd_suffix);
+    fd_store::store(fd, "bus" + fd_suffix);
+
+    return state;
+}
+
+void entity::adopt_stored(config & config_object)
+{
+    auto & srv = config_object.get_service();
+
+    auto adopt = [&](const std::string & name, _entity_state state) {
+        if (!config_object.try_get(name))
+        {
+            std::cerr << error_prefix() << "Warning: adopted entity " << name
+                      << ", which is not in the running configuration.\n";
+        }
+
+        state.netns = fd_store::take("netns." + name);
+        if (state.netns)
+        {
+            srv.network_monitor().watch(name, state.netns.get());
+        }
+
+        srv.registry().set_phase(name, lifecycle_phase::active);
+        srv.registry().set_pid(name, state.pid);
+
+        _live_entities.insert_or_assign(name, std::move(state));
+    };
+
+    // The entities can't be left without a daemon talking to them, so their old connections are only
+    // released once they have been given new ones. Entityd closes its side of the old connection when it
+    // switches over; the ones that fail to are shut down by closing their control sockets.
+    auto release = [](const std::string & fd_suffix, bool adopted) {
+        fd_store::take("bus" + fd_suffix);
+        if (!adopted)
+        {
+            fd_store::remove("bus" + fd_suffix);
+            fd_store::remove("control" + fd_suffix);
+        }
+    };
+
+    if (auto control = fd_store::take("control"))
+    {
+        auto state = _reconnect(srv, std::move(control), "");
+        release("", state.has_value());
+
+        if (state)
+        {
+            sd_bus_error error = SD_BUS_ERROR_NULL;
+            sd_bus_message * reply = nullptr;
+
+            int ret = sd_bus_call_method(
+                state->bus.get(),
+                services::entityd_host.service,
+                services::entityd_host.dbus_path,
+                services::entityd_host.interface,
+                "List",
+                &error,
+                &reply,
+                "");
+            if (ret < 0)
+            {
+                std::cerr << error_prefix() << "Failed to list the entities of the shared entityd: "
+                          << error.message << '\n';
+            }
+            else if ((ret = sd_bus_message_enter_container(reply, 'a', "(so)")) >= 0)
+            {
+                const char * name;
+                const char * object_path;
+                while ((ret = sd_bus_message_read(reply, "(so)", &name, &object_path)) > 0)
+                {
+                    adopt(
+                        name,
+                        _entity_state{ .pid = state->pid,
+                                       .bus = _entity_state::bus_ptr(sd_bus_ref(state->bus.get())),
+                                       .object_path = object_path });
+                }
+            }
+
+            sd_bus_error_free(&error);
+            sd_bus_message_unref(reply);
+
+            _shared_entityd = std::move(state);
+        }
+    }
+
+    for (auto && name : fd_store::remaining())
+    {
+        if (!name.starts_with("control."))
+        {
+            continue;
+        }
+
+        auto entity_name = name.substr(std::strlen("control."));
+        auto state = _reconnect(srv, fd_store::take(name), "." + entity_name);
+        release("." + entity_name, state.has_value());
+
+        if (state)
+        {
+            adopt(entity_name, std::move(*state));
+        }
+    }
+
+    // Whatever is left belonged to entities that are gone.
+    for (auto && name : fd_store::remaining())
+    {
+        fd_store::take(name);
+        fd_store::remove(name);
+    }
+}
+
+// The names of the units matching the pattern that systemd has not stopped yet, or an empty optional if they
+// couldn't be listed.
+std::optional<std::vector<std::string>> _running_units(sd_bus * bus, const char * pattern)
+{
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message * reply = nullptr;
+
+    int ret = sd_bus_call_method(
+        bus,
+        services::systemd::manager.service,
+        services::systemd::manager.dbus_path,
+        services::systemd::manager.interface,
+        "ListUnitsByPatterns",
+        &error,
+        &reply,
+        "asas",
+        3,
+        "active",
+        "activating",
+        "deactivating",
+        1,
+        pattern);
+    if (ret < 0)
+    {
+        std::cerr << error_prefix() << "Failed to list units: " << error.message << '\n';
+        sd_bus_error_free(&error);
+        return std::nullopt;
+    }
+
+    std::vector<std::string> names;
+
+    ret = sd_bus_message_enter_container(reply, 'a', "(ssssssouso)");
+    const char * name;
+    while (ret >= 0
+           && (ret = sd_bus_message_read(
+                   reply,
+                   "(ssssssouso)",
+                   &name,
+                   nullptr,
+                   nullptr,
+                   nullptr,
+                   nullptr,
+                   nullptr,
+                   nullptr,
+                   nullptr,
+                   nullptr,
+                   nullptr))
+               > 0)
+    {
+        names.push_back(name);
+    }
+    sd_bus_message_unref(reply);
+
+    if (ret < 0)
+    {
+        std::cerr << error_prefix() << "Failed to parse systemd response: " << strerror(-ret) << '\n';
+        return std::nullopt;
+    }
+
+    return names;
+}
+
+void entity::collect_leftovers(config & config_object)
+{
+    auto & srv = config_object.get_service();
+
+    // The units and cgroups go first, so that nothing that is still running in them can recreate what the
+    // journals are about to be used to remove.
+    if (auto cgroups = srv.cgroups())
+    {
+        for (auto && name : cgroups->entities())
+        {
+            if (!_live_entities.contains(name))
+            {
+                cgroups->remove(cgroups->entity_path(name));
+            }
+        }
+    }
+    else if (auto units = _running_units(srv.bus(), "nonsense-*.slice"))
+    {
+        std::unordered_set<std::string> live_slices;
+        for (auto && [name, state] : _live_entities)
+        {
+            live_slices.insert(_slice_name(name));
+        }
+
+        std::erase_if(*units, [&](auto && unit) { return live_slices.contains(unit); });
+
+        for (auto && unit : *units)
+        {
+            sd_bus_error error = SD_BUS_ERROR_NULL;
+            int ret = sd_bus_call_method(
+                srv.bus(),
+                services::systemd::manager.service,
+                services::systemd::manager.dbus_path,
+                services::systemd::manager.interface,
+                "StopUnit",
+                &error,
+                nullptr,
+                "ss",
+                unit.c_str(),
+                "replace");
+            if (ret < 0)
+            {
+                std::cerr << error_prefix() << "Failed to stop leftover unit " << unit << ": "
+                          << error.message << '\n';
+                sd_bus_error_free(&error);
+            }
+        }
+
+        // A slice with the same name is created when the entity is started again, which fails while the old
+        // one is still being stopped. The jobs are not waited for through JobRemoved, since nothing processes
+        // the bus before the service loop starts.
+        using clock = std::chrono::steady_clock;
+        auto deadline = clock::now() + std::chrono::seconds(5);
+        while (!units->empty() && clock::now() < deadline)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+            auto running = _running_units(srv.bus(), "nonsense-*.slice");
+            if (!running)
+            {
+                break;
+            }
+
+            std::erase_if(
+                *units, [&](auto && unit) { return std::ranges::find(*running, unit) == running->end(); });
+        }
+
+        for (auto && unit : *units)
+        {
+            std::cerr << error_prefix() << "Leftover unit " << unit << " did not stop in time.\n";
+        }
+    }
+
+    std::vector<std::string> names;
+
+    std::error_code ec;
+    for (auto && entry : std::filesystem::directory_iterator(entityd_journal_directory, ec))
+    {
+        auto name = entry.path().filename().string();
+        if (!_live_entities.contains(name))
+        {
+            names.push_back(std::move(name));
+        }
+    }
+
+    if (names.empty())
+    {
+        return;
+    }
+
+    auto filename = (install_prefix / "bin" / "nonsense-entityd").string();
+    std::string mode = "--collect";
+
+    std::vector<char *> arguments = { filename.data(), mode.data() };
+    for (auto && name : names)
+    {
+        arguments.push_back(name.data());
+    }
+    arguments.push_back(nullptr);
+
+    auto pid = fork();
+    if (pid == -1)
+    {
+        std::cerr << error_prefix() << "Failed to fork to collect leftover entities: " << strerror(errno)
+                  << '\n';
+        return;
+    }
+
+    if (pid == 0)
+    {
+        execv(filename.c_str(), arguments.data());
+        perror("Failed to exec into nonsense-entityd");
+        std::abort();
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        std::cerr << error_prefix() << "Failed to collect leftover entities.\n";
+    }
+}
 }
@@ -18,20 +18,58 @@
 
 #include "async.h"
 #include "function.h"
+#include "registry.h"
+#include "unique_fd.h"
 
 #include <json.hpp>
 
+#include <optional>
 #include <string_view>
 
 namespace nonsensed
 {
 class config;
+class lifecycle_operation;
+class service;
+struct resource_controls;
 
 class entity
 {
 public:
+    const std::string & name() const
+    {
+        return _name;
+    }
+
+    bool running() const
+    {
+        return _live_entities.count(_name);
+    }
+
+    // The network namespace of the entity, if it is running and has one; -1 otherwise.
+    int netns() const;
+
+    // Whether the entity has a network component living in a namespace created for it, rather than in the
+    // default or an external one.
+    bool has_own_namespace() const;
+
+    // The name of the entity the network component of this entity uses as its uplink, if any.
+    std::optional<std::string> uplink() const;
+
     subtask start();
-    subtask stop();
+    // The entity ends up in the given phase, which is either inactive or hibernated. An entity that is not
+    // running can still be stopped if it is hibernated, which makes it inactive.
+    subtask stop(lifecycle_phase final_phase = lifecycle_phase::inactive);
+    // Stops every running entity downstream of this one, leaves first and independent branches concurrently,
+    // and then this entity itself, if it is running. An entity is only stopped once everything downstream of
+    // it has been, so a failure leaves the rest of its branch upstream of it running; the failures of all
+    // branches are reported together.
+    subtask stop_subtree();
+
+    // Applies the current configuration of a running entity in place, keeping its namespace and devices, and
+    // only falls back to stopping and starting it when that is not possible. Starts the entity if it is not
+    // running. Unless told otherwise, running downlinks of an entity reconfigured in place are restarted too.
+    subtask restart(bool restart_downlinks = true);
 
     class queue_awaitable
     {
@@ -69,6 +107,17 @@ public:
 
     queue_awaitable enqueue();
 
+    // Takes over the entities left running by a previous instance of the daemon, whose connections it
+    // handed over to the service manager; see fd_store.
+    static void adopt_stored(config & config_object);
+
+    // Has entityd remove whatever was left behind by the entities that were running when a previous instance
+    // of the daemon, or their entityd processes, died without cleaning up; see entityd::journal. Must be
+    // called after adopt_stored, so that the entities that are still running are left alone. The units or
+    // cgroups of the entities that are not running anymore are removed first, along with anything that is
+    // still left running in them.
+    static void collect_leftovers(config & config_object);
+
 private:
     friend class config;
 
@@ -88,8 +137,54 @@ private:
         using bus_ptr =
             std::unique_ptr<sd_bus, std::integral_constant<sd_bus * (*)(sd_bus *), &sd_bus_unref>>;
         bus_ptr bus;
+
+        // The path of the Entityd object of this entity on the bus above. A dedicated entityd process serves
+        // its only entity at the root; a multiplexed one assigns a path per entity.
+        std::string object_path = "/";
+
+        // The socket over which a restarted daemon gives the entityd process a new bus connection.
+        unique_fd control;
+        // The network namespace of the entity, if it has a network component.
+        unique_fd netns;
     };
 
     static std::unordered_map<std::string, _entity_state> _live_entities;
+
+    // The entityd process serving all entities in the multiplexed entityd mode, once it has been started.
+    static std::optional<_entity_state> _shared_entityd;
+
+    // The fds of the entityd process are put into the store under names ending with the suffix. If given the
+    // cgroup.procs of a cgroup, entityd moves itself into that cgroup before it execs.
+    subtask _spawn_entityd(
+        std::string argument,
+        std::string fd_suffix,
+        _entity_state * state,
+        int cgroup_procs = -1);
+    static std::optional<_entity_state> _reconnect(
+        service & srv,
+        unique_fd control,
+        const std::string & fd_suffix);
+    subtask _start_dedicated_entityd(lifecycle_operation * operation);
+    // The body of stop, for when the entity's queue is already held.
+    subtask _stop_queued(lifecycle_phase final_phase);
+    subtask _start_shared_entityd();
+    // Lets go of the entityd of a running entity that has been shut down: reaps the process, drops the fds
+    // and the connection kept for it, and removes its cgroup or stops its slice.
+    subtask _release_entityd();
+    // Leases an address to the entity in the subnet of the switch it is connected to the bridge of, if it is,
+    // unless it already holds one there; fails if no free addresses are left in the subnet.
+    subtask _lease_address();
+    // Backs out of a start that has failed after entityd was spawned: shuts it down, or kills it if that
+    // fails, and releases it, so that the entity is not left looking like it is running.
+    subtask _abort_start();
+    // Appends the "a{sh}" map of the namespaces of the running uplinks of the entity that entityd needs to
+    // connect it, plus the given namespace of the entity itself, if any.
+    int _append_namespaces(sd_bus_message * message, const unique_fd & own);
+
+    // The systemd slice of the named entity, in the systemd cgroup mode.
+    static std::string _slice_name(const std::string & name);
+    resource_controls _resource_controls() const;
+    // Applies the resources component of a running entity to its cgroup.
+    subtask _apply_resources();
 };
 }
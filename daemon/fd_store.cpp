@@ -0,0 +1,152 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fd_store.h"
+
+#include "log_helpers.h"
+
+#include <systemd/sd-daemon.h>
+
+#include <sys/mman.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+
+namespace nonsensed
+{
+namespace fd_store
+{
+    namespace
+    {
+        std::unordered_map<std::string, unique_fd> & _received()
+        {
+            static auto received = [] {
+                std::unordered_map<std::string, unique_fd> ret;
+
+                char ** names = nullptr;
+                int count = sd_listen_fds_with_names(1, &names);
+                if (count < 0)
+                {
+                    std::cerr << error_prefix()
+                              << "Failed to retrieve the file descriptor store: " << strerror(-count) << '\n';
+                    return ret;
+                }
+
+                for (int i = 0; i < count; ++i)
+                {
+                    ret.emplace(names[i], unique_fd(SD_LISTEN_FDS_START + i));
+                    free(names[i]);
+                }
+                free(names);
+
+                return ret;
+            }();
+
+            return received;
+        }
+    }
+
+    void store(int fd, const std::string & name)
+    {
+        auto state = "FDSTORE=1\nFDNAME=" + name;
+        int ret = sd_pid_notify_with_fds(0, 0, state.c_str(), &fd, 1);
+        if (ret < 0)
+        {
+            std::cerr << error_prefix() << "Failed to store file descriptor " << name << ": "
+                      << strerror(-ret) << '\n';
+        }
+    }
+
+    void store_contents(const std::string & contents, const std::string & name)
+    {
+        remove(name);
+
+        unique_fd fd{ memfd_create(name.c_str(), MFD_CLOEXEC) };
+        if (!fd)
+        {
+            std::cerr << error_prefix() << "Failed to create a memfd for " << name << ": " << strerror(errno)
+                      << '\n';
+            return;
+        }
+
+        for (std::size_t written = 0; written < contents.size();)
+        {
+            auto ret = write(fd.get(), contents.data() + written, contents.size() - written);
+            if (ret == -1)
+            {
+                std::cerr << error_prefix() << "Failed to write " << name
+                          << " into a memfd: " << strerror(errno) << '\n';
+                return;
+            }
+            written += ret;
+        }
+
+        store(fd.get(), name);
+    }
+
+    void remove(const std::string & name)
+    {
+        auto state = "FDSTOREREMOVE=1\nFDNAME=" + name;
+        int ret = sd_notify(0, state.c_str());
+        if (ret < 0)
+        {
+            std::cerr << error_prefix() << "Failed to remove file descriptor " << name
+                      << " from the store: " << strerror(-ret) << '\n';
+        }
+    }
+
+    unique_fd take(const std::string & name)
+    {
+        auto & received = _received();
+
+        auto it = received.find(name);
+        if (it == received.end())
+        {
+            return {};
+        }
+
+        auto ret = std::move(it->second);
+        received.erase(it);
+        return ret;
+    }
+
+    std::vector<std::string> remaining()
+    {
+        std::vector<std::string> ret;
+        for (auto && [name, fd] : _received())
+        {
+            ret.push_back(name);
+        }
+        return ret;
+    }
+
+    std::string read_contents(int fd)
+    {
+        std::string ret;
+        char buffer[4096];
+
+        ssize_t size;
+        while ((size = pread(fd, buffer, sizeof(buffer), ret.size())) > 0)
+        {
+            ret.append(buffer, size);
+        }
+
+        return ret;
+    }
+}
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "unique_fd.h"
+
+#include <string>
+#include <vector>
+
+namespace nonsensed
+{
+// The file descriptor store of the systemd service running the daemon, which keeps file descriptors open
+// while the daemon restarts, and passes them to the next instance. All the functions below do nothing when
+// the daemon does not run as a systemd service.
+namespace fd_store
+{
+    // Hands a copy of the fd over to the service manager, under the given name.
+    void store(int fd, const std::string & name);
+    // Stores the contents in a memfd, replacing anything stored under the same name before.
+    void store_contents(const std::string & contents, const std::string & name);
+    void remove(const std::string & name);
+
+    // Takes the fd stored under the given name by the previous instance of the daemon, if there is one.
+    unique_fd take(const std::string & name);
+    // The names of the fds passed to this instance of the daemon that have not been taken yet.
+    std::vector<std::string> remaining();
+
+    std::string read_contents(int fd);
+}
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "idle_monitor.h"
+
+#include "cli.h"
+#include "config.h"
+#include "entity.h"
+#include "log_helpers.h"
+#include "netns_monitor.h"
+#include "registry.h"
+#include "service.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+namespace nonsensed
+{
+idle_monitor::idle_monitor(config & running, service & srv)
+    : _config{ running }, _timeout{ srv.get_options().idle_timeout() }
+{
+    if (_timeout.count() == 0)
+    {
+        return;
+    }
+
+    // Often enough for an entity to be hibernated not much later than it has been idle for the timeout.
+    auto interval = std::max<std::chrono::milliseconds>(_timeout / 4, std::chrono::seconds(1));
+    srv.every(interval, [this] { _check(); });
+}
+
+void idle_monitor::_check()
+{
+    auto now = std::chrono::steady_clock::now();
+    auto & registry = _config.get_service().registry();
+
+    for (auto && name : _config.entity_names())
+    {
+        auto ent = _config.try_get(name);
+        if (!ent || registry.get(name).phase != lifecycle_phase::active || !ent->has_own_namespace()
+            || ent->netns() == -1)
+        {
+            _samples.erase(name);
+            continue;
+        }
+
+        auto it = _samples.find(name);
+        if (it == _samples.end())
+        {
+            auto socket = rtnetlink_socket_in(ent->netns());
+            if (!socket)
+            {
+                std::cerr << error_prefix() << "Failed to open a socket in the namespace of " << name
+                          << " to read its counters: " << strerror(errno) << '\n';
+                continue;
+            }
+
+            it = _samples.emplace(name, _sample{ std::move(socket), 0, now }).first;
+        }
+
+        auto packets = count_packets(it->second.socket.get());
+        if (!packets)
+        {
+            std::cerr << error_prefix() << "Failed to read the counters of the namespace of " << name << ": "
+                      << strerror(errno) << '\n';
+            continue;
+        }
+
+        if (it->second.packets != *packets)
+        {
+            it->second.packets = *packets;
+            it->second.changed = now;
+        }
+
+        if (now - it->second.changed < _timeout)
+        {
+            continue;
+        }
+
+        // An uplink serves its running downlinks even when they're quiet; it can only go once they're gone.
+        auto downlinks = _config.get_downlinks(name);
+        auto running = [](auto && downlink) { return downlink.running(); };
+        if (std::any_of(downlinks.begin(), downlinks.end(), running))
+        {
+            continue;
+        }
+
+        _samples.erase(it);
+
+        // The entity is kept in the task, since nothing else holds on to it until the stop is done.
+        async::detach(
+            [ent = *ent](coro::coroutine_handle<promise> nonsense_promise_arg) mutable -> future {
+                co_await ent.stop(lifecycle_phase::hibernated);
+                co_return unit;
+            },
+            [name](const reply_status_t * error) {
+                if (error)
+                {
+                    std::cerr << error_prefix() << "Failed to hibernate idle entity " << name << ".\n";
+                }
+            });
+    }
+}
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "unique_fd.h"
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+namespace nonsensed
+{
+class config;
+class service;
+
+// Hibernates entities that have been idle for the time given with --idle-timeout: entities with a namespace
+// of their own, no running downlinks, and no packets going through any of the interfaces in their namespace.
+// A hibernated entity is stopped, but remembered as hibernated rather than inactive, so that GetNamespaceFd
+// (and with it nonsensectl exec) starts it again before replying. Nothing else of the entity is kept;
+// starting it again relies on the namespace pool being warm.
+class idle_monitor
+{
+public:
+    idle_monitor(config & running, service & srv);
+
+private:
+    void _check();
+
+    config & _config;
+    const std::chrono::seconds _timeout;
+
+    // The counters are read over a socket in the namespace of the entity, made once for as long as the
+    // entity is sampled, so that reading them never needs to enter the namespace.
+    struct _sample
+    {
+        unique_fd socket;
+        std::uint64_t packets;
+        std::chrono::steady_clock::time_point changed;
+    };
+
+    std::unordered_map<std::string, _sample> _samples;
+};
+}
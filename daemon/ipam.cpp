@@ -0,0 +1,307 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ipam.h"
+
+#include "fd_store.h"
+#include "log_helpers.h"
+
+#include <arpa/inet.h>
+
+#include <json.hpp>
+
+#include <algorithm>
+#include <charconv>
+#include <iostream>
+#include <unordered_set>
+
+namespace nonsensed
+{
+std::optional<ipv4_subnet> parse_subnet(std::string_view subnet)
+{
+    auto separator = subnet.find('/');
+    if (separator == std::string_view::npos)
+    {
+        return std::nullopt;
+    }
+
+    in_addr parsed;
+    if (inet_pton(AF_INET, std::string(subnet.substr(0, separator)).c_str(), &parsed) != 1)
+    {
+        return std::nullopt;
+    }
+
+    auto length_string = subnet.substr(separator + 1);
+    int length;
+    auto [end, error] = std::from_chars(length_string.begin(), length_string.end(), length);
+    if (error != std::errc() || end != length_string.end() || length < 0 || length > 32)
+    {
+        return std::nullopt;
+    }
+
+    auto mask = length == 0 ? 0 : ~std::uint32_t(0) << (32 - length);
+    return ipv4_subnet{ .address = ntohl(parsed.s_addr) & mask, .prefix_length = length };
+}
+
+static std::string _format(std::uint32_t address, int prefix_length)
+{
+    char buffer[INET_ADDRSTRLEN];
+    in_addr raw{ .s_addr = htonl(address) };
+    inet_ntop(AF_INET, &raw, buffer, sizeof(buffer));
+    return buffer + ("/" + std::to_string(prefix_length));
+}
+
+std::string to_string(const ipv4_subnet & subnet)
+{
+    return _format(subnet.address, subnet.prefix_length);
+}
+
+address_pool::address_pool(ipv4_subnet subnet)
+    : _subnet{ subnet }, _end(static_cast<std::uint32_t>(std::max<std::uint64_t>(subnet.size(), 1) - 1))
+{
+}
+
+std::optional<std::uint32_t> address_pool::allocate()
+{
+    // Released hosts may have been reserved again since; those are dropped here, each of them once.
+    while (!_released.empty())
+    {
+        auto host = _released.back();
+        _released.pop_back();
+
+        if (!_taken(host))
+        {
+            _set(host, true);
+            return host;
+        }
+    }
+
+    while (_next < _end)
+    {
+        auto host = _next++;
+        if (!_taken(host))
+        {
+            _set(host, true);
+            return host;
+        }
+    }
+
+    return std::nullopt;
+}
+
+bool address_pool::reserve(std::uint32_t host)
+{
+    if (host < first_host || host >= _end || _taken(host))
+    {
+        return false;
+    }
+
+    _set(host, true);
+    return true;
+}
+
+void address_pool::release(std::uint32_t host)
+{
+    if (host < first_host || host >= _end || !_taken(host))
+    {
+        return;
+    }
+
+    _set(host, false);
+
+    // Hosts past the cursor are found by it anyway.
+    if (host < _next)
+    {
+        _released.push_back(host);
+    }
+}
+
+bool address_pool::_taken(std::uint32_t host) const
+{
+    auto word = host / 64;
+    return word < _bitmap.size() && (_bitmap[word] >> (host % 64)) & 1;
+}
+
+void address_pool::_set(std::uint32_t host, bool taken)
+{
+    auto word = host / 64;
+    if (word >= _bitmap.size())
+    {
+        _bitmap.resize(word + 1);
+    }
+
+    auto bit = std::uint64_t(1) << (host % 64);
+    _bitmap[word] = taken ? _bitmap[word] | bit : _bitmap[word] & ~bit;
+}
+
+ipam::ipam()
+{
+    auto fd = fd_store::take("ipam-leases");
+    if (!fd)
+    {
+        return;
+    }
+
+    try
+    {
+        auto stored = nlohmann::json::parse(fd_store::read_contents(fd.get()));
+
+        for (auto && [entity, lease] : stored.items())
+        {
+            auto switch_name = lease.at("switch").get<std::string>();
+            auto subnet = parse_subnet(lease.at("subnet").get<std::string>());
+            auto host = lease.at("host").get<std::uint32_t>();
+
+            if (!subnet || !_pool(switch_name, *subnet).reserve(host))
+            {
+                std::cerr << error_prefix() << "Dropping an invalid stored address lease of " << entity
+                          << '\n';
+                _dirty = true;
+                continue;
+            }
+
+            _leases.emplace(entity, _lease{ std::move(switch_name), *subnet, host });
+        }
+    }
+    catch (std::exception & ex)
+    {
+        std::cerr << error_prefix() << "Failed to restore the address leases: " << ex.what() << '\n';
+        _pools.clear();
+        _leases.clear();
+        _dirty = true;
+    }
+}
+
+std::optional<std::string> ipam::lease(
+    const std::string & entity,
+    const std::string & switch_name,
+    const ipv4_subnet & subnet)
+{
+    auto it = _leases.find(entity);
+    if (it != _leases.end())
+    {
+        auto & current = it->second;
+        if (current.switch_name == switch_name && current.subnet == subnet)
+        {
+            return _format(subnet.address + current.host, subnet.prefix_length);
+        }
+
+        _release(current);
+        _leases.erase(it);
+        _dirty = true;
+    }
+
+    auto host = _pool(switch_name, subnet).allocate();
+    if (!host)
+    {
+        return std::nullopt;
+    }
+
+    _leases.emplace(entity, _lease{ switch_name, subnet, *host });
+    _dirty = true;
+
+    return _format(subnet.address + *host, subnet.prefix_length);
+}
+
+void ipam::release(const std::string & entity)
+{
+    auto it = _leases.find(entity);
+    if (it == _leases.end())
+    {
+        return;
+    }
+
+    _release(it->second);
+    _leases.erase(it);
+    _dirty = true;
+}
+
+std::optional<std::string> ipam::address_of(const std::string & entity) const
+{
+    auto it = _leases.find(entity);
+    if (it == _leases.end())
+    {
+        return std::nullopt;
+    }
+
+    return _format(it->second.subnet.address + it->second.host, it->second.subnet.prefix_length);
+}
+
+void ipam::retain(const std::vector<std::string> & entities)
+{
+    std::unordered_set<std::string> kept(entities.begin(), entities.end());
+
+    for (auto it = _leases.begin(); it != _leases.end();)
+    {
+        if (kept.contains(it->first))
+        {
+            ++it;
+            continue;
+        }
+
+        _release(it->second);
+        it = _leases.erase(it);
+        _dirty = true;
+    }
+}
+
+void ipam::flush()
+{
+    if (!_dirty)
+    {
+        return;
+    }
+
+    auto stored = nlohmann::json::object();
+    for (auto && [entity, lease] : _leases)
+    {
+        stored[entity] = { { "switch", lease.switch_name },
+                           { "subnet", to_string(lease.subnet) },
+                           { "host", lease.host } };
+    }
+
+    fd_store::store_contents(stored.dump(), "ipam-leases");
+    _dirty = false;
+}
+
+address_pool & ipam::_pool(const std::string & switch_name, const ipv4_subnet & subnet)
+{
+    auto it = _pools.find(switch_name);
+    if (it != _pools.end() && it->second.subnet() == subnet)
+    {
+        return it->second;
+    }
+
+    // The subnet of the switch has changed; the leases in the previous one are gone along with it, and get
+    // replaced as the entities holding them ask for their addresses again.
+    if (it != _pools.end())
+    {
+        std::erase_if(_leases, [&](auto && lease) { return lease.second.switch_name == switch_name; });
+        _dirty = true;
+    }
+
+    return _pools.insert_or_assign(switch_name, address_pool(subnet)).first->second;
+}
+
+void ipam::_release(const _lease & lease)
+{
+    auto it = _pools.find(lease.switch_name);
+    if (it != _pools.end() && it->second.subnet() == lease.subnet)
+    {
+        it->second.release(lease.host);
+    }
+}
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace nonsensed
+{
+// An IPv4 subnet, with the address in host byte order and the bits past the prefix length cleared.
+struct ipv4_subnet
+{
+    std::uint32_t address = 0;
+    int prefix_length = 0;
+
+    // The number of addresses in the subnet, including the network and broadcast ones.
+    std::uint64_t size() const
+    {
+        return std::uint64_t(1) << (32 - prefix_length);
+    }
+
+    bool operator==(const ipv4_subnet &) const = default;
+};
+
+// Parses a subnet of the form "a.b.c.d/n"; bits of the address past the prefix length are dropped.
+std::optional<ipv4_subnet> parse_subnet(std::string_view subnet);
+std::string to_string(const ipv4_subnet & subnet);
+
+// The addresses in the subnet of a switch that are handed out to the entities connected to its bridge. The
+// first two hosts of the subnet are taken by the switch itself; the first by its end of the connection to its
+// uplink, which is the gateway of everything below it, and the second by its bridge.
+//
+// Taken hosts are kept in a bitmap, which grows as the addresses get handed out. Hosts are handed out in
+// order, and the ones released before the end of the range is reached are reused first, so allocating and
+// releasing both take constant time.
+class address_pool
+{
+public:
+    static constexpr std::uint32_t first_host = 3;
+
+    address_pool(ipv4_subnet subnet);
+
+    const ipv4_subnet & subnet() const
+    {
+        return _subnet;
+    }
+
+    // Returns the number of a free host within the subnet, and marks it as taken; empty once all are taken.
+    std::optional<std::uint32_t> allocate();
+    // Marks a specific host as taken; fails if it is not one that could be handed out, or is already taken.
+    bool reserve(std::uint32_t host);
+    void release(std::uint32_t host);
+
+private:
+    bool _taken(std::uint32_t host) const;
+    void _set(std::uint32_t host, bool taken);
+
+    ipv4_subnet _subnet;
+    // One past the last host that can be handed out; the broadcast address is not.
+    std::uint32_t _end;
+    // Hosts at and past this one have never been handed out by `allocate`, but may have been reserved.
+    std::uint32_t _next = first_host;
+    std::vector<std::uint32_t> _released;
+    std::vector<std::uint64_t> _bitmap;
+};
+
+// Assigns addresses to the entities connected to the bridges of switches: clients, and routers whose uplink
+// is a switch. An assignment, a lease, is kept for as long as the entity stays connected to the same subnet,
+// including while it is stopped and across restarts of the daemon, so that an entity keeps its address.
+class ipam
+{
+public:
+    // Restores the leases handed over by the previous instance of the daemon.
+    ipam();
+
+    // Returns the address of the entity in the subnet of the switch, as "a.b.c.d/n", allocating one if the
+    // entity does not already hold a lease there; a lease it holds elsewhere is released. Empty if there are
+    // no free addresses left in the subnet.
+    std::optional<std::string> lease(
+        const std::string & entity,
+        const std::string & switch_name,
+        const ipv4_subnet & subnet);
+    void release(const std::string & entity);
+    // The address of the lease the entity holds, as "a.b.c.d/n", if any.
+    std::optional<std::string> address_of(const std::string & entity) const;
+    // Releases the leases of all entities other than the given ones.
+    void retain(const std::vector<std::string> & entities);
+
+    // Hands the leases over to the file descriptor store, if they have changed since the last time; called
+    // once per iteration of the loop of the service, so that a burst of changes is stored once.
+    void flush();
+
+private:
+    struct _lease
+    {
+        std::string switch_name;
+        ipv4_subnet subnet;
+        std::uint32_t host;
+    };
+
+    address_pool & _pool(const std::string & switch_name, const ipv4_subnet & subnet);
+    void _release(const _lease & lease);
+
+    // By the name of the switch.
+    std::unordered_map<std::string, address_pool> _pools;
+    // By the name of the entity holding the lease.
+    std::unordered_map<std::string, _lease> _leases;
+    bool _dirty = false;
+};
+}
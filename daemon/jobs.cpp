@@ -0,0 +1,157 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "jobs.h"
+
+#include "log_helpers.h"
+#include "registry.h"
+#include "service.h"
+
+#include <cassert>
+#include <iostream>
+
+namespace nonsensed
+{
+DEFINE_PROPERTY_GET(job, id);
+DEFINE_PROPERTY_GET(job, entity);
+DEFINE_PROPERTY_GET(job, operation);
+
+static const sd_bus_vtable job_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+
+    SD_BUS_PROPERTY("Id", "t", job::property_id_get, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+    SD_BUS_PROPERTY("Entity", "s", job::property_entity_get, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+    SD_BUS_PROPERTY("Operation", "s", job::property_operation_get, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+
+    SD_BUS_SIGNAL("Progress", "ss", 0),
+
+    SD_BUS_VTABLE_END
+};
+
+job::job(std::uint64_t id, const service & srv, std::string entity, std::string operation)
+    : _id{ id },
+      _object_path{ "/info/griwes/nonsense/job/" + std::to_string(id) },
+      _entity{ std::move(entity) },
+      _operation{ std::move(operation) }
+{
+    int ret = sd_bus_add_object_vtable(
+        srv.bus(), &_bus_slot, _object_path.c_str(), "info.griwes.nonsense.Job", job_vtable, this);
+    if (ret < 0)
+    {
+        throw std::runtime_error(
+            "Failed to install the Job interface at " + _object_path + ": " + strerror(-ret));
+    }
+}
+
+PROPERTY_GET_SIGNATURE(job, id)
+{
+    assert(property == std::string_view("Id"));
+    return sd_bus_message_append(reply, "t", _id);
+}
+
+PROPERTY_GET_SIGNATURE(job, entity)
+{
+    assert(property == std::string_view("Entity"));
+    return sd_bus_message_append(reply, "s", _entity.c_str());
+}
+
+PROPERTY_GET_SIGNATURE(job, operation)
+{
+    assert(property == std::string_view("Operation"));
+    return sd_bus_message_append(reply, "s", _operation.c_str());
+}
+
+jobs::jobs(const service & srv) : _srv{ srv }
+{
+    _srv.registry().observe(
+        [this](const std::string & name, const entity_status & status) { _progress(name, status); });
+}
+
+job & jobs::add(std::string entity, std::string operation)
+{
+    auto id = _next_id++;
+    auto [it, inserted] = _jobs.emplace(
+        id, std::make_unique<job>(id, _srv, std::move(entity), std::move(operation)));
+    assert(inserted);
+    return *it->second;
+}
+
+void jobs::run(job & new_job, subtask task)
+{
+    async::detach(
+        std::move(task), [this, id = new_job.id()](const reply_status_t * error) { _done(id, error); });
+}
+
+// Phase changes are coalesced by the registry, so a quick operation may skip reporting some of its phases, or
+// even all of them, if it is done before the end of the iteration of the main loop it was started in.
+void jobs::_progress(const std::string & name, const entity_status & status)
+{
+    for (auto && [id, running] : _jobs)
+    {
+        if (running->entity() != name)
+        {
+            continue;
+        }
+
+        int ret = sd_bus_emit_signal(
+            _srv.bus(),
+            running->object_path(),
+            "info.griwes.nonsense.Job",
+            "Progress",
+            "ss",
+            std::string(to_string(status.phase)).c_str(),
+            status.step.c_str());
+        if (ret < 0)
+        {
+            std::cerr << error_prefix() << "Failed to emit a progress signal for job " << id << ": "
+                      << strerror(-ret) << '\n';
+        }
+    }
+}
+
+void jobs::_done(std::uint64_t id, const reply_status_t * error)
+{
+    auto it = _jobs.find(id);
+    assert(it != _jobs.end());
+
+    std::string description;
+    if (error)
+    {
+        description = error->error.message ? error->error.message
+                    : error->error.name    ? error->error.name
+                                           : strerror(-error->code);
+    }
+
+    int ret = sd_bus_emit_signal(
+        _srv.bus(),
+        "/info/griwes/nonsense",
+        "info.griwes.nonsense.Controller",
+        "JobDone",
+        "tosss",
+        id,
+        it->second->object_path(),
+        it->second->entity().c_str(),
+        error ? "failed" : "done",
+        description.c_str());
+    if (ret < 0)
+    {
+        std::cerr << error_prefix() << "Failed to emit the completion signal of job " << id << ": "
+                  << strerror(-ret) << '\n';
+    }
+
+    _jobs.erase(it);
+}
+}
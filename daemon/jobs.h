@@ -0,0 +1,94 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "dbus.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+
+namespace nonsensed
+{
+class service;
+struct entity_status;
+
+// A lifecycle operation on an entity running in the background. Until it is done, it is exposed over the bus
+// as an object implementing info.griwes.nonsense.Job, which emits a Progress signal whenever the entity
+// enters a new lifecycle phase.
+class job
+{
+public:
+    job(std::uint64_t id, const service & srv, std::string entity, std::string operation);
+
+    std::uint64_t id() const
+    {
+        return _id;
+    }
+
+    const char * object_path() const
+    {
+        return _object_path.c_str();
+    }
+
+    const std::string & entity() const
+    {
+        return _entity;
+    }
+
+    const std::string & operation() const
+    {
+        return _operation;
+    }
+
+    DECLARE_PROPERTY_GET(id);
+    DECLARE_PROPERTY_GET(entity);
+    DECLARE_PROPERTY_GET(operation);
+
+private:
+    dbus_slot _bus_slot;
+
+    std::uint64_t _id;
+    std::string _object_path;
+
+    std::string _entity;
+    std::string _operation;
+};
+
+// The jobs currently running in the daemon. Once a job is done, the JobDone signal of the Controller
+// interface is emitted with its outcome, and the job object is removed.
+class jobs
+{
+public:
+    jobs(const service & srv);
+
+    // The job is only started by `run`, so that the caller can announce it first; a job that completes right
+    // away would otherwise be gone before anyone learnt about it.
+    job & add(std::string entity, std::string operation);
+    void run(job & new_job, subtask task);
+
+private:
+    void _progress(const std::string & name, const entity_status & status);
+    void _done(std::uint64_t id, const reply_status_t * error);
+
+    const service & _srv;
+
+    std::uint64_t _next_id = 1;
+    std::map<std::uint64_t, std::unique_ptr<job>> _jobs;
+};
+}
@@ -19,6 +19,9 @@
 #include "cli.h"
 #include "configuration.h"
 #include "controller.h"
+#include "entity.h"
+#include "idle_monitor.h"
+#include "ipam.h"
 #include "log_helpers.h"
 #include "service.h"
 
@@ -31,6 +34,13 @@ try
     auto service = nonsensed::service(opts, config);
     auto control = nonsensed::controller(opts, config, service);
     (void)control;
+    auto idle = nonsensed::idle_monitor(config.running(), service);
+    (void)idle;
+
+    nonsensed::entity::adopt_stored(config.running());
+    nonsensed::entity::collect_leftovers(config.running());
+    // Leases handed over for entities that are no longer in the configuration won't be asked for again.
+    service.addresses().retain(config.running().entity_names());
 
     service.loop();
 
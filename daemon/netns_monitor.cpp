@@ -0,0 +1,757 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "netns_monitor.h"
+
+#include "log_helpers.h"
+#include "registry.h"
+#include "service.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/if.h>
+#include <linux/net_namespace.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/socket.h>
+#include <sched.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace nonsensed
+{
+namespace
+{
+    std::vector<char> _message(std::uint16_t type, std::uint16_t flags, const void * header, std::size_t size)
+    {
+        std::vector<char> ret(NLMSG_SPACE(size));
+        auto message = reinterpret_cast<nlmsghdr *>(ret.data());
+        message->nlmsg_len = ret.size();
+        message->nlmsg_type = type;
+        message->nlmsg_flags = NLM_F_REQUEST | flags;
+        message->nlmsg_seq = 1;
+        std::memcpy(NLMSG_DATA(message), header, size);
+        return ret;
+    }
+
+    template<typename T>
+    void _append(std::vector<char> & message, std::uint16_t type, const T & value)
+    {
+        auto offset = message.size();
+        message.resize(offset + RTA_SPACE(sizeof(T)));
+
+        auto attribute = reinterpret_cast<rtattr *>(message.data() + offset);
+        attribute->rta_type = type;
+        attribute->rta_len = RTA_LENGTH(sizeof(T));
+        std::memcpy(RTA_DATA(attribute), &value, sizeof(T));
+
+        reinterpret_cast<nlmsghdr *>(message.data())->nlmsg_len = message.size();
+    }
+
+    // Sends a request, and calls the handler for every message of the reply other than the final one. Returns
+    // 0 on success, or a negated errno value.
+    template<typename Handler>
+    int _request(int socket, const std::vector<char> & message, Handler && handler)
+    {
+        if (socket == -1 || send(socket, message.data(), message.size(), 0) == -1)
+        {
+            return -errno;
+        }
+
+        std::vector<char> buffer(32768);
+        while (true)
+        {
+            auto size = recv(socket, buffer.data(), buffer.size(), 0);
+            if (size == -1)
+            {
+                return -errno;
+            }
+
+            int length = size;
+            for (auto header = reinterpret_cast<nlmsghdr *>(buffer.data()); NLMSG_OK(header, length);
+                 header = NLMSG_NEXT(header, length))
+            {
+                if (header->nlmsg_type == NLMSG_DONE)
+                {
+                    return 0;
+                }
+
+                if (header->nlmsg_type == NLMSG_ERROR)
+                {
+                    return static_cast<nlmsgerr *>(NLMSG_DATA(header))->error;
+                }
+
+                handler(header);
+            }
+        }
+    }
+
+    // The same, over a socket of its own, in the namespace of the daemon.
+    template<typename Handler>
+    int _request(const std::vector<char> & message, Handler && handler)
+    {
+        unique_fd socket{ ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE) };
+        return _request(socket.get(), message, std::forward<Handler>(handler));
+    }
+
+    // Calls the visitor with the type and the payload of every attribute.
+    template<typename Visitor>
+    void _attributes(rtattr * attribute, int length, Visitor && visitor)
+    {
+        for (; RTA_OK(attribute, length); attribute = RTA_NEXT(attribute, length))
+        {
+            visitor(attribute->rta_type, RTA_DATA(attribute));
+        }
+    }
+
+    // The index and the name of a link, and whether it is up and has carrier.
+    std::pair<int, std::string> _parse_link(const nlmsghdr * message, bool & up, bool & carrier)
+    {
+        auto info = static_cast<ifinfomsg *>(NLMSG_DATA(message));
+
+        std::string name;
+        _attributes(IFLA_RTA(info), IFLA_PAYLOAD(message), [&](auto type, auto data) {
+            if (type == IFLA_IFNAME)
+            {
+                name = static_cast<const char *>(data);
+            }
+        });
+
+        up = info->ifi_flags & IFF_UP;
+        carrier = info->ifi_flags & IFF_LOWER_UP;
+        return std::pair(info->ifi_index, std::move(name));
+    }
+
+    std::string _format(const void * address, int prefix_length, int family = AF_INET)
+    {
+        char buffer[INET6_ADDRSTRLEN];
+        inet_ntop(family, address, buffer, sizeof(buffer));
+        return buffer + ("/" + std::to_string(prefix_length));
+    }
+
+    // The address of an address message, and whether it is still tentative; empty for messages without one.
+    std::string _parse_address(const nlmsghdr * message, bool & tentative)
+    {
+        auto info = static_cast<ifaddrmsg *>(NLMSG_DATA(message));
+
+        const void * address = nullptr;
+        std::uint32_t flags = info->ifa_flags;
+        _attributes(IFA_RTA(info), IFA_PAYLOAD(message), [&](auto type, auto data) {
+            if (type == IFA_LOCAL || (type == IFA_ADDRESS && !address))
+            {
+                address = data;
+            }
+            else if (type == IFA_FLAGS)
+            {
+                std::memcpy(&flags, data, sizeof(flags));
+            }
+        });
+
+        // Both IPv4 and IPv6 ones; the link-local addresses of the latter are tentative until their duplicate
+        // address detection is done, and an address that has failed it stays tentative for good.
+        tentative = (flags & IFA_F_TENTATIVE) && !(flags & IFA_F_DADFAILED);
+        return address ? _format(address, info->ifa_prefixlen, info->ifa_family) : std::string();
+    }
+
+    // The details of an IPv4 unicast route of a route message; false for messages about any other route.
+    bool _parse_route(
+        const nlmsghdr * message,
+        std::uint32_t & table,
+        std::uint32_t & destination,
+        std::int32_t & link,
+        std::uint32_t & metric)
+    {
+        auto info = static_cast<rtmsg *>(NLMSG_DATA(message));
+        auto cloned = info->rtm_flags & RTM_F_CLONED;
+        if (info->rtm_family != AF_INET || info->rtm_type != RTN_UNICAST || cloned)
+        {
+            return false;
+        }
+
+        table = info->rtm_table;
+        destination = 0;
+        link = 0;
+        metric = 0;
+        _attributes(RTM_RTA(info), RTM_PAYLOAD(message), [&](auto type, auto data) {
+            if (type == RTA_TABLE)
+            {
+                std::memcpy(&table, data, sizeof(table));
+            }
+            else if (type == RTA_DST)
+            {
+                std::memcpy(&destination, data, sizeof(destination));
+            }
+            else if (type == RTA_OIF)
+            {
+                std::memcpy(&link, data, sizeof(link));
+            }
+            else if (type == RTA_PRIORITY)
+            {
+                std::memcpy(&metric, data, sizeof(metric));
+            }
+        });
+
+        return true;
+    }
+
+    bool _is_own_netns(int netns)
+    {
+        struct stat own;
+        struct stat other;
+        return stat("/proc/self/ns/net", &own) == 0 && fstat(netns, &other) == 0 && own.st_dev == other.st_dev
+            && own.st_ino == other.st_ino;
+    }
+}
+
+netns_monitor::netns_monitor(service & srv)
+    : _service{ srv },
+      _socket{ ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE) }
+{
+    if (!_socket)
+    {
+        throw std::runtime_error(std::string("Failed to open a netlink socket: ") + strerror(errno));
+    }
+
+    int enable = 1;
+    if (setsockopt(_socket.get(), SOL_NETLINK, NETLINK_LISTEN_ALL_NSID, &enable, sizeof(enable)) == -1)
+    {
+        throw std::runtime_error(
+            std::string("Failed to listen to all network namespaces: ") + strerror(errno));
+    }
+
+    // Starting or stopping a tree of entities makes for bursts of notifications from all of its namespaces.
+    int size = 4 * 1024 * 1024;
+    setsockopt(_socket.get(), SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    sockaddr_nl address{ .nl_family = AF_NETLINK,
+                         .nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE
+                             | RTMGRP_IPV6_IFADDR };
+    if (bind(_socket.get(), reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1)
+    {
+        throw std::runtime_error(std::string("Failed to bind a netlink socket: ") + strerror(errno));
+    }
+}
+
+void netns_monitor::watch(const std::string & entity, int netns)
+{
+    std::int32_t nsid = NETNSA_NSID_NOT_ASSIGNED;
+
+    if (!_is_own_netns(netns))
+    {
+        // Lets the kernel pick the id; a namespace that already has one keeps it.
+        auto header = rtgenmsg{ .rtgen_family = AF_UNSPEC };
+        auto request = _message(RTM_NEWNSID, NLM_F_ACK, &header, sizeof(header));
+        _append(request, NETNSA_FD, static_cast<std::uint32_t>(netns));
+        _append(request, NETNSA_NSID, std::int32_t(-1));
+        auto ret = _request(request, [](auto &&) {});
+
+        request = _message(RTM_GETNSID, NLM_F_ACK, &header, sizeof(header));
+        _append(request, NETNSA_FD, static_cast<std::uint32_t>(netns));
+        if (ret == 0 || ret == -EEXIST)
+        {
+            ret = _request(request, [&](const nlmsghdr * message) {
+                auto info = static_cast<rtgenmsg *>(NLMSG_DATA(message));
+                auto attributes = reinterpret_cast<rtattr *>(
+                    reinterpret_cast<char *>(info) + NLMSG_ALIGN(sizeof(rtgenmsg)));
+                _attributes(attributes, NLMSG_PAYLOAD(message, sizeof(rtgenmsg)), [&](auto type, auto data) {
+                    if (type == NETNSA_NSID)
+                    {
+                        std::memcpy(&nsid, data, sizeof(nsid));
+                    }
+                });
+            });
+        }
+
+        if (ret < 0 || nsid == NETNSA_NSID_NOT_ASSIGNED)
+        {
+            std::cerr << error_prefix() << "Failed to assign an id to the network namespace of " << entity
+                      << ", its network won't be monitored: " << strerror(ret < 0 ? -ret : EINVAL) << '\n';
+            return;
+        }
+    }
+
+    auto & watched = _namespaces[nsid];
+    watched.entities.insert(entity);
+    if (!watched.netns)
+    {
+        watched.netns = unique_fd(fcntl(netns, F_DUPFD_CLOEXEC, 3));
+    }
+
+    // What the network is like now; the notifications only tell what changes.
+    auto ret = _seed(watched);
+    if (ret < 0)
+    {
+        std::cerr << error_prefix() << "Failed to list the network state of the namespace of " << entity
+                  << ": " << strerror(-ret) << '\n';
+    }
+}
+
+int netns_monitor::_seed(_namespace & netns)
+{
+    netns.links.clear();
+
+    auto socket = rtnetlink_socket_in(netns.netns.get());
+    if (!socket)
+    {
+        return -errno;
+    }
+
+    auto link_header = ifinfomsg{ .ifi_family = AF_UNSPEC };
+    auto ret = _request(
+        socket.get(),
+        _message(RTM_GETLINK, NLM_F_DUMP, &link_header, sizeof(link_header)),
+        [&](const nlmsghdr * message) { _handle(netns, message); });
+
+    auto address_header = ifaddrmsg{ .ifa_family = AF_UNSPEC };
+    if (ret == 0)
+    {
+        ret = _request(
+            socket.get(),
+            _message(RTM_GETADDR, NLM_F_DUMP, &address_header, sizeof(address_header)),
+            [&](const nlmsghdr * message) { _handle(netns, message); });
+    }
+
+    auto route_header = rtmsg{ .rtm_family = AF_INET };
+    if (ret == 0)
+    {
+        ret = _request(
+            socket.get(),
+            _message(RTM_GETROUTE, NLM_F_DUMP, &route_header, sizeof(route_header)),
+            [&](const nlmsghdr * message) { _handle(netns, message); });
+    }
+
+    return ret;
+}
+
+void netns_monitor::unwatch(const std::string & entity)
+{
+    // The id stays assigned for as long as the namespace exists; it may be reused for a later namespace once
+    // this one is gone, which watch then takes over.
+    for (auto it = _namespaces.begin(); it != _namespaces.end();)
+    {
+        it->second.entities.erase(entity);
+        it = it->second.entities.empty() ? _namespaces.erase(it) : std::next(it);
+    }
+
+    _resolve([&](auto && waiter) { return waiter.entity == entity; }, false);
+}
+
+void netns_monitor::process()
+{
+    std::vector<char> buffer(65536);
+    char control[CMSG_SPACE(sizeof(std::int32_t))];
+
+    // Whether anything has changed in any of the watched namespaces, so that some may have come online.
+    auto changed = false;
+
+    for (auto reading = true; reading;)
+    {
+        iovec data{ .iov_base = buffer.data(), .iov_len = buffer.size() };
+        msghdr header{
+            .msg_iov = &data, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)
+        };
+
+        auto size = recvmsg(_socket.get(), &header, 0);
+        if (size == -1)
+        {
+            switch (errno)
+            {
+                case EINTR:
+                    continue;
+
+                case EAGAIN:
+                    reading = false;
+                    continue;
+
+                case ENOBUFS:
+                    // What is known about the namespaces can't be trusted anymore, so it is listed anew.
+                    for (auto && [nsid, netns] : _namespaces)
+                    {
+                        _record(netns, 0, "some changes were missed");
+                        if (auto ret = _seed(netns); ret < 0)
+                        {
+                            std::cerr << error_prefix() << "Failed to list the network state of a namespace: "
+                                      << strerror(-ret) << '\n';
+                        }
+                    }
+                    changed = true;
+                    continue;
+
+                default:
+                    std::cerr << error_prefix() << "Failed to read network notifications: " << strerror(errno)
+                              << '\n';
+                    reading = false;
+                    continue;
+            }
+        }
+
+        // Notifications from the namespace of the daemon come without an id.
+        std::int32_t nsid = NETNSA_NSID_NOT_ASSIGNED;
+        for (auto message = CMSG_FIRSTHDR(&header); message; message = CMSG_NXTHDR(&header, message))
+        {
+            if (message->cmsg_level == SOL_NETLINK && message->cmsg_type == NETLINK_LISTEN_ALL_NSID)
+            {
+                std::memcpy(&nsid, CMSG_DATA(message), sizeof(nsid));
+            }
+        }
+
+        auto it = _namespaces.find(nsid);
+        if (it == _namespaces.end())
+        {
+            continue;
+        }
+        changed = true;
+
+        int length = size;
+        for (auto message = reinterpret_cast<nlmsghdr *>(buffer.data()); NLMSG_OK(message, length);
+             message = NLMSG_NEXT(message, length))
+        {
+            _handle(it->second, message);
+        }
+    }
+
+    if (!changed || _waiters.empty())
+    {
+        return;
+    }
+
+    _resolve([&](auto && waiter) { return online(waiter.entity, waiter.default_route); }, true);
+}
+
+bool netns_monitor::online(const std::string & entity, bool default_route)
+{
+    if (!_find(entity))
+    {
+        return false;
+    }
+
+    // The downlink of the entity lives in the namespace of its uplink, so all of them are looked through.
+    auto has_default_route = false;
+    for (auto && [nsid, netns] : _namespaces)
+    {
+        for (auto && [index, link] : netns.links)
+        {
+            if (!_belongs_to(netns, link, entity))
+            {
+                continue;
+            }
+
+            // The uplink of a switch is a port of its bridge, so even the bridge of a switch with nothing
+            // below it has carrier once the entity is connected.
+            if (!link.up || !link.carrier)
+            {
+                return false;
+            }
+
+            for (auto && [address, tentative] : link.addresses)
+            {
+                if (tentative)
+                {
+                    return false;
+                }
+            }
+
+            has_default_route = has_default_route || !link.default_routes.empty();
+        }
+    }
+
+    return has_default_route || !default_route;
+}
+
+void netns_monitor::wait_online(
+    const std::string & entity,
+    bool default_route,
+    std::chrono::milliseconds timeout,
+    function<void(bool)> callback)
+{
+    if (!_find(entity) || online(entity, default_route))
+    {
+        callback(_find(entity) != nullptr);
+        return;
+    }
+
+    auto id = ++_last_waiter_id;
+    _waiters.push_back(
+        { .id = id, .entity = entity, .default_route = default_route, .callback = std::move(callback) });
+
+    if (timeout.count())
+    {
+        _service.after(timeout, [this, id] {
+            _resolve([&](auto && waiter) { return waiter.id == id; }, false);
+        });
+    }
+}
+
+netns_monitor::_namespace * netns_monitor::_find(const std::string & entity)
+{
+    for (auto && [nsid, netns] : _namespaces)
+    {
+        if (netns.entities.contains(entity))
+        {
+            return &netns;
+        }
+    }
+    return nullptr;
+}
+
+template<typename Predicate>
+void netns_monitor::_resolve(Predicate && predicate, bool result)
+{
+    std::vector<_waiter> resolved;
+    for (auto it = _waiters.begin(); it != _waiters.end();)
+    {
+        if (predicate(*it))
+        {
+            resolved.push_back(std::move(*it));
+            it = _waiters.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    for (auto && waiter : resolved)
+    {
+        waiter.callback(result);
+    }
+}
+
+bool netns_monitor::_belongs_to(const _namespace & netns, const _link & link, const std::string & entity)
+{
+    // The downlink of an entity lives in the namespace of its uplink, but belongs to the entity.
+    if (link.name.starts_with("nd-"))
+    {
+        return std::string_view(link.name).substr(3) == entity;
+    }
+
+    return netns.entities.contains(entity);
+}
+
+void netns_monitor::_record(_namespace & netns, int index, const std::string & event)
+{
+    auto it = netns.links.find(index);
+    if (it != netns.links.end() && it->second.name.starts_with("nd-"))
+    {
+        auto owner = it->second.name.substr(3);
+        if (_find(owner))
+        {
+            _service.registry().add_network_event(owner, event);
+        }
+        return;
+    }
+
+    for (auto && entity : netns.entities)
+    {
+        _service.registry().add_network_event(entity, event);
+    }
+}
+
+void netns_monitor::_handle(_namespace & netns, const nlmsghdr * message)
+{
+    auto link_name = [&](int index) {
+        auto it = netns.links.find(index);
+        return it == netns.links.end() ? "link " + std::to_string(index) : it->second.name;
+    };
+
+    switch (message->nlmsg_type)
+    {
+        case RTM_NEWLINK:
+        {
+            bool up;
+            bool carrier;
+            auto [index, name] = _parse_link(message, up, carrier);
+            auto [it, inserted] = netns.links.try_emplace(index);
+            it->second.name = std::move(name);
+
+            // New links have nothing to compare against, and come without carrier anyway.
+            if (!inserted && it->second.carrier != carrier)
+            {
+                auto change = carrier ? " regained carrier" : " lost carrier";
+                _record(netns, index, "link " + it->second.name + change);
+            }
+            it->second.up = up;
+            it->second.carrier = carrier;
+            break;
+        }
+
+        case RTM_DELLINK:
+        {
+            auto info = static_cast<ifinfomsg *>(NLMSG_DATA(message));
+            _record(netns, info->ifi_index, "link " + link_name(info->ifi_index) + " removed");
+            netns.links.erase(info->ifi_index);
+            break;
+        }
+
+        case RTM_NEWADDR:
+        {
+            auto info = static_cast<ifaddrmsg *>(NLMSG_DATA(message));
+
+            bool tentative;
+            auto address = _parse_address(message, tentative);
+            // The link is always announced before its addresses and routes; one that isn't known anymore is
+            // being removed, and must not come back as a link that is never up.
+            auto it = netns.links.find(info->ifa_index);
+            if (!address.empty() && it != netns.links.end())
+            {
+                it->second.addresses[address] = tentative;
+            }
+            break;
+        }
+
+        case RTM_DELADDR:
+        {
+            auto info = static_cast<ifaddrmsg *>(NLMSG_DATA(message));
+
+            bool tentative;
+            auto address = _parse_address(message, tentative);
+            if (address.empty())
+            {
+                break;
+            }
+
+            if (auto it = netns.links.find(info->ifa_index); it != netns.links.end())
+            {
+                it->second.addresses.erase(address);
+            }
+
+            if (info->ifa_family == AF_INET)
+            {
+                _record(
+                    netns,
+                    info->ifa_index,
+                    "address " + address + " removed from " + link_name(info->ifa_index));
+            }
+            break;
+        }
+
+        case RTM_NEWROUTE:
+        {
+            std::uint32_t table;
+            std::uint32_t destination;
+            std::int32_t link;
+            std::uint32_t metric;
+            if (!_parse_route(message, table, destination, link, metric))
+            {
+                break;
+            }
+
+            auto info = static_cast<rtmsg *>(NLMSG_DATA(message));
+            auto it = netns.links.find(link);
+            if (table == RT_TABLE_MAIN && info->rtm_dst_len == 0 && it != netns.links.end())
+            {
+                it->second.default_routes.insert(metric);
+            }
+            break;
+        }
+
+        case RTM_DELROUTE:
+        {
+            std::uint32_t table;
+            std::uint32_t destination;
+            std::int32_t link;
+            std::uint32_t metric;
+            if (!_parse_route(message, table, destination, link, metric) || table != RT_TABLE_MAIN)
+            {
+                break;
+            }
+
+            auto info = static_cast<rtmsg *>(NLMSG_DATA(message));
+            if (auto it = netns.links.find(link); it != netns.links.end() && info->rtm_dst_len == 0)
+            {
+                it->second.default_routes.erase(metric);
+            }
+
+            _record(netns, link, "route to " + _format(&destination, info->rtm_dst_len) + " removed");
+            break;
+        }
+    }
+}
+
+unique_fd rtnetlink_socket_in(int netns)
+{
+    unique_fd ret;
+    int error = 0;
+
+    std::thread([&] {
+        if (setns(netns, CLONE_NEWNET) == -1)
+        {
+            error = errno;
+            return;
+        }
+
+        ret = unique_fd{ ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE) };
+        error = errno;
+    }).join();
+
+    errno = error;
+    return ret;
+}
+
+std::optional<std::uint64_t> count_packets(int socket)
+{
+    auto header = ifinfomsg{ .ifi_family = AF_UNSPEC };
+    auto request = _message(RTM_GETLINK, NLM_F_DUMP, &header, sizeof(header));
+
+    while (true)
+    {
+        std::uint64_t packets = 0;
+        auto interrupted = false;
+
+        auto ret = _request(socket, request, [&](const nlmsghdr * message) {
+            interrupted = interrupted || (message->nlmsg_flags & NLM_F_DUMP_INTR);
+
+            auto info = static_cast<ifinfomsg *>(NLMSG_DATA(message));
+            if (message->nlmsg_type != RTM_NEWLINK || (info->ifi_flags & IFF_LOOPBACK))
+            {
+                return;
+            }
+
+            _attributes(IFLA_RTA(info), IFLA_PAYLOAD(message), [&](auto type, auto data) {
+                // The received and the transmitted packets are the first two counters; the structure has
+                // grown at the end over time, so nothing past them is read.
+                if (type == IFLA_STATS64)
+                {
+                    std::uint64_t counters[2];
+                    std::memcpy(counters, data, sizeof(counters));
+                    packets += counters[0] + counters[1];
+                }
+            });
+        });
+
+        if (ret < 0)
+        {
+            errno = -ret;
+            return std::nullopt;
+        }
+
+        // Links that came or went while they were being listed may have been missed or counted twice.
+        if (!interrupted)
+        {
+            return packets;
+        }
+    }
+}
+}
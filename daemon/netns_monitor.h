@@ -0,0 +1,147 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "function.h"
+#include "unique_fd.h"
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+extern "C"
+{
+    struct nlmsghdr;
+}
+
+namespace nonsensed
+{
+class service;
+
+// Watches the network namespaces of running entities, and records what happens to their networks in the
+// registry: links losing or regaining carrier, and links, addresses and routes going away. A single rtnetlink
+// socket in the namespace of the daemon receives the notifications of every namespace that has an id there
+// (NETLINK_LISTEN_ALL_NSID); the monitor assigns one to the namespace of every entity it watches, so it needs
+// no thread or process per namespace. Entityd puts back what belongs to it on its own; this is about knowing
+// that it had to.
+//
+// The same notifications keep track of the state of the links of every watched namespace, their addresses and
+// default routes, which is what tells when the network of an entity becomes usable, for those waiting for
+// that.
+class netns_monitor
+{
+public:
+    netns_monitor(service & srv);
+
+    netns_monitor(const netns_monitor &) = delete;
+    netns_monitor & operator=(const netns_monitor &) = delete;
+
+    int fd() const
+    {
+        return _socket.get();
+    }
+
+    void watch(const std::string & entity, int netns);
+    void unwatch(const std::string & entity);
+
+    // Reads all the pending notifications.
+    void process();
+
+    // Whether the network of a watched entity is online: every link of the entity is up and has carrier, no
+    // address on them is still tentative, and, if asked for, one of them has a default route in the main
+    // table. The links of an entity are the ones its events are recorded for; see _record.
+    bool online(const std::string & entity, bool default_route);
+    // Calls the callback with true once the namespace of the entity is online, or with false once the timeout
+    // passes or the entity stops being watched, whichever comes first. A zero timeout never passes.
+    void wait_online(
+        const std::string & entity,
+        bool default_route,
+        std::chrono::milliseconds timeout,
+        function<void(bool)> callback);
+
+private:
+    struct _link
+    {
+        std::string name;
+        bool up = false;
+        bool carrier = false;
+        // By address, with whether it is still tentative.
+        std::map<std::string, bool> addresses;
+        // The metrics of the default routes in the main table that go out through the link.
+        std::set<std::uint32_t> default_routes;
+    };
+
+    // Entities that share a namespace, like the ones living in the namespace of the daemon, all get told
+    // about what happens in it.
+    struct _namespace
+    {
+        // A copy, since the fd of the entity that was watched first may well go before the others.
+        unique_fd netns;
+        std::set<std::string> entities;
+        std::unordered_map<int, _link> links;
+    };
+
+    struct _waiter
+    {
+        std::uint64_t id;
+        std::string entity;
+        bool default_route;
+        function<void(bool)> callback;
+    };
+
+    // Whether the link belongs to the entity: a downlink (nd-<entity>) belongs to the entity it is for, and
+    // any other link to the entities whose namespace it is in.
+    static bool _belongs_to(const _namespace & netns, const _link & link, const std::string & entity);
+    // Records the event for the entities the link with the given index belongs to, or for the entities whose
+    // namespace it is if there is no such link.
+    void _record(_namespace & netns, int index, const std::string & event);
+    // Replaces what is known about the namespace with a dump of its links, addresses and routes. Returns 0 on
+    // success, or a negated errno value.
+    int _seed(_namespace & netns);
+    void _handle(_namespace & netns, const nlmsghdr * message);
+
+    _namespace * _find(const std::string & entity);
+    // Calls back, with the given result, the waiters the predicate picks; they're taken out first, since the
+    // callbacks may add waiters of their own.
+    template<typename Predicate>
+    void _resolve(Predicate && predicate, bool result);
+
+    service & _service;
+    unique_fd _socket;
+
+    // By the id of the namespace in the namespace of the daemon; the namespace of the daemon itself, whose
+    // notifications come without one, is under NETNSA_NSID_NOT_ASSIGNED.
+    std::unordered_map<std::int32_t, _namespace> _namespaces;
+
+    std::vector<_waiter> _waiters;
+    std::uint64_t _last_waiter_id = 0;
+};
+
+// Creates an rtnetlink socket in the network namespace. A netlink socket talks to the namespace it was
+// created in; it is created on a thread of its own, which enters the namespace and ends there, so that the
+// calling thread never leaves the namespace of the daemon. Sets errno on failure.
+unique_fd rtnetlink_socket_in(int netns);
+
+// The number of packets received and sent on all interfaces other than loopback ones, listed over an
+// rtnetlink socket in their namespace. Sets errno on failure.
+std::optional<std::uint64_t> count_packets(int socket);
+}
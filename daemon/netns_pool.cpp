@@ -0,0 +1,145 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "netns_pool.h"
+
+#include "log_helpers.h"
+
+#include <fcntl.h>
+#include <net/if.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <iostream>
+#include <string>
+
+namespace nonsensed
+{
+// Moves the calling thread into a new network namespace, brings up its loopback device, and sets the sysctls
+// of the role in it.
+static unique_fd _prepare_netns(network_role role)
+{
+    if (unshare(CLONE_NEWNET) == -1)
+    {
+        std::cerr << error_prefix() << "Failed to create a network namespace: " << strerror(errno) << '\n';
+        return {};
+    }
+
+    unique_fd netns{ open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC) };
+    unique_fd sock{ socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0) };
+    if (!netns || !sock)
+    {
+        std::cerr << error_prefix() << "Failed to open a new network namespace: " << strerror(errno) << '\n';
+        return {};
+    }
+
+    ifreq request{};
+    std::strcpy(request.ifr_name, "lo");
+    int ret = ioctl(sock.get(), SIOCGIFFLAGS, &request);
+    if (ret != -1)
+    {
+        request.ifr_flags |= IFF_UP;
+        ret = ioctl(sock.get(), SIOCSIFFLAGS, &request);
+    }
+
+    if (ret == -1)
+    {
+        std::cerr << error_prefix() << "Failed to bring up the loopback device of a new network namespace: "
+                  << strerror(errno) << '\n';
+        return {};
+    }
+
+    // The sysctls under /proc/sys/net are the ones of the namespace of the thread that opens them.
+    for (auto && [path, value] : role_sysctls(role))
+    {
+        auto full_path = "/proc/sys/" + std::string(path);
+        unique_fd sysctl{ open(full_path.c_str(), O_WRONLY | O_CLOEXEC) };
+        if (!sysctl || write(sysctl.get(), value.data(), value.size()) != ssize_t(value.size()))
+        {
+            std::cerr << error_prefix() << "Failed to set " << full_path << " in a new network namespace: "
+                      << strerror(errno) << '\n';
+            return {};
+        }
+    }
+
+    return netns;
+}
+
+netns_pool::netns_pool(std::size_t size) : _size(size)
+{
+    if (_size != 0)
+    {
+        _worker = std::jthread([this](std::stop_token stop) { _refill(stop); });
+    }
+}
+
+unique_fd netns_pool::take(network_role role)
+{
+    std::lock_guard lock(_mutex);
+
+    // The first request for a role only makes the pool start keeping spares for it.
+    auto & spares = _spares[role];
+    _taken.notify_one();
+
+    if (spares.empty())
+    {
+        return {};
+    }
+
+    auto ret = std::move(spares.back());
+    spares.pop_back();
+
+    return ret;
+}
+
+std::optional<network_role> netns_pool::_short_role() const
+{
+    for (auto && [role, spares] : _spares)
+    {
+        if (spares.size() < _size)
+        {
+            return role;
+        }
+    }
+
+    return std::nullopt;
+}
+
+void netns_pool::_refill(std::stop_token stop)
+{
+    std::unique_lock lock(_mutex);
+
+    while (_taken.wait(lock, stop, [&] { return _short_role().has_value(); }))
+    {
+        auto role = *_short_role();
+
+        lock.unlock();
+        auto netns = _prepare_netns(role);
+        lock.lock();
+
+        if (!netns)
+        {
+            // Whatever went wrong is not going to fix itself; entities still start without the pool.
+            return;
+        }
+
+        _spares[role].push_back(std::move(netns));
+    }
+}
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "common_definitions.h"
+#include "unique_fd.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace nonsensed
+{
+// Spare network namespaces, held open by fd and prepared ahead of time, so that starting an entity that needs
+// a namespace of its own doesn't wait on the kernel creating one. The pool is refilled by a background
+// thread, which lives in whichever namespace it has created last; the rest of the daemon is not affected.
+//
+// A namespace is prepared for a network role: its loopback device is up and the sysctls of the role are set
+// (see role_sysctls). The pool keeps the given number of spares for each role that has been asked for at
+// least once, so that roles no entity uses don't hold namespaces.
+class netns_pool
+{
+public:
+    netns_pool(std::size_t size);
+
+    netns_pool(const netns_pool &) = delete;
+    netns_pool & operator=(const netns_pool &) = delete;
+
+    // Returns an empty fd if there are no spares for the role, in which case entityd creates a namespace
+    // itself.
+    unique_fd take(network_role role);
+
+private:
+    void _refill(std::stop_token stop);
+    // A role that has fewer spares than it should, if any; requires the mutex.
+    std::optional<network_role> _short_role() const;
+
+    const std::size_t _size;
+
+    std::mutex _mutex;
+    std::condition_variable_any _taken;
+    std::map<network_role, std::vector<unique_fd>> _spares;
+
+    // Last, so that it is stopped and joined before anything it uses is destroyed.
+    std::jthread _worker;
+};
+}
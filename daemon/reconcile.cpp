@@ -0,0 +1,132 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "reconcile.h"
+
+#include "config.h"
+#include "entity.h"
+#include "ipam.h"
+#include "service.h"
+
+#include <map>
+#include <set>
+
+namespace nonsensed
+{
+// The length of the chain of uplinks above an entity.
+static std::size_t _depth(config & cfg, const std::string & name)
+{
+    std::size_t depth = 0;
+
+    auto uplink = std::optional<std::string>(name);
+    while (auto ent = cfg.try_get(*uplink))
+    {
+        uplink = ent->uplink();
+        if (!uplink)
+        {
+            break;
+        }
+
+        ++depth;
+    }
+
+    return depth;
+}
+
+// Groups the running entities among the given names by their depth in the configuration.
+static std::map<std::size_t, std::vector<entity>> _running_by_depth(
+    config & cfg,
+    const std::set<std::string> & names)
+{
+    std::map<std::size_t, std::vector<entity>> ret;
+
+    for (auto && name : names)
+    {
+        auto ent = cfg.try_get(name);
+        if (ent && ent->running())
+        {
+            ret[_depth(cfg, name)].push_back(*ent);
+        }
+    }
+
+    return ret;
+}
+
+subtask reconcile(config * previous, config * current)
+{
+    RETURN_TASK
+    {
+        auto difference = previous->diff(*current);
+
+        auto removed = _running_by_depth(
+            *previous, std::set<std::string>(difference.removed.begin(), difference.removed.end()));
+
+        for (auto it = removed.rbegin(); it != removed.rend(); ++it)
+        {
+            std::vector<subtask> stops;
+            for (auto && ent : it->second)
+            {
+                stops.push_back(ent.stop());
+            }
+
+            co_await async::when_all(std::move(stops));
+        }
+
+        // Addresses of the entities that are gone go back to the subnets of their switches.
+        for (auto && name : difference.removed)
+        {
+            current->get_service().addresses().release(name);
+        }
+
+        // A change to an entity also changes the view of the uplink chain that everything downstream of it
+        // has, so those need to be looked at too.
+        std::set<std::string> affected;
+        std::vector<std::string> pending = difference.changed;
+
+        while (!pending.empty())
+        {
+            auto name = std::move(pending.back());
+            pending.pop_back();
+
+            if (!affected.insert(name).second)
+            {
+                continue;
+            }
+
+            for (auto && downlink : current->get_downlinks(name))
+            {
+                pending.push_back(downlink.name());
+            }
+        }
+
+        auto changed = _running_by_depth(*current, affected);
+
+        for (auto && [depth, entities] : changed)
+        {
+            std::vector<subtask> restarts;
+            for (auto && ent : entities)
+            {
+                // The downlinks that need it are in the affected set, and are handled at the next depth.
+                restarts.push_back(ent.restart(false));
+            }
+
+            co_await async::when_all(std::move(restarts));
+        }
+
+        co_return unit;
+    };
+}
+}
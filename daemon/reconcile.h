@@ -0,0 +1,30 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "async.h"
+
+namespace nonsensed
+{
+class config;
+
+// Brings the running entities in line with a newly committed configuration. Running entities that have been
+// removed from the configuration are stopped, deepest first. Running entities whose configuration changed,
+// together with the running entities downstream of them, are restarted in place, uplinks before their
+// downlinks, and independent entities at the same depth concurrently. Nothing else is touched.
+subtask reconcile(config * previous, config * current);
+}
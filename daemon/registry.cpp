@@ -0,0 +1,206 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "registry.h"
+
+#include "async.h"
+#include "log_helpers.h"
+
+#include <systemd/sd-bus.h>
+
+#include <iostream>
+
+namespace nonsensed
+{
+std::string_view to_string(lifecycle_phase phase)
+{
+    switch (phase)
+    {
+        case lifecycle_phase::inactive:
+            return "inactive";
+        case lifecycle_phase::waiting:
+            return "waiting";
+        case lifecycle_phase::spawning:
+            return "spawning";
+        case lifecycle_phase::creating_units:
+            return "creating-units";
+        case lifecycle_phase::configuring:
+            return "configuring";
+        case lifecycle_phase::active:
+            return "active";
+        case lifecycle_phase::reconfiguring:
+            return "reconfiguring";
+        case lifecycle_phase::stopping:
+            return "stopping";
+        case lifecycle_phase::failed:
+            return "failed";
+        case lifecycle_phase::hibernated:
+            return "hibernated";
+
+        case lifecycle_phase::count:
+            break;
+    }
+
+    return "unknown";
+}
+
+namespace
+{
+    std::uint64_t _realtime_usec()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    }
+}
+
+const entity_status & entity_registry::get(const std::string & name)
+{
+    return _records[name].status;
+}
+
+void entity_registry::set_phase(const std::string & name, lifecycle_phase phase)
+{
+    auto & record = _records[name];
+    auto now = std::chrono::steady_clock::now();
+
+    if (record.status.phase_since)
+    {
+        record.status.durations[static_cast<std::size_t>(record.status.phase)] =
+            std::chrono::duration_cast<std::chrono::microseconds>(now - record.phase_entered).count();
+    }
+
+    record.status.phase = phase;
+    record.status.step.clear();
+    record.status.phase_since = _realtime_usec();
+    record.phase_entered = now;
+
+    switch (phase)
+    {
+        case lifecycle_phase::active:
+            if (!record.status.started_at)
+            {
+                record.status.started_at = record.status.phase_since;
+            }
+            break;
+
+        case lifecycle_phase::inactive:
+        case lifecycle_phase::hibernated:
+            record.status.pid = 0;
+            record.status.started_at = 0;
+            record.status.network_events = 0;
+            record.status.last_network_event.clear();
+            break;
+
+        default:
+            break;
+    }
+
+    _dirty.insert(name);
+}
+
+void entity_registry::set_pid(const std::string & name, int pid)
+{
+    _records[name].status.pid = pid;
+    _dirty.insert(name);
+}
+
+void entity_registry::set_error(const std::string & name, std::string error)
+{
+    _records[name].status.last_error = std::move(error);
+    _dirty.insert(name);
+}
+
+void entity_registry::add_network_event(const std::string & name, std::string event)
+{
+    auto & status = _records[name].status;
+    ++status.network_events;
+    status.last_network_event = std::move(event);
+    _dirty.insert(name);
+}
+
+void entity_registry::set_step(const std::string & name, std::string step)
+{
+    _records[name].status.step = std::move(step);
+    _dirty.insert(name);
+}
+
+void entity_registry::flush(sd_bus * bus)
+{
+    for (auto && name : _dirty)
+    {
+        auto & status = _records.at(name).status;
+
+        int ret = sd_bus_emit_signal(
+            bus,
+            "/info/griwes/nonsense",
+            "info.griwes.nonsense.Controller",
+            "EntityStateChanged",
+            "ssus",
+            name.c_str(),
+            std::string(to_string(status.phase)).c_str(),
+            static_cast<std::uint32_t>(status.pid),
+            status.last_error.c_str());
+        if (ret < 0)
+        {
+            std::cerr << error_prefix() << "Failed to emit a state change signal for entity " << name << ": "
+                      << strerror(-ret) << '\n';
+        }
+
+        for (auto && observer : _observers)
+        {
+            observer(name, status);
+        }
+    }
+
+    _dirty.clear();
+}
+
+void entity_registry::observe(function<void(const std::string &, const entity_status &)> observer)
+{
+    _observers.push_back(std::move(observer));
+}
+
+lifecycle_operation::lifecycle_operation(
+    entity_registry & registry,
+    std::string name,
+    lifecycle_phase initial,
+    const promise & owner)
+    : _registry{ registry }, _name{ std::move(name) }, _owner{ owner }
+{
+    _registry.set_phase(_name, initial);
+}
+
+lifecycle_operation::~lifecycle_operation()
+{
+    if (!_completed)
+    {
+        _registry.set_error(_name, _owner.error());
+        _registry.set_phase(_name, lifecycle_phase::failed);
+    }
+}
+
+void lifecycle_operation::enter(lifecycle_phase phase)
+{
+    _registry.set_phase(_name, phase);
+}
+
+void lifecycle_operation::complete(lifecycle_phase phase)
+{
+    _completed = true;
+    _registry.set_phase(_name, phase);
+}
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "function.h"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+extern "C"
+{
+    struct sd_bus;
+}
+
+namespace nonsensed
+{
+class promise;
+
+enum class lifecycle_phase
+{
+    inactive,
+    // Queued behind another operation on the entity, or waiting for its uplink to start.
+    waiting,
+    spawning,
+    creating_units,
+    configuring,
+    active,
+    reconfiguring,
+    stopping,
+    failed,
+    // Stopped for being idle; started again when a client asks for the entity. See idle_monitor.
+    hibernated,
+
+    count
+};
+
+std::string_view to_string(lifecycle_phase phase);
+
+struct entity_status
+{
+    lifecycle_phase phase = lifecycle_phase::inactive;
+    int pid = 0;
+    // Wall clock time, in microseconds since the epoch, of when the entity last became active.
+    std::uint64_t started_at = 0;
+    // Wall clock time, in microseconds since the epoch, of when the entity entered its current phase.
+    std::uint64_t phase_since = 0;
+    // How long, in microseconds, the entity spent in each phase the last time it went through it.
+    std::array<std::uint64_t, static_cast<std::size_t>(lifecycle_phase::count)> durations{};
+    std::string last_error;
+    // How many changes to the network of the entity the daemon has seen since it last became active, and what
+    // the last one was; see netns_monitor.
+    std::uint64_t network_events = 0;
+    std::string last_network_event;
+    // The step of the current phase the entity is going through, as reported by entityd while applying its
+    // components; empty outside of those.
+    std::string step;
+};
+
+// The in-memory record of the runtime state of entities. Changes are not announced as they happen; instead,
+// `flush` emits a single EntityStateChanged signal per entity that changed since the previous flush, which
+// the service does once per iteration of its loop.
+class entity_registry
+{
+public:
+    const entity_status & get(const std::string & name);
+
+    void set_phase(const std::string & name, lifecycle_phase phase);
+    void set_pid(const std::string & name, int pid);
+    void set_error(const std::string & name, std::string error);
+    void add_network_event(const std::string & name, std::string event);
+    void set_step(const std::string & name, std::string step);
+
+    void flush(sd_bus * bus);
+
+    // The observer is called by `flush` for every entity whose state changed, after its signal is emitted.
+    void observe(function<void(const std::string &, const entity_status &)> observer);
+
+private:
+    struct _record
+    {
+        entity_status status;
+        std::chrono::steady_clock::time_point phase_entered;
+    };
+
+    std::unordered_map<std::string, _record> _records;
+    std::set<std::string> _dirty;
+    std::vector<function<void(const std::string &, const entity_status &)>> _observers;
+};
+
+// Tracks a single lifecycle operation on an entity, like starting or stopping it. If the tracker is destroyed
+// before the operation is marked as complete, which is what happens when the coroutine performing it is torn
+// down because of an error, the entity is marked as failed with the error of that coroutine, given by its
+// promise.
+class lifecycle_operation
+{
+public:
+    lifecycle_operation(
+        entity_registry & registry,
+        std::string name,
+        lifecycle_phase initial,
+        const promise & owner);
+    ~lifecycle_operation();
+
+    lifecycle_operation(const lifecycle_operation &) = delete;
+    lifecycle_operation & operator=(const lifecycle_operation &) = delete;
+
+    void enter(lifecycle_phase phase);
+    void complete(lifecycle_phase phase);
+
+private:
+    entity_registry & _registry;
+    std::string _name;
+    const promise & _owner;
+    bool _completed = false;
+};
+}
@@ -15,19 +15,35 @@
  */
 
 #include "service.h"
+#include "cgroup.h"
+#include "cli.h"
 #include "configuration.h"
+#include "ipam.h"
+#include "netns_monitor.h"
+#include "netns_pool.h"
+#include "registry.h"
 
 #include <systemd/sd-bus.h>
 
 #include <sys/epoll.h>
 
+#include <algorithm>
 #include <stdexcept>
 #include <string>
 
 namespace nonsensed
 {
 service::service(const options & opts, configuration & config_object)
+    : _opts{ opts },
+      _registry{ std::make_unique<entity_registry>() },
+      _namespaces{ std::make_unique<netns_pool>(opts.netns_pool_size()) },
+      _addresses{ std::make_unique<ipam>() }
 {
+    if (opts.get_cgroup_mode() == cgroup_mode::direct)
+    {
+        _cgroups = std::make_unique<cgroup_tree>();
+    }
+
     _epoll_fd = epoll_create1(0);
     if (_epoll_fd == -1)
     {
@@ -69,9 +85,14 @@ service::service(const options & opts, configuration & config_object)
 
     register_bus(_bus);
 
+    _network_monitor = std::make_unique<netns_monitor>(*this);
+    watch(_network_monitor->fd(), [this] { _network_monitor->process(); });
+
     config_object.install(*this);
 }
 
+service::~service() = default;
+
 void service::loop()
 {
     // Initialize to the main bus for the call before the first epoll_wait.
@@ -95,10 +116,101 @@ void service::loop()
             continue;
         }
 
-        if (epoll_wait(_epoll_fd, &event, 1, -1) == -1)
+        // Everything that was ready has been processed; announce the state changes it caused before going to
+        // sleep, so that a burst of transitions results in a single signal per entity.
+        _registry->flush(_bus);
+        _addresses->flush();
+
+        auto ready = epoll_wait(_epoll_fd, &event, 1, _run_timers());
+        if (ready == -1)
         {
             throw std::runtime_error(std::string("Failed to wait on the epoll fd: ") + strerror(errno));
         }
+
+        // Woken up by a timer; whatever its callback has started is on the main bus.
+        if (ready == 0)
+        {
+            event.data.ptr = _bus;
+        }
+
+        // Likewise for watched fds.
+        auto watch = std::find_if(
+            _watches.begin(), _watches.end(), [&](auto && watch) { return watch.get() == event.data.ptr; });
+        if (ready == 1 && watch != _watches.end())
+        {
+            (*watch)->callback();
+            event.data.ptr = _bus;
+        }
+    }
+}
+
+void service::every(std::chrono::milliseconds interval, function<void()> callback)
+{
+    _timers.push_back(
+        { .interval = interval,
+          .next = std::chrono::steady_clock::now() + interval,
+          .callback = std::move(callback) });
+}
+
+void service::after(std::chrono::milliseconds delay, function<void()> callback)
+{
+    _deadlines.emplace(std::chrono::steady_clock::now() + delay, std::move(callback));
+}
+
+int service::_run_timers()
+{
+    if (_timers.empty() && _deadlines.empty())
+    {
+        return -1;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    auto next = std::chrono::steady_clock::time_point::max();
+
+    // Taken out before being called, since the callbacks may well add deadlines of their own.
+    while (!_deadlines.empty() && _deadlines.begin()->first <= now)
+    {
+        auto callback = std::move(_deadlines.begin()->second);
+        _deadlines.erase(_deadlines.begin());
+        callback();
+    }
+
+    if (!_deadlines.empty())
+    {
+        next = _deadlines.begin()->first;
+    }
+
+    // Likewise, the callbacks may add timers, which would move the ones already there. Those are only due
+    // after a whole interval, so only the timers there were to begin with are run, and each of them is taken
+    // out for the time of its call.
+    for (std::size_t i = 0, count = _timers.size(); i < count; ++i)
+    {
+        if (_timers[i].next <= now)
+        {
+            auto callback = std::move(_timers[i].callback);
+            callback();
+            _timers[i].callback = std::move(callback);
+            _timers[i].next = now + _timers[i].interval;
+        }
+    }
+
+    for (auto && timer : _timers)
+    {
+        next = std::min(next, timer.next);
+    }
+
+    // Rounded up, so that the timer is actually due once the wait is over.
+    return std::chrono::ceil<std::chrono::milliseconds>(next - now).count();
+}
+
+void service::watch(int fd, function<void()> callback)
+{
+    auto & added = _watches.emplace_back(std::make_unique<_watch>(_watch{ fd, std::move(callback) }));
+
+    auto event = epoll_event{ .events = EPOLLIN, .data = epoll_data{ .ptr = added.get() } };
+    if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+    {
+        throw std::runtime_error(std::string("Failed to add an fd to epoll: ") + strerror(errno));
     }
 }
 
@@ -16,6 +16,13 @@
 
 #pragma once
 
+#include "function.h"
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <vector>
+
 extern "C"
 {
     struct sd_bus;
@@ -25,11 +32,17 @@ namespace nonsensed
 {
 class options;
 class configuration;
+class entity_registry;
+class netns_pool;
+class cgroup_tree;
+class netns_monitor;
+class ipam;
 
 class service
 {
 public:
     service(const options & opts, configuration & config_object);
+    ~service();
 
     void loop();
 
@@ -38,11 +51,78 @@ public:
         return _bus;
     }
 
+    const options & get_options() const
+    {
+        return _opts;
+    }
+
+    entity_registry & registry() const
+    {
+        return *_registry;
+    }
+
+    netns_pool & namespaces() const
+    {
+        return *_namespaces;
+    }
+
+    netns_monitor & network_monitor() const
+    {
+        return *_network_monitor;
+    }
+
+    ipam & addresses() const
+    {
+        return *_addresses;
+    }
+
+    // Only present in the direct cgroup mode.
+    cgroup_tree * cgroups() const
+    {
+        return _cgroups.get();
+    }
+
     void register_bus(sd_bus * bus);
     void unregister_bus(sd_bus * bus);
 
+    // Calls the callback from the loop every time the interval passes, for as long as the service exists.
+    void every(std::chrono::milliseconds interval, function<void()> callback);
+    // Calls the callback from the loop once, after the delay passes.
+    void after(std::chrono::milliseconds delay, function<void()> callback);
+    // Calls the callback from the loop every time the fd becomes readable, for as long as the service exists.
+    void watch(int fd, function<void()> callback);
+
 private:
+    struct _timer
+    {
+        std::chrono::milliseconds interval;
+        std::chrono::steady_clock::time_point next;
+        function<void()> callback;
+    };
+
+    // Runs the callbacks of the timers and deadlines that are due, and returns the number of milliseconds
+    // until the next one is, or -1 if there are none.
+    int _run_timers();
+
+    // Kept by pointer, which is what epoll hands back for them, alongside the buses.
+    struct _watch
+    {
+        int fd;
+        function<void()> callback;
+    };
+
+    const options & _opts;
+    std::unique_ptr<entity_registry> _registry;
+    std::unique_ptr<netns_pool> _namespaces;
+    std::unique_ptr<cgroup_tree> _cgroups;
+    std::unique_ptr<netns_monitor> _network_monitor;
+    std::unique_ptr<ipam> _addresses;
+
     int _epoll_fd = -1;
     sd_bus * _bus = nullptr;
+
+    std::vector<_timer> _timers;
+    std::multimap<std::chrono::steady_clock::time_point, function<void()>> _deadlines;
+    std::vector<std::unique_ptr<_watch>> _watches;
 };
 }
@@ -39,7 +39,7 @@ static const sd_bus_vtable transaction_vtable[] = {
 
     SD_BUS_METHOD("Serialize", "", "s", transaction::method_serialize, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_METHOD("Add", "sa(ss)", "", transaction::method_add, SD_BUS_VTABLE_UNPRIVILEGED),
-    SD_BUS_METHOD("Set", "s(ss)", "", transaction::method_set, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("Set", "sa(ss)", "", transaction::method_set, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_METHOD("Delete", "s", "", transaction::method_delete, SD_BUS_VTABLE_UNPRIVILEGED),
 
     SD_BUS_PROPERTY("Owner", "u", transaction::property_owner_get, 0, SD_BUS_VTABLE_PROPERTY_CONST),
@@ -121,12 +121,79 @@ METHOD_SIGNATURE(transaction, add)
 
 METHOD_SIGNATURE(transaction, set)
 {
-    co_return reply_status(-ENOSYS);
+    int status;
+
+    uid_t owner;
+    __attribute__((cleanup(sd_bus_creds_unrefp))) sd_bus_creds * creds = nullptr;
+    status = sd_bus_query_sender_creds(message, SD_BUS_CREDS_UID | SD_BUS_CREDS_AUGMENT, &creds);
+    assert(status >= 0);
+    co_yield log_and_reply_on_error(
+        sd_bus_creds_get_uid(creds, &owner), "Failed to get the originating uid of a message");
+
+    if (owner != _owner && owner != 0)
+    {
+        co_return reply_status_const(
+            -EACCES,
+            "info.griwes.nonsense.AccessDenied",
+            "You do not have permissions to modify this transaction.");
+    }
+
+    const char * name;
+
+    co_yield log_and_reply_on_error(sd_bus_message_read(message, "s", &name), "Failed to parse parameters");
+
+    set operation{ name, {} };
+
+    co_yield log_and_reply_on_error(
+        sd_bus_message_enter_container(message, SD_BUS_TYPE_ARRAY, "(ss)"), "Failed to enter container");
+
+    while ((status = sd_bus_message_enter_container(message, SD_BUS_TYPE_STRUCT, "ss")) > 0)
+    {
+        const char * parameter;
+        const char * value;
+
+        co_yield log_and_reply_on_error(
+            sd_bus_message_read(message, "ss", &parameter, &value), "Failed to parse parameters");
+
+        operation.modification.push_back({ parameter, value });
+
+        co_yield log_and_reply_on_error(sd_bus_message_exit_container(message), "Failed to exit struct");
+    }
+    co_yield log_and_reply_on_error(status, "Failed to enter struct");
+
+    co_yield log_and_reply_on_error(sd_bus_message_exit_container(message), "Failed to exit container");
+
+    _operations.push_back(operation);
+
+    co_return reply_status(sd_bus_reply_method_return(message, ""));
 }
 
 METHOD_SIGNATURE(transaction, delete)
 {
-    co_return reply_status(-ENOSYS);
+    int status;
+
+    uid_t owner;
+    __attribute__((cleanup(sd_bus_creds_unrefp))) sd_bus_creds * creds = nullptr;
+    status = sd_bus_query_sender_creds(message, SD_BUS_CREDS_UID | SD_BUS_CREDS_AUGMENT, &creds);
+    assert(status >= 0);
+    co_yield log_and_reply_on_error(
+        sd_bus_creds_get_uid(creds, &owner), "Failed to get the originating uid of a message");
+
+    if (owner != _owner && owner != 0)
+    {
+        co_return reply_status_const(
+            -EACCES,
+            "info.griwes.nonsense.AccessDenied",
+            "You do not have permissions to modify this transaction.");
+    }
+
+    const char * name;
+
+    co_yield log_and_reply_on_error(sd_bus_message_read(message, "s", &name), "Failed to parse parameters");
+
+    _operations.push_back(delete_{ name });
+
+    co_return reply_status(sd_bus_reply_method_return(message, ""));
 }
 
 PROPERTY_GET_SIGNATURE(transaction, owner)
@@ -17,8 +17,10 @@
 #include "transactions.h"
 
 #include "config.h"
+#include "fd_store.h"
 #include "log_helpers.h"
 #include "overloads.h"
+#include "reconcile.h"
 #include "service.h"
 #include "transaction.h"
 
@@ -165,12 +167,34 @@ METHOD_SIGNATURE(transactions, commit)
                      return 0;
                  },
 
-                  [&](auto &&) {
-                      sd_bus_error_set_const(
-                          error,
-                          "info.griwes.nonsense.NotImplementedYet",
-                          "A transaction containing this kind of an operation is not implemented yet.");
-                      return -ENOSYS;
+                  [&](transaction::set set) {
+                      auto [result, message] = running_copy.set(set.name, set.modification);
+                      if (result < 0)
+                      {
+                          sd_bus_error_set(
+                              error,
+                              result == -ENOENT ? "info.griwes.nonsense.NoSuchEntity"
+                                                : "info.griwes.nonsense.InvalidEntityParameters",
+                              message.c_str());
+                          return result;
+                      }
+
+                      return 0;
+                  },
+
+                  [&](transaction::delete_ removal) {
+                      auto [result, message] = running_copy.remove(removal.name);
+                      if (result < 0)
+                      {
+                          sd_bus_error_set(
+                              error,
+                              result == -ENOENT ? "info.griwes.nonsense.NoSuchEntity"
+                                                : "info.griwes.nonsense.EntityInUse",
+                              message.c_str());
+                          return result;
+                      }
+
+                      return 0;
                   } };
 
     for (auto && operation : it->second->operations())
@@ -181,10 +205,52 @@ METHOD_SIGNATURE(transactions, commit)
         }
     }
 
+    // The entities the commit removes that are running, to be started again if it gets rolled back.
+    std::vector<std::string> running_removed;
+    for (auto && name : _running_config.diff(running_copy).removed)
+    {
+        if (_running_config.try_get(name)->running())
+        {
+            running_removed.push_back(name);
+        }
+    }
+
+    auto previous_config = _running_config;
     _running_config = running_copy;
+    fd_store::store_contents(_running_config.serialize(), "running-config");
 
     _transactions.erase(it);
 
+    if (auto failure = co_await async::attempt(reconcile(&previous_config, &_running_config)))
+    {
+        // A commit that can't be applied doesn't take effect: the previous configuration is put back, and
+        // the entities are brought back in line with it as far as they can be.
+        _running_config = previous_config;
+        fd_store::store_contents(_running_config.serialize(), "running-config");
+
+        auto rollback = co_await async::attempt(
+            [&]([[maybe_unused]] coro::coroutine_handle<promise> nonsense_promise_arg) -> future {
+                co_await reconcile(&running_copy, &_running_config);
+
+                std::vector<subtask> starts;
+                for (auto && name : running_removed)
+                {
+                    starts.push_back(_running_config.try_get(name)->start());
+                }
+                co_await async::when_all(std::move(starts));
+
+                co_return unit;
+            });
+
+        if (rollback)
+        {
+            std::cerr << error_prefix() << "Failed to restore the entities to the previous configuration: "
+                      << async::describe(*rollback) << '\n';
+        }
+
+        co_return std::move(*failure);
+    }
+
     co_return reply_status(sd_bus_reply_method_return(message, ""));
 }
 
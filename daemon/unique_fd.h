@@ -0,0 +1,76 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <unistd.h>
+
+#include <utility>
+
+namespace nonsensed
+{
+class unique_fd
+{
+public:
+    unique_fd() = default;
+
+    explicit unique_fd(int fd) : _fd{ fd }
+    {
+    }
+
+    unique_fd(unique_fd && other) : _fd{ std::exchange(other._fd, -1) }
+    {
+    }
+
+    unique_fd & operator=(unique_fd && other)
+    {
+        reset(std::exchange(other._fd, -1));
+        return *this;
+    }
+
+    ~unique_fd()
+    {
+        reset();
+    }
+
+    int get() const
+    {
+        return _fd;
+    }
+
+    explicit operator bool() const
+    {
+        return _fd != -1;
+    }
+
+    int release()
+    {
+        return std::exchange(_fd, -1);
+    }
+
+    void reset(int fd = -1)
+    {
+        if (_fd != -1)
+        {
+            close(_fd);
+        }
+        _fd = fd;
+    }
+
+private:
+    int _fd = -1;
+};
+}
@@ -46,6 +46,13 @@ public:
         _cleanups.clear();
     }
 
+    // Forgets the cleanups without running them, for when whatever they would undo is taken care of
+    // otherwise.
+    void discard()
+    {
+        _cleanups.clear();
+    }
+
     void add(nonsensed::function<void()> fn)
     {
         _cleanups.push_back(std::move(fn));
@@ -0,0 +1,109 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "cleanup.h"
+#include "journal.h"
+#include "netns.h"
+#include "reconciler.h"
+
+#include "../daemon/bus_slot.h"
+#include "../daemon/common_definitions.h"
+
+#include <json.hpp>
+
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace entityd
+{
+// The state of a single entity served by this entityd process. In the default mode, there is exactly one of
+// these per process; in the multiplexed mode, a single process hosts as many as the daemon asks it to.
+struct hosted_entity
+{
+    hosted_entity(std::string name) : name(name), undo(std::move(name))
+    {
+    }
+
+    hosted_entity(const hosted_entity &) = delete;
+    hosted_entity & operator=(const hosted_entity &) = delete;
+
+    ~hosted_entity()
+    {
+        if (netns_fd != -1)
+        {
+            close(netns_fd);
+        }
+    }
+
+    std::string name;
+    std::string object_path;
+    nonsensed::dbus_slot slot;
+
+    // The network namespace of the entity, held open by fd; every operation on the entity enters it for its
+    // duration. -1 until the network component is added.
+    int netns_fd = -1;
+
+    // Whether the namespace has been created for the entity, and so goes away with it, along with everything
+    // in it.
+    bool owns_netns = false;
+
+    // Whether the namespace is bind-mounted under /var/run/netns, for tools that look namespaces up by name.
+    bool export_netns = true;
+
+    // The namespaces of the uplinks of the entity, up to the root of its tree, as given by the daemon.
+    namespace_map uplink_namespaces;
+
+    int uplink_netns(const std::string & uplink) const
+    {
+        auto it = uplink_namespaces.find(uplink);
+        if (it == uplink_namespaces.end())
+        {
+            throw std::runtime_error("The namespace of uplink " + uplink + " is not known");
+        }
+        return it->second.get();
+    }
+
+    // The namespace of the entity itself or of one of its uplinks, by the name of the entity; -1 if it's not
+    // known.
+    int netns_of(const std::string & entity) const
+    {
+        if (entity == name)
+        {
+            return netns_fd;
+        }
+
+        auto it = uplink_namespaces.find(entity);
+        return it == uplink_namespaces.end() ? -1 : it->second.get();
+    }
+
+    std::unordered_map<nonsensed::component_type, nlohmann::json> current_components;
+    // The components among the above that ApplyComponents is still in the middle of applying.
+    std::unordered_set<nonsensed::component_type> applying;
+
+    // Keeps the links, addresses and routes of the entity in place; empty until the network component is
+    // added, and for the root.
+    std::optional<reconciler> network;
+
+    cleanup cleanups;
+    // What the cleanups above and the reconciler have created, persisted for when entityd doesn't get to
+    // remove it.
+    journal undo;
+};
+}
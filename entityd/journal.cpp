@@ -0,0 +1,167 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "journal.h"
+#include "netns.h"
+#include "teardown.h"
+
+#include "../daemon/common_definitions.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+namespace entityd
+{
+namespace
+{
+    const char * kind_names[] = { "link", "route", "mount", "table" };
+
+    std::ostream & operator<<(std::ostream & os, const journal::record & rec)
+    {
+        return os << kind_names[static_cast<int>(rec.type)] << ' '
+                  << (rec.netns.empty() ? std::string("-") : rec.netns) << ' ' << rec.object << '\n';
+    }
+
+    std::vector<journal::record> read(const std::filesystem::path & path)
+    {
+        std::vector<journal::record> ret;
+
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line))
+        {
+            std::istringstream is(line);
+            std::string kind, netns, object;
+            if (!(is >> kind >> netns >> object))
+            {
+                continue;
+            }
+
+            auto it = std::find(std::begin(kind_names), std::end(kind_names), kind);
+            if (it == std::end(kind_names))
+            {
+                continue;
+            }
+
+            ret.push_back({ static_cast<journal::record::kind>(it - std::begin(kind_names)),
+                            netns == "-" ? std::string() : netns,
+                            object });
+        }
+
+        return ret;
+    }
+}
+
+journal::journal(std::string entity) : _entity(std::move(entity))
+{
+}
+
+std::filesystem::path journal::_path(const std::string & entity)
+{
+    return std::filesystem::path(nonsensed::entityd_journal_directory) / entity / "journal";
+}
+
+void journal::add(record rec, bool connection)
+{
+    (connection ? _connection : _base).push_back(std::move(rec));
+    _write();
+}
+
+void journal::drop_connection()
+{
+    _connection.clear();
+    _write();
+}
+
+std::vector<journal::record> journal::records() const
+{
+    auto ret = _base;
+    ret.insert(ret.end(), _connection.begin(), _connection.end());
+    return ret;
+}
+
+void journal::discard()
+{
+    _base.clear();
+    _connection.clear();
+
+    std::error_code ec;
+    std::filesystem::remove(_path(_entity), ec);
+    std::filesystem::remove(_path(_entity).parent_path(), ec);
+}
+
+// The journal is small, so it is rewritten in full every time, and swapped in with a rename so that it is
+// never seen half-written.
+void journal::_write()
+{
+    auto path = _path(_entity);
+    std::filesystem::create_directories(path.parent_path());
+
+    auto temporary = path;
+    temporary += ".new";
+
+    {
+        std::ofstream out(temporary, std::ios::trunc);
+        for (auto && rec : _base)
+        {
+            out << rec;
+        }
+        for (auto && rec : _connection)
+        {
+            out << rec;
+        }
+
+        if (!out.flush())
+        {
+            throw std::runtime_error("Failed to write the journal of entity " + _entity);
+        }
+    }
+
+    std::filesystem::rename(temporary, path);
+}
+
+void journal::collect(const std::string & entity, const namespace_map & namespaces)
+{
+    auto path = _path(entity);
+    if (!std::filesystem::exists(path))
+    {
+        return;
+    }
+
+    // What belonged to the entity's own namespace is removed too, since the namespace may have been one that
+    // outlives the entity, and if it hasn't, there is nothing to look it up by anymore anyway.
+    auto plan = plan_teardown(entity, read(path), false);
+
+    nonsensed::unique_fd opened;
+    execute(plan, [&](const std::string & netns_name) {
+        if (auto it = namespaces.find(netns_name); it != namespaces.end())
+        {
+            return it->second.get();
+        }
+
+        // If the namespace is gone, it took everything in it along.
+        opened.reset(open(("/var/run/netns/nonsense:" + netns_name).c_str(), O_RDONLY | O_CLOEXEC));
+        return opened.get();
+    });
+
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+    std::filesystem::remove(path.parent_path(), ec);
+}
+}
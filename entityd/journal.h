@@ -0,0 +1,83 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "netns.h"
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace entityd
+{
+// A write-ahead record of the kernel objects entityd creates for an entity outside of its own network
+// namespace, or that keep that namespace alive. Every record is written before the object is created, so that
+// if entityd dies without running its cleanups, the next entityd to start the entity (or the daemon, when it
+// boots) can find and remove whatever was left behind.
+//
+// Objects that live only inside of a namespace that gets torn down with the entity are not recorded; removing
+// the namespace removes them.
+class journal
+{
+public:
+    struct record
+    {
+        enum class kind
+        {
+            link,
+            route,
+            mount,
+            table
+        };
+
+        kind type;
+        // The name of the entity whose namespace the object lives in; unused for mounts.
+        std::string netns;
+        // The name of the link, the prefix of the route, the path of the mount, or the name of the nftables
+        // table.
+        std::string object;
+    };
+
+    journal(std::string entity);
+
+    journal(const journal &) = delete;
+    journal & operator=(const journal &) = delete;
+
+    // Records belonging to the connection of the entity to its uplink are dropped on their own when the
+    // connection is redone.
+    void add(record rec, bool connection = false);
+    void drop_connection();
+
+    std::vector<record> records() const;
+
+    // Forgets everything; called once all the recorded objects have been removed.
+    void discard();
+
+    // Removes everything recorded in the journal of an entity that has been left behind, and then the journal
+    // itself, with a teardown_plan. The namespaces of entities are looked up among the given ones first, and
+    // then under /var/run/netns.
+    static void collect(const std::string & entity, const namespace_map & namespaces = {});
+
+private:
+    static std::filesystem::path _path(const std::string & entity);
+    void _write();
+
+    std::string _entity;
+    std::vector<record> _base;
+    std::vector<record> _connection;
+};
+}
@@ -15,24 +15,46 @@
  */
 
 #include "cleanup.h"
-
+#include "hosted_entity.h"
+#include "journal.h"
+#include "netlink.h"
+#include "netns.h"
+#include "nftables.h"
+#include "reconciler.h"
+#include "router.h"
+#include "scheduler.h"
+#include "switch.h"
+#include "teardown.h"
+
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
 #include <filesystem>
 #include <iostream>
-#include <sstream>
+#include <memory>
+#include <optional>
 #include <unordered_map>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 #include "../daemon/common_definitions.h"
 #include "../daemon/log_helpers.h"
 
 #include <systemd/sd-bus-vtable.h>
 #include <systemd/sd-bus.h>
+#include <systemd/sd-daemon.h>
 #include <systemd/sd-id128.h>
 
 #include <unistd.h>
 
+#include <arpa/inet.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/mount.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -40,82 +62,84 @@
 
 sd_bus * bus;
 
-std::string name;
-std::unordered_map<nonsensed::component_type, nlohmann::json> current_components;
+// The socket over which a restarted daemon sends a new bus connection to replace the one to its previous
+// instance; -1 if entityd wasn't given one.
+int control_fd = -1;
 
-entityd::cleanup cleanups;
-entityd::cleanup connection_cleanups;
+// Whether this process serves many entities (started as `nonsense-entityd --multiplexed`), or just the one
+// named on its command line.
+bool multiplexed = false;
 
-void annotated_system(std::string command)
-{
-    std::cerr << "system(" << command << ")\n";
-    auto ret = system(command.c_str());
-    if (ret != 0)
-    {
-        std::cerr << "system(" << command << ") failed";
-        throw std::runtime_error("system(" + command + ") failed");
-    }
-}
+// The network namespace entityd was started in. Entities never leave the process in their own namespaces
+// after an operation on them finishes; see entityd::netns_guard.
+int host_netns_fd = -1;
 
-void setup_interfaces()
-{
-    entityd::cleanup clean;
+std::unordered_map<std::string, std::unique_ptr<entityd::hosted_entity>> entities;
 
-    annotated_system("ip link add nu-" + name + " type veth peer nd-" + name);
-    clean.add([] { system(("ip link del nu-" + name).c_str()); });
-    annotated_system("ip link set nu-" + name + " up");
+// Entities that have been shut down while handling a message; their objects are removed once the handler
+// returns, since a slot cannot be released from within its own callback.
+std::vector<std::string> released_entities;
 
-    cleanups.add(std::move(clean));
-}
-
-void setup_bridge()
+void setup_nft(entityd::hosted_entity & self, nonsensed::network_role role)
 {
     entityd::cleanup clean;
 
-    annotated_system("ip link add nb-" + name + " type bridge");
-    clean.add([] { system(("ip link del nb-" + name).c_str()); });
-    annotated_system("ip link set nb-" + name + " up");
-    annotated_system("ip link set nu-" + name + " master nb-" + name);
+    auto & name = self.name;
+    auto & component = self.current_components.at(nonsensed::component_type::network);
 
-    cleanups.add(std::move(clean));
-}
+    self.undo.add({ entityd::journal::record::kind::table, name, entityd::nftables::ruleset_table });
 
-void setup_nft()
-{
-    entityd::cleanup clean;
+    if (role == nonsensed::network_role::router)
+    {
+        entityd::router::load_ruleset(name, component.value("offload", false));
+    }
+    else
+    {
+        entityd::switch_::load_ruleset();
+    }
 
-    assert(0);
+    clean.add([] {
+        try
+        {
+            entityd::nftables::socket socket;
+            socket.delete_table(entityd::nftables::ruleset_table);
+            socket.commit();
+        }
+        catch (std::exception &)
+        {
+        }
+    });
 
-    cleanups.add(std::move(clean));
+    self.cleanups.add(std::move(clean));
 }
 
-std::string nth_address_in_subnet(std::string_view net_value, int n, bool include_mask = true)
+// The nth address of the subnet, as an address of a link in it.
+entityd::netlink::interface_address nth_address(const entityd::netlink::route & subnet, std::uint32_t n)
 {
-    auto sep = net_value.find('/');
-    assert(sep != std::string_view::npos);
-
-    auto network = net_value.substr(0, sep);
-    auto mask = net_value.substr(sep + 1);
-    assert(mask == "24" && "this logic needs updating when network addresses other than /24 are supported");
-
-    auto last_octet = network.rfind('.');
-    auto prefix = network.substr(0, last_octet);
-
-    std::ostringstream os;
-    os << prefix << '.' << n;
-    if (include_mask)
-    {
-        os << '/' << mask;
-    }
+    return { .address = htonl(ntohl(subnet.destination) + n), .prefix_length = subnet.prefix_length };
+}
 
-    return os.str();
+entityd::netlink::interface_address parse_interface_address(const std::string & address)
+{
+    auto parsed = entityd::netlink::parse_interface_address(address);
+    assert(parsed);
+    return *parsed;
 }
 
-void connect()
+// The network state of an entity with a network component. Every entity other than the root is connected to
+// its uplink by a veth pair, with nu-<name> in its own namespace and nd-<name> in the namespace of the
+// uplink. A switch is routed to from its uplink: nd- gets the first address of its subnet, its bridge,
+// nb-<name>, gets the second one, and the switches further up route the subnet towards it. Clients and
+// routers are ports of the bridge of their uplink instead, with the address in its subnet that the daemon has
+// leased to them; see nonsensed::ipam.
+entityd::network_state desired_network_state(entityd::hosted_entity & self)
 {
-    entityd::cleanup clean;
+    using link = entityd::network_state::link;
 
-    auto & component = current_components.at(nonsensed::component_type::network);
+    auto & name = self.name;
+    // A copy, since looking things up below inserts nulls into the tree, and the stored component must stay
+    // as it was received for reconfigure_network to compare against.
+    auto component = self.current_components.at(nonsensed::component_type::network);
 
     auto get = [](auto && component, auto name) -> auto &
     {
@@ -123,100 +147,166 @@ void connect()
     };
 
     auto & uplink_name = get(component, ":uplink-name");
+    auto default_route = entityd::netlink::route{ .destination = 0, .prefix_length = 0 };
 
-    annotated_system("ip link set nd-" + name + " netns nonsense:" + uplink_name);
-    clean.add([=] {
-        system(
-            ("ip netns exec nonsense:" + uplink_name + " ip link set nd-" + name + " netns nonsense:" + name)
-                .c_str());
-    });
+    entityd::network_state state;
+    auto & own = state.namespaces[name];
+    auto & uplink = state.namespaces[uplink_name];
+
+    auto interface = link{
+        .name = "nu-" + name, .type = link::kind::veth, .peer = "nd-" + name, .peer_netns = uplink_name
+    };
+    auto downlink = link{ .name = "nd-" + name, .type = link::kind::veth_peer };
+
+    if (component["role"] == "router")
+    {
+        interface.group = entityd::router::uplink_group;
+    }
+
+    if (component["uplink"]["role"] == "router")
+    {
+        downlink.group = entityd::router::downlink_group;
+    }
+
+    auto subnet_of = [](auto && component) {
+        auto subnet = entityd::netlink::parse_route(component["address"].template get_ref<std::string &>());
+        assert(subnet);
+        return *subnet;
+    };
 
     if (component["role"] == "switch")
     {
-        auto & net = get(component, "address");
-        auto downlink_address = nth_address_in_subnet(net, 1, true);
+        auto net = subnet_of(component);
+        auto gateway = nth_address(net, 1);
 
-        annotated_system(
-            "ip netns exec nonsense:" + uplink_name + " ip addr add " + downlink_address + " dev nd-" + name);
-        clean.add([=] {
-            system(("ip netns exec nonsense:" + uplink_name + " ip addr del " + downlink_address + " dev nd-"
-                    + name)
-                       .c_str());
-        });
+        interface.master = "nb-" + name;
+        own.links.push_back(
+            { .name = "nb-" + name, .type = link::kind::bridge, .addresses = { nth_address(net, 2) } });
+        own.routes.push_back({ default_route, gateway.address });
+        downlink.addresses.push_back(gateway);
 
-        auto * uplink = &component["uplink"];
-        while (!uplink->is_null() && (*uplink)["role"] == "switch")
+        auto * uplink_component = &component["uplink"];
+        while (!uplink_component->is_null() && (*uplink_component)["role"] == "switch")
         {
-            auto & uplink_name = get(*uplink, ":uplink-name");
-            auto & uplink_net = get(*uplink, "address");
-            auto uplink_uplink_address = nth_address_in_subnet(uplink_net, 2, false);
+            auto & uplink_name = get(*uplink_component, ":uplink-name");
+            auto via = nth_address(subnet_of(*uplink_component), 2);
 
-            annotated_system(
-                "ip netns exec nonsense:" + uplink_name + " ip route add " + net + " via "
-                + uplink_uplink_address);
-            clean.add(
-                [=] { system(("ip netns exec nonsense:" + uplink_name + " ip route del " + net).c_str()); });
+            state.namespaces[uplink_name].routes.push_back({ net, via.address });
 
-            uplink = &((*uplink)["uplink"]);
+            uplink_component = &((*uplink_component)["uplink"]);
         }
+    }
 
-        annotated_system("ip netns exec nonsense:" + uplink_name + " ip link set nd-" + name + " up");
-        clean.add([=] {
-            system(("ip netns exec nonsense:" + uplink_name + " ip link set nd-" + name + " down").c_str());
-        });
+    else
+    {
+        // Handed out by the daemon, from the subnet of the switch the entity is connected to.
+        auto assigned = component.find(":assigned-address");
+        if (assigned == component.end())
+        {
+            throw std::runtime_error(
+                "No address has been assigned to " + name + " in the subnet of its uplink.");
+        }
 
-        auto gateway = nth_address_in_subnet(net, 1, false);
-        auto assigned_address = nth_address_in_subnet(net, 2, true);
+        auto gateway = nth_address(subnet_of(component["uplink"]), 1);
 
-        annotated_system("ip addr add " + assigned_address + " dev nb-" + name);
-        clean.add([=] { system(("ip addr del " + assigned_address + " dev nb-" + name).c_str()); });
-        annotated_system("ip route add default via " + gateway);
-        clean.add([=] { system("ip route del default"); });
+        interface.addresses.push_back(parse_interface_address(assigned->get<std::string>()));
+        own.routes.push_back({ default_route, gateway.address });
+        downlink.master = "nb-" + uplink_name;
     }
 
-    else
+    own.links.insert(own.links.begin(), std::move(interface));
+    uplink.links.push_back(std::move(downlink));
+
+    return state;
+}
+
+// Records what a network state leaves behind outside of what the entity takes with it when it goes away: the
+// links in its own namespace, unless only the connection is being redone, and everything in the namespaces
+// of its uplinks, which makes up the connection.
+void record_network_state(
+    entityd::hosted_entity & self,
+    const entityd::network_state & state,
+    bool connection_only)
+{
+    for (auto && [netns_name, namespace_state] : state.namespaces)
     {
-        annotated_system(
-            "ip netns exec nonsense:" + uplink_name + " ip link set nd-" + name + " master nb-"
-            + uplink_name);
+        auto connection = netns_name != self.name;
+        if (!connection && connection_only)
+        {
+            continue;
+        }
 
-        // auto & assigned_address = get(component, ":assigned-address");
+        for (auto && link : namespace_state.links)
+        {
+            self.undo.add({ entityd::journal::record::kind::link, netns_name, link.name }, connection);
+        }
+
+        if (!connection)
+        {
+            continue;
+        }
+
+        for (auto && route : namespace_state.routes)
+        {
+            auto prefix = entityd::netlink::to_string(route.target);
+            self.undo.add({ entityd::journal::record::kind::route, netns_name, prefix }, true);
+        }
+    }
+}
 
-        auto & uplink_net = get(component["uplink"], "address");
+// Brings the network of the entity to the state its network component asks for. Failures of the first pass
+// are fatal, since nothing would have noticed anything to fix yet; later ones are retried whenever one of the
+// namespaces changes.
+void connect(
+    entityd::hosted_entity & self,
+    bool connection_only,
+    entityd::reconciler::netns_lookup netns_of)
+{
+    auto state = desired_network_state(self);
+    record_network_state(self, state, connection_only);
 
-        auto gateway = nth_address_in_subnet(uplink_net, 1, false);
-        // FIXME: this is wrong, need to "dhcp" in the main process
-        auto assigned_address = nth_address_in_subnet(uplink_net, 3, true);
+    if (!self.network)
+    {
+        self.network.emplace(self.name);
+    }
+    self.network->set_desired(std::move(state));
 
-        annotated_system("ip netns exec nonsense:" + uplink_name + " ip link set nd-" + name + " up");
-        clean.add([=] {
-            system(("ip netns exec nonsense:" + uplink_name + " ip link set nd-" + name + " down").c_str());
-        });
+    auto failures = self.network->reconcile(std::move(netns_of));
+    if (!failures.empty())
+    {
+        throw std::runtime_error("Failed to set up the network of " + self.name + ": " + failures.front());
+    }
 
-        annotated_system("ip addr add " + assigned_address + " dev nu-" + name);
-        clean.add([=] { system(("ip addr del " + assigned_address + " dev nu-" + name).c_str()); });
-        annotated_system("ip route add default via " + gateway);
-        clean.add([=] { system("ip route del default"); });
+    // The flowtable of the uplink is not part of the state, so a pass doesn't put the link back into it.
+    auto component = self.current_components.at(nonsensed::component_type::network);
+    if (component["uplink"]["role"] == "router" && component["uplink"].value("offload", false))
+    {
+        auto uplink_netns = self.uplink_netns(component[":uplink-name"].get<std::string>());
+        entityd::router::offload_downlink(uplink_netns, "nd-" + self.name);
     }
+}
 
-    connection_cleanups.add(std::move(clean));
+void connect(entityd::hosted_entity & self)
+{
+    connect(self, false, [&](const std::string & entity) { return self.netns_of(entity); });
 }
 
-void add_network(nlohmann::json & component, sd_bus_message * message, sd_bus_error * error)
-try
+// Enters the namespace of the entity, creating it first if the entity is to have one of its own, and keeps it
+// open and, if asked to, mounted; the process is back in the host namespace once this returns.
+void setup_namespace(entityd::hosted_entity & self, nlohmann::json & component, int pooled_netns)
 {
     entityd::cleanup clean;
 
-    std::cerr << component << '\n';
-
-    auto role = component["role"].get_ref<std::string &>();
-    auto role_enum = nonsensed::known_network_roles.at(role);
+    auto & name = self.name;
 
-    current_components.emplace(nonsensed::component_type::network, component);
+    // A previous entityd serving this entity may have died before cleaning up after it.
+    entityd::journal::collect(name, self.uplink_namespaces);
 
     auto & external = component["external"];
     auto & default_ = component["default"];
 
+    entityd::netns_guard guard{ host_netns_fd };
+
     if (external.is_boolean() && external == true)
     {
         auto path = [&] {
@@ -231,27 +321,93 @@ try
         auto fd = open(("/var/run/netns/" + name).c_str(), 0);
         assert(fd != -1);
         setns(fd, CLONE_NEWNET);
+        close(fd);
     }
     else if (!default_.is_boolean() || default_ == false)
     {
-        assert(unshare(CLONE_NEWNET) == 0);
+        self.owns_netns = true;
+
+        if (pooled_netns != -1)
+        {
+            if (setns(pooled_netns, CLONE_NEWNET) == -1)
+            {
+                throw std::runtime_error(
+                    std::string("Failed to enter a pooled network namespace: ") + strerror(errno));
+            }
+        }
+        else
+        {
+            assert(unshare(CLONE_NEWNET) == 0);
+            // Namespaces from the pool of the daemon come with this already done.
+            entityd::netlink::socket socket;
+            socket.set_link_up("lo");
+            socket.commit_or_throw();
+
+            auto role = nonsensed::known_network_roles.at(component["role"].get_ref<std::string &>());
+            for (auto && [path, value] : nonsensed::role_sysctls(role))
+            {
+                auto full_path = "/proc/sys/" + std::string(path);
+                nonsensed::unique_fd sysctl{ open(full_path.c_str(), O_WRONLY | O_CLOEXEC) };
+                if (!sysctl || write(sysctl.get(), value.data(), value.size()) != ssize_t(value.size()))
+                {
+                    throw std::runtime_error("Failed to set " + full_path + ": " + strerror(errno));
+                }
+            }
+        }
     }
 
-    auto full_path = "/var/run/netns/nonsense:" + name;
+    self.netns_fd = entityd::open_current_netns();
 
-    std::filesystem::create_directories("/var/run/netns");
-    umount(full_path.c_str());
-    assert(open(full_path.c_str(), O_CREAT) != -1);
-    auto ret = mount("/proc/self/ns/net", full_path.c_str(), nullptr, MS_BIND, nullptr);
-    if (ret != 0)
+    // Without the mount, the namespace is kept alive by the fd above, and by the copy of it the daemon holds
+    // on to and hands out through GetNamespaceFd.
+    if (self.export_netns)
     {
-        perror("Failed to mount the network namespace under /var/run/netns");
-        std::abort();
+        auto full_path = "/var/run/netns/nonsense:" + name;
+
+        self.undo.add({ entityd::journal::record::kind::mount, "", full_path });
+        std::filesystem::create_directories("/var/run/netns");
+        umount(full_path.c_str());
+        assert(open(full_path.c_str(), O_CREAT) != -1);
+        auto ret = mount("/proc/thread-self/ns/net", full_path.c_str(), nullptr, MS_BIND, nullptr);
+        if (ret != 0)
+        {
+            perror("Failed to mount the network namespace under /var/run/netns");
+            std::abort();
+        }
+
+        clean.add([=] { umount(full_path.c_str()); });
     }
 
-    clean.add([=] { umount(full_path.c_str()); });
+    self.cleanups.add(std::move(clean));
+}
 
-    cleanups.add(std::move(clean));
+// A single step of applying a component, announced with the Progress signal before it is taken.
+struct apply_step
+{
+    const char * name;
+    nonsensed::function<void()> run;
+};
+
+std::vector<apply_step> network_steps(
+    entityd::hosted_entity & self,
+    nlohmann::json component,
+    nonsensed::unique_fd pooled_netns)
+{
+    auto role_enum = nonsensed::known_network_roles.at(component["role"].get_ref<std::string &>());
+
+    self.current_components.emplace(nonsensed::component_type::network, component);
+
+    std::vector<apply_step> steps;
+    steps.push_back(
+        { "namespace",
+          [&self, component = std::move(component), pooled_netns = std::move(pooled_netns)]() mutable {
+              setup_namespace(self, component, pooled_netns.get());
+          } });
+
+    auto ruleset = [&self, role_enum] {
+        entityd::netns_guard guard{ self.netns_fd };
+        setup_nft(self, role_enum);
+    };
 
     switch (role_enum)
     {
@@ -262,128 +418,750 @@ try
             assert(0);
 
         case nonsensed::network_role::router:
-            setup_interfaces();
-            setup_nft();
-            connect();
+            steps.push_back({ "ruleset", ruleset });
+            steps.push_back({ "connection", [&self] { connect(self); } });
             break;
 
         case nonsensed::network_role::switch_:
-            setup_interfaces();
-            setup_bridge();
-            connect();
+            if (self.current_components.at(nonsensed::component_type::network).value("notrack", false))
+            {
+                steps.push_back({ "ruleset", ruleset });
+            }
+            steps.push_back({ "connection", [&self] { connect(self); } });
             break;
 
         case nonsensed::network_role::client:
-            setup_interfaces();
-            connect();
+            steps.push_back({ "connection", [&self] { connect(self); } });
             break;
     }
+
+    return steps;
 }
-catch (...)
+
+// Takes the steps of applying a component one after another, giving way to the rest of the main loop in
+// between them. If one of them fails, the component is not considered active; whatever the steps before it
+// have set up is only removed when the entity is shut down.
+nonsensed::subtask apply_component(
+    entityd::hosted_entity & self,
+    std::string type_name,
+    nonsensed::component_type type,
+    std::vector<apply_step> steps)
 {
-    current_components.erase(nonsensed::component_type::network);
-    assert(!"really need to reply to the message here...");
+    using namespace nonsensed;
+
+    return [&self, type_name = std::move(type_name), type, steps = std::move(steps)](
+               [[maybe_unused]] coro::coroutine_handle<promise> nonsense_promise_arg) mutable -> future {
+        for (auto it = steps.begin(); it != steps.end(); ++it)
+        {
+            if (it != steps.begin())
+            {
+                co_await entityd::yield(self);
+            }
+
+            int ret = sd_bus_emit_signal(
+                bus,
+                self.object_path.c_str(),
+                "info.griwes.nonsense.Entityd",
+                "Progress",
+                "ss",
+                type_name.c_str(),
+                it->name);
+            if (ret < 0)
+            {
+                std::cerr << error_prefix() << "Failed to announce the progress of " << self.name << ": "
+                          << strerror(-ret) << '\n';
+            }
+
+            std::optional<std::string> failure;
+            try
+            {
+                it->run();
+            }
+            catch (std::exception & ex)
+            {
+                failure = ex.what();
+            }
+
+            if (failure)
+            {
+                self.current_components.erase(type);
+                self.applying.erase(type);
+
+                co_return reply_error_format(
+                    "info.griwes.nonsense.FailedToApply",
+                    "Failed to apply the %s component (%s): %s",
+                    type_name.c_str(),
+                    it->name,
+                    failure->c_str());
+            }
+        }
+
+        self.applying.erase(type);
+        co_return unit;
+    };
+}
+
+// Reads an "a{sh}" map of entity names to their namespaces; the fds are duplicated, since the ones in the
+// message are closed along with it.
+int read_namespaces(sd_bus_message * message, entityd::namespace_map & namespaces)
+{
+    int ret = sd_bus_message_enter_container(message, SD_BUS_TYPE_ARRAY, "{sh}");
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    const char * name;
+    int fd;
+
+    while ((ret = sd_bus_message_read(message, "{sh}", &name, &fd)) > 0)
+    {
+        nonsensed::unique_fd copy{ fcntl(fd, F_DUPFD_CLOEXEC, 3) };
+        if (!copy)
+        {
+            return -errno;
+        }
+        namespaces.insert_or_assign(name, std::move(copy));
+    }
+
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    return sd_bus_message_exit_container(message);
+}
+
+nonsensed::future apply_components(
+    entityd::hosted_entity & self,
+    sd_bus_message * message,
+    [[maybe_unused]] sd_bus_error * error)
+{
+    using namespace nonsensed;
+
+    std::vector<std::tuple<std::string, component_type, nlohmann::json>> components;
+
+    co_yield log_and_reply_on_error(
+        sd_bus_message_enter_container(message, SD_BUS_TYPE_ARRAY, "(ss)"),
+        "Failed to parse ApplyComponents");
+
+    const char * type_str;
+    const char * config;
+
+    int ret;
+
+    // Everything is checked before anything is applied, so that a bad request leaves the entity untouched.
+    while ((ret = sd_bus_message_read(message, "(ss)", &type_str, &config)) > 0)
+    {
+        auto it = known_components.find(type_str);
+        if (it == known_components.end())
+        {
+            co_return reply_error_format(
+                "info.griwes.nonsense.UnknownComponent", "Unknown component type: %s.", type_str);
+        }
+
+        auto type = it->second;
+        auto is_same_type = [&](auto && component) { return std::get<1>(component) == type; };
+
+        if (self.current_components.contains(type) || std::ranges::any_of(components, is_same_type))
+        {
+            co_return reply_error_const(
+                "info.griwes.nonsense.ComponentAlreadyActive",
+                "Tried to add an already active component to an entity");
+        }
+
+        components.emplace_back(type_str, type, nlohmann::json::parse(config));
+    }
+
+    co_yield log_and_reply_on_error(ret, "Failed to parse ApplyComponents");
+    co_yield log_and_reply_on_error(
+        sd_bus_message_exit_container(message), "Failed to parse ApplyComponents");
+
+    // The namespaces of the uplinks of the entity, and, under the name of the entity itself, possibly one the
+    // daemon has prepared ahead of time for its network component.
+    entityd::namespace_map namespaces;
+    co_yield log_and_reply_on_error(read_namespaces(message, namespaces), "Failed to parse ApplyComponents");
+    co_yield log_and_reply_on_error(
+        sd_bus_message_read(message, "b", &self.export_netns), "Failed to parse ApplyComponents");
+
+    auto pooled = namespaces.extract(self.name);
+    self.uplink_namespaces = std::move(namespaces);
+
+    // Components don't depend on one another, so they are all applied at the same time, and the reply is sent
+    // once all of them are done.
+    std::vector<subtask> tasks;
+    for (auto && [type_name, type, component] : components)
+    {
+        switch (type)
+        {
+            case component_type::network:
+                self.applying.insert(type);
+                tasks.push_back(apply_component(
+                    self,
+                    type_name,
+                    type,
+                    network_steps(
+                        self, std::move(component), pooled ? std::move(pooled.mapped()) : unique_fd())));
+                break;
+
+            case component_type::resources:
+                break;
+        }
+    }
+
+    co_await async::when_all(std::move(tasks));
+
+    co_return reply_status(sd_bus_reply_method_return(message, "b", true));
+}
+
+int handle_apply_components(sd_bus_message * message, void * userdata, sd_bus_error * error)
+{
+    apply_components(*static_cast<entityd::hosted_entity *>(userdata), message, error);
+    return 1;
 }
 
-int add_component(sd_bus_message * message, void *, sd_bus_error * error)
+nonsensed::reconfigure_result reconfigure_network(
+    entityd::hosted_entity & self,
+    nlohmann::json & component,
+    entityd::namespace_map namespaces)
 {
-    static std::unordered_map<std::string_view, nonsensed::component_type> known_components = {
-        { "network", nonsensed::component_type::network }
+    auto & current = self.current_components.at(nonsensed::component_type::network);
+
+    if (current == component)
+    {
+        return nonsensed::reconfigure_result::unchanged;
+    }
+
+    // These decide which namespace the entity lives in, what devices it has, and what ruleset it loads;
+    // changing any of them means building the entity from scratch.
+    for (auto key : { "role", "external", "external_name", "default", "offload", "notrack" })
+    {
+        if (current.value(key, nlohmann::json()) != component.value(key, nlohmann::json()))
+        {
+            return nonsensed::reconfigure_result::restart_required;
+        }
+    }
+
+    // Everything else is the connection to the uplink, which can be redone while keeping the namespace, the
+    // devices inside of it, and whatever is connected to them from downstream. The reconciler moves nd- over
+    // to the new uplink, and removes routes from the namespaces that no longer need them, which it finds
+    // through the namespaces the connection has been made with.
+    self.undo.drop_connection();
+    auto previous_namespaces = std::exchange(self.uplink_namespaces, std::move(namespaces));
+    current = component;
+
+    auto netns_of = [&](const std::string & entity) {
+        auto fd = self.netns_of(entity);
+        if (auto it = previous_namespaces.find(entity); fd == -1 && it != previous_namespaces.end())
+        {
+            fd = it->second.get();
+        }
+        return fd;
     };
 
+    switch (nonsensed::known_network_roles.at(component["role"].get_ref<std::string &>()))
+    {
+        case nonsensed::network_role::root:
+        case nonsensed::network_role::interface:
+            break;
+
+        case nonsensed::network_role::router:
+        case nonsensed::network_role::switch_:
+        case nonsensed::network_role::client:
+            connect(self, true, netns_of);
+            break;
+    }
+
+    return nonsensed::reconfigure_result::reconfigured;
+}
+
+int reconfigure_component(sd_bus_message * message, void * userdata, sd_bus_error * error)
+{
+    auto & self = *static_cast<entityd::hosted_entity *>(userdata);
+
     char * type_str;
     char * config;
 
     int ret = sd_bus_message_read(message, "ss", &type_str, &config);
-    assert(ret >= 0); // FIXME
+    if (ret < 0)
+    {
+        return ret;
+    }
 
-    auto it = known_components.find(type_str);
-    assert(it != known_components.end()); // FIXME
-    auto type = it->second;
+    auto it = nonsensed::known_components.find(type_str);
+    if (it == nonsensed::known_components.end())
+    {
+        sd_bus_error_setf(
+            error, "info.griwes.nonsense.UnknownComponent", "Unknown component type: %s.", type_str);
+        return sd_bus_reply_method_error(message, error);
+    }
 
-    if (current_components.contains(type))
+    if (!self.current_components.contains(it->second) || self.applying.contains(it->second))
     {
         sd_bus_error_set_const(
             error,
-            "info.griwes.nonsense.ComponentAlreadyActive",
-            "Tried to add an already active component to an entity");
+            "info.griwes.nonsense.ComponentNotActive",
+            "Tried to reconfigure a component that is not active in an entity, or is still being applied");
         return sd_bus_reply_method_error(message, error);
     }
 
+    entityd::namespace_map namespaces;
+    ret = read_namespaces(message, namespaces);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
     auto component = nlohmann::json::parse(config);
+    auto result = nonsensed::reconfigure_result::unchanged;
 
-    switch (type)
+    try
     {
-        case nonsensed::component_type::network:
-            add_network(component, message, error);
-            break;
+        switch (it->second)
+        {
+            case nonsensed::component_type::network:
+                result = reconfigure_network(self, component, std::move(namespaces));
+                break;
+
+            case nonsensed::component_type::resources:
+                break;
+        }
+    }
+    catch (std::exception & ex)
+    {
+        sd_bus_error_set(error, "info.griwes.nonsense.FailedToReconfigure", ex.what());
+        return sd_bus_reply_method_error(message, error);
     }
 
-    return sd_bus_reply_method_return(message, "b", true);
+    return sd_bus_reply_method_return(message, "y", static_cast<std::uint8_t>(result));
+}
+
+void shutdown(entityd::hosted_entity & self)
+{
+    entityd::cancel_yielded(
+        self,
+        nonsensed::reply_error_const(
+            "info.griwes.nonsense.EntityShutDown", "The entity was shut down before the request was done"));
+
+    // Instead of running the cleanups one by one, what the journal has recorded is removed with as few
+    // requests as the kernel allows; everything else the cleanups would undo goes away along with it.
+    // The reconciler goes first, so that nothing puts back what the teardown removes.
+    self.network.reset();
+
+    auto plan = entityd::plan_teardown(self.name, self.undo.records(), self.owns_netns);
+    entityd::execute(plan, [&](const std::string & netns_name) { return self.netns_of(netns_name); });
+
+    self.cleanups.discard();
+    self.undo.discard();
 }
 
 void shutdown()
 {
-    connection_cleanups.run();
-    cleanups.run();
+    for (auto && [name, entity] : entities)
+    {
+        shutdown(*entity);
+    }
+}
+
+int get_namespace_fd(sd_bus_message * message, void * userdata, sd_bus_error * error)
+{
+    auto & self = *static_cast<entityd::hosted_entity *>(userdata);
+
+    if (self.netns_fd == -1)
+    {
+        sd_bus_error_set_const(
+            error, "info.griwes.nonsense.NoNamespace", "The entity does not have a network namespace");
+        return sd_bus_reply_method_error(message, error);
+    }
+
+    return sd_bus_reply_method_return(message, "h", self.netns_fd);
 }
 
-int handle_shutdown(sd_bus_message * msg, void *, sd_bus_error *)
+int handle_shutdown(sd_bus_message * msg, void * userdata, sd_bus_error *)
 {
-    shutdown();
+    auto & self = *static_cast<entityd::hosted_entity *>(userdata);
+
+    shutdown(self);
     sd_bus_reply_method_return(msg, "");
-    std::exit(0);
+
+    if (!multiplexed)
+    {
+        std::exit(0);
+    }
+
+    released_entities.push_back(self.name);
+    return 1;
 }
 
 static const sd_bus_vtable entityd_vtable[] = {
     SD_BUS_VTABLE_START(0),
 
-    SD_BUS_METHOD("AddComponent", "ss", "b", add_component, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD(
+        "ApplyComponents", "a(ss)a{sh}b", "b", handle_apply_components, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("ReconfigureComponent", "ssa{sh}", "y", reconfigure_component, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("GetNamespaceFd", "", "h", get_namespace_fd, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_METHOD("Shutdown", "", "", handle_shutdown, SD_BUS_VTABLE_UNPRIVILEGED),
 
+    SD_BUS_SIGNAL("Progress", "ss", 0),
+
+    SD_BUS_VTABLE_END
+};
+
+void install(entityd::hosted_entity & self)
+{
+    self.slot.reset();
+
+    int ret = sd_bus_add_object_vtable(
+        bus, &self.slot, self.object_path.c_str(), "info.griwes.nonsense.Entityd", entityd_vtable, &self);
+    if (ret < 0)
+    {
+        throw std::runtime_error(std::string("Failed to install the Entityd interface: ") + strerror(-ret));
+    }
+}
+
+entityd::hosted_entity & host(std::string name, std::string object_path)
+{
+    auto [it, inserted] = entities.emplace(name, std::make_unique<entityd::hosted_entity>(name));
+    auto & self = *it->second;
+
+    if (!inserted)
+    {
+        return self;
+    }
+
+    self.object_path = std::move(object_path);
+
+    try
+    {
+        install(self);
+    }
+    catch (...)
+    {
+        entities.erase(it);
+        throw;
+    }
+
+    return self;
+}
+
+int handle_host(sd_bus_message * message, void *, sd_bus_error * error)
+{
+    const char * name;
+
+    int ret = sd_bus_message_read(message, "s", &name);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    char * path;
+    ret = sd_bus_path_encode("/info/griwes/nonsense/entityd", name, &path);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    std::string object_path = path;
+    free(path);
+
+    try
+    {
+        auto & self = host(name, object_path);
+        return sd_bus_reply_method_return(message, "o", self.object_path.c_str());
+    }
+    catch (std::exception & ex)
+    {
+        sd_bus_error_set(error, "info.griwes.nonsense.FailedToHost", ex.what());
+        return sd_bus_reply_method_error(message, error);
+    }
+}
+
+int handle_list(sd_bus_message * message, void *, sd_bus_error *)
+{
+    sd_bus_message * reply = nullptr;
+
+    int ret = sd_bus_message_new_method_return(message, &reply);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    ret = sd_bus_message_open_container(reply, SD_BUS_TYPE_ARRAY, "(so)");
+
+    for (auto it = entities.begin(); ret >= 0 && it != entities.end(); ++it)
+    {
+        ret = sd_bus_message_append(reply, "(so)", it->first.c_str(), it->second->object_path.c_str());
+    }
+
+    if (ret >= 0)
+    {
+        ret = sd_bus_message_close_container(reply);
+    }
+
+    if (ret >= 0)
+    {
+        ret = sd_bus_send(nullptr, reply, nullptr);
+    }
+
+    sd_bus_message_unref(reply);
+    return ret;
+}
+
+static const sd_bus_vtable entityd_host_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+
+    SD_BUS_METHOD("Host", "s", "o", handle_host, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("List", "", "a(so)", handle_list, SD_BUS_VTABLE_UNPRIVILEGED),
+
     SD_BUS_VTABLE_END
 };
 
+nonsensed::dbus_slot host_slot;
+
+void install_host()
+{
+    host_slot.reset();
+
+    int ret = sd_bus_add_object_vtable(
+        bus, &host_slot, "/", "info.griwes.nonsense.EntitydHost", entityd_host_vtable, nullptr);
+    if (ret < 0)
+    {
+        throw std::runtime_error(
+            std::string("Failed to install the EntitydHost interface: ") + strerror(-ret));
+    }
+}
+
+sd_bus * start_bus(int fd)
+{
+    sd_bus * new_bus;
+
+    int ret = sd_bus_new(&new_bus);
+    if (ret < 0)
+    {
+        throw std::runtime_error(std::string("Failed to allocate a bus: ") + strerror(-ret));
+    }
+
+    if ((ret = sd_bus_set_fd(new_bus, fd, fd)) < 0
+        || (ret = sd_bus_set_server(new_bus, true, SD_ID128_NULL)) < 0 || (ret = sd_bus_start(new_bus)) < 0)
+    {
+        sd_bus_unref(new_bus);
+        throw std::runtime_error(std::string("Failed to start the bus: ") + strerror(-ret));
+    }
+
+    return new_bus;
+}
+
+// Switches over to a connection sent by a restarted daemon over the control socket. The daemon keeps the
+// previous connection open in the file descriptor store of its service until this is done, so the entities
+// never find themselves without a daemon.
+void reconnect()
+{
+    char byte;
+    iovec iov{ .iov_base = &byte, .iov_len = 1 };
+
+    alignas(cmsghdr) char control_buffer[CMSG_SPACE(sizeof(int))] = {};
+    msghdr message{ .msg_iov = &iov,
+                    .msg_iovlen = 1,
+                    .msg_control = control_buffer,
+                    .msg_controllen = sizeof(control_buffer) };
+
+    auto size = recvmsg(control_fd, &message, MSG_CMSG_CLOEXEC);
+    if (size == -1)
+    {
+        throw std::runtime_error(
+            std::string("Failed to receive from the control socket: ") + strerror(errno));
+    }
+
+    if (size == 0)
+    {
+        // Neither the daemon nor its service manager holds the control socket anymore; nobody is going to
+        // talk to the entities again.
+        throw std::runtime_error("The control socket has been closed.");
+    }
+
+    auto header = CMSG_FIRSTHDR(&message);
+    if (!header || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+    {
+        throw std::runtime_error("Received a message without a connection on the control socket.");
+    }
+
+    int fd;
+    std::memcpy(&fd, CMSG_DATA(header), sizeof(int));
+
+    auto new_bus = start_bus(fd);
+
+    // The slots hold references to the previous bus; they are dropped while installing the objects again.
+    std::swap(bus, new_bus);
+
+    if (multiplexed)
+    {
+        install_host();
+    }
+
+    for (auto && [name, entity] : entities)
+    {
+        install(*entity);
+    }
+
+    sd_bus_close(new_bus);
+    sd_bus_unref(new_bus);
+
+    pid_t pid = getpid();
+    if (write(control_fd, &pid, sizeof(pid)) != sizeof(pid))
+    {
+        throw std::runtime_error(std::string("Failed to acknowledge a new connection: ") + strerror(errno));
+    }
+}
+
+// Runs a pass for every entity whose namespaces have changed in a way that may have undone its network.
+void reconcile_changed()
+{
+    for (auto && [name, entity] : entities)
+    {
+        if (!entity->network || !entity->network->notified())
+        {
+            continue;
+        }
+
+        try
+        {
+            for (auto && failure : entity->network->reconcile(
+                     [&](const std::string & netns_name) { return entity->netns_of(netns_name); }))
+            {
+                std::cerr << nonsensed::error_prefix() << "Failed to fix the network of " << name << ": "
+                          << failure << '\n';
+            }
+        }
+        catch (std::exception & ex)
+        {
+            std::cerr << nonsensed::error_prefix() << "Failed to fix the network of " << name << ": "
+                      << ex.what() << '\n';
+        }
+    }
+}
+
+void wait()
+{
+    int events = sd_bus_get_events(bus);
+    if (events < 0)
+    {
+        throw std::runtime_error(std::string("Failed to get bus events: ") + strerror(-events));
+    }
+
+    std::vector<pollfd> fds{ { .fd = sd_bus_get_fd(bus), .events = static_cast<short>(events) } };
+    if (control_fd != -1)
+    {
+        fds.push_back({ .fd = control_fd, .events = POLLIN });
+    }
+
+    for (auto && [name, entity] : entities)
+    {
+        if (entity->network)
+        {
+            for (auto fd : entity->network->fds())
+            {
+                fds.push_back({ .fd = fd, .events = POLLIN });
+            }
+        }
+    }
+
+    std::uint64_t until;
+    int ret = sd_bus_get_timeout(bus, &until);
+    if (ret < 0)
+    {
+        throw std::runtime_error(std::string("Failed to get bus timeout: ") + strerror(-ret));
+    }
+
+    int timeout = -1;
+    if (until != UINT64_MAX)
+    {
+        auto now = std::chrono::duration_cast<std::chrono::microseconds>(
+                       std::chrono::steady_clock::now().time_since_epoch())
+                       .count();
+        timeout = until > std::uint64_t(now) ? (until - now + 999) / 1000 : 0;
+    }
+
+    if (poll(fds.data(), fds.size(), timeout) == -1 && errno != EINTR)
+    {
+        throw std::runtime_error(std::string("Failed to poll: ") + strerror(errno));
+    }
+
+    reconcile_changed();
+
+    if (control_fd != -1 && fds[1].revents)
+    {
+        reconnect();
+    }
+}
+
 int main(int argc, char ** argv)
 try
 {
-    name = argv[1];
-    std::cerr << name << '\n';
+    if (argc >= 2 && argv[1] == std::string_view("--collect"))
+    {
+        for (int i = 2; i < argc; ++i)
+        {
+            entityd::journal::collect(argv[i]);
+        }
+        return 0;
+    }
 
-    sd_bus_new(&bus);
+    if (argc != 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <entity name> | --multiplexed | --collect <entity name>...\n";
+        return 1;
+    }
 
-    sd_bus_set_fd(bus, STDIN_FILENO, STDIN_FILENO);
-    sd_bus_set_server(bus, true, SD_ID128_NULL);
+    multiplexed = argv[1] == std::string_view("--multiplexed");
+    std::cerr << argv[1] << '\n';
 
-    sd_bus_start(bus);
+    host_netns_fd = entityd::open_current_netns();
 
-    int ret;
+    if (sd_is_socket(nonsensed::entityd_control_fd, AF_UNIX, SOCK_STREAM, 0) > 0)
+    {
+        control_fd = nonsensed::entityd_control_fd;
+        fcntl(control_fd, F_SETFD, FD_CLOEXEC);
+    }
 
-    ret =
-        sd_bus_add_object_vtable(bus, nullptr, "/", "info.griwes.nonsense.Entityd", entityd_vtable, nullptr);
-    if (ret < 0)
+    bus = start_bus(STDIN_FILENO);
+
+    if (multiplexed)
     {
-        throw std::runtime_error(std::string("Failed to install the Entityd interface: ") + strerror(-ret));
+        install_host();
+    }
+    else
+    {
+        host(argv[1], "/");
     }
 
     while (true)
     {
-        ret = sd_bus_process(bus, nullptr);
+        int ret = sd_bus_process(bus, nullptr);
         if (ret < 0)
         {
             throw std::runtime_error(std::string("Failed to process bus: ") + strerror(-ret));
         }
 
+        for (auto && name : released_entities)
+        {
+            entities.erase(name);
+        }
+        released_entities.clear();
+
         if (ret > 0)
         {
             continue;
         }
 
-        ret = sd_bus_wait(bus, -1);
-        if (ret < 0)
+        // Requests in progress only continue once the bus has nothing more to deliver, and never block it for
+        // longer than a single one of their steps.
+        if (entityd::has_yielded())
         {
-            throw std::runtime_error(std::string("Failed to wait on bus: ") + strerror(-ret));
+            entityd::resume_yielded();
+            continue;
         }
+
+        wait();
     }
 }
 catch (std::exception & ex)
@@ -0,0 +1,770 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "netlink.h"
+#include "netns.h"
+
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/veth.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+
+namespace entityd
+{
+namespace netlink
+{
+    std::optional<std::uint32_t> parse_address(std::string_view address)
+    {
+        in_addr parsed;
+        if (inet_pton(AF_INET, std::string(address).c_str(), &parsed) != 1)
+        {
+            return std::nullopt;
+        }
+        return parsed.s_addr;
+    }
+
+    std::optional<interface_address> parse_interface_address(std::string_view address)
+    {
+        auto separator = address.find('/');
+        if (separator == std::string_view::npos)
+        {
+            return std::nullopt;
+        }
+
+        auto length_string = address.substr(separator + 1);
+
+        int length;
+        auto [end, error] = std::from_chars(length_string.begin(), length_string.end(), length);
+        if (error != std::errc() || end != length_string.end() || length < 0 || length > 32)
+        {
+            return std::nullopt;
+        }
+
+        auto parsed = parse_address(address.substr(0, separator));
+        if (!parsed)
+        {
+            return std::nullopt;
+        }
+
+        return interface_address{ .address = *parsed, .prefix_length = length };
+    }
+
+    std::optional<route> parse_route(std::string_view prefix)
+    {
+        auto parsed = parse_interface_address(prefix);
+        if (!parsed)
+        {
+            return std::nullopt;
+        }
+
+        auto length = parsed->prefix_length;
+        auto mask = length == 0 ? 0 : htonl(~std::uint32_t() << (32 - length));
+        return route{ .destination = parsed->address & mask, .prefix_length = length };
+    }
+
+    std::string to_string(const route & route)
+    {
+        char buffer[INET_ADDRSTRLEN];
+        in_addr address{ .s_addr = route.destination };
+        inet_ntop(AF_INET, &address, buffer, sizeof(buffer));
+        return buffer + ("/" + std::to_string(route.prefix_length));
+    }
+
+    namespace
+    {
+        int open_socket()
+        {
+            auto fd = ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+            if (fd == -1)
+            {
+                throw std::runtime_error(std::string("Failed to open a netlink socket: ") + strerror(errno));
+            }
+
+            sockaddr_nl address{ .nl_family = AF_NETLINK };
+            if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1)
+            {
+                auto error = errno;
+                close(fd);
+                throw std::runtime_error(std::string("Failed to bind a netlink socket: ") + strerror(error));
+            }
+
+            return fd;
+        }
+    }
+
+    socket::socket() : _fd(open_socket())
+    {
+    }
+
+    socket::socket(int netns)
+    {
+        netns_guard guard{ netns };
+        _fd = open_socket();
+    }
+
+    socket::~socket()
+    {
+        close(_fd);
+    }
+
+    template<typename Header, typename Handler>
+    bool socket::_dump_once(std::uint16_t type, const Header & header, Handler && handler)
+    {
+        struct
+        {
+            nlmsghdr message;
+            Header header;
+        } request{ .message = { .nlmsg_len = NLMSG_LENGTH(sizeof(Header)),
+                                .nlmsg_type = type,
+                                .nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+                                .nlmsg_seq = ++_sequence },
+                   .header = header };
+
+        if (send(_fd, &request, request.message.nlmsg_len, 0) == -1)
+        {
+            throw std::runtime_error(
+                std::string("Failed to send a netlink dump request: ") + strerror(errno));
+        }
+
+        alignas(nlmsghdr) char buffer[32768];
+        auto consistent = true;
+
+        while (true)
+        {
+            auto size = recv(_fd, buffer, sizeof(buffer), 0);
+            if (size == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                // Some of the replies were dropped; the rest of the dump is still read, so that it doesn't
+                // get in the way of the next request.
+                if (errno == ENOBUFS)
+                {
+                    consistent = false;
+                    continue;
+                }
+
+                throw std::runtime_error(std::string("Failed to receive a netlink dump: ") + strerror(errno));
+            }
+
+            for (auto message = reinterpret_cast<nlmsghdr *>(buffer); NLMSG_OK(message, size);
+                 message = NLMSG_NEXT(message, size))
+            {
+                if (message->nlmsg_seq != _sequence)
+                {
+                    continue;
+                }
+
+                // The kernel sets this on the messages of a dump during which the dumped objects changed, in
+                // which case some of them may have been missed or seen twice.
+                if (message->nlmsg_flags & NLM_F_DUMP_INTR)
+                {
+                    consistent = false;
+                }
+
+                switch (message->nlmsg_type)
+                {
+                    case NLMSG_DONE:
+                        return consistent;
+
+                    case NLMSG_ERROR:
+                    {
+                        auto error = static_cast<nlmsgerr *>(NLMSG_DATA(message));
+                        throw std::runtime_error(
+                            std::string("Netlink dump failed: ") + strerror(-error->error));
+                    }
+
+                    default:
+                        handler(message);
+                }
+            }
+        }
+    }
+
+    template<typename Header, typename Parser>
+    auto socket::_dump(std::uint16_t type, const Header & header, Parser && parse)
+    {
+        std::vector<typename std::invoke_result_t<Parser &, nlmsghdr *>::value_type> ret;
+
+        auto handler = [&](nlmsghdr * message) {
+            if (auto parsed = parse(message))
+            {
+                ret.push_back(std::move(*parsed));
+            }
+        };
+
+        while (!_dump_once(type, header, handler))
+        {
+            ret.clear();
+        }
+
+        return ret;
+    }
+
+    std::vector<link> socket::dump_links()
+    {
+        return _dump(RTM_GETLINK, ifinfomsg{ .ifi_family = AF_UNSPEC }, [](nlmsghdr * message) {
+            auto info = static_cast<ifinfomsg *>(NLMSG_DATA(message));
+            auto length = static_cast<int>(IFLA_PAYLOAD(message));
+
+            link parsed{ .index = info->ifi_index, .up = (info->ifi_flags & IFF_UP) != 0 };
+
+            for (auto attribute = IFLA_RTA(info); RTA_OK(attribute, length);
+                 attribute = RTA_NEXT(attribute, length))
+            {
+                switch (attribute->rta_type)
+                {
+                    case IFLA_IFNAME:
+                        parsed.name = static_cast<const char *>(RTA_DATA(attribute));
+                        break;
+
+                    case IFLA_MASTER:
+                        std::memcpy(&parsed.master, RTA_DATA(attribute), sizeof(parsed.master));
+                        break;
+
+                    case IFLA_GROUP:
+                        std::memcpy(&parsed.group, RTA_DATA(attribute), sizeof(parsed.group));
+                        break;
+                }
+            }
+
+            return std::optional(std::move(parsed));
+        });
+    }
+
+    namespace
+    {
+        // The address of the link itself is IFA_LOCAL; IFA_ADDRESS is the same, except on point-to-point
+        // links, where it's the address of the other end, and it's only there alone without IFA_LOCAL.
+        std::optional<address_entry> parse_address_message(nlmsghdr * message)
+        {
+            auto info = static_cast<ifaddrmsg *>(NLMSG_DATA(message));
+            auto length = static_cast<int>(IFA_PAYLOAD(message));
+
+            if (info->ifa_family != AF_INET)
+            {
+                return std::nullopt;
+            }
+
+            std::optional<std::uint32_t> local;
+            std::optional<std::uint32_t> address;
+
+            for (auto attribute = IFA_RTA(info); RTA_OK(attribute, length);
+                 attribute = RTA_NEXT(attribute, length))
+            {
+                std::uint32_t value;
+                std::memcpy(&value, RTA_DATA(attribute), sizeof(value));
+
+                switch (attribute->rta_type)
+                {
+                    case IFA_LOCAL:
+                        local = value;
+                        break;
+
+                    case IFA_ADDRESS:
+                        address = value;
+                        break;
+                }
+            }
+
+            if (!local && !address)
+            {
+                return std::nullopt;
+            }
+
+            return address_entry{ .link = static_cast<int>(info->ifa_index),
+                                  .address = { .address = local ? *local : *address,
+                                               .prefix_length = info->ifa_prefixlen } };
+        }
+
+        // Only unicast routes of the main table are of interest.
+        std::optional<route_entry> parse_route_message(nlmsghdr * message)
+        {
+            auto info = static_cast<rtmsg *>(NLMSG_DATA(message));
+            auto length = static_cast<int>(RTM_PAYLOAD(message));
+
+            std::uint32_t table = info->rtm_table;
+            route_entry ret{ .target = { .destination = 0, .prefix_length = info->rtm_dst_len } };
+
+            for (auto attribute = RTM_RTA(info); RTA_OK(attribute, length);
+                 attribute = RTA_NEXT(attribute, length))
+            {
+                switch (attribute->rta_type)
+                {
+                    case RTA_TABLE:
+                        std::memcpy(&table, RTA_DATA(attribute), sizeof(table));
+                        break;
+
+                    case RTA_DST:
+                        std::memcpy(&ret.target.destination, RTA_DATA(attribute), sizeof(std::uint32_t));
+                        break;
+
+                    case RTA_GATEWAY:
+                        std::memcpy(&ret.gateway, RTA_DATA(attribute), sizeof(ret.gateway));
+                        break;
+                }
+            }
+
+            if (info->rtm_family != AF_INET || table != RT_TABLE_MAIN || info->rtm_type != RTN_UNICAST)
+            {
+                return std::nullopt;
+            }
+
+            return ret;
+        }
+    }
+
+    std::vector<address_entry> socket::dump_addresses()
+    {
+        return _dump(RTM_GETADDR, ifaddrmsg{ .ifa_family = AF_INET }, parse_address_message);
+    }
+
+    std::vector<route_entry> socket::dump_routes()
+    {
+        return _dump(RTM_GETROUTE, rtmsg{ .rtm_family = AF_INET }, parse_route_message);
+    }
+
+    // Sends the batch, and collects the acknowledgements of all of its requests; any other replies to them
+    // are passed to the handler. If some of the replies are lost, whether the requests that are yet to be
+    // acknowledged have succeeded is unknown, so they are reported as failed with ENOBUFS.
+    template<typename Handler>
+    std::vector<int> socket::_commit(Handler && handler)
+    {
+        std::vector<int> ret(_batch_sequences.size(), ENOBUFS);
+        if (_batch.empty())
+        {
+            return ret;
+        }
+
+        auto batch = std::move(_batch);
+        auto sequences = std::move(_batch_sequences);
+        _batch.clear();
+        _batch_sequences.clear();
+        _batch_descriptions.clear();
+
+        if (send(_fd, batch.data(), batch.size(), 0) == -1)
+        {
+            throw std::runtime_error(std::string("Failed to send a netlink batch: ") + strerror(errno));
+        }
+
+        alignas(nlmsghdr) char buffer[8192];
+
+        for (std::size_t acknowledged = 0; acknowledged < sequences.size();)
+        {
+            auto size = recv(_fd, buffer, sizeof(buffer), 0);
+            if (size == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                // The acknowledgements that are still to come are skipped by the following requests, since
+                // they don't match their sequence numbers.
+                if (errno == ENOBUFS)
+                {
+                    break;
+                }
+
+                throw std::runtime_error(
+                    std::string("Failed to receive netlink acknowledgements: ") + strerror(errno));
+            }
+
+            for (auto message = reinterpret_cast<nlmsghdr *>(buffer); NLMSG_OK(message, size);
+                 message = NLMSG_NEXT(message, size))
+            {
+                auto it = std::find(sequences.begin(), sequences.end(), message->nlmsg_seq);
+                if (it == sequences.end())
+                {
+                    continue;
+                }
+
+                if (message->nlmsg_type != NLMSG_ERROR)
+                {
+                    handler(message);
+                    continue;
+                }
+
+                ret[it - sequences.begin()] = -static_cast<nlmsgerr *>(NLMSG_DATA(message))->error;
+                ++acknowledged;
+            }
+        }
+
+        return ret;
+    }
+
+    std::optional<int> socket::find_link(const std::string & name)
+    {
+        assert(_batch.empty());
+
+        _queue("find link " + name, RTM_GETLINK, ifinfomsg{ .ifi_family = AF_UNSPEC });
+        _queue_attribute(IFLA_IFNAME, name);
+
+        std::optional<int> ret;
+        auto results = _commit([&](nlmsghdr * message) {
+            if (message->nlmsg_type == RTM_NEWLINK)
+            {
+                ret = static_cast<ifinfomsg *>(NLMSG_DATA(message))->ifi_index;
+            }
+        });
+
+        if (results.front() != 0 && results.front() != ENODEV)
+        {
+            throw std::runtime_error("Failed to find link " + name + ": " + strerror(results.front()));
+        }
+
+        return ret;
+    }
+
+    template<typename Header>
+    void socket::_queue(std::string description, std::uint16_t type, const Header & header, int flags)
+    {
+        auto offset = _batch.size();
+        _batch.resize(offset + NLMSG_SPACE(sizeof(Header)));
+        _last_message = offset;
+
+        auto message = reinterpret_cast<nlmsghdr *>(_batch.data() + offset);
+        *message = { .nlmsg_len = NLMSG_LENGTH(sizeof(Header)),
+                     .nlmsg_type = type,
+                     .nlmsg_flags = static_cast<std::uint16_t>(NLM_F_REQUEST | NLM_F_ACK | flags),
+                     .nlmsg_seq = ++_sequence };
+        std::memcpy(NLMSG_DATA(message), &header, sizeof(Header));
+
+        _batch_sequences.push_back(_sequence);
+        _batch_descriptions.push_back(std::move(description));
+    }
+
+    // Appends an attribute to the last queued message. A nested attribute is started by appending it with
+    // just its fixed header (if any), and finished with _end_nested once everything inside of it is appended.
+    std::size_t socket::_queue_attribute(std::uint16_t type, const void * data, std::size_t size)
+    {
+        auto attribute_offset = _batch.size();
+        _batch.resize(attribute_offset + RTA_SPACE(size));
+
+        auto attribute = reinterpret_cast<rtattr *>(_batch.data() + attribute_offset);
+        attribute->rta_type = type;
+        attribute->rta_len = RTA_LENGTH(size);
+        if (size)
+        {
+            std::memcpy(RTA_DATA(attribute), data, size);
+        }
+
+        auto message = reinterpret_cast<nlmsghdr *>(_batch.data() + _last_message);
+        message->nlmsg_len = _batch.size() - _last_message;
+
+        return attribute_offset;
+    }
+
+    void socket::_queue_attribute(std::uint16_t type, const std::string & value)
+    {
+        _queue_attribute(type, value.c_str(), value.size() + 1);
+    }
+
+    void socket::_end_nested(std::size_t attribute_offset)
+    {
+        auto attribute = reinterpret_cast<rtattr *>(_batch.data() + attribute_offset);
+        attribute->rta_len = _batch.size() - attribute_offset;
+    }
+
+    void socket::create_veth(const std::string & name, const std::string & peer, int peer_netns)
+    {
+        // Brought up right away, the same way `ip link add ... up` does it.
+        _queue(
+            "create veth " + name,
+            RTM_NEWLINK,
+            ifinfomsg{ .ifi_family = AF_UNSPEC, .ifi_flags = IFF_UP, .ifi_change = IFF_UP },
+            NLM_F_CREATE | NLM_F_EXCL);
+        _queue_attribute(IFLA_IFNAME, name);
+
+        auto info = _queue_attribute(IFLA_LINKINFO, nullptr, 0);
+        _queue_attribute(IFLA_INFO_KIND, "veth");
+        auto data = _queue_attribute(IFLA_INFO_DATA, nullptr, 0);
+
+        ifinfomsg peer_header{ .ifi_family = AF_UNSPEC };
+        auto peer_info = _queue_attribute(VETH_INFO_PEER, &peer_header, sizeof(peer_header));
+        _queue_attribute(IFLA_IFNAME, peer);
+        std::uint32_t fd = peer_netns;
+        _queue_attribute(IFLA_NET_NS_FD, &fd, sizeof(fd));
+
+        _end_nested(peer_info);
+        _end_nested(data);
+        _end_nested(info);
+    }
+
+    void socket::create_bridge(const std::string & name)
+    {
+        _queue(
+            "create bridge " + name,
+            RTM_NEWLINK,
+            ifinfomsg{ .ifi_family = AF_UNSPEC, .ifi_flags = IFF_UP, .ifi_change = IFF_UP },
+            NLM_F_CREATE | NLM_F_EXCL);
+        _queue_attribute(IFLA_IFNAME, name);
+
+        auto info = _queue_attribute(IFLA_LINKINFO, nullptr, 0);
+        _queue_attribute(IFLA_INFO_KIND, "bridge");
+        _end_nested(info);
+    }
+
+    void socket::set_link_up(const std::string & name, bool up)
+    {
+        ifinfomsg header{ .ifi_family = AF_UNSPEC, .ifi_change = IFF_UP };
+        if (up)
+        {
+            header.ifi_flags = IFF_UP;
+        }
+
+        _queue((up ? "set up " : "set down ") + name, RTM_NEWLINK, header);
+        _queue_attribute(IFLA_IFNAME, name);
+    }
+
+    void socket::set_link_master(const std::string & name, int master_index)
+    {
+        _queue("set master of " + name, RTM_NEWLINK, ifinfomsg{ .ifi_family = AF_UNSPEC });
+        _queue_attribute(IFLA_IFNAME, name);
+        std::uint32_t master = master_index;
+        _queue_attribute(IFLA_MASTER, &master, sizeof(master));
+    }
+
+    void socket::set_link_group(const std::string & name, std::uint32_t group)
+    {
+        _queue("set group of " + name, RTM_NEWLINK, ifinfomsg{ .ifi_family = AF_UNSPEC });
+        _queue_attribute(IFLA_IFNAME, name);
+        _queue_attribute(IFLA_GROUP, &group, sizeof(group));
+    }
+
+    void socket::move_link(const std::string & name, int netns)
+    {
+        _queue("move link " + name, RTM_NEWLINK, ifinfomsg{ .ifi_family = AF_UNSPEC });
+        _queue_attribute(IFLA_IFNAME, name);
+        std::uint32_t fd = netns;
+        _queue_attribute(IFLA_NET_NS_FD, &fd, sizeof(fd));
+    }
+
+    void socket::delete_link(int index)
+    {
+        _queue(
+            "delete link " + std::to_string(index),
+            RTM_DELLINK,
+            ifinfomsg{ .ifi_family = AF_UNSPEC, .ifi_index = index });
+    }
+
+    void socket::delete_link(const std::string & name)
+    {
+        _queue("delete link " + name, RTM_DELLINK, ifinfomsg{ .ifi_family = AF_UNSPEC });
+        _queue_attribute(IFLA_IFNAME, name);
+    }
+
+    namespace
+    {
+        ifaddrmsg address_header(int index, const interface_address & address)
+        {
+            return { .ifa_family = AF_INET,
+                     .ifa_prefixlen = static_cast<unsigned char>(address.prefix_length),
+                     .ifa_scope = RT_SCOPE_UNIVERSE,
+                     .ifa_index = static_cast<std::uint32_t>(index) };
+        }
+    }
+
+    void socket::add_address(int index, const interface_address & address)
+    {
+        _queue(
+            "add address to link " + std::to_string(index),
+            RTM_NEWADDR,
+            address_header(index, address),
+            NLM_F_CREATE | NLM_F_EXCL);
+        _queue_attribute(IFA_LOCAL, &address.address, sizeof(address.address));
+        _queue_attribute(IFA_ADDRESS, &address.address, sizeof(address.address));
+    }
+
+    void socket::delete_address(int index, const interface_address & address)
+    {
+        _queue(
+            "delete address from link " + std::to_string(index), RTM_DELADDR, address_header(index, address));
+        _queue_attribute(IFA_LOCAL, &address.address, sizeof(address.address));
+        _queue_attribute(IFA_ADDRESS, &address.address, sizeof(address.address));
+    }
+
+    void socket::add_route(const route & target, std::uint32_t gateway)
+    {
+        _queue(
+            "add route",
+            RTM_NEWROUTE,
+            rtmsg{ .rtm_family = AF_INET,
+                   .rtm_dst_len = static_cast<unsigned char>(target.prefix_length),
+                   .rtm_table = RT_TABLE_MAIN,
+                   .rtm_protocol = RTPROT_BOOT,
+                   .rtm_scope = RT_SCOPE_UNIVERSE,
+                   .rtm_type = RTN_UNICAST },
+            NLM_F_CREATE | NLM_F_EXCL);
+        if (target.prefix_length != 0)
+        {
+            _queue_attribute(RTA_DST, &target.destination, sizeof(target.destination));
+        }
+        _queue_attribute(RTA_GATEWAY, &gateway, sizeof(gateway));
+    }
+
+    void socket::delete_route(const route & target)
+    {
+        _queue(
+            "delete route",
+            RTM_DELROUTE,
+            rtmsg{ .rtm_family = AF_INET,
+                   .rtm_dst_len = static_cast<unsigned char>(target.prefix_length),
+                   .rtm_table = RT_TABLE_MAIN,
+                   .rtm_scope = RT_SCOPE_NOWHERE });
+        _queue_attribute(RTA_DST, &target.destination, sizeof(target.destination));
+    }
+
+    std::vector<int> socket::commit()
+    {
+        return _commit([](nlmsghdr *) {});
+    }
+
+    std::vector<std::string> socket::commit_and_report()
+    {
+        auto descriptions = _batch_descriptions;
+        auto results = commit();
+
+        std::vector<std::string> ret;
+        for (std::size_t i = 0; i < results.size(); ++i)
+        {
+            if (results[i] != 0)
+            {
+                ret.push_back("Netlink request to " + descriptions[i] + " failed: " + strerror(results[i]));
+            }
+        }
+
+        return ret;
+    }
+
+    void socket::commit_or_throw()
+    {
+        auto failures = commit_and_report();
+        if (!failures.empty())
+        {
+            throw std::runtime_error(failures.front());
+        }
+    }
+
+    monitor::monitor(int netns)
+    {
+        netns_guard guard{ netns };
+
+        _fd = ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+        if (_fd == -1)
+        {
+            throw std::runtime_error(std::string("Failed to open a netlink socket: ") + strerror(errno));
+        }
+
+        sockaddr_nl address{ .nl_family = AF_NETLINK,
+                             .nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE };
+        if (bind(_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1)
+        {
+            auto error = errno;
+            close(_fd);
+            throw std::runtime_error(std::string("Failed to bind a netlink monitor: ") + strerror(error));
+        }
+    }
+
+    monitor::~monitor()
+    {
+        close(_fd);
+    }
+
+    std::vector<notification> monitor::read()
+    {
+        std::vector<notification> ret;
+        alignas(nlmsghdr) char buffer[32768];
+
+        while (true)
+        {
+            auto size = recv(_fd, buffer, sizeof(buffer), 0);
+            if (size == -1)
+            {
+                if (errno == ENOBUFS)
+                {
+                    ret.push_back({ .type = notification::kind::overflow });
+                    continue;
+                }
+
+                if (errno == EAGAIN || errno == EINTR)
+                {
+                    return ret;
+                }
+
+                throw std::runtime_error(
+                    std::string("Failed to read netlink notifications: ") + strerror(errno));
+            }
+
+            for (auto message = reinterpret_cast<nlmsghdr *>(buffer); NLMSG_OK(message, size);
+                 message = NLMSG_NEXT(message, size))
+            {
+                switch (message->nlmsg_type)
+                {
+                    case RTM_NEWLINK:
+                    case RTM_DELLINK:
+                    {
+                        auto info = static_cast<ifinfomsg *>(NLMSG_DATA(message));
+                        auto length = static_cast<int>(IFLA_PAYLOAD(message));
+                        notification link{ .type = notification::kind::link, .link = info->ifi_index };
+
+                        for (auto attribute = IFLA_RTA(info); RTA_OK(attribute, length);
+                             attribute = RTA_NEXT(attribute, length))
+                        {
+                            if (attribute->rta_type == IFLA_IFNAME)
+                            {
+                                link.link_name = static_cast<const char *>(RTA_DATA(attribute));
+                            }
+                        }
+
+                        ret.push_back(std::move(link));
+                        break;
+                    }
+
+                    case RTM_NEWADDR:
+                    case RTM_DELADDR:
+                        if (auto address = parse_address_message(message))
+                        {
+                            ret.push_back({ .type = notification::kind::address, .link = address->link });
+                        }
+                        break;
+
+                    case RTM_NEWROUTE:
+                    case RTM_DELROUTE:
+                        if (auto route = parse_route_message(message))
+                        {
+                            ret.push_back({ .type = notification::kind::route, .target = route->target });
+                        }
+                        break;
+                }
+            }
+        }
+    }
+}
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace entityd
+{
+namespace netlink
+{
+    struct link
+    {
+        int index;
+        std::string name;
+        bool up = false;
+        // The index of the master of the link, or 0 if it has none.
+        int master = 0;
+        std::uint32_t group = 0;
+    };
+
+    // An IPv4 route in the main routing table, identified by its destination.
+    struct route
+    {
+        // In network byte order, with the bits past the prefix length cleared.
+        std::uint32_t destination;
+        int prefix_length;
+
+        bool operator==(const route &) const = default;
+    };
+
+    // An IPv4 address assigned to a link, together with the length of the prefix of its subnet.
+    struct interface_address
+    {
+        // In network byte order.
+        std::uint32_t address;
+        int prefix_length;
+
+        bool operator==(const interface_address &) const = default;
+    };
+
+    // A route in the main routing table, together with its gateway, which is 0 for routes without one.
+    struct route_entry
+    {
+        route target;
+        std::uint32_t gateway = 0;
+
+        bool operator==(const route_entry &) const = default;
+    };
+
+    struct address_entry
+    {
+        int link;
+        interface_address address;
+    };
+
+    // Parses an address of the form "a.b.c.d", into network byte order.
+    std::optional<std::uint32_t> parse_address(std::string_view address);
+    // Parses an address of the form "a.b.c.d/n".
+    std::optional<interface_address> parse_interface_address(std::string_view address);
+    // Parses a prefix of the form "a.b.c.d/n".
+    std::optional<route> parse_route(std::string_view prefix);
+    // Formats a route the way parse_route expects it.
+    std::string to_string(const route & route);
+
+    // A NETLINK_ROUTE socket in the network namespace the calling thread is in when it is created.
+    class socket
+    {
+    public:
+        socket();
+        // Opens the socket in the given network namespace instead; -1 means the current one.
+        explicit socket(int netns);
+        ~socket();
+
+        socket(const socket &) = delete;
+        socket & operator=(const socket &) = delete;
+
+        std::vector<link> dump_links();
+        std::vector<address_entry> dump_addresses();
+        std::vector<route_entry> dump_routes();
+        // Must not be called while there are requests queued.
+        std::optional<int> find_link(const std::string & name);
+
+        // Requests are queued, and then sent together in a single batch by commit, which returns the error
+        // (as a positive errno value, or 0 for success) of every request, in order. The kernel handles them
+        // in order too, so a request can rely on the ones queued before it, except for the indices of links
+        // they create.
+        void create_veth(const std::string & name, const std::string & peer, int peer_netns);
+        void create_bridge(const std::string & name);
+        void set_link_up(const std::string & name, bool up = true);
+        void set_link_master(const std::string & name, int master_index);
+        void set_link_group(const std::string & name, std::uint32_t group);
+        void move_link(const std::string & name, int netns);
+        void delete_link(int index);
+        void delete_link(const std::string & name);
+        void add_address(int index, const interface_address & address);
+        void delete_address(int index, const interface_address & address);
+        // A route to the destination via a gateway; a prefix length of 0 makes it the default route.
+        void add_route(const route & target, std::uint32_t gateway);
+        void delete_route(const route & target);
+        std::vector<int> commit();
+        // Commits, and returns a description of the failure of every request that has failed.
+        std::vector<std::string> commit_and_report();
+        // Commits, and throws if any of the requests has failed.
+        void commit_or_throw();
+
+    private:
+        // Returns the objects of a dump that the parser returns a value for, redoing the dump until it gets a
+        // consistent one.
+        template<typename Header, typename Parser>
+        auto _dump(std::uint16_t type, const Header & header, Parser && parse);
+        // Returns false if the dump was interrupted by a change of the dumped objects, or some of its replies
+        // were lost.
+        template<typename Header, typename Handler>
+        bool _dump_once(std::uint16_t type, const Header & header, Handler && handler);
+        template<typename Handler>
+        std::vector<int> _commit(Handler && handler);
+
+        template<typename Header>
+        void _queue(std::string description, std::uint16_t type, const Header & header, int flags = 0);
+        // Returns the offset of the attribute, for _end_nested.
+        std::size_t _queue_attribute(std::uint16_t type, const void * data, std::size_t size);
+        void _queue_attribute(std::uint16_t type, const std::string & value);
+        void _end_nested(std::size_t attribute_offset);
+
+        int _fd = -1;
+        std::uint32_t _sequence = 0;
+
+        std::vector<char> _batch;
+        std::size_t _last_message = 0;
+        std::vector<std::uint32_t> _batch_sequences;
+        std::vector<std::string> _batch_descriptions;
+    };
+
+    // A change to the links, IPv4 addresses or IPv4 routes of a namespace, as reported by a monitor.
+    struct notification
+    {
+        enum class kind
+        {
+            link,
+            address,
+            route,
+            // The kernel has dropped notifications, because they weren't read quickly enough; anything could
+            // have changed.
+            overflow
+        };
+
+        kind type;
+        // The name of the link, for changes to links.
+        std::string link_name;
+        // The index of the link, for changes to links and addresses.
+        int link = 0;
+        // For changes to routes.
+        route target = {};
+    };
+
+    // A NETLINK_ROUTE socket subscribed to the notifications of changes to the links, IPv4 addresses and
+    // IPv4 routes of the given namespace.
+    class monitor
+    {
+    public:
+        explicit monitor(int netns);
+        ~monitor();
+
+        monitor(const monitor &) = delete;
+        monitor & operator=(const monitor &) = delete;
+
+        // For polling; it's readable when there are notifications to read.
+        int fd() const
+        {
+            return _fd;
+        }
+
+        // Reads all the notifications that have arrived so far, without blocking.
+        std::vector<notification> read();
+
+    private:
+        int _fd = -1;
+    };
+}
+}
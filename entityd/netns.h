@@ -0,0 +1,97 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "../daemon/unique_fd.h"
+
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace entityd
+{
+// Opens the network namespace of the calling thread.
+inline int open_current_netns()
+{
+    int fd = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        throw std::runtime_error(
+            std::string("Failed to open the current network namespace: ") + strerror(errno));
+    }
+    return fd;
+}
+
+// Network namespaces of entities, held open by fd, by entity name.
+using namespace_map = std::unordered_map<std::string, nonsensed::unique_fd>;
+
+// A path that refers to a namespace held open by this process, for tools that take namespaces by path.
+inline std::string netns_path(int fd)
+{
+    return "/proc/" + std::to_string(getpid()) + "/fd/" + std::to_string(fd);
+}
+
+// Switches the calling thread into a network namespace for the lifetime of the guard, and switches it back
+// into the namespace it was in before when destroyed. A guard constructed with an fd of -1 does nothing,
+// which is what is used for entities that live in the namespace of entityd itself.
+class netns_guard
+{
+public:
+    netns_guard(int target_fd)
+    {
+        if (target_fd == -1)
+        {
+            return;
+        }
+
+        _original_fd = open_current_netns();
+        if (setns(target_fd, CLONE_NEWNET) == -1)
+        {
+            auto error = errno;
+            close(_original_fd);
+            throw std::runtime_error(std::string("Failed to enter a network namespace: ") + strerror(error));
+        }
+    }
+
+    netns_guard(const netns_guard &) = delete;
+    netns_guard & operator=(const netns_guard &) = delete;
+
+    ~netns_guard()
+    {
+        if (_original_fd == -1)
+        {
+            return;
+        }
+
+        if (setns(_original_fd, CLONE_NEWNET) == -1)
+        {
+            perror("Failed to return to the original network namespace");
+            std::abort();
+        }
+        close(_original_fd);
+    }
+
+private:
+    int _original_fd = -1;
+};
+}
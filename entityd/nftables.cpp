@@ -0,0 +1,605 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nftables.h"
+#include "netns.h"
+
+#include <arpa/inet.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_conntrack_common.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter_ipv4.h>
+#include <linux/netlink.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+namespace entityd
+{
+namespace nftables
+{
+    static_assert(static_cast<std::uint32_t>(verdict::drop) == NF_DROP);
+    static_assert(static_cast<std::uint32_t>(verdict::accept) == NF_ACCEPT);
+    static_assert(static_cast<std::int32_t>(verdict::jump) == NFT_JUMP);
+    static_assert(ct_established == NF_CT_STATE_BIT(IP_CT_ESTABLISHED));
+    static_assert(ct_related == NF_CT_STATE_BIT(IP_CT_RELATED));
+    static_assert(ct_new == NF_CT_STATE_BIT(IP_CT_NEW));
+    static_assert(static_cast<int>(hook::input) == NF_INET_LOCAL_IN);
+    static_assert(static_cast<int>(hook::postrouting) == NF_INET_POST_ROUTING);
+    static_assert(raw_priority == NF_IP_PRI_RAW);
+
+    namespace
+    {
+        // Builds a sequence of netlink attributes, with nested ones started by begin and finished by end.
+        class attributes
+        {
+        public:
+            void put(std::uint16_t type, const void * data, std::size_t size)
+            {
+                auto offset = _buffer.size();
+                _buffer.resize(offset + NLA_ALIGN(NLA_HDRLEN + size));
+
+                auto attribute = reinterpret_cast<nlattr *>(_buffer.data() + offset);
+                attribute->nla_type = type;
+                attribute->nla_len = NLA_HDRLEN + size;
+                if (size)
+                {
+                    std::memcpy(_buffer.data() + offset + NLA_HDRLEN, data, size);
+                }
+            }
+
+            void put(std::uint16_t type, const std::string & value)
+            {
+                put(type, value.c_str(), value.size() + 1);
+            }
+
+            // Integer attributes of nftables are in network byte order.
+            void put_u32(std::uint16_t type, std::uint32_t value)
+            {
+                value = htonl(value);
+                put(type, &value, sizeof(value));
+            }
+
+            std::size_t begin(std::uint16_t type)
+            {
+                auto offset = _buffer.size();
+                put(type | NLA_F_NESTED, nullptr, 0);
+                return offset;
+            }
+
+            void end(std::size_t offset)
+            {
+                reinterpret_cast<nlattr *>(_buffer.data() + offset)->nla_len = _buffer.size() - offset;
+            }
+
+            void append(const std::vector<char> & encoded)
+            {
+                _buffer.insert(_buffer.end(), encoded.begin(), encoded.end());
+            }
+
+            std::vector<char> & buffer()
+            {
+                return _buffer;
+            }
+
+        private:
+            std::vector<char> _buffer;
+        };
+
+        // Interface names are compared as whole IFNAMSIZ buffers, padded with zeroes.
+        void put_name_value(attributes & attrs, std::uint16_t type, const std::string & name)
+        {
+            char value[IFNAMSIZ] = {};
+            std::memcpy(value, name.c_str(), std::min(name.size(), sizeof(value) - 1));
+
+            auto data = attrs.begin(type);
+            attrs.put(NFTA_DATA_VALUE, value, sizeof(value));
+            attrs.end(data);
+        }
+
+        // Encodes a single expression; fill adds the attributes of its data.
+        template<typename Fill>
+        void put_expression(std::vector<char> & expressions, const char * name, Fill && fill)
+        {
+            attributes attrs;
+            auto element = attrs.begin(NFTA_LIST_ELEM);
+            attrs.put(NFTA_EXPR_NAME, name);
+            auto data = attrs.begin(NFTA_EXPR_DATA);
+            fill(attrs);
+            attrs.end(data);
+            attrs.end(element);
+
+            expressions.insert(expressions.end(), attrs.buffer().begin(), attrs.buffer().end());
+        }
+
+        void load_meta(std::vector<char> & expressions, std::uint32_t key, std::uint32_t reg = NFT_REG_1)
+        {
+            put_expression(expressions, "meta", [&](attributes & attrs) {
+                attrs.put_u32(NFTA_META_DREG, reg);
+                attrs.put_u32(NFTA_META_KEY, key);
+            });
+        }
+
+        template<typename Fill>
+        void compare(std::vector<char> & expressions, std::uint32_t operation, Fill && fill_value)
+        {
+            put_expression(expressions, "cmp", [&](attributes & attrs) {
+                attrs.put_u32(NFTA_CMP_SREG, NFT_REG_1);
+                attrs.put_u32(NFTA_CMP_OP, operation);
+                fill_value(attrs);
+            });
+        }
+
+        void put_verdict(attributes & attrs, std::uint16_t type, verdict code, const std::string & chain = {})
+        {
+            auto data = attrs.begin(type);
+            auto nested = attrs.begin(NFTA_DATA_VERDICT);
+            attrs.put_u32(NFTA_VERDICT_CODE, static_cast<std::uint32_t>(code));
+            if (!chain.empty())
+            {
+                attrs.put(NFTA_VERDICT_CHAIN, chain);
+            }
+            attrs.end(nested);
+            attrs.end(data);
+        }
+    }
+
+    void rule::_match_name(std::uint32_t key, const std::string & name)
+    {
+        if (name.size() > 1 && name.back() == '*')
+        {
+            // Comparing fewer bytes than the register holds compares just the prefix.
+            load_meta(_expressions, key);
+            compare(_expressions, NFT_CMP_EQ, [&](attributes & attrs) {
+                auto data = attrs.begin(NFTA_CMP_DATA);
+                attrs.put(NFTA_DATA_VALUE, name.data(), name.size() - 1);
+                attrs.end(data);
+            });
+            return;
+        }
+
+        load_meta(_expressions, key);
+        compare(_expressions, NFT_CMP_EQ, [&](attributes & attrs) {
+            put_name_value(attrs, NFTA_CMP_DATA, name);
+        });
+    }
+
+    void rule::_match_group(std::uint32_t key, std::uint32_t group)
+    {
+        // Groups are loaded in host byte order.
+        load_meta(_expressions, key);
+        compare(_expressions, NFT_CMP_EQ, [&](attributes & attrs) {
+            auto data = attrs.begin(NFTA_CMP_DATA);
+            attrs.put(NFTA_DATA_VALUE, &group, sizeof(group));
+            attrs.end(data);
+        });
+    }
+
+    void rule::_verdict(verdict code)
+    {
+        put_expression(_expressions, "immediate", [&](attributes & attrs) {
+            attrs.put_u32(NFTA_IMMEDIATE_DREG, NFT_REG_VERDICT);
+            put_verdict(attrs, NFTA_IMMEDIATE_DATA, code);
+        });
+    }
+
+    rule & rule::iifname(const std::string & name)
+    {
+        _match_name(NFT_META_IIFNAME, name);
+        return *this;
+    }
+
+    rule & rule::oifname(const std::string & name)
+    {
+        _match_name(NFT_META_OIFNAME, name);
+        return *this;
+    }
+
+    rule & rule::iifgroup(std::uint32_t group)
+    {
+        _match_group(NFT_META_IIFGROUP, group);
+        return *this;
+    }
+
+    rule & rule::oifgroup(std::uint32_t group)
+    {
+        _match_group(NFT_META_OIFGROUP, group);
+        return *this;
+    }
+
+    rule & rule::l4proto(std::uint8_t protocol)
+    {
+        load_meta(_expressions, NFT_META_L4PROTO);
+        compare(_expressions, NFT_CMP_EQ, [&](attributes & attrs) {
+            auto data = attrs.begin(NFTA_CMP_DATA);
+            attrs.put(NFTA_DATA_VALUE, &protocol, sizeof(protocol));
+            attrs.end(data);
+        });
+        return *this;
+    }
+
+    rule & rule::ct_state(std::uint32_t states)
+    {
+        // The state is a bitmask in host byte order; the rule matches if any of the bits are set.
+        put_expression(_expressions, "ct", [&](attributes & attrs) {
+            attrs.put_u32(NFTA_CT_DREG, NFT_REG_1);
+            attrs.put_u32(NFTA_CT_KEY, NFT_CT_STATE);
+        });
+
+        put_expression(_expressions, "bitwise", [&](attributes & attrs) {
+            std::uint32_t zero = 0;
+            attrs.put_u32(NFTA_BITWISE_SREG, NFT_REG_1);
+            attrs.put_u32(NFTA_BITWISE_DREG, NFT_REG_1);
+            attrs.put_u32(NFTA_BITWISE_LEN, sizeof(states));
+            auto mask = attrs.begin(NFTA_BITWISE_MASK);
+            attrs.put(NFTA_DATA_VALUE, &states, sizeof(states));
+            attrs.end(mask);
+            auto xor_ = attrs.begin(NFTA_BITWISE_XOR);
+            attrs.put(NFTA_DATA_VALUE, &zero, sizeof(zero));
+            attrs.end(xor_);
+        });
+
+        compare(_expressions, NFT_CMP_NEQ, [&](attributes & attrs) {
+            std::uint32_t zero = 0;
+            auto data = attrs.begin(NFTA_CMP_DATA);
+            attrs.put(NFTA_DATA_VALUE, &zero, sizeof(zero));
+            attrs.end(data);
+        });
+
+        return *this;
+    }
+
+    rule & rule::accept()
+    {
+        _verdict(verdict::accept);
+        return *this;
+    }
+
+    rule & rule::drop()
+    {
+        _verdict(verdict::drop);
+        return *this;
+    }
+
+    rule & rule::masquerade()
+    {
+        put_expression(_expressions, "masq", [](attributes &) {});
+        return *this;
+    }
+
+    rule & rule::flow_offload(const std::string & flowtable)
+    {
+        put_expression(_expressions, "flow_offload", [&](attributes & attrs) {
+            attrs.put(NFTA_FLOW_TABLE_NAME, flowtable);
+        });
+        return *this;
+    }
+
+    rule & rule::notrack()
+    {
+        put_expression(_expressions, "notrack", [](attributes &) {});
+        return *this;
+    }
+
+    rule & rule::group_vmap(std::initializer_list<direction> keys, const std::string & map)
+    {
+        // A concatenation is loaded into consecutive 32 bit registers, one for each of its parts.
+        std::uint32_t reg = NFT_REG32_00;
+        for (auto key : keys)
+        {
+            load_meta(_expressions, key == direction::in ? NFT_META_IIFGROUP : NFT_META_OIFGROUP, reg++);
+        }
+
+        put_expression(_expressions, "lookup", [&](attributes & attrs) {
+            attrs.put(NFTA_LOOKUP_SET, map);
+            attrs.put_u32(NFTA_LOOKUP_SREG, NFT_REG32_00);
+            attrs.put_u32(NFTA_LOOKUP_DREG, NFT_REG_VERDICT);
+        });
+        return *this;
+    }
+
+    namespace
+    {
+        int open_socket()
+        {
+            auto fd = ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+            if (fd == -1)
+            {
+                throw std::runtime_error(
+                    std::string("Failed to open a netfilter socket: ") + strerror(errno));
+            }
+
+            // Errors don't need to carry a copy of the request they refer to.
+            int one = 1;
+            setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+
+            sockaddr_nl address{ .nl_family = AF_NETLINK };
+            if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1)
+            {
+                auto error = errno;
+                close(fd);
+                throw std::runtime_error(
+                    std::string("Failed to bind a netfilter socket: ") + strerror(error));
+            }
+
+            return fd;
+        }
+
+        std::uint16_t message_type(std::uint16_t type)
+        {
+            return (NFNL_SUBSYS_NFTABLES << 8) | type;
+        }
+    }
+
+    socket::socket() : _fd(open_socket())
+    {
+    }
+
+    socket::socket(int netns)
+    {
+        netns_guard guard{ netns };
+        _fd = open_socket();
+    }
+
+    socket::~socket()
+    {
+        close(_fd);
+    }
+
+    void socket::_queue(
+        std::string description,
+        std::uint16_t type,
+        std::uint16_t flags,
+        const std::vector<char> & attributes)
+    {
+        auto offset = _batch.size();
+        _batch.resize(offset + NLMSG_SPACE(sizeof(nfgenmsg)));
+
+        auto message = reinterpret_cast<nlmsghdr *>(_batch.data() + offset);
+        *message = { .nlmsg_type = message_type(type),
+                     .nlmsg_flags = static_cast<std::uint16_t>(NLM_F_REQUEST | flags),
+                     .nlmsg_seq = ++_sequence };
+        *static_cast<nfgenmsg *>(NLMSG_DATA(message))
+            = { .nfgen_family = NFPROTO_IPV4, .version = NFNETLINK_V0 };
+
+        _batch.insert(_batch.end(), attributes.begin(), attributes.end());
+        reinterpret_cast<nlmsghdr *>(_batch.data() + offset)->nlmsg_len = _batch.size() - offset;
+
+        _batch_sequences.push_back(_sequence);
+        _batch_descriptions.push_back(std::move(description));
+    }
+
+    void socket::add_table(const std::string & table)
+    {
+        attributes attrs;
+        attrs.put(NFTA_TABLE_NAME, table);
+        _queue("add table " + table, NFT_MSG_NEWTABLE, NLM_F_CREATE, attrs.buffer());
+    }
+
+    void socket::delete_table(const std::string & table)
+    {
+        attributes attrs;
+        attrs.put(NFTA_TABLE_NAME, table);
+        _queue("delete table " + table, NFT_MSG_DELTABLE, 0, attrs.buffer());
+    }
+
+    void socket::add_chain(
+        const std::string & table,
+        const std::string & chain,
+        const std::string & type,
+        hook chain_hook,
+        verdict policy)
+    {
+        attributes attrs;
+        attrs.put(NFTA_CHAIN_TABLE, table);
+        attrs.put(NFTA_CHAIN_NAME, chain);
+        auto nested = attrs.begin(NFTA_CHAIN_HOOK);
+        attrs.put_u32(NFTA_HOOK_HOOKNUM, chain_hook.number);
+        attrs.put_u32(NFTA_HOOK_PRIORITY, chain_hook.priority);
+        attrs.end(nested);
+        attrs.put_u32(NFTA_CHAIN_POLICY, static_cast<std::uint32_t>(policy));
+        attrs.put(NFTA_CHAIN_TYPE, type);
+        _queue("add chain " + chain, NFT_MSG_NEWCHAIN, NLM_F_CREATE | NLM_F_EXCL, attrs.buffer());
+    }
+
+    void socket::add_chain(const std::string & table, const std::string & chain)
+    {
+        attributes attrs;
+        attrs.put(NFTA_CHAIN_TABLE, table);
+        attrs.put(NFTA_CHAIN_NAME, chain);
+        _queue("add chain " + chain, NFT_MSG_NEWCHAIN, NLM_F_CREATE | NLM_F_EXCL, attrs.buffer());
+    }
+
+    void socket::add_group_vmap(const std::string & table, const std::string & map, std::size_t keys)
+    {
+        attributes attrs;
+        attrs.put(NFTA_SET_TABLE, table);
+        attrs.put(NFTA_SET_NAME, map);
+        attrs.put_u32(NFTA_SET_FLAGS, NFT_SET_MAP);
+        attrs.put_u32(NFTA_SET_KEY_LEN, keys * sizeof(std::uint32_t));
+        attrs.put_u32(NFTA_SET_DATA_TYPE, NFT_DATA_VERDICT);
+        attrs.put_u32(NFTA_SET_ID, ++_set_id);
+        _queue("add map " + map, NFT_MSG_NEWSET, NLM_F_CREATE | NLM_F_EXCL, attrs.buffer());
+    }
+
+    void socket::add_group_vmap_element(
+        const std::string & table,
+        const std::string & map,
+        const std::vector<std::uint32_t> & groups,
+        verdict code,
+        const std::string & chain)
+    {
+        attributes attrs;
+        attrs.put(NFTA_SET_ELEM_LIST_TABLE, table);
+        attrs.put(NFTA_SET_ELEM_LIST_SET, map);
+        auto elements = attrs.begin(NFTA_SET_ELEM_LIST_ELEMENTS);
+        auto element = attrs.begin(NFTA_LIST_ELEM);
+        auto key = attrs.begin(NFTA_SET_ELEM_KEY);
+        attrs.put(NFTA_DATA_VALUE, groups.data(), groups.size() * sizeof(std::uint32_t));
+        attrs.end(key);
+        put_verdict(attrs, NFTA_SET_ELEM_DATA, code, chain);
+        attrs.end(element);
+        attrs.end(elements);
+        _queue("add element to map " + map, NFT_MSG_NEWSETELEM, NLM_F_CREATE, attrs.buffer());
+    }
+
+    void socket::add_flowtable(
+        const std::string & table,
+        const std::string & flowtable,
+        const std::vector<std::string> & devices)
+    {
+        // Flowtables hook into the ingress of their devices.
+        attributes attrs;
+        attrs.put(NFTA_FLOWTABLE_TABLE, table);
+        attrs.put(NFTA_FLOWTABLE_NAME, flowtable);
+        auto hook = attrs.begin(NFTA_FLOWTABLE_HOOK);
+        attrs.put_u32(NFTA_FLOWTABLE_HOOK_NUM, NF_NETDEV_INGRESS);
+        attrs.put_u32(NFTA_FLOWTABLE_HOOK_PRIORITY, 0);
+        auto nested = attrs.begin(NFTA_FLOWTABLE_HOOK_DEVS);
+        for (auto && device : devices)
+        {
+            attrs.put(NFTA_DEVICE_NAME, device);
+        }
+        attrs.end(nested);
+        attrs.end(hook);
+        _queue("add flowtable " + flowtable, NFT_MSG_NEWFLOWTABLE, NLM_F_CREATE, attrs.buffer());
+    }
+
+    void socket::add_rule(const std::string & table, const std::string & chain, const rule & rule)
+    {
+        attributes attrs;
+        attrs.put(NFTA_RULE_TABLE, table);
+        attrs.put(NFTA_RULE_CHAIN, chain);
+        auto expressions = attrs.begin(NFTA_RULE_EXPRESSIONS);
+        attrs.append(rule._expressions);
+        attrs.end(expressions);
+        _queue("add rule to chain " + chain, NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND, attrs.buffer());
+    }
+
+    void socket::commit()
+    {
+        if (_batch.empty())
+        {
+            return;
+        }
+
+        auto sequences = std::move(_batch_sequences);
+        auto descriptions = std::move(_batch_descriptions);
+        _batch_sequences.clear();
+        _batch_descriptions.clear();
+
+        // The transaction is delimited by batch messages, which are addressed to the subsystem, rather than
+        // being requests of their own.
+        auto delimiter = [&](std::uint16_t type) {
+            struct
+            {
+                nlmsghdr message;
+                nfgenmsg header;
+            } ret{ .message = { .nlmsg_len = NLMSG_LENGTH(sizeof(nfgenmsg)),
+                                .nlmsg_type = type,
+                                .nlmsg_flags = NLM_F_REQUEST,
+                                .nlmsg_seq = ++_sequence },
+                   .header = { .nfgen_family = AF_UNSPEC,
+                               .version = NFNETLINK_V0,
+                               .res_id = htons(NFNL_SUBSYS_NFTABLES) } };
+            return ret;
+        };
+
+        auto begin = delimiter(NFNL_MSG_BATCH_BEGIN);
+        auto end = delimiter(NFNL_MSG_BATCH_END);
+
+        // Successful requests are not acknowledged, so the batch is followed by a request that always gets a
+        // reply; by the time it arrives, the errors of the batch, if any, have all arrived before it.
+        struct
+        {
+            nlmsghdr message;
+            nfgenmsg header;
+        } fence{ .message = { .nlmsg_len = NLMSG_LENGTH(sizeof(nfgenmsg)),
+                              .nlmsg_type = message_type(NFT_MSG_GETGEN),
+                              .nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK,
+                              .nlmsg_seq = ++_sequence },
+                 .header = { .nfgen_family = AF_UNSPEC, .version = NFNETLINK_V0 } };
+
+        std::vector<char> batch;
+        batch.reserve(_batch.size() + 2 * sizeof(begin));
+        batch.insert(batch.end(), reinterpret_cast<char *>(&begin), reinterpret_cast<char *>(&begin + 1));
+        batch.insert(batch.end(), _batch.begin(), _batch.end());
+        batch.insert(batch.end(), reinterpret_cast<char *>(&end), reinterpret_cast<char *>(&end + 1));
+        _batch.clear();
+
+        if (send(_fd, batch.data(), batch.size(), 0) == -1 || send(_fd, &fence, sizeof(fence), 0) == -1)
+        {
+            throw std::runtime_error(
+                std::string("Failed to send an nftables transaction: ") + strerror(errno));
+        }
+
+        int failure = 0;
+        std::string failed_request;
+        alignas(nlmsghdr) char buffer[32768];
+
+        while (true)
+        {
+            auto size = recv(_fd, buffer, sizeof(buffer), 0);
+            if (size == -1)
+            {
+                throw std::runtime_error(
+                    std::string("Failed to receive the result of an nftables transaction: ")
+                    + strerror(errno));
+            }
+
+            for (auto message = reinterpret_cast<nlmsghdr *>(buffer); NLMSG_OK(message, size);
+                 message = NLMSG_NEXT(message, size))
+            {
+                if (message->nlmsg_seq == fence.message.nlmsg_seq)
+                {
+                    if (message->nlmsg_type != NLMSG_ERROR)
+                    {
+                        continue;
+                    }
+
+                    if (failure != 0)
+                    {
+                        throw std::system_error(
+                            failure,
+                            std::generic_category(),
+                            "nftables request to " + failed_request + " failed");
+                    }
+                    return;
+                }
+
+                auto it = std::find(sequences.begin(), sequences.end(), message->nlmsg_seq);
+                if (message->nlmsg_type != NLMSG_ERROR || it == sequences.end())
+                {
+                    continue;
+                }
+
+                auto error = -static_cast<nlmsgerr *>(NLMSG_DATA(message))->error;
+                if (error != 0 && failure == 0)
+                {
+                    failure = error;
+                    failed_request = descriptions[it - sequences.begin()];
+                }
+            }
+        }
+    }
+}
+}
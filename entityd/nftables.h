@@ -0,0 +1,168 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+namespace entityd
+{
+namespace nftables
+{
+    // The table entityd keeps the ruleset of a namespace in, whatever the role of its entity.
+    inline const std::string ruleset_table = "nonsense";
+
+    enum class verdict : std::uint32_t
+    {
+        drop = 0,
+        accept = 1,
+        // Only valid as the data of an element of a verdict map, which names the chain to jump to.
+        jump = static_cast<std::uint32_t>(-3)
+    };
+
+    // The interfaces of a packet whose groups a verdict map is keyed by, for rule::group_vmap.
+    enum class direction
+    {
+        in,
+        out
+    };
+
+    // Conntrack states, for rule::ct_state.
+    constexpr std::uint32_t ct_established = 1 << 1;
+    constexpr std::uint32_t ct_related = 1 << 2;
+    constexpr std::uint32_t ct_new = 1 << 3;
+
+    // A rule, built from matches followed by a single action. Every match compiles down to the nftables
+    // expressions that load a value into a register and compare it.
+    class rule
+    {
+    public:
+        // A name ending with a * matches every interface whose name starts with what comes before it.
+        rule & iifname(const std::string & name);
+        rule & oifname(const std::string & name);
+        rule & iifgroup(std::uint32_t group);
+        rule & oifgroup(std::uint32_t group);
+        rule & l4proto(std::uint8_t protocol);
+        // Matches packets in any of the given conntrack states.
+        rule & ct_state(std::uint32_t states);
+
+        rule & accept();
+        rule & drop();
+        rule & masquerade();
+        // Hands the flow of the packet over to a flowtable of the same table, whose fast path forwards the
+        // rest of it without going through the ruleset again, once it's established.
+        rule & flow_offload(const std::string & flowtable);
+        // Keeps conntrack from tracking the packet.
+        rule & notrack();
+        // Looks the groups of the interfaces of a packet, concatenated in the given order, up in a verdict
+        // map of the same table, and takes the verdict found there, if any; this is a single hash lookup,
+        // however many interfaces are in the groups.
+        rule & group_vmap(std::initializer_list<direction> keys, const std::string & map);
+
+    private:
+        friend class socket;
+
+        void _match_name(std::uint32_t key, const std::string & name);
+        void _match_group(std::uint32_t key, std::uint32_t group);
+        void _verdict(verdict code);
+
+        // Encoded NFTA_LIST_ELEM attributes, one per expression.
+        std::vector<char> _expressions;
+    };
+
+    struct hook
+    {
+        enum point : std::uint32_t
+        {
+            prerouting,
+            input,
+            forward,
+            output,
+            postrouting
+        };
+
+        point number;
+        std::int32_t priority;
+    };
+
+    // Base chains at this priority of the prerouting hook see packets before conntrack does.
+    constexpr std::int32_t raw_priority = -300;
+
+    // A NETLINK_NETFILTER socket in the network namespace the calling thread is in when it is created, or
+    // in the given one. Everything is done in the ip family.
+    class socket
+    {
+    public:
+        socket();
+        explicit socket(int netns);
+        ~socket();
+
+        socket(const socket &) = delete;
+        socket & operator=(const socket &) = delete;
+
+        // Requests are queued into a single transaction, which commit applies atomically: either all of them
+        // take effect, or none do, and packets never see the ruleset in between.
+        void add_table(const std::string & table);
+        void delete_table(const std::string & table);
+        // A base chain; type is "filter" or "nat".
+        void add_chain(
+            const std::string & table,
+            const std::string & chain,
+            const std::string & type,
+            hook chain_hook,
+            verdict policy);
+        // A regular chain, only reached by jumps.
+        void add_chain(const std::string & table, const std::string & chain);
+        // A verdict map keyed by the groups of the given number of interfaces.
+        void add_group_vmap(const std::string & table, const std::string & map, std::size_t keys);
+        // The chain is only used by jumps.
+        void add_group_vmap_element(
+            const std::string & table,
+            const std::string & map,
+            const std::vector<std::uint32_t> & groups,
+            verdict code,
+            const std::string & chain = {});
+        // Adding a flowtable that is already there adds the devices to it.
+        void add_flowtable(
+            const std::string & table,
+            const std::string & flowtable,
+            const std::vector<std::string> & devices);
+        void add_rule(const std::string & table, const std::string & chain, const rule & rule);
+        // Throws a std::system_error with the error of the first rejected request if the transaction has been
+        // rejected.
+        void commit();
+
+    private:
+        void _queue(
+            std::string description,
+            std::uint16_t type,
+            std::uint16_t flags,
+            const std::vector<char> & attributes);
+
+        int _fd = -1;
+        std::uint32_t _sequence = 0;
+
+        std::vector<char> _batch;
+        std::vector<std::uint32_t> _batch_sequences;
+        std::vector<std::string> _batch_descriptions;
+        // Every set needs an id unique within its transaction.
+        std::uint32_t _set_id = 0;
+    };
+}
+}
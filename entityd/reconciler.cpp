@@ -0,0 +1,410 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "reconciler.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace entityd
+{
+namespace
+{
+    template<typename Link>
+    bool has_link(const std::vector<Link> & links, const std::string & name)
+    {
+        return std::any_of(links.begin(), links.end(), [&](auto && link) { return link.name == name; });
+    }
+
+    void append(std::vector<std::string> & failures, std::vector<std::string> more)
+    {
+        failures.insert(failures.end(), more.begin(), more.end());
+    }
+}
+
+reconciler::reconciler(std::string entity) : _entity(std::move(entity))
+{
+}
+
+void reconciler::set_desired(network_state state)
+{
+    _previous = std::exchange(_desired, std::move(state));
+    // The namespaces may not be the same ones anymore, even where their names are.
+    _watched.clear();
+}
+
+std::vector<std::string> reconciler::reconcile(netns_lookup netns_of)
+{
+    std::vector<std::string> failures;
+
+    // Subscribing before anything is dumped makes sure that no change made after the dump goes unnoticed. The
+    // changes made by the pass itself are noticed too, which costs one more pass that finds nothing to do.
+    std::erase_if(_watched, [&](auto && watched) { return !_desired.namespaces.contains(watched.first); });
+    for (auto && [name, state] : _desired.namespaces)
+    {
+        auto netns = netns_of(name);
+        if (netns == -1)
+        {
+            failures.push_back("The namespace of " + name + " is not known");
+            continue;
+        }
+
+        auto & watched = _watched[name];
+        if (!watched.monitor)
+        {
+            try
+            {
+                watched.monitor = std::make_unique<netlink::monitor>(netns);
+            }
+            catch (std::exception & ex)
+            {
+                failures.push_back(ex.what());
+            }
+        }
+    }
+
+    append(failures, _reconcile_links(netns_of));
+
+    for (auto && [name, state] : _desired.namespaces)
+    {
+        if (auto netns = netns_of(name); netns != -1)
+        {
+            append(failures, _reconcile_namespace(name, netns, state));
+        }
+    }
+
+    // Namespaces the entity doesn't need anything in anymore may still have its routes.
+    for (auto && [name, state] : _previous.namespaces)
+    {
+        auto netns = netns_of(name);
+        if (!_desired.namespaces.contains(name) && netns != -1)
+        {
+            append(failures, _reconcile_namespace(name, netns, {}));
+        }
+    }
+
+    return failures;
+}
+
+std::vector<std::string> reconciler::_reconcile_links(netns_lookup & netns_of)
+{
+    std::map<std::string, std::vector<netlink::link>> dumps;
+    std::map<std::string, std::unique_ptr<netlink::socket>> sockets;
+
+    // Both are only opened for the namespaces that are looked at; nullptr for unknown namespaces.
+    auto links_in = [&](const std::string & netns_name) -> const std::vector<netlink::link> * {
+        auto netns = netns_of(netns_name);
+        if (netns == -1)
+        {
+            return nullptr;
+        }
+
+        auto it = dumps.find(netns_name);
+        if (it == dumps.end())
+        {
+            it = dumps.emplace(netns_name, netlink::socket{ netns }.dump_links()).first;
+        }
+        return &it->second;
+    };
+
+    auto socket_in = [&](const std::string & netns_name) -> netlink::socket & {
+        auto & socket = sockets[netns_name];
+        if (!socket)
+        {
+            socket = std::make_unique<netlink::socket>(netns_of(netns_name));
+        }
+        return *socket;
+    };
+
+    // Where a link can be found when it's not where it should be: in the namespace the previous state had it
+    // in, or in the namespace of the entity, where older versions of entityd left the uplink end of the veth
+    // pair between connections.
+    auto whereabouts = [&](const std::string & link) {
+        std::vector<std::string> ret;
+        for (auto && [name, state] : _previous.namespaces)
+        {
+            if (has_link(state.links, link))
+            {
+                ret.push_back(name);
+            }
+        }
+        ret.push_back(_entity);
+        return ret;
+    };
+
+    std::vector<std::string> failures;
+
+    for (auto && [name, state] : _desired.namespaces)
+    {
+        auto present = links_in(name);
+        if (!present)
+        {
+            continue;
+        }
+
+        for (auto && link : state.links)
+        {
+            if (has_link(*present, link.name))
+            {
+                continue;
+            }
+
+            auto moved = false;
+            for (auto && candidate : whereabouts(link.name))
+            {
+                auto links = links_in(candidate);
+                if (candidate != name && links && has_link(*links, link.name))
+                {
+                    socket_in(candidate).move_link(link.name, netns_of(name));
+                    moved = true;
+                    break;
+                }
+            }
+
+            if (moved)
+            {
+                continue;
+            }
+
+            switch (link.type)
+            {
+                case network_state::link::kind::veth:
+                {
+                    auto peer_netns = netns_of(link.peer_netns);
+                    if (peer_netns == -1)
+                    {
+                        failures.push_back(
+                            "Cannot create link " + link.name + ": the namespace of " + link.peer_netns
+                            + " is not known");
+                        break;
+                    }
+                    socket_in(name).create_veth(link.name, link.peer, peer_netns);
+                    break;
+                }
+
+                case network_state::link::kind::bridge:
+                    socket_in(name).create_bridge(link.name);
+                    break;
+
+                case network_state::link::kind::veth_peer:
+                    // The pair is broken if the other end is still there, and can only be replaced as a
+                    // whole.
+                    for (auto && [other_name, other_state] : _desired.namespaces)
+                    {
+                        for (auto && other : other_state.links)
+                        {
+                            auto links = links_in(other_name);
+                            if (other.type == network_state::link::kind::veth && other.peer == link.name
+                                && links && has_link(*links, other.name))
+                            {
+                                auto & socket = socket_in(other_name);
+                                socket.delete_link(other.name);
+                                socket.create_veth(other.name, link.name, netns_of(name));
+                            }
+                        }
+                    }
+                    break;
+            }
+        }
+    }
+
+    for (auto && [name, socket] : sockets)
+    {
+        append(failures, socket->commit_and_report());
+    }
+
+    return failures;
+}
+
+std::vector<std::string> reconciler::_reconcile_namespace(
+    const std::string & netns_name,
+    int netns,
+    const network_state::namespace_state & state)
+{
+    netlink::socket socket{ netns };
+    auto links = socket.dump_links();
+    auto addresses = socket.dump_addresses();
+    auto routes = socket.dump_routes();
+
+    auto find = [&](const std::string & name) -> const netlink::link * {
+        auto it = std::find_if(links.begin(), links.end(), [&](auto && link) { return link.name == name; });
+        return it == links.end() ? nullptr : &*it;
+    };
+
+    std::vector<std::string> failures;
+    watched_namespace watched;
+
+    for (auto && link : state.links)
+    {
+        watched.link_names.insert(link.name);
+
+        auto actual = find(link.name);
+        if (!actual)
+        {
+            failures.push_back("Link " + link.name + " is missing");
+            continue;
+        }
+        watched.link_indices.insert(actual->index);
+
+        auto master = link.master.empty() ? nullptr : find(link.master);
+        if (!link.master.empty() && !master)
+        {
+            failures.push_back("Bridge " + link.master + " of link " + link.name + " is missing");
+        }
+        else if (actual->master != (master ? master->index : 0))
+        {
+            socket.set_link_master(link.name, master ? master->index : 0);
+        }
+
+        if (actual->group != link.group)
+        {
+            socket.set_link_group(link.name, link.group);
+        }
+
+        if (!actual->up)
+        {
+            socket.set_link_up(link.name);
+        }
+
+        for (auto && address : link.addresses)
+        {
+            auto present = std::any_of(addresses.begin(), addresses.end(), [&](auto && entry) {
+                return entry.link == actual->index && entry.address == address;
+            });
+            if (!present)
+            {
+                socket.add_address(actual->index, address);
+            }
+        }
+
+        for (auto && entry : addresses)
+        {
+            auto wanted = std::find(link.addresses.begin(), link.addresses.end(), entry.address);
+            if (entry.link == actual->index && wanted == link.addresses.end())
+            {
+                socket.delete_address(entry.link, entry.address);
+            }
+        }
+    }
+
+    // Routes go last, since their gateways are only reachable once the addresses are there.
+    auto present = [&](const netlink::route & target) {
+        auto matches = [&](auto && entry) { return entry.target == target; };
+        return std::find_if(routes.begin(), routes.end(), matches);
+    };
+
+    for (auto && route : state.routes)
+    {
+        watched.routes.push_back(route.target);
+
+        auto it = present(route.target);
+        if (it != routes.end() && it->gateway == route.gateway)
+        {
+            continue;
+        }
+
+        if (it != routes.end())
+        {
+            socket.delete_route(route.target);
+        }
+        socket.add_route(route.target, route.gateway);
+    }
+
+    if (auto previous = _previous.namespaces.find(netns_name); previous != _previous.namespaces.end())
+    {
+        for (auto && route : previous->second.routes)
+        {
+            auto wanted = std::any_of(state.routes.begin(), state.routes.end(), [&](auto && entry) {
+                return entry.target == route.target;
+            });
+            if (wanted)
+            {
+                continue;
+            }
+
+            watched.routes.push_back(route.target);
+            if (present(route.target) != routes.end())
+            {
+                socket.delete_route(route.target);
+            }
+        }
+    }
+
+    append(failures, socket.commit_and_report());
+
+    if (auto it = _watched.find(netns_name); it != _watched.end())
+    {
+        watched.monitor = std::move(it->second.monitor);
+        it->second = std::move(watched);
+    }
+
+    return failures;
+}
+
+std::vector<int> reconciler::fds() const
+{
+    std::vector<int> ret;
+    for (auto && [name, watched] : _watched)
+    {
+        if (watched.monitor)
+        {
+            ret.push_back(watched.monitor->fd());
+        }
+    }
+    return ret;
+}
+
+bool reconciler::notified()
+{
+    auto ret = false;
+
+    for (auto && [name, watched] : _watched)
+    {
+        if (!watched.monitor)
+        {
+            continue;
+        }
+
+        // Everything is read, even once something relevant has been found, so that it's not found again.
+        for (auto && change : watched.monitor->read())
+        {
+            switch (change.type)
+            {
+                case netlink::notification::kind::link:
+                    ret = ret || watched.link_names.contains(change.link_name)
+                        || watched.link_indices.contains(change.link);
+                    break;
+
+                case netlink::notification::kind::address:
+                    ret = ret || watched.link_indices.contains(change.link);
+                    break;
+
+                case netlink::notification::kind::route:
+                    ret = ret
+                        || std::find(watched.routes.begin(), watched.routes.end(), change.target)
+                            != watched.routes.end();
+                    break;
+
+                case netlink::notification::kind::overflow:
+                    ret = true;
+                    break;
+            }
+        }
+    }
+
+    return ret;
+}
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "netlink.h"
+
+#include "../daemon/function.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace entityd
+{
+// The links, addresses and routes an entity needs, in its own namespace and in the namespaces of its uplinks.
+// Every link is kept up.
+struct network_state
+{
+    struct link
+    {
+        enum class kind
+        {
+            // The end of a veth pair that creates the pair when it's missing.
+            veth,
+            // The other end, which only comes into being with the first one.
+            veth_peer,
+            bridge
+        };
+
+        std::string name;
+        kind type;
+        // For veth: the name of the other end, and the entity whose namespace it goes into.
+        std::string peer;
+        std::string peer_netns;
+        // The bridge the link is a port of, in the same namespace; empty for none.
+        std::string master;
+        std::uint32_t group = 0;
+        // The links belong to the entity, so these are all the addresses they have.
+        std::vector<netlink::interface_address> addresses;
+    };
+
+    struct namespace_state
+    {
+        std::vector<link> links;
+        // Routes are told apart by destination; others, to destinations not listed here, are left alone.
+        std::vector<netlink::route_entry> routes;
+    };
+
+    // By the name of the entity whose namespace they are in.
+    std::map<std::string, namespace_state> namespaces;
+};
+
+// Brings the kernel in line with the network state an entity needs. A pass dumps the links, addresses and
+// routes of every namespace of the state, and only sends the requests that fix what differs: it creates
+// missing links, moves links that are in the wrong namespace, fixes their masters, groups and addresses, and
+// adds, replaces and removes routes. Between passes, it watches the namespaces for changes, so that one that
+// undoes part of the state is fixed by the next pass, rather than by restarting the entity.
+class reconciler
+{
+public:
+    // Namespaces are looked up by the name of the entity they belong to; -1 means the namespace isn't known.
+    using netns_lookup = nonsensed::function<int(const std::string &)>;
+
+    explicit reconciler(std::string entity);
+
+    // Sets the state the next pass brings the kernel to. Links of the previous state that aren't in their new
+    // namespace are moved over from the old one, and routes to destinations only the previous state had are
+    // removed.
+    void set_desired(network_state state);
+
+    // A single pass; returns a description of every request that has failed. Namespaces netns_of doesn't
+    // know are skipped.
+    std::vector<std::string> reconcile(netns_lookup netns_of);
+
+    // The descriptors to poll for changes in the namespaces of the state, as of the last pass.
+    std::vector<int> fds() const;
+    // Reads the changes that have arrived, and returns whether any of them concern the state of the entity,
+    // which calls for another pass.
+    bool notified();
+
+private:
+    struct watched_namespace
+    {
+        std::unique_ptr<netlink::monitor> monitor;
+        std::set<std::string> link_names;
+        std::set<int> link_indices;
+        std::vector<netlink::route> routes;
+    };
+
+    std::vector<std::string> _reconcile_links(netns_lookup & netns_of);
+    std::vector<std::string> _reconcile_namespace(
+        const std::string & netns_name,
+        int netns,
+        const network_state::namespace_state & state);
+
+    std::string _entity;
+    network_state _desired;
+    network_state _previous;
+    std::map<std::string, watched_namespace> _watched;
+};
+}
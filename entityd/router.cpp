@@ -0,0 +1,88 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "router.h"
+#include "nftables.h"
+
+#include <netinet/in.h>
+
+namespace entityd
+{
+namespace router
+{
+    using nftables::ruleset_table;
+
+    void load_ruleset(const std::string & entity, bool offload)
+    {
+        using nftables::direction;
+        using nftables::rule;
+        using nftables::verdict;
+
+        const auto & table = ruleset_table;
+
+        nftables::socket socket;
+
+        // Adding the table before deleting it makes sure there is one to delete.
+        socket.add_table(table);
+        socket.delete_table(table);
+        socket.add_table(table);
+
+        // Allow downstream to router, disallow upstream to router, allow all ICMP.
+        socket.add_group_vmap(table, "input-groups", 1);
+        socket.add_group_vmap_element(table, "input-groups", { downlink_group }, verdict::accept);
+        socket.add_group_vmap_element(table, "input-groups", { uplink_group }, verdict::drop);
+
+        socket.add_chain(table, "input", "filter", { nftables::hook::input, 0 }, verdict::accept);
+        socket.add_rule(table, "input", rule().l4proto(IPPROTO_ICMP).accept());
+        socket.add_rule(table, "input", rule().group_vmap({ direction::in }, "input-groups"));
+
+        // Allow from downstream to upstream, and from upstream to downstream if downstream initiated.
+        socket.add_chain(table, "from-uplink");
+        socket.add_rule(
+            table, "from-uplink", rule().ct_state(nftables::ct_established | nftables::ct_related).accept());
+
+        socket.add_group_vmap(table, "forward-groups", 2);
+        socket.add_group_vmap_element(
+            table, "forward-groups", { downlink_group, uplink_group }, verdict::accept);
+        socket.add_group_vmap_element(
+            table, "forward-groups", { uplink_group, downlink_group }, verdict::jump, "from-uplink");
+
+        socket.add_chain(table, "forward", "filter", { nftables::hook::forward, 0 }, verdict::drop);
+        if (offload)
+        {
+            // Only flows the rules below have let through get established, so only they are offloaded.
+            socket.add_flowtable(table, flowtable, { "nu-" + entity });
+            socket.add_rule(table, "forward", rule().l4proto(IPPROTO_TCP).flow_offload(flowtable));
+            socket.add_rule(table, "forward", rule().l4proto(IPPROTO_UDP).flow_offload(flowtable));
+        }
+        socket.add_rule(
+            table, "forward", rule().group_vmap({ direction::in, direction::out }, "forward-groups"));
+
+        // Masquerade the source address of everything routed to the uplink.
+        socket.add_chain(table, "postrouting", "nat", { nftables::hook::postrouting, 100 }, verdict::accept);
+        socket.add_rule(table, "postrouting", rule().oifgroup(uplink_group).masquerade());
+
+        socket.commit();
+    }
+
+    void offload_downlink(int router_netns, const std::string & link)
+    {
+        nftables::socket socket{ router_netns };
+        socket.add_flowtable(ruleset_table, flowtable, { link });
+        socket.commit();
+    }
+}
+}
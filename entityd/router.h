@@ -0,0 +1,49 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace entityd
+{
+namespace router
+{
+    // The ruleset tells the links of a router apart by their interface groups, which are plain integers,
+    // rather than by their names. The router puts its own uplink into one group, and every downlink puts its
+    // link in the namespace of the router into the other as it connects, so the ruleset never changes after
+    // it's loaded, and a link that goes away takes its group with it.
+    constexpr std::uint32_t uplink_group = 1;
+    constexpr std::uint32_t downlink_group = 2;
+
+    // Loads the ruleset of a router into the current namespace, replacing one loaded before, if any, in a
+    // single transaction. Traffic coming in through a downlink can go out through the uplink of the router,
+    // with its source masqueraded; traffic coming in through the uplink is only let through to the downlinks
+    // if it belongs to a connection they have initiated.
+    //
+    // A router that offloads forwarding also gets a flowtable, which its uplink and the links of its
+    // downlinks are added to; established TCP and UDP flows between them then take its fast path, rather
+    // than going through conntrack and the forward chain for every packet.
+    void load_ruleset(const std::string & entity, bool offload);
+
+    inline const std::string flowtable = "fastpath";
+
+    // Adds a link of a downlink to the flowtable of a router that offloads forwarding. The link leaves the
+    // flowtable by itself when it leaves the namespace of the router, or goes away.
+    void offload_downlink(int router_netns, const std::string & link);
+}
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scheduler.h"
+
+#include <deque>
+#include <utility>
+
+namespace entityd
+{
+namespace
+{
+    struct yielded
+    {
+        hosted_entity * entity;
+        nonsensed::coro::coroutine_handle<nonsensed::promise> handle;
+    };
+
+    std::deque<yielded> queue;
+}
+
+void _yield(hosted_entity & entity, nonsensed::coro::coroutine_handle<nonsensed::promise> handle)
+{
+    queue.push_back({ &entity, std::move(handle) });
+}
+
+bool has_yielded()
+{
+    return !queue.empty();
+}
+
+void resume_yielded()
+{
+    // Only the coroutines that have given way so far; the ones that give way again are resumed the next time,
+    // after the bus has been served.
+    auto ready = std::exchange(queue, {});
+    for (auto && entry : ready)
+    {
+        entry.handle.resume();
+    }
+}
+
+void cancel_yielded(hosted_entity & entity, const nonsensed::reply_error_t & error)
+{
+    std::deque<yielded> cancelled;
+    std::erase_if(queue, [&](auto && entry) {
+        if (entry.entity != &entity)
+        {
+            return false;
+        }
+        cancelled.push_back(entry);
+        return true;
+    });
+
+    // The same as what the runtime does with a coroutine whose awaited operation has failed.
+    for (auto && entry : cancelled)
+    {
+        entry.handle.promise().return_value(error);
+        entry.handle.destroy();
+    }
+}
+}
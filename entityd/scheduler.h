@@ -0,0 +1,63 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "../daemon/async.h"
+
+namespace entityd
+{
+struct hosted_entity;
+
+void _yield(hosted_entity & entity, nonsensed::coro::coroutine_handle<nonsensed::promise> handle);
+
+// Requests that take a while to handle, like applying components, are run as coroutines on the runtime of
+// the daemon, and give way to the rest of the main loop between their steps by awaiting this; the bus is
+// still served while they are in progress, and requests for other entities get to make progress in the
+// meantime. A coroutine must not give way while inside of a namespace other than the one of entityd, since
+// whatever runs next would run there, too.
+inline auto yield(hosted_entity & entity)
+{
+    struct
+    {
+        hosted_entity & entity;
+
+        bool await_ready()
+        {
+            return false;
+        }
+
+        void await_suspend(nonsensed::coro::coroutine_handle<nonsensed::promise> handle)
+        {
+            _yield(entity, std::move(handle));
+        }
+
+        void await_resume()
+        {
+        }
+    } awaitable{ entity };
+
+    return awaitable;
+}
+
+// Coroutines that have given way are resumed by `resume_yielded`, in the order they gave way in.
+bool has_yielded();
+void resume_yielded();
+
+// Ends the coroutines that have given way while working on the entity, with the error as their outcome.
+// Called when the entity is shut down, since they must not be resumed once it is gone.
+void cancel_yielded(hosted_entity & entity, const nonsensed::reply_error_t & error);
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "switch.h"
+#include "nftables.h"
+
+namespace entityd
+{
+namespace switch_
+{
+    void load_ruleset()
+    {
+        using nftables::ruleset_table;
+
+        nftables::socket socket;
+
+        // Adding the table before deleting it makes sure there is one to delete.
+        socket.add_table(ruleset_table);
+        socket.delete_table(ruleset_table);
+        socket.add_table(ruleset_table);
+
+        socket.add_chain(
+            ruleset_table,
+            "prerouting",
+            "filter",
+            { nftables::hook::prerouting, nftables::raw_priority },
+            nftables::verdict::accept);
+        socket.add_rule(ruleset_table, "prerouting", nftables::rule().notrack());
+
+        socket.commit();
+    }
+}
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+namespace entityd
+{
+namespace switch_
+{
+    // Loads the ruleset of a switch that doesn't track connections into the current namespace, replacing one
+    // loaded before, if any, in a single transaction. Switches neither filter nor translate anything, so the
+    // ruleset only keeps conntrack from tracking what they forward, be it routed between their uplink and
+    // their downlinks, or bridged between their clients (which the ip hooks only see with br_netfilter).
+    void load_ruleset();
+}
+}
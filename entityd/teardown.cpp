@@ -0,0 +1,186 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "teardown.h"
+#include "netlink.h"
+#include "nftables.h"
+
+#include "../daemon/log_helpers.h"
+
+#include <sys/mount.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <system_error>
+
+namespace entityd
+{
+namespace
+{
+    // The two ends of the veth pair connecting an entity to its uplink; see desired_network_state.
+    std::string entity_end(const std::string & entity)
+    {
+        return "nu-" + entity;
+    }
+
+    std::string uplink_end(const std::string & entity)
+    {
+        return "nd-" + entity;
+    }
+
+    void report(const char * action, const std::string & object, int error)
+    {
+        // The object may have gone away together with a namespace, or a peer device, that was removed
+        // before it.
+        if (error != 0 && error != ESRCH && error != ENODEV && error != ENOENT)
+        {
+            std::cerr << nonsensed::error_prefix() << "Failed to remove " << action << ' ' << object << ": "
+                      << strerror(error) << '\n';
+        }
+    }
+}
+
+teardown_plan plan_teardown(
+    const std::string & entity,
+    const std::vector<journal::record> & records,
+    bool netns_dies)
+{
+    teardown_plan ret;
+
+    auto has_pair = std::any_of(records.begin(), records.end(), [&](auto && rec) {
+        return rec.type == journal::record::kind::link && rec.netns == entity
+            && rec.object == entity_end(entity);
+    });
+
+    for (auto && rec : records)
+    {
+        switch (rec.type)
+        {
+            case journal::record::kind::mount:
+                ret.mounts.push_back(rec.object);
+                break;
+
+            case journal::record::kind::route:
+                if (rec.netns == entity && netns_dies)
+                {
+                    break;
+                }
+
+                ret.batches[rec.netns].routes.push_back(rec.object);
+                break;
+
+            case journal::record::kind::link:
+                if (rec.netns == entity)
+                {
+                    // The entity end of the pair is deleted even when the namespace is about to be destroyed,
+                    // since that happens asynchronously, and until it does, the uplink end would stay in the
+                    // namespace of the uplink, in the way of the entity being started again.
+                    if (netns_dies && rec.object != entity_end(entity))
+                    {
+                        break;
+                    }
+                }
+                else if (has_pair && rec.object == uplink_end(entity))
+                {
+                    break;
+                }
+
+                ret.batches[rec.netns].links.push_back(rec.object);
+                break;
+
+            case journal::record::kind::table:
+                if (rec.netns == entity && netns_dies)
+                {
+                    break;
+                }
+
+                ret.batches[rec.netns].tables.push_back(rec.object);
+                break;
+        }
+    }
+
+    return ret;
+}
+
+void execute(const teardown_plan & plan, nonsensed::function<int(const std::string &)> netns_of)
+{
+    for (auto && [netns_name, batch] : plan.batches)
+    {
+        int fd = netns_of(netns_name);
+        if (fd == -1)
+        {
+            continue;
+        }
+
+        try
+        {
+            netlink::socket socket{ fd };
+
+            std::vector<const std::string *> queued;
+            for (auto && prefix : batch.routes)
+            {
+                if (auto route = netlink::parse_route(prefix))
+                {
+                    socket.delete_route(*route);
+                    queued.push_back(&prefix);
+                }
+            }
+            for (auto && link : batch.links)
+            {
+                socket.delete_link(link);
+                queued.push_back(&link);
+            }
+
+            auto results = socket.commit();
+            auto routes = queued.size() - batch.links.size();
+            for (std::size_t i = 0; i < results.size(); ++i)
+            {
+                report(i < routes ? "route" : "link", *queued[i], results[i]);
+            }
+
+            for (auto && table : batch.tables)
+            {
+                try
+                {
+                    nftables::socket nft{ fd };
+                    nft.delete_table(table);
+                    nft.commit();
+                }
+                catch (std::system_error & ex)
+                {
+                    report("table", table, ex.code().value());
+                }
+            }
+        }
+        catch (std::exception & ex)
+        {
+            std::cerr << nonsensed::error_prefix() << "Failed to clean up the namespace of " << netns_name
+                      << ": " << ex.what() << '\n';
+        }
+    }
+
+    for (auto && mount : plan.mounts)
+    {
+        if (umount2(mount.c_str(), MNT_DETACH) == -1 && errno != EINVAL && errno != ENOENT)
+        {
+            report("mount", mount, errno);
+        }
+        unlink(mount.c_str());
+    }
+}
+}
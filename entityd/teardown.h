@@ -0,0 +1,62 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "journal.h"
+
+#include "../daemon/function.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace entityd
+{
+// The smallest set of requests that removes everything recorded in the journal of an entity that is being
+// shut down. It relies on the kernel removing things on its own: deleting a link deletes its addresses and
+// the routes through it, deleting either end of a veth pair deletes the other one, and destroying a
+// namespace deletes all the links in it. Addresses and routes that entityd adds to its own links are never
+// recorded in the journal to begin with, for the same reason.
+struct teardown_plan
+{
+    // Sent in a single batch per namespace; routes go first, since some of them may point at the links.
+    // nftables tables are deleted in a transaction of their own.
+    struct batch
+    {
+        // Prefixes, as in the journal.
+        std::vector<std::string> routes;
+        std::vector<std::string> links;
+        std::vector<std::string> tables;
+    };
+
+    // By the name of the entity whose namespace they are in, as in the journal.
+    std::map<std::string, batch> batches;
+    std::vector<std::string> mounts;
+};
+
+// netns_dies says whether the namespace of the entity goes away once it is shut down, which is the case for
+// namespaces created for it (as opposed to the namespace of entityd and external ones).
+teardown_plan plan_teardown(
+    const std::string & entity,
+    const std::vector<journal::record> & records,
+    bool netns_dies);
+
+// Carries out a plan, with the namespaces looked up by netns_of; the batches of namespaces it returns -1 for
+// are skipped. Failures are reported, but don't stop the rest of the plan from being carried out, and objects
+// that are already gone are not considered failures.
+void execute(const teardown_plan & plan, nonsensed::function<int(const std::string &)> netns_of);
+}
@@ -0,0 +1,250 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compares the TCP throughput across a chain of routers, from a client below the lowest one to a server
+// above the highest one, when the routers have no ruleset at all, when they have the ruleset entityd loads,
+// and when that ruleset also offloads established flows to a flowtable.
+//
+// Usage: benchmark-multi-hop-throughput [router count] [seconds per configuration]
+//
+// Must be run as root. Everything happens in fresh network namespaces, which go away with the process.
+
+#include "../../entityd/netlink.h"
+#include "../../entityd/netns.h"
+#include "../../entityd/nftables.h"
+#include "../../entityd/router.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+int create_netns()
+{
+    entityd::netns_guard guard{ -1 };
+    if (unshare(CLONE_NEWNET) == -1)
+    {
+        throw std::runtime_error("Failed to create a network namespace");
+    }
+
+    auto fd = entityd::open_current_netns();
+    entityd::netlink::socket socket;
+    socket.set_link_up("lo");
+    socket.commit_or_throw();
+    return fd;
+}
+
+// Hop i is connected to hop i + 1 by link i, whose lower end, nu-h<i>, has address 10.0.<i>.2, and whose
+// upper end, nd-h<i>, has address 10.0.<i>.1.
+std::string subnet(int link)
+{
+    return "10.0." + std::to_string(link) + ".0/24";
+}
+
+std::string address(int link, int host)
+{
+    return "10.0." + std::to_string(link) + "." + std::to_string(host);
+}
+
+void add_address(entityd::netlink::socket & socket, const std::string & link, const std::string & address)
+{
+    auto index = socket.find_link(link);
+    if (!index)
+    {
+        throw std::runtime_error("No link " + link);
+    }
+    socket.add_address(*index, *entityd::netlink::parse_interface_address(address + "/24"));
+    socket.set_link_up(link);
+}
+
+void add_route(entityd::netlink::socket & socket, const std::string & destination, const std::string & via)
+{
+    socket.add_route(*entityd::netlink::parse_route(destination), *entityd::netlink::parse_address(via));
+}
+
+// The chain is hops.front() (the client), then the routers, then hops.back() (the server).
+std::vector<int> build_chain(int routers)
+{
+    std::vector<int> hops;
+    for (int i = 0; i < routers + 2; ++i)
+    {
+        hops.push_back(create_netns());
+    }
+
+    for (int i = 0; i < routers + 1; ++i)
+    {
+        auto n = std::to_string(i);
+        entityd::netlink::socket lower{ hops[i] };
+        entityd::netlink::socket upper{ hops[i + 1] };
+
+        lower.create_veth("nu-h" + n, "nd-h" + n, hops[i + 1]);
+        lower.commit_or_throw();
+        add_address(lower, "nu-h" + n, address(i, 2));
+        add_address(upper, "nd-h" + n, address(i, 1));
+        lower.commit_or_throw();
+        upper.commit_or_throw();
+
+        // Every hop but the server routes everything upwards, and every hop but the client routes the subnets
+        // further down downwards, which only matters when the routers don't masquerade.
+        add_route(lower, "0.0.0.0/0", address(i, 1));
+        for (int j = 0; j < i; ++j)
+        {
+            add_route(upper, subnet(j), address(i, 2));
+        }
+        lower.commit_or_throw();
+        upper.commit_or_throw();
+    }
+
+    for (int i = 1; i < routers + 1; ++i)
+    {
+        entityd::netns_guard guard{ hops[i] };
+        auto forwarding = std::fopen("/proc/sys/net/ipv4/ip_forward", "w");
+        std::fputs("1", forwarding);
+        std::fclose(forwarding);
+
+        entityd::netlink::socket socket;
+        socket.set_link_group("nu-h" + std::to_string(i), entityd::router::uplink_group);
+        socket.set_link_group("nd-h" + std::to_string(i - 1), entityd::router::downlink_group);
+        socket.commit_or_throw();
+    }
+
+    return hops;
+}
+
+void no_rulesets(const std::vector<int> & hops)
+{
+    for (std::size_t i = 1; i < hops.size() - 1; ++i)
+    {
+        entityd::nftables::socket socket{ hops[i] };
+        socket.add_table(entityd::nftables::ruleset_table);
+        socket.delete_table(entityd::nftables::ruleset_table);
+        socket.commit();
+    }
+}
+
+void load_rulesets(const std::vector<int> & hops, bool offload)
+{
+    for (std::size_t i = 1; i < hops.size() - 1; ++i)
+    {
+        entityd::netns_guard guard{ hops[i] };
+        entityd::router::load_ruleset("h" + std::to_string(i), offload);
+        if (offload)
+        {
+            entityd::router::offload_downlink(hops[i], "nd-h" + std::to_string(i - 1));
+        }
+    }
+}
+
+// Streams data from the client to the server for the given time, and returns how much of it has arrived.
+std::size_t stream(const std::vector<int> & hops, std::chrono::duration<double> duration)
+{
+    sockaddr_in server_address{ .sin_family = AF_INET, .sin_port = htons(5000) };
+    inet_pton(AF_INET, address(hops.size() - 2, 1).c_str(), &server_address.sin_addr);
+
+    int listener;
+    {
+        entityd::netns_guard guard{ hops.back() };
+        listener = ::socket(AF_INET, SOCK_STREAM, 0);
+    }
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(listener, reinterpret_cast<sockaddr *>(&server_address), sizeof(server_address)) == -1
+        || listen(listener, 1) == -1)
+    {
+        throw std::runtime_error("Failed to set up the server");
+    }
+
+    std::size_t received = 0;
+    std::thread server{ [&] {
+        auto connection = accept(listener, nullptr, nullptr);
+        std::vector<char> buffer(1 << 20);
+        ssize_t size;
+        while ((size = recv(connection, buffer.data(), buffer.size(), 0)) > 0)
+        {
+            received += size;
+        }
+        close(connection);
+    } };
+
+    int client;
+    {
+        entityd::netns_guard guard{ hops.front() };
+        client = ::socket(AF_INET, SOCK_STREAM, 0);
+    }
+    if (connect(client, reinterpret_cast<sockaddr *>(&server_address), sizeof(server_address)) == -1)
+    {
+        close(client);
+        shutdown(listener, SHUT_RDWR);
+        server.join();
+        close(listener);
+        throw std::runtime_error("Failed to connect to the server");
+    }
+
+    std::vector<char> buffer(1 << 16);
+    auto end = std::chrono::steady_clock::now() + duration;
+    while (std::chrono::steady_clock::now() < end)
+    {
+        send(client, buffer.data(), buffer.size(), 0);
+    }
+
+    close(client);
+    server.join();
+    close(listener);
+    return received;
+}
+}
+
+int main(int argc, char ** argv)
+try
+{
+    auto routers = argc > 1 ? std::stoi(argv[1]) : 4;
+    auto seconds = argc > 2 ? std::stod(argv[2]) : 3;
+
+    auto hops = build_chain(routers);
+
+    for (auto [name, configure] :
+         { std::pair<const char *, void (*)(const std::vector<int> &)>{ "no rulesets", &no_rulesets },
+           { "rulesets", [](auto & hops) { load_rulesets(hops, false); } },
+           { "rulesets with offload", [](auto & hops) { load_rulesets(hops, true); } } })
+    {
+        try
+        {
+            configure(hops);
+            auto bytes = stream(hops, std::chrono::duration<double>(seconds));
+            std::cout << name << ", " << routers << " routers: " << bytes << " bytes in " << seconds << " s, "
+                      << bytes * 8 / seconds / 1e9 << " Gbit/s\n";
+        }
+        catch (std::exception & ex)
+        {
+            std::cout << name << ", " << routers << " routers: failed: " << ex.what() << '\n';
+        }
+    }
+}
+catch (std::exception & ex)
+{
+    std::cerr << "Error: " << ex.what() << '\n';
+    return 1;
+}
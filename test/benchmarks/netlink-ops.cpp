@@ -0,0 +1,169 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compares the rate at which the operations entityd performs to connect an entity get done when each of them
+// is an `ip` command, the way entityd used to do them, against doing them over netlink: a batch per entity,
+// the way entityd does them now, and a batch per operation for all entities at once.
+//
+// Usage: benchmark-netlink-ops [entity count]
+//
+// Must be run as root. Everything happens in a pair of fresh network namespaces, which go away with the
+// process.
+
+#include "../../entityd/netlink.h"
+#include "../../entityd/netns.h"
+
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include <sched.h>
+
+namespace
+{
+// Creating a veth pair with one end in the uplink namespace, adding an address to the other, bringing the
+// uplink end up, and removing the pair.
+constexpr int operations_per_entity = 4;
+
+std::string address(int i)
+{
+    return "10." + std::to_string(i / 250) + "." + std::to_string(i % 250 + 1) + ".2/16";
+}
+
+void run(const std::string & command)
+{
+    if (std::system(command.c_str()) != 0)
+    {
+        throw std::runtime_error(command + " failed");
+    }
+}
+
+void shell(int count, int uplink_netns)
+{
+    auto uplink = entityd::netns_path(uplink_netns);
+
+    for (int i = 0; i < count; ++i)
+    {
+        auto n = std::to_string(i);
+        run("ip link add nu-" + n + " up type veth peer nd-" + n + " netns " + uplink);
+        run("ip addr add " + address(i) + " dev nu-" + n);
+
+        entityd::netns_guard guard{ uplink_netns };
+        run("ip link set nd-" + n + " up");
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        run("ip link del nu-" + std::to_string(i));
+    }
+}
+
+void netlink_per_entity(int count, int uplink_netns)
+{
+    entityd::netlink::socket own;
+    entityd::netlink::socket uplink{ uplink_netns };
+
+    for (int i = 0; i < count; ++i)
+    {
+        auto n = std::to_string(i);
+        own.create_veth("nu-" + n, "nd-" + n, uplink_netns);
+        own.commit_or_throw();
+
+        auto index = own.find_link("nu-" + n);
+        assert(index);
+        own.add_address(*index, *entityd::netlink::parse_interface_address(address(i)));
+        own.commit_or_throw();
+
+        uplink.set_link_up("nd-" + n);
+        uplink.commit_or_throw();
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        own.delete_link("nu-" + std::to_string(i));
+        own.commit_or_throw();
+    }
+}
+
+void netlink_batched(int count, int uplink_netns)
+{
+    entityd::netlink::socket own;
+    entityd::netlink::socket uplink{ uplink_netns };
+
+    for (int i = 0; i < count; ++i)
+    {
+        auto n = std::to_string(i);
+        own.create_veth("nu-" + n, "nd-" + n, uplink_netns);
+        uplink.set_link_up("nd-" + n);
+    }
+    own.commit_or_throw();
+    uplink.commit_or_throw();
+
+    for (auto && link : own.dump_links())
+    {
+        if (link.name.starts_with("nu-"))
+        {
+            auto i = std::stoi(link.name.substr(3));
+            own.add_address(link.index, *entityd::netlink::parse_interface_address(address(i)));
+        }
+    }
+    own.commit_or_throw();
+
+    for (int i = 0; i < count; ++i)
+    {
+        own.delete_link("nu-" + std::to_string(i));
+    }
+    own.commit_or_throw();
+}
+}
+
+int main(int argc, char ** argv)
+try
+{
+    auto count = argc > 1 ? std::stoi(argv[1]) : 200;
+
+    if (unshare(CLONE_NEWNET) == -1)
+    {
+        perror("Failed to create the uplink namespace");
+        return 1;
+    }
+    auto uplink_netns = entityd::open_current_netns();
+
+    if (unshare(CLONE_NEWNET) == -1)
+    {
+        perror("Failed to create the entity namespace");
+        return 1;
+    }
+
+    for (auto [name, backend] : { std::pair{ "shell", &shell },
+                                  std::pair{ "netlink, batch per entity", &netlink_per_entity },
+                                  std::pair{ "netlink, batch per operation", &netlink_batched } })
+    {
+        auto start = std::chrono::steady_clock::now();
+        backend(count, uplink_netns);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cout << name << ": " << count * operations_per_entity << " operations in " << elapsed.count()
+                  << " s, " << count * operations_per_entity / elapsed.count() << " operations/s\n";
+    }
+}
+catch (std::exception & ex)
+{
+    std::cerr << "Error: " << ex.what() << '\n';
+    return 1;
+}
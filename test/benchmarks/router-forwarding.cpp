@@ -0,0 +1,277 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compares the rate at which a router with many downlinks forwards packets from one of them to its uplink,
+// depending on how its ruleset tells the links apart: by matching their names against wildcards, the way the
+// static ruleset routers used to load did, with a rule for each downlink, the way a ruleset naming every link
+// would, and by looking their interface groups up in verdict maps, the way the ruleset entityd loads does.
+//
+// Usage: benchmark-router-forwarding [downlink count] [seconds per ruleset]
+//
+// Must be run as root. Everything happens in fresh network namespaces, which go away with the process.
+
+#include "../../entityd/netlink.h"
+#include "../../entityd/netns.h"
+#include "../../entityd/nftables.h"
+#include "../../entityd/router.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <thread>
+
+namespace
+{
+using entityd::nftables::rule;
+using entityd::nftables::verdict;
+
+const std::string & table = entityd::nftables::ruleset_table;
+
+int create_netns()
+{
+    entityd::netns_guard guard{ -1 };
+    if (unshare(CLONE_NEWNET) == -1)
+    {
+        throw std::runtime_error("Failed to create a network namespace");
+    }
+
+    auto fd = entityd::open_current_netns();
+    entityd::netlink::socket socket;
+    socket.set_link_up("lo");
+    socket.commit_or_throw();
+    return fd;
+}
+
+void add_address(int netns, const std::string & link, const std::string & address)
+{
+    entityd::netlink::socket socket{ netns };
+    auto index = socket.find_link(link);
+    if (!index)
+    {
+        throw std::runtime_error("No link " + link);
+    }
+    socket.add_address(*index, *entityd::netlink::parse_interface_address(address));
+    socket.set_link_up(link);
+    socket.commit_or_throw();
+}
+
+void add_default_route(int netns, const std::string & gateway)
+{
+    entityd::netlink::socket socket{ netns };
+    socket.add_route({ .destination = 0, .prefix_length = 0 }, *entityd::netlink::parse_address(gateway));
+    socket.commit_or_throw();
+}
+
+void base_chains(entityd::nftables::socket & socket)
+{
+    socket.add_table(table);
+    socket.delete_table(table);
+    socket.add_table(table);
+    socket.add_chain(table, "input", "filter", { entityd::nftables::hook::input, 0 }, verdict::accept);
+    socket.add_chain(table, "forward", "filter", { entityd::nftables::hook::forward, 0 }, verdict::drop);
+    socket.add_chain(
+        table, "postrouting", "nat", { entityd::nftables::hook::postrouting, 100 }, verdict::accept);
+}
+
+void wildcards(int)
+{
+    entityd::nftables::socket socket;
+    base_chains(socket);
+    socket.add_rule(table, "input", rule().l4proto(IPPROTO_ICMP).accept());
+    socket.add_rule(table, "input", rule().iifname("nd-*").accept());
+    socket.add_rule(table, "input", rule().iifname("nu-*").drop());
+    socket.add_rule(table, "forward", rule().iifname("nd-*").oifname("nu-*").accept());
+    socket.add_rule(
+        table,
+        "forward",
+        rule()
+            .iifname("nu-*")
+            .oifname("nd-*")
+            .ct_state(entityd::nftables::ct_established | entityd::nftables::ct_related)
+            .accept());
+    socket.add_rule(table, "postrouting", rule().oifname("nu-*").masquerade());
+    socket.commit();
+}
+
+void rule_per_downlink(int count)
+{
+    entityd::nftables::socket socket;
+    base_chains(socket);
+    socket.add_rule(table, "input", rule().l4proto(IPPROTO_ICMP).accept());
+    for (int i = 0; i < count; ++i)
+    {
+        // Keeps transactions within the size of the socket buffer.
+        if (i % 100 == 99)
+        {
+            socket.commit();
+        }
+
+        auto downlink = "nd-" + std::to_string(i);
+        socket.add_rule(table, "input", rule().iifname(downlink).accept());
+        socket.add_rule(table, "forward", rule().iifname(downlink).oifname("nu-router").accept());
+        socket.add_rule(
+            table,
+            "forward",
+            rule()
+                .iifname("nu-router")
+                .oifname(downlink)
+                .ct_state(entityd::nftables::ct_established | entityd::nftables::ct_related)
+                .accept());
+    }
+    socket.add_rule(table, "input", rule().iifname("nu-router").drop());
+    socket.add_rule(table, "postrouting", rule().oifname("nu-router").masquerade());
+    socket.commit();
+}
+
+void groups(int)
+{
+    entityd::router::load_ruleset("router", false);
+}
+
+// Sends small datagrams for the given time, and returns how many of them made it to the receiver.
+std::size_t forward(int downstream_netns, int upstream_netns, std::chrono::duration<double> duration)
+{
+    int receiver;
+    {
+        entityd::netns_guard guard{ upstream_netns };
+        receiver = ::socket(AF_INET, SOCK_DGRAM, 0);
+    }
+    sockaddr_in address{ .sin_family = AF_INET, .sin_port = htons(5000) };
+    inet_pton(AF_INET, "10.255.0.1", &address.sin_addr);
+    if (bind(receiver, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1)
+    {
+        throw std::runtime_error("Failed to bind the receiver");
+    }
+    timeval timeout{ .tv_usec = 200000 };
+    setsockopt(receiver, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    std::atomic<std::size_t> received = 0;
+    std::thread counter{ [&] {
+        char buffer[64];
+        while (recv(receiver, buffer, sizeof(buffer), 0) > 0)
+        {
+            ++received;
+        }
+    } };
+
+    int sender;
+    {
+        entityd::netns_guard guard{ downstream_netns };
+        sender = ::socket(AF_INET, SOCK_DGRAM, 0);
+    }
+    connect(sender, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+
+    char payload[32] = {};
+    auto end = std::chrono::steady_clock::now() + duration;
+    while (std::chrono::steady_clock::now() < end)
+    {
+        for (int i = 0; i < 64; ++i)
+        {
+            send(sender, payload, sizeof(payload), 0);
+        }
+    }
+
+    counter.join();
+    close(sender);
+    close(receiver);
+    return received;
+}
+}
+
+int main(int argc, char ** argv)
+try
+{
+    auto count = argc > 1 ? std::stoi(argv[1]) : 500;
+    auto seconds = argc > 2 ? std::stod(argv[2]) : 3;
+
+    auto upstream = create_netns();
+    auto router = create_netns();
+    auto downstream = create_netns();
+
+    {
+        entityd::netns_guard guard{ router };
+        auto forwarding = std::fopen("/proc/sys/net/ipv4/ip_forward", "w");
+        std::fputs("1", forwarding);
+        std::fclose(forwarding);
+    }
+
+    entityd::netlink::socket socket{ router };
+    socket.create_veth("nu-router", "nd-router", upstream);
+    socket.commit_or_throw();
+    socket.set_link_group("nu-router", entityd::router::uplink_group);
+    socket.commit_or_throw();
+    add_address(upstream, "nd-router", "10.255.0.1/24");
+    add_address(router, "nu-router", "10.255.0.2/24");
+    add_default_route(router, "10.255.0.1");
+
+    // Only the last downlink carries traffic, so the rules matching it come after the rules for all others.
+    for (int i = 0; i < count; ++i)
+    {
+        auto n = std::to_string(i);
+        socket.create_veth("nd-" + n, "nu-" + n, downstream);
+        socket.commit_or_throw();
+        socket.set_link_group("nd-" + n, entityd::router::downlink_group);
+    }
+    socket.commit_or_throw();
+
+    auto last = std::to_string(count - 1);
+    add_address(router, "nd-" + last, "10.0.0.1/24");
+    add_address(downstream, "nu-" + last, "10.0.0.2/24");
+    add_default_route(downstream, "10.0.0.1");
+
+    // The links take a while to become usable after they are created, and more so the more of them there are.
+    for (int attempt = 0; forward(downstream, upstream, std::chrono::milliseconds(100)) == 0; ++attempt)
+    {
+        if (attempt == 100)
+        {
+            throw std::runtime_error("Nothing gets forwarded");
+        }
+    }
+
+    // The links take a while to become usable after they are created, the longer the more of them there are.
+    for (int attempt = 0; forward(downstream, upstream, std::chrono::milliseconds(100)) == 0; ++attempt)
+    {
+        if (attempt == 100)
+        {
+            throw std::runtime_error("Nothing gets forwarded");
+        }
+    }
+
+    entityd::netns_guard guard{ router };
+
+    for (auto [name, load] : { std::pair{ "wildcards", &wildcards },
+                               std::pair{ "rule per downlink", &rule_per_downlink },
+                               std::pair{ "groups", &groups } })
+    {
+        load(count);
+        auto forwarded = forward(downstream, upstream, std::chrono::duration<double>(seconds));
+        std::cout << name << ", " << count << " downlinks: " << forwarded << " packets forwarded in "
+                  << seconds << " s, " << forwarded / seconds << " packets/s\n";
+    }
+}
+catch (std::exception & ex)
+{
+    std::cerr << "Error: " << ex.what() << '\n';
+    return 1;
+}
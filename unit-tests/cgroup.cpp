@@ -0,0 +1,77 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../daemon/cgroup.h"
+
+#include <cassert>
+#include <stdexcept>
+
+namespace
+{
+nonsensed::resource_controls parse(const char * component)
+{
+    return nonsensed::parse_resource_controls(nlohmann::json::parse(component));
+}
+
+bool rejected(const char * component)
+{
+    try
+    {
+        parse(component);
+    }
+    catch (std::invalid_argument &)
+    {
+        return true;
+    }
+    return false;
+}
+}
+
+int main()
+{
+    auto defaults = nonsensed::parse_resource_controls(nlohmann::json::object());
+    assert(defaults.cpu_weight == 100);
+    assert(defaults.io_weight == 100);
+    assert(defaults.memory_max == UINT64_MAX);
+    assert(defaults.allowed_cpus.empty());
+
+    auto controls =
+        parse(R"({ "cpu_weight": 500, "io_weight": 20, "memory_max": "64M", "allowed_cpus": "0-2,9" })");
+    assert(controls.cpu_weight == 500);
+    assert(controls.io_weight == 20);
+    assert(controls.memory_max == 64 << 20);
+    assert(controls.allowed_cpus == "0-2,9");
+
+    assert(parse(R"({ "memory_max": 4096 })").memory_max == 4096);
+    assert(parse(R"({ "memory_max": "infinity" })").memory_max == UINT64_MAX);
+    assert(parse(R"({ "allowed_cpus": 3 })").allowed_cpus == "3");
+
+    assert(rejected(R"({ "cpu_weight": 0 })"));
+    assert(rejected(R"({ "io_weight": 10001 })"));
+    assert(rejected(R"({ "memory_max": "12X" })"));
+    assert(rejected(R"({ "memory_max": -1 })"));
+    assert(rejected(R"({ "memory_max": "99999999999T" })"));
+    assert(parse(R"({ "memory_max": "16777215T" })").memory_max == std::uint64_t(16777215) << 40);
+    assert(rejected(R"({ "allowed_cpus": "3-1" })"));
+    assert(rejected(R"({ "allowed_cpus": "a" })"));
+    assert(rejected(R"({ "cpu_quota": 1 })"));
+
+    auto mask = nonsensed::cpu_set_mask("0-2,9");
+    assert(mask.size() == 2);
+    assert(mask[0] == 0b111);
+    assert(mask[1] == 0b10);
+    assert(nonsensed::cpu_set_mask("").empty());
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../daemon/cli.h"
+#include "../daemon/config.h"
+
+#include <cassert>
+#include <tuple>
+
+namespace nonsensed
+{
+struct config_test
+{
+    config & cfg;
+
+    bool resolved(const std::string & name) const
+    {
+        return cfg._resolved.contains(name);
+    }
+
+    const std::string & payload(const std::string & name) const
+    {
+        return cfg._component_payload(name, "network");
+    }
+};
+}
+
+int main(int argc, char ** argv)
+{
+    auto opts = nonsensed::options(argc, argv);
+    auto running = nonsensed::config(opts);
+
+    // A chain of switches, and another one next to it; switches don't get addresses in the subnets of their
+    // uplinks, so resolving them doesn't need the address pool of the service.
+    {
+        auto candidate = running;
+        assert(candidate.add("uplink", { { "network.role", "root" } }).error_code == 0);
+        for (auto [name, address, uplink] : { std::tuple("top", "10.1.0.0/16", "uplink"),
+                                              std::tuple("middle", "10.2.0.0/16", "top"),
+                                              std::tuple("bottom", "10.3.0.0/16", "middle"),
+                                              std::tuple("aside", "10.4.0.0/16", "top") })
+        {
+            auto result = candidate.add(
+                name,
+                { { "network.role", "switch" },
+                  { "network.address", address },
+                  { "network.uplink", uplink } });
+            assert(result.error_code == 0);
+        }
+        running = candidate;
+    }
+
+    nonsensed::config_test test{ running };
+
+    std::vector<std::string> names = { "uplink", "top", "middle", "bottom", "aside" };
+    std::unordered_map<std::string, const std::string *> payloads;
+    for (auto && name : names)
+    {
+        payloads[name] = &test.payload(name);
+    }
+    assert(payloads["bottom"]->find("10.2.0.0/16") != std::string::npos);
+
+    // Changing an entity drops the resolved forms of it and of everything downstream of it, and nothing else.
+    {
+        auto candidate = running;
+        assert(candidate.set("middle", { { "network.address", "10.5.0.0/16" } }).error_code == 0);
+        running = candidate;
+    }
+
+    for (auto && name : { "uplink", "top", "aside" })
+    {
+        assert(test.resolved(name));
+        assert(&test.payload(name) == payloads[name]);
+    }
+    for (auto && name : { "middle", "bottom" })
+    {
+        assert(!test.resolved(name));
+    }
+
+    assert(test.payload("middle").find("10.5.0.0/16") != std::string::npos);
+    assert(test.payload("bottom").find("10.5.0.0/16") != std::string::npos);
+    assert(test.payload("bottom").find("10.2.0.0/16") == std::string::npos);
+
+    for (auto && name : names)
+    {
+        payloads[name] = &test.payload(name);
+    }
+
+    // Removing an entity drops only its own resolved form, since it can't have any downlinks left.
+    {
+        auto candidate = running;
+        assert(candidate.remove("bottom").error_code == 0);
+        running = candidate;
+    }
+
+    assert(!test.resolved("bottom"));
+    for (auto && name : { "uplink", "top", "middle", "aside" })
+    {
+        assert(test.resolved(name));
+        assert(&test.payload(name) == payloads[name]);
+    }
+}
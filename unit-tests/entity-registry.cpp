@@ -0,0 +1,167 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../daemon/async.h"
+#include "../daemon/registry.h"
+
+#include <cassert>
+
+using nonsensed::promise;
+using nonsensed::coro::coroutine_handle;
+
+// Runs a lifecycle operation on the entity in a coroutine that suspends until resumed from the outside, and
+// then fails with the given error, or, without one, finishes without completing the operation.
+nonsensed::subtask failing_operation(
+    nonsensed::entity_registry & registry,
+    const char * name,
+    coroutine_handle<promise> & suspended,
+    const char * error)
+{
+    return [&registry, name, &suspended, error](
+               [[maybe_unused]] coroutine_handle<promise> nonsense_promise_arg) -> nonsensed::future {
+        nonsensed::lifecycle_operation operation{
+            registry, name, nonsensed::lifecycle_phase::waiting, co_await nonsensed::async::current_promise()
+        };
+
+        struct
+        {
+            coroutine_handle<promise> & suspended;
+
+            bool await_ready()
+            {
+                return false;
+            }
+
+            void await_suspend(coroutine_handle<promise> handle)
+            {
+                suspended = handle;
+            }
+
+            void await_resume()
+            {
+            }
+        } suspend{ suspended };
+
+        co_await suspend;
+
+        if (error)
+        {
+            co_return nonsensed::reply_error_format("info.griwes.nonsense.Test", "%s", error);
+        }
+
+        co_return nonsensed::unit;
+    };
+}
+
+int main()
+{
+    using nonsensed::lifecycle_phase;
+
+    nonsensed::entity_registry registry;
+    // Stands in for the promise of a coroutine running the operations below, which never fails.
+    promise owner{ coroutine_handle<promise>() };
+
+    assert(registry.get("ent1").phase == lifecycle_phase::inactive);
+    assert(registry.get("ent1").phase_since == 0);
+
+    {
+        nonsensed::lifecycle_operation operation{ registry, "ent1", lifecycle_phase::waiting, owner };
+        assert(registry.get("ent1").phase == lifecycle_phase::waiting);
+
+        operation.enter(lifecycle_phase::spawning);
+        registry.set_pid("ent1", 1234);
+        operation.enter(lifecycle_phase::configuring);
+        operation.complete(lifecycle_phase::active);
+    }
+
+    auto & status = registry.get("ent1");
+    assert(status.phase == lifecycle_phase::active);
+    assert(status.pid == 1234);
+    assert(status.started_at != 0);
+    assert(status.started_at == status.phase_since);
+    assert(status.last_error.empty());
+
+    // The phase the entity is in now has no recorded duration yet; the phases it went through do, and the
+    // inactive phase it was in before doesn't, because it was never entered.
+    assert(status.durations[static_cast<std::size_t>(lifecycle_phase::inactive)] == 0);
+    assert(status.durations[static_cast<std::size_t>(lifecycle_phase::active)] == 0);
+
+    auto started_at = status.started_at;
+
+    {
+        nonsensed::lifecycle_operation operation{ registry, "ent1", lifecycle_phase::reconfiguring, owner };
+        operation.complete(lifecycle_phase::active);
+    }
+
+    assert(status.started_at == started_at);
+
+    {
+        nonsensed::lifecycle_operation operation{ registry, "ent1", lifecycle_phase::stopping, owner };
+        // Torn down without completing, like a coroutine destroyed by an error.
+    }
+
+    assert(status.phase == lifecycle_phase::failed);
+    assert(status.pid == 1234);
+
+    {
+        nonsensed::lifecycle_operation operation{ registry, "ent1", lifecycle_phase::stopping, owner };
+        operation.complete(lifecycle_phase::inactive);
+    }
+
+    assert(status.phase == lifecycle_phase::inactive);
+    assert(status.pid == 0);
+    assert(status.started_at == 0);
+
+    {
+        // Hibernating an entity forgets its process, like stopping it does.
+        nonsensed::lifecycle_operation operation{ registry, "ent1", lifecycle_phase::waiting, owner };
+        registry.set_pid("ent1", 5678);
+        operation.complete(lifecycle_phase::active);
+    }
+
+    {
+        nonsensed::lifecycle_operation operation{ registry, "ent1", lifecycle_phase::stopping, owner };
+        operation.complete(lifecycle_phase::hibernated);
+    }
+
+    assert(status.phase == lifecycle_phase::hibernated);
+    assert(status.pid == 0);
+    assert(status.started_at == 0);
+    assert(nonsensed::to_string(lifecycle_phase::hibernated) == "hibernated");
+
+    assert(registry.get("ent2").phase == lifecycle_phase::inactive);
+    assert(nonsensed::to_string(lifecycle_phase::creating_units) == "creating-units");
+
+    {
+        // An operation that fails is marked with the error of its own coroutine, not with whatever error some
+        // other operation has failed with in the meantime.
+        coroutine_handle<promise> first, second;
+        auto ignore = [](const nonsensed::reply_status_t *) {};
+
+        nonsensed::async::detach(failing_operation(registry, "ent3", first, "first failed"), ignore);
+        nonsensed::async::detach(failing_operation(registry, "ent4", second, nullptr), ignore);
+        assert(registry.get("ent3").phase == lifecycle_phase::waiting);
+        assert(registry.get("ent4").phase == lifecycle_phase::waiting);
+
+        first.resume();
+        assert(registry.get("ent3").phase == lifecycle_phase::failed);
+        assert(registry.get("ent3").last_error == "first failed");
+
+        second.resume();
+        assert(registry.get("ent4").phase == lifecycle_phase::failed);
+        assert(registry.get("ent4").last_error.empty());
+    }
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "../daemon/ipam.h"
+
+#include <cassert>
+#include <set>
+
+int main()
+{
+    using nonsensed::parse_subnet;
+
+    // Any prefix length is understood, and host bits are dropped.
+    auto subnet = parse_subnet("10.1.2.3/20");
+    assert(subnet);
+    assert(to_string(*subnet) == "10.1.0.0/20");
+    assert(subnet->size() == 4096);
+
+    assert(!parse_subnet("10.1.0.0"));
+    assert(!parse_subnet("10.1.0.0/33"));
+    assert(!parse_subnet("10.1.0/24"));
+    assert(!parse_subnet("10.1.0.0/2x"));
+
+    {
+        // The network address, the two addresses of the switch, and the broadcast address are never handed
+        // out.
+        nonsensed::address_pool pool{ *parse_subnet("192.168.0.0/29") };
+
+        std::set<std::uint32_t> hosts;
+        while (auto host = pool.allocate())
+        {
+            hosts.insert(*host);
+        }
+        assert((hosts == std::set<std::uint32_t>{ 3, 4, 5, 6 }));
+
+        // Released hosts are handed out again.
+        pool.release(5);
+        assert(pool.allocate() == 5u);
+        assert(!pool.allocate());
+
+        assert(!pool.reserve(4));
+        assert(!pool.reserve(7));
+        assert(!pool.reserve(1));
+    }
+
+    {
+        // Reserved hosts, as restored from stored leases, are skipped both by the cursor and when reused.
+        nonsensed::address_pool pool{ *parse_subnet("192.168.0.0/24") };
+        assert(pool.allocate() == 3u);
+        pool.release(3);
+        assert(pool.reserve(3));
+        assert(pool.reserve(4));
+        assert(pool.allocate() == 5u);
+    }
+
+    {
+        nonsensed::address_pool pool{ *parse_subnet("10.0.0.0/16") };
+        std::set<std::uint32_t> hosts;
+        for (int i = 0; i < 65532; ++i)
+        {
+            auto host = pool.allocate();
+            assert(host && hosts.insert(*host).second);
+        }
+        assert(!pool.allocate());
+    }
+
+    {
+        nonsensed::ipam ipam;
+        auto first = parse_subnet("192.168.2.0/24");
+        auto second = parse_subnet("192.168.3.0/28");
+
+        assert(ipam.lease("client1", "switch1", *first) == "192.168.2.3/24");
+        assert(ipam.lease("client2", "switch1", *first) == "192.168.2.4/24");
+
+        // A lease is kept for as long as the entity asks for an address in the same subnet.
+        assert(ipam.lease("client1", "switch1", *first) == "192.168.2.3/24");
+        assert(ipam.address_of("client1") == "192.168.2.3/24");
+        assert(!ipam.address_of("client3"));
+
+        // Moving to another switch gives the previous address back.
+        assert(ipam.lease("client1", "switch2", *second) == "192.168.3.3/28");
+        assert(ipam.lease("client3", "switch1", *first) == "192.168.2.3/24");
+
+        ipam.release("client2");
+        assert(!ipam.address_of("client2"));
+        assert(ipam.lease("client4", "switch1", *first) == "192.168.2.4/24");
+
+        // A switch changing its subnet drops the leases in the previous one.
+        auto changed = parse_subnet("10.0.0.0/8");
+        assert(ipam.lease("client3", "switch1", *changed) == "10.0.0.3/8");
+        assert(ipam.lease("client4", "switch1", *changed) == "10.0.0.4/8");
+
+        ipam.retain({ "client1" });
+        assert(ipam.lease("client5", "switch1", *changed) == "10.0.0.3/8");
+        assert(ipam.lease("client1", "switch2", *second) == "192.168.3.3/28");
+
+        ipam.flush();
+    }
+}
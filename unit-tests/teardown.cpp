@@ -0,0 +1,84 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../entityd/nftables.h"
+#include "../entityd/teardown.h"
+
+#include <cassert>
+
+namespace
+{
+using kind = entityd::journal::record::kind;
+
+template<typename... Ts>
+std::vector<std::string> strings(Ts... values)
+{
+    return { values... };
+}
+}
+
+int main()
+{
+    // The journal of a router connected to its uplink, with a subnet routed to it from there, a bridge of its
+    // own, its ruleset, and the mount of its namespace.
+    std::vector<entityd::journal::record> records = {
+        { kind::link, "uplink", "nd-edge" },
+        { kind::link, "edge", "nu-edge" },
+        { kind::route, "uplink", "192.168.3.0/24" },
+        { kind::link, "edge", "nb-edge" },
+        { kind::route, "edge", "10.0.0.0/8" },
+        { kind::table, "edge", entityd::nftables::ruleset_table },
+        { kind::mount, "", "/var/run/netns/nonsense:edge" },
+    };
+
+    // When the namespace of the entity is destroyed with it, whatever is inside of it goes away on its own,
+    // except for the entity end of the veth pair, which takes the uplink end with it.
+    auto plan = entityd::plan_teardown("edge", records, true);
+    assert(plan.batches.size() == 2);
+    assert(plan.batches.at("edge").links == strings("nu-edge"));
+    assert(plan.batches.at("edge").routes.empty());
+    assert(plan.batches.at("edge").tables.empty());
+    assert(plan.batches.at("uplink").links.empty());
+    assert(plan.batches.at("uplink").routes == strings("192.168.3.0/24"));
+    assert(plan.batches.at("uplink").tables.empty());
+    assert(plan.mounts == strings("/var/run/netns/nonsense:edge"));
+
+    // When it outlives the entity, everything recorded in it is removed, including the ruleset.
+    plan = entityd::plan_teardown("edge", records, false);
+    assert(plan.batches.size() == 2);
+    assert(plan.batches.at("edge").links == strings("nu-edge", "nb-edge"));
+    assert(plan.batches.at("edge").routes == strings("10.0.0.0/8"));
+    assert(plan.batches.at("edge").tables == strings(entityd::nftables::ruleset_table));
+    assert(plan.batches.at("uplink").links.empty());
+    assert(plan.batches.at("uplink").routes == strings("192.168.3.0/24"));
+    assert(plan.batches.at("uplink").tables.empty());
+    assert(plan.mounts == strings("/var/run/netns/nonsense:edge"));
+
+    // Without the entity end of the pair, there's nothing to take the uplink end with it.
+    records = {
+        { kind::link, "uplink", "nd-edge" },
+        { kind::route, "edge", "10.0.0.0/8" },
+        { kind::table, "edge", entityd::nftables::ruleset_table },
+    };
+
+    for (auto netns_dies : { true, false })
+    {
+        plan = entityd::plan_teardown("edge", records, netns_dies);
+        assert(plan.batches.at("uplink").links == strings("nd-edge"));
+        assert(plan.batches.contains("edge") != netns_dies);
+        assert(plan.mounts.empty());
+    }
+}
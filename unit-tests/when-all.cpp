@@ -0,0 +1,216 @@
+/*
+ * Copyright © 2020-2021 Michał 'Griwes' Dominiak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../daemon/async.h"
+#include "../daemon/cli.h"
+
+#include <cassert>
+#include <vector>
+
+using nonsensed::promise;
+using nonsensed::coro::coroutine_handle;
+
+// A subtask that suspends until resumed from the outside, and then either completes or fails.
+struct pending_task
+{
+    coroutine_handle<promise> handle = nullptr;
+    bool fail = false;
+    bool done = false;
+
+    nonsensed::subtask run()
+    {
+        return [this](coroutine_handle<promise> nonsense_promise_arg) -> nonsensed::future {
+            struct
+            {
+                pending_task & self;
+
+                bool await_ready()
+                {
+                    return false;
+                }
+
+                void await_suspend(coroutine_handle<promise> handle)
+                {
+                    self.handle = handle;
+                }
+
+                void await_resume()
+                {
+                }
+            } suspend{ *this };
+
+            co_await suspend;
+
+            done = true;
+
+            if (fail)
+            {
+                co_return nonsensed::reply_status(-EINVAL);
+            }
+
+            co_return nonsensed::unit;
+        };
+    }
+};
+
+// Stands in for a top level coroutine: waits for the outcome of a when_all group to be reported to a join
+// state, and records that it has been.
+struct observer
+{
+    nonsensed::join_state & state;
+    bool finished = false;
+
+    nonsensed::future run(sd_bus_message *, sd_bus_error *)
+    {
+        struct
+        {
+            nonsensed::join_state & state;
+
+            bool await_ready()
+            {
+                return false;
+            }
+
+            void await_suspend(coroutine_handle<promise> handle)
+            {
+                state.continuation = handle;
+            }
+
+            void await_resume()
+            {
+            }
+        } wait{ state };
+
+        co_await wait;
+        finished = true;
+
+        co_await nonsensed::coro::suspend_always();
+        co_return nonsensed::unit;
+    }
+};
+
+struct group
+{
+    nonsensed::join_state state{ .remaining = 1 };
+    observer watcher{ state };
+
+    group(std::vector<nonsensed::subtask> tasks)
+    {
+        watcher.run(nullptr, nullptr);
+        nonsensed::async::_join_one(&state, nonsensed::async::when_all(std::move(tasks)));
+    }
+};
+
+int main(int argc, char ** argv)
+{
+    auto opts = nonsensed::options(argc, argv);
+
+    {
+        // An empty group completes immediately.
+        group empty({});
+        assert(empty.watcher.finished);
+        assert(!empty.state.error);
+    }
+
+    {
+        // A group completes only once all of its subtasks are done, regardless of the order they finish in.
+        pending_task a, b, c;
+
+        std::vector<nonsensed::subtask> tasks;
+        tasks.push_back(a.run());
+        tasks.push_back(b.run());
+        tasks.push_back(c.run());
+
+        group all(std::move(tasks));
+
+        assert(a.handle && b.handle && c.handle);
+        assert(!all.watcher.finished);
+
+        b.handle.resume();
+        assert(b.done && !all.watcher.finished);
+        c.handle.resume();
+        assert(c.done && !all.watcher.finished);
+        a.handle.resume();
+        assert(a.done && all.watcher.finished);
+        assert(!all.state.error);
+    }
+
+    {
+        // A failing subtask does not stop the others, and its error is reported once all of them are done.
+        pending_task a, b;
+        b.fail = true;
+
+        std::vector<nonsensed::subtask> tasks;
+        tasks.push_back(a.run());
+        tasks.push_back(b.run());
+
+        group failing(std::move(tasks));
+
+        b.handle.resume();
+        assert(!failing.watcher.finished);
+        a.handle.resume();
+        assert(a.done && failing.watcher.finished);
+        assert(failing.state.error && failing.state.error->code == -EINVAL);
+    }
+
+    {
+        // A detached subtask reports its outcome to the callback once it's done, and not before.
+        pending_task a, b;
+        b.fail = true;
+
+        int a_code = 1;
+        int b_code = 1;
+
+        nonsensed::async::detach(
+            a.run(), [&](const nonsensed::reply_status_t * error) { a_code = error ? error->code : 0; });
+        nonsensed::async::detach(
+            b.run(), [&](const nonsensed::reply_status_t * error) { b_code = error ? error->code : 0; });
+        assert(a_code == 1 && b_code == 1);
+
+        a.handle.resume();
+        assert(a_code == 0);
+        b.handle.resume();
+        assert(b_code == -EINVAL);
+    }
+
+    {
+        // An attempted subtask hands its outcome to the awaiting coroutine, which carries on even if the
+        // subtask has failed.
+        pending_task a, b;
+        b.fail = true;
+
+        std::vector<int> codes;
+        auto attempt = [&](pending_task & task) -> nonsensed::subtask {
+            return [&](coroutine_handle<promise> nonsense_promise_arg) -> nonsensed::future {
+                auto error = co_await nonsensed::async::attempt(task.run());
+                codes.push_back(error ? error->code : 0);
+                co_return nonsensed::unit;
+            };
+        };
+
+        std::vector<nonsensed::subtask> tasks;
+        tasks.push_back(attempt(a));
+        tasks.push_back(attempt(b));
+
+        group attempts(std::move(tasks));
+
+        b.handle.resume();
+        assert(codes == std::vector<int>{ -EINVAL });
+        a.handle.resume();
+        assert((codes == std::vector<int>{ -EINVAL, 0 }));
+        assert(attempts.watcher.finished && !attempts.state.error);
+    }
+}